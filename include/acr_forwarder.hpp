@@ -0,0 +1,157 @@
+/**
+ * @file acr_forwarder.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+#ifndef ACR_FORWARDER_HPP_
+#define ACR_FORWARDER_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rf.h"
+#include "message.hpp"
+#include "acr_spool.hpp"
+#include "peer_state_cache.hpp"
+#include "ccf_stripes.hpp"
+
+// Stores ACRs that couldn't be delivered to any CCF in an AcrSpool, and
+// replays them once a CCF is reachable again.
+//
+// The replay thread sends one spooled ACR at a time, in the order they were
+// spooled, at no more than the configured rate.  As the next ACR isn't sent
+// until the last one has been answered, the CDF's response time also limits
+// the rate, so the configured rate is only a ceiling.  Replayed ACRs have the
+// T-flag (potentially retransmitted) set, so the CDF can detect duplicates.
+// A spooled ACR is only removed from the spool once a CCF has answered it
+// with anything other than a transient error.  After a transient error (or
+// no answer) the replay thread backs off, for twice as long each time the
+// same ACR fails, up to a limit.
+// Like any other ACR, a replayed ACR goes over the connection picked for its
+// session if the CCF's ACRs are striped across several.
+class AcrForwarder
+{
+public:
+  // Connects the replayed ACR's Diameter transaction to the forwarder, so
+  // that the forwarder can cut it off when it stops.  Once detached, the
+  // outcome of the replay is ignored.
+  class ReplayLink
+  {
+  public:
+    ReplayLink(AcrForwarder* forwarder);
+    ~ReplayLink();
+
+    void response(int result_code);
+    void timeout();
+    void detach();
+
+  private:
+    pthread_mutex_t _lock;
+    AcrForwarder* _forwarder;
+  };
+
+  // The parts of an ACR we need to rebuild it.
+  struct SpooledAcr
+  {
+    std::string call_id;
+    std::string session_id;
+    std::vector<std::string> ccfs;
+    uint32_t accounting_record_number;
+    std::string event;
+  };
+
+  /// @param spool             - The spool to use.  Must already be open.
+  /// @param replay_rate       - The most ACRs to replay per second.
+  /// @param peer_state_cache  - If set, used to avoid replaying to CCFs that
+  ///                            are known to be down.
+  /// @param ccf_stripes       - If set, picks the connection to use for each
+  ///                            CCF.
+  AcrForwarder(AcrSpool* spool,
+               Rf::Dictionary* dict,
+               Diameter::Stack* diameter_stack,
+               const std::string& dest_realm,
+               int diameter_timeout_ms,
+               int replay_rate,
+               PeerStateCache* peer_state_cache = NULL,
+               const CcfStripes* ccf_stripes = NULL);
+  virtual ~AcrForwarder();
+
+  /// Starts and stops the replay thread.  Stopping waits (for up to the
+  /// Diameter timeout) for a replay in flight to finish, and then detaches
+  /// it, so the forwarder can be deleted straight away.
+  bool start();
+  void stop();
+
+  /// Spools an ACR that couldn't be delivered.  Returns false if it couldn't
+  /// be spooled.
+  bool spool_acr(const Message* msg);
+
+  /// Called with the outcome of a replayed ACR.
+  void replay_response(int result_code);
+  void replay_timeout();
+
+  /// Metrics.
+  uint64_t spool_depth() { return _spool->depth(); }
+  uint64_t spool_age_ms() { return _spool->oldest_age_ms(); }
+  uint64_t spool_dropped_count() { return _spool->dropped_count(); }
+  uint64_t spooled_count();
+  uint64_t replayed_count();
+
+  /// Returns the number of ACRs replayed in the last full second.
+  uint64_t replay_rate();
+
+  static std::string encode(const Message* msg);
+  static bool decode(const std::string& data, SpooledAcr& acr);
+
+  // How long to wait before trying again after a replayed ACR fails, or when
+  // there is no CCF to replay to.  Repeated failures back off up to the
+  // maximum.
+  static const int BACKOFF_MS = 1000;
+  static const int MAX_BACKOFF_MS = 32000;
+
+  /// Whether an ACR answered with this result code could succeed if it were
+  /// sent again later.
+  static bool is_transient(int result_code);
+
+private:
+  static void* replay_thread_fn(void* forwarder_ptr);
+  void replay_thread();
+  bool replay_next();
+  void replay_complete(bool delivered);
+
+  AcrSpool* _spool;
+  Rf::Dictionary* _dict;
+  Diameter::Stack* _diameter_stack;
+  const std::string _dest_realm;
+  const int _diameter_timeout_ms;
+  const int _replay_interval_ms;
+  PeerStateCache* _peer_state_cache;
+  const CcfStripes* _ccf_stripes;
+  std::shared_ptr<ReplayLink> _link;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  pthread_cond_t _idle_cond;
+  pthread_t _replay_thread;
+  bool _replay_thread_running;
+  bool _terminated;
+  bool _replay_in_flight;
+  bool _backoff;
+  int _failure_backoff_ms;
+
+  uint64_t _spooled;
+  uint64_t _replayed;
+  uint64_t _rate_window_start_ms;
+  uint64_t _rate_window_count;
+  uint64_t _last_rate;
+};
+
+#endif /* ACR_FORWARDER_HPP_ */
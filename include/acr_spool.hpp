@@ -0,0 +1,129 @@
+/**
+ * @file acr_spool.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+#ifndef ACR_SPOOL_HPP_
+#define ACR_SPOOL_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+// An append-only queue of records, held in a memory-mapped file so that it
+// survives a restart.  Used to hold ACRs that couldn't be delivered to any
+// CCF until they can be replayed.
+//
+// The file starts with a header holding the offsets of the first unconsumed
+// record (the head) and of the end of the last record (the tail).  Each
+// record is
+//   [length (4 bytes)][CRC32 of the rest (4 bytes)][spooled time (8 bytes)]
+//   [payload]
+// Records are only ever appended at the tail and consumed from the head.
+// Consumed space is reclaimed when the spool empties, or by moving the live
+// records to the start of the file when there is no room for a new record.
+//
+// Changes are flushed to disk in batches by a background thread (every
+// sync_interval_ms), rather than on every append.  The exception is moving
+// the live records, which is flushed straight away, before and after the
+// header is changed, so that the header never points at records that aren't
+// on disk yet.  On startup, any records after the first one that fails its
+// CRC check (for example because we crashed part way through writing it) are
+// discarded.
+class AcrSpool
+{
+public:
+  /// @param path             - The spool file.  Created if it doesn't exist.
+  /// @param size_bytes       - The size of the spool file.
+  /// @param sync_interval_ms - How often changes are flushed to disk.
+  AcrSpool(const std::string& path,
+           size_t size_bytes,
+           int sync_interval_ms = DEFAULT_SYNC_INTERVAL_MS);
+  virtual ~AcrSpool();
+
+  /// Opens (creating if necessary) and maps the spool file, recovers any
+  /// records already in it, and starts the sync thread.  Returns false if the
+  /// spool can't be used.
+  bool open();
+
+  /// Flushes any changes to disk, stops the sync thread and unmaps the file.
+  void close();
+
+  /// Adds a record to the tail of the spool.  Returns false if there is no
+  /// room for it.
+  bool append(const std::string& payload);
+
+  /// Gets the record at the head of the spool without consuming it.  Returns
+  /// false if the spool is empty.
+  bool peek(std::string& payload, uint64_t& spooled_ms);
+
+  /// Consumes the record at the head of the spool.
+  void pop();
+
+  /// Flushes any changes to disk now.
+  void sync();
+
+  /// Returns the number of records in the spool.
+  uint64_t depth();
+
+  /// Returns how long ago the oldest record in the spool was added, or 0 if
+  /// the spool is empty.
+  uint64_t oldest_age_ms();
+
+  /// Returns the number of records we had no room for.
+  uint64_t dropped_count();
+
+  static const int DEFAULT_SYNC_INTERVAL_MS = 100;
+
+private:
+  struct Header
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t count;
+  };
+
+  struct RecordHeader
+  {
+    uint32_t length;
+    uint32_t crc;
+    uint64_t spooled_ms;
+  };
+
+  static const uint32_t MAGIC = 0x52414c46;  // "RALF"
+  static const uint32_t VERSION = 1;
+  static const size_t DATA_START = 64;
+
+  void recover();
+  void compact();
+  static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t length);
+  static uint32_t record_crc(const RecordHeader& hdr, const uint8_t* payload);
+
+  static void* sync_thread_fn(void* spool_ptr);
+  void sync_thread();
+
+  const std::string _path;
+  const size_t _size_bytes;
+  const int _sync_interval_ms;
+
+  int _fd;
+  uint8_t* _base;
+  Header* _header;
+  bool _dirty;
+  uint64_t _dropped;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  pthread_t _sync_thread;
+  bool _sync_thread_running;
+  bool _terminated;
+};
+
+#endif /* ACR_SPOOL_HPP_ */
@@ -0,0 +1,52 @@
+/**
+ * @file ccf_stripes.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+#ifndef CCF_STRIPES_HPP_
+#define CCF_STRIPES_HPP_
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Spreads the ACRs for a CCF across several Diameter connections to it.
+//
+// freeDiameter keeps a single connection to each Diameter peer, so all the
+// ACRs for a CCF share one TCP stream.  A CCF can instead be configured with a
+// set of stripes - additional Diameter identities for the same CCF, each of
+// which is configured as a peer in the freeDiameter configuration and so has
+// its own connection.  Each ACR is sent to one of the stripes, chosen by
+// hashing the session's Call-ID so that all the ACRs for a session use the
+// same connection and stay in order.
+//
+// The stripes are set up at start of day and not changed afterwards, so no
+// locking is needed.
+class CcfStripes
+{
+public:
+  CcfStripes();
+  virtual ~CcfStripes();
+
+  /// Parses the stripe configuration.  Each entry has the form
+  ///   <ccf>=<stripe1>;<stripe2>;...
+  /// Returns false if any entry is invalid.
+  bool configure(const std::vector<std::string>& config);
+
+  /// Returns the Diameter identity to send the session's ACRs for this CCF
+  /// to.  CCFs with no stripes configured are returned unchanged.
+  std::string select(const std::string& ccf, const std::string& key) const;
+
+  /// Returns true if any stripes are configured.
+  bool empty() const { return _stripes.empty(); }
+
+private:
+  std::map<std::string, std::vector<std::string>> _stripes;
+};
+
+#endif /* CCF_STRIPES_HPP_ */
@@ -0,0 +1,165 @@
+/**
+ * @file chronos_queue.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CHRONOS_QUEUE_HPP_
+#define CHRONOS_QUEUE_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "sas.h"
+#include "chronosconnection.h"
+#include "stage_statistics.hpp"
+
+// Sends timer operations to Chronos from a small pool of threads, so the
+// threads handling ACRs and Diameter answers don't wait for Chronos.
+//
+// Each thread sends one operation at a time over its own keep-alive
+// connection to Chronos, so however many operations are queued they share
+// the same few connections.  When an operation completes, its callback (if
+// any) is called on the thread that sent it.  Operations on the same timer
+// are sent one at a time, in the order they were queued, so a deletion
+// can't overtake an update that would then re-create the timer.
+//
+// If coalescing is turned on, updates of existing timers wait up to a short
+// tick before being sent, and are sent together at the end of it.  While
+// waiting, a later update of the same timer replaces the earlier one, so
+// only the latest is sent.  Deletions are always sent straight away, and
+// drop any update still waiting for the timer, so it can't re-create the
+// timer once it's deleted.  Creations of new timers have no timer ID to
+// coalesce on, so are always sent straight away too.
+class ChronosQueue
+{
+public:
+  enum Method
+  {
+    POST,
+    PUT,
+    DELETE
+  };
+
+  // Told the outcome of a timer operation.  The callback is called exactly
+  // once for each operation that was queued, and may delete itself.  If the
+  // operation was replaced by a later one, it is told the later one's
+  // outcome.
+  class Callback
+  {
+  public:
+    virtual ~Callback() {}
+
+    /// @param rc       - The HTTP result from Chronos.
+    /// @param timer_id - The timer's ID, which Chronos may have changed.
+    virtual void on_timer_complete(HTTPCode rc, const std::string& timer_id) = 0;
+  };
+
+  static const int DEFAULT_THREADS = 4;
+  static const int DEFAULT_MAX_DEPTH = 10000;
+
+  /// @param conn      - The connection to Chronos.
+  /// @param threads   - The number of threads (and so connections) to use.
+  /// @param max_depth - The most operations to queue.  Further operations
+  ///                    are refused, and the caller should send them itself.
+  /// @param stats     - If set, the time each operation takes, and the
+  ///                    number sent and coalesced, are recorded here.
+  /// @param coalesce_ms - How long updates wait to be coalesced.  0 means
+  ///                    they are sent straight away.
+  ChronosQueue(ChronosConnection* conn,
+               int threads = DEFAULT_THREADS,
+               int max_depth = DEFAULT_MAX_DEPTH,
+               StageStatistics* stats = NULL,
+               int coalesce_ms = 0);
+  virtual ~ChronosQueue();
+
+  /// Starts and stops the threads.  Stopping waits for every queued
+  /// operation to be sent.
+  bool start();
+  void stop();
+
+  /// Queues a timer operation.  Returns false if the queue is full or
+  /// stopped, in which case the callback is not called.
+  bool send(Method method,
+            const std::string& timer_id,
+            uint32_t interval,
+            uint32_t repeat_for,
+            const std::string& callback_uri,
+            const std::string& opaque_data,
+            SAS::TrailId trail,
+            const std::map<std::string, uint32_t>& tags,
+            Callback* callback);
+
+  /// Queues the deletion of a timer.  Returns false if the queue is full or
+  /// stopped.
+  bool send_delete(const std::string& timer_id, SAS::TrailId trail);
+
+  /// The number of operations waiting to be sent.
+  size_t depth();
+
+  /// The number of operations sent, and the number saved by coalescing.
+  uint64_t sent_count();
+  uint64_t coalesced_count();
+
+private:
+  struct Operation
+  {
+    Method method;
+    std::string timer_id;
+    uint32_t interval;
+    uint32_t repeat_for;
+    std::string callback_uri;
+    std::string opaque_data;
+    SAS::TrailId trail;
+    std::map<std::string, uint32_t> tags;
+    std::vector<Callback*> callbacks;
+  };
+
+  bool enqueue(Operation* op);
+  std::deque<Operation*>::iterator next_ready();
+  void coalesce(Operation* pending, Operation* op);
+  void process(Operation* op);
+
+  static void* worker_thread_fn(void* queue_ptr);
+  void worker_thread();
+  static void* flush_thread_fn(void* queue_ptr);
+  void flush_thread();
+  void flush();
+
+  ChronosConnection* _conn;
+  const int _num_threads;
+  const size_t _max_depth;
+  StageStatistics* _stats;
+  const int _coalesce_ms;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  std::deque<Operation*> _queue;
+  std::vector<pthread_t> _threads;
+  bool _terminated;
+
+  // The timers with an operation being sent.  Later operations on them wait
+  // in the queue until it completes.
+  std::set<std::string> _in_flight;
+
+  // Operations waiting to be coalesced, by timer ID.
+  std::map<std::string, Operation*> _pending;
+  pthread_cond_t _flush_cond;
+  pthread_t _flush_thread;
+  bool _flush_thread_running;
+
+  uint64_t _sent;
+  uint64_t _coalesced;
+};
+
+#endif /* CHRONOS_QUEUE_HPP_ */
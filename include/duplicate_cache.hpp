@@ -0,0 +1,89 @@
+/**
+ * @file duplicate_cache.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+#ifndef DUPLICATE_CACHE_HPP_
+#define DUPLICATE_CACHE_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+#include "ralf_time.hpp"
+
+// Remembers the ACRs we've seen recently, so that a request we've already
+// handled isn't sent to the CDF again.  Sprout retries a POST that times
+// out, and Chronos can pop a timer twice while its cluster is resized, and
+// each duplicate would otherwise become an extra ACR.
+//
+// Each ACR is identified by its Call-ID, role, function and record type and
+// a fingerprint of the request body, and remembered for a fixed window.
+// The pops of an INTERIM timer all have the same body, so they are
+// identified by their session alone, and each is remembered for no more than
+// half the session's interim interval, so the next real pop is never taken
+// for a repeat.
+//
+// The entries are split across shards by hash, each with its own lock, so
+// requests on different threads rarely contend.
+class DuplicateCache
+{
+public:
+  /// @param window_ms - How long each ACR is remembered for.
+  DuplicateCache(int window_ms);
+  virtual ~DuplicateCache();
+
+  /// Builds the key identifying an ACR.
+  static std::string key(const std::string& call_id,
+                         int role,
+                         int function,
+                         int record_type,
+                         const std::string& body);
+
+  /// Builds the key identifying a session's timer pops.
+  static std::string timer_pop_key(const std::string& call_id,
+                                   int role,
+                                   int function);
+
+  /// Returns true if the ACR with the given key was seen in the window
+  /// before the given time (on the monotonic clock).  Otherwise remembers
+  /// it and returns false.
+  bool check(const std::string& key, uint64_t now_ms = RalfTime::now_ms());
+
+  /// As check(), but the ACR is only remembered for the given time if that
+  /// is shorter than the window.
+  bool check_within(const std::string& key,
+                    uint64_t max_window_ms,
+                    uint64_t now_ms = RalfTime::now_ms());
+
+  /// The number of ACRs remembered, and the number of duplicates found.
+  size_t size();
+  uint64_t suppressed() const { return _suppressed.load(); }
+
+  static const int NUM_SHARDS = 16;
+
+private:
+  struct Shard
+  {
+    pthread_mutex_t lock;
+
+    // When each ACR's entry expires, and the entries in the order they
+    // expire (which is the order they were added, as the window is fixed).
+    std::unordered_map<std::string, uint64_t> expiries;
+    std::deque<std::pair<uint64_t, std::string>> queue;
+  };
+
+  const uint64_t _window_ms;
+  Shard _shards[NUM_SHARDS];
+  std::atomic<uint64_t> _suppressed;
+};
+
+#endif /* DUPLICATE_CACHE_HPP_ */
@@ -0,0 +1,198 @@
+/**
+ * @file flight_recorder.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef FLIGHT_RECORDER_HPP_
+#define FLIGHT_RECORDER_HPP_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "sas.h"
+#include "ralf_time.hpp"
+
+// Keeps a compact timeline of each ACR Ralf handles: when it arrived, when
+// it was parsed, the start and end of each store and Chronos operation, when
+// it was sent to each CCF and answered, and when it completed.
+//
+// Completed timelines are written to a ring buffer of recent requests, and
+// those that took longer than a threshold are also written to a ring buffer
+// of slow requests, which lasts much longer.  Writing never takes a lock.
+// The buffers can be dumped as text on demand - from the HTTP API, or to a
+// file in response to a signal.
+class FlightRecorder
+{
+public:
+  enum EventType
+  {
+    NONE = 0,
+    PARSED,
+    STAGE_START,
+    STAGE_END,
+    CDF_SEND,
+    CDF_ANSWER,
+    CDF_TIMEOUT,
+    CDF_SHED,
+    COMPLETE
+  };
+
+  struct Event
+  {
+    // Microseconds since the request arrived.
+    uint32_t offset_us;
+
+    // Depends on the type: the stage for STAGE_START and STAGE_END, the
+    // index of the CCF for CDF_SEND and CDF_SHED, and the result code for
+    // CDF_ANSWER.
+    int32_t detail;
+
+    uint8_t type;
+  };
+
+  static const int MAX_EVENTS = 24;
+  static const int MAX_CALL_ID = 63;
+
+  // A request's timeline, as stored in the ring buffers.
+  struct Entry
+  {
+    char call_id[MAX_CALL_ID + 1];
+    SAS::TrailId trail;
+    uint64_t arrival_ms;
+    uint32_t total_us;
+    uint8_t num_events;
+    bool truncated;
+    Event events[MAX_EVENTS];
+  };
+
+  // The timeline of a request that is in progress.  Each Message carries
+  // one.  Marking a timeline that hasn't been started does nothing.
+  class Timeline
+  {
+  public:
+    Timeline() : _recorder(NULL), _arrival_us(0) {}
+
+    void start(FlightRecorder* recorder,
+               uint64_t arrival_us,
+               const std::string& call_id,
+               SAS::TrailId trail);
+
+    bool started() const { return (_recorder != NULL); }
+
+    void mark(EventType type, int32_t detail = 0)
+    {
+      if (_recorder != NULL)
+      {
+        mark_at(type, detail, RalfTime::now_us());
+      }
+    }
+
+    void mark_at(EventType type, int32_t detail, uint64_t now_us);
+
+    // Marks the request as complete and hands the timeline to the recorder.
+    // Does nothing if the timeline hasn't been started or is already
+    // finished.
+    void finish();
+
+  private:
+    FlightRecorder* _recorder;
+    uint64_t _arrival_us;
+    Entry _entry;
+  };
+
+  // The timeline of the request the current thread is working on, if any.
+  // This lets code that doesn't see the Message (such as the session
+  // stores) mark the timeline.
+  static Timeline* current();
+
+  // Sets the current thread's timeline until it goes out of scope or is
+  // cleared.
+  class CurrentTimeline
+  {
+  public:
+    CurrentTimeline(Timeline* timeline);
+    ~CurrentTimeline();
+    void clear();
+  };
+
+  static const int DEFAULT_RECENT_CAPACITY = 4096;
+  static const int DEFAULT_SLOW_CAPACITY = 1024;
+
+  /// @param slow_threshold_ms - Requests that take at least this long are
+  ///                            kept in the slow request buffer.
+  /// @param recent_capacity   - The number of recent requests to keep.
+  /// @param slow_capacity     - The number of slow requests to keep.
+  FlightRecorder(int slow_threshold_ms,
+                 int recent_capacity = DEFAULT_RECENT_CAPACITY,
+                 int slow_capacity = DEFAULT_SLOW_CAPACITY);
+  virtual ~FlightRecorder();
+
+  /// Records a completed timeline.
+  void record(const Entry& entry);
+
+  /// Returns the slow requests (and, if requested, the recent requests) as
+  /// text, one request per line, oldest first.
+  std::string dump(bool include_recent);
+
+  /// Starts and stops the thread that writes dumps to files in the given
+  /// directory when request_dump() is called.
+  bool start(const std::string& dump_dir);
+  void stop();
+
+  /// Asks for a dump to be written to a file.  Safe to call from a signal
+  /// handler.
+  void request_dump();
+
+  /// Writes a dump to a file, returning the name of the file (or an empty
+  /// string on failure).
+  std::string dump_to_file();
+
+  static std::string format(const Entry& entry);
+
+private:
+  struct Slot
+  {
+    // Odd while the entry is being written.
+    std::atomic<uint64_t> seq;
+    Entry entry;
+  };
+
+  class Ring
+  {
+  public:
+    Ring(int capacity);
+    ~Ring();
+    void write(const Entry& entry);
+    void read(std::vector<Entry>& entries);
+
+  private:
+    Slot* _slots;
+    const uint64_t _capacity;
+    std::atomic<uint64_t> _next;
+  };
+
+  static void* dump_thread_fn(void* recorder_ptr);
+  void dump_thread();
+
+  const uint32_t _slow_threshold_us;
+  Ring _recent;
+  Ring _slow;
+
+  std::string _dump_dir;
+  sem_t _dump_sem;
+  pthread_t _dump_thread;
+  bool _dump_thread_running;
+  std::atomic<bool> _terminated;
+};
+
+#endif /* FLIGHT_RECORDER_HPP_ */
@@ -18,6 +18,12 @@
 #include "httpstack_utils.h"
 #include "message.hpp"
 #include "session_manager.hpp"
+#include "stage_statistics.hpp"
+#include "peer_statistics.hpp"
+#include "flight_recorder.hpp"
+#include "local_timer_wheel.hpp"
+#include "load_monitor.h"
+#include "duplicate_cache.hpp"
 #include "sas.h"
 #include "ralfsasevent.h"
 
@@ -26,6 +32,26 @@ const std::string TIMER_INTERIM_PARAM = "timer-interim";
 struct BillingHandlerConfig
 {
   SessionManager* mgr;
+
+  // How long we have to deliver each ACR to a CCF, across all the CCFs we
+  // try.  0 means that each CCF gets the full Diameter timeout.
+  int acr_deadline_ms;
+
+  // If set, the time spent parsing requests and the number of requests in
+  // progress are recorded here.
+  StageStatistics* stats;
+
+  // If set, each request's timeline is recorded here.
+  FlightRecorder* recorder;
+
+  // If set, timer pops must also be admitted by this, so that they can be
+  // throttled separately from ACRs from Sprout.  A timer pop that is turned
+  // away just means one fewer INTERIM - the next pop keeps the session alive.
+  LoadMonitor* timer_pop_load_monitor;
+
+  // If set, requests that repeat one we've handled recently are answered
+  // without being handled again.
+  DuplicateCache* duplicates;
 };
 
 class BillingTask : public HttpStackUtils::Task
@@ -34,7 +60,8 @@ public:
   BillingTask(HttpStack::Request& req,
                      const BillingHandlerConfig* cfg,
                      SAS::TrailId trail) :
-    HttpStackUtils::Task(req, trail), _sess_mgr(cfg->mgr)
+    HttpStackUtils::Task(req, trail),
+    _cfg(cfg)
   {};
   void run();
   static HTTPCode parse_body(std::string call_id,
@@ -42,9 +69,20 @@ public:
                              std::string reqbody,
                              Message** msg,
                              SAS::TrailId trail);
+
+  // Handles an ACR, or an INTERIM timer popping, whether it came over HTTP
+  // or from the local timer wheel: admits timer pops, parses the body,
+  // answers duplicates and passes the message to the session manager.
+  // Returns the HTTP code to answer with.
+  static HTTPCode handle_request(const BillingHandlerConfig* cfg,
+                                 const std::string& call_id,
+                                 bool timer_interim,
+                                 const std::string& body,
+                                 uint64_t arrival_us,
+                                 SAS::TrailId trail);
 private:
   inline std::string call_id() {return _req.file();};
-  SessionManager* _sess_mgr;
+  const BillingHandlerConfig* _cfg;
 };
 
 class BillingHandler:
@@ -85,4 +123,61 @@ private:
   bool _http_acr_logging;
 };
 
+// Handles INTERIM timers popping in the local timer wheel, just as
+// BillingTask handles them popping in Chronos, but without the HTTP request.
+class LocalTimerPopHandler : public LocalTimerWheel::PopHandler
+{
+public:
+  LocalTimerPopHandler(const BillingHandlerConfig* cfg) : _cfg(cfg) {};
+  void on_timer_pop(const std::string& callback_uri,
+                    const std::string& opaque_data);
+
+private:
+  const BillingHandlerConfig* _cfg;
+};
+
+struct PeerStatisticsHandlerConfig
+{
+  PeerStatistics* peer_stats;
+};
+
+// Returns the per-CCF statistics as JSON.  If the "reset" parameter is
+// "true" the statistics are cleared once they have been read.
+class PeerStatisticsTask : public HttpStackUtils::Task
+{
+public:
+  PeerStatisticsTask(HttpStack::Request& req,
+                     const PeerStatisticsHandlerConfig* cfg,
+                     SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail),
+    _peer_stats(cfg->peer_stats)
+  {};
+  void run();
+
+private:
+  PeerStatistics* _peer_stats;
+};
+
+struct FlightRecorderHandlerConfig
+{
+  FlightRecorder* recorder;
+};
+
+// Returns the flight recorder's slow requests as text.  If the "recent"
+// parameter is "true" the recent requests are included too.
+class FlightRecorderTask : public HttpStackUtils::Task
+{
+public:
+  FlightRecorderTask(HttpStack::Request& req,
+                     const FlightRecorderHandlerConfig* cfg,
+                     SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail),
+    _recorder(cfg->recorder)
+  {};
+  void run();
+
+private:
+  FlightRecorder* _recorder;
+};
+
 #endif
@@ -0,0 +1,117 @@
+/**
+ * @file latency_histogram.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef LATENCY_HISTOGRAM_HPP_
+#define LATENCY_HISTOGRAM_HPP_
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+// Histogram of latencies in microseconds, in the style of HdrHistogram.
+// Values below 128us are recorded exactly; above that, each power of two is
+// split into 64 buckets, so values are recorded to within 1.6%.
+class LatencyHistogram
+{
+public:
+  LatencyHistogram() : _counts(NUM_BUCKETS, 0), _total(0), _max(0) {}
+
+  void record(uint64_t value)
+  {
+    _counts[index(value)]++;
+    _total++;
+    _max = std::max(_max, value);
+  }
+
+  // Adds counts recorded elsewhere against the bucket indexes given by
+  // index(), for example when merging several threads' figures.
+  void add_bucket(size_t index, uint64_t count)
+  {
+    _counts[index] += count;
+    _total += count;
+  }
+
+  void add_max(uint64_t value)
+  {
+    _max = std::max(_max, value);
+  }
+
+  void reset()
+  {
+    std::fill(_counts.begin(), _counts.end(), 0);
+    _total = 0;
+    _max = 0;
+  }
+
+  uint64_t count() const { return _total; }
+  uint64_t max() const { return _max; }
+
+  // Returns the value at the given percentile (0-100).
+  uint64_t percentile(double pct) const
+  {
+    if (_total == 0)
+    {
+      return 0;
+    }
+
+    uint64_t target = std::max((uint64_t)1, (uint64_t)((pct / 100.0) * _total + 0.5));
+    uint64_t seen = 0;
+
+    for (size_t ii = 0; ii < _counts.size(); ii++)
+    {
+      seen += _counts[ii];
+
+      if (seen >= target)
+      {
+        return std::min(highest_equivalent(ii), _max);
+      }
+    }
+
+    return _max; // LCOV_EXCL_LINE
+  }
+
+  static const int EXACT = 128;
+  static const int SUB_BUCKETS = 64;
+  static const int NUM_BUCKETS = EXACT + (58 * SUB_BUCKETS);
+
+  // The bucket a value is recorded in.
+  static size_t index(uint64_t value)
+  {
+    if (value < EXACT)
+    {
+      return value;
+    }
+
+    // Shift the value so it lies in [64, 128).
+    int shift = (63 - __builtin_clzll(value)) - 6;
+    return EXACT + ((shift - 1) * SUB_BUCKETS) + ((value >> shift) - SUB_BUCKETS);
+  }
+
+private:
+
+  static uint64_t highest_equivalent(size_t index)
+  {
+    if (index < (size_t)EXACT)
+    {
+      return index;
+    }
+
+    int shift = ((index - EXACT) / SUB_BUCKETS) + 1;
+    uint64_t sub = ((index - EXACT) % SUB_BUCKETS) + SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> _counts;
+  uint64_t _total;
+  uint64_t _max;
+};
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * @file load_feedback.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef LOAD_FEEDBACK_HPP_
+#define LOAD_FEEDBACK_HPP_
+
+#include <stdint.h>
+#include <atomic>
+
+#include "load_monitor.h"
+#include "stage_statistics.hpp"
+
+// Feeds the state of Ralf's backends into the load monitor's throttling.
+//
+// The load monitor only sees how long Ralf takes to answer each HTTP
+// request, but Ralf answers before it has sent the ACR to the CDF, so a slow
+// CDF (or a slow session store) doesn't slow the HTTP replies down until
+// Ralf is already struggling.  This class watches the number of ACRs
+// waiting for a CDF and smoothed CDF and store latencies, and gives the load
+// monitor a penalty when any of them goes over its limit, which makes it
+// reduce the rate at which it admits requests.
+class LoadFeedback
+{
+public:
+  /// @param load_monitor     - The load monitor to penalize.
+  /// @param max_cdf_in_flight - The number of ACRs that may be waiting for a
+  ///                            CDF at once.  0 means no limit.
+  /// @param cdf_target_latency_us
+  ///                          - The smoothed CDF round trip time above which
+  ///                            we penalize.  0 means no limit.
+  /// @param store_target_latency_us
+  ///                          - The smoothed session store latency (local or
+  ///                            remote) above which we penalize.  0 means no
+  ///                            limit.
+  LoadFeedback(LoadMonitor* load_monitor,
+               int max_cdf_in_flight,
+               int cdf_target_latency_us,
+               int store_target_latency_us);
+  virtual ~LoadFeedback() {}
+
+  /// Records how long a stage took.  Only the CDF and store stages are
+  /// monitored.
+  void record_latency(StageStatistics::Stage stage, uint64_t latency_us);
+
+  /// Records the number of ACRs now waiting for a CDF.
+  void record_cdf_in_flight(int64_t in_flight);
+
+  /// Returns the smoothed latency of a stage.
+  uint64_t smoothed_latency_us(StageStatistics::Stage stage) const;
+
+  /// Returns the number of penalties given to the load monitor.
+  uint64_t penalties() const;
+
+  // The load monitor reduces its rate once per adjustment however many
+  // penalties it has had, so there's no point penalizing it more often than
+  // this.
+  static const uint64_t MIN_PENALTY_INTERVAL_US = 10000;
+
+  // Each new latency moves the smoothed latency this fraction of the way
+  // towards it.
+  static const int SMOOTHING_DIVISOR = 8;
+
+private:
+  void penalize();
+
+  LoadMonitor* _load_monitor;
+  const int64_t _max_cdf_in_flight;
+  uint64_t _target_latency_us[StageStatistics::NUM_STAGES];
+  std::atomic<uint64_t> _smoothed_latency_us[StageStatistics::NUM_STAGES];
+  std::atomic<uint64_t> _last_penalty_us;
+  std::atomic<uint64_t> _penalties;
+};
+
+#endif /* LOAD_FEEDBACK_HPP_ */
@@ -0,0 +1,209 @@
+/**
+ * @file local_timer_wheel.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+#ifndef LOCAL_TIMER_WHEEL_HPP_
+#define LOCAL_TIMER_WHEEL_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "sas.h"
+#include "chronosconnection.h"
+
+// Schedules INTERIM timers in-process, as an alternative to Chronos for
+// single-site deployments.  It takes the place of the ChronosConnection, so
+// the session manager creates, updates and deletes timers exactly as it
+// would in Chronos, and each pop is handed straight to a PopHandler rather
+// than coming back to us over HTTP.
+//
+// Timers are held in a hierarchical timing wheel: LEVELS wheels of SLOTS
+// slots each, where a slot in each level covers SLOTS times as long as a
+// slot in the level below.  Each timer sits in the lowest level whose span
+// reaches its expiry, and is moved down a level (cascaded) as its slot comes
+// round, so adding, deleting and popping a timer are all constant time.
+//
+// The sessions in the store hold the IDs of their timers, as they do with
+// Chronos, but the store can't be searched for the sessions on startup.
+// Instead the timers are saved to a file of their own, and restored from it
+// when we start.  The file holds a snapshot of the timers followed by a
+// record of each timer created, updated or deleted since.  The records are
+// collected as the changes happen and appended on each tick, so the threads
+// changing timers never wait for the disk, and if Ralf crashes only the
+// last tick's changes are lost.  Nothing syncs the file to disk, though, so
+// if the host crashes the changes since the OS last wrote it out are lost
+// too.  The snapshot is rewritten (dropping the records it replaces)
+// periodically and when we stop.  Pops that were due while we were down
+// happen straight away (once, however many were missed).
+class LocalTimerWheel : public ChronosConnection
+{
+public:
+  // Told when a timer pops.  Called on one of the wheel's pop threads.
+  class PopHandler
+  {
+  public:
+    virtual ~PopHandler() {}
+
+    /// @param callback_uri - The callback URI the timer was created with.
+    /// @param opaque_data  - The body the timer was created with.
+    virtual void on_timer_pop(const std::string& callback_uri,
+                              const std::string& opaque_data) = 0;
+  };
+
+  static const int DEFAULT_TICK_MS = 100;
+  static const int DEFAULT_POP_THREADS = 4;
+  static const int DEFAULT_CHECKPOINT_INTERVAL_MS = 10000;
+
+  /// @param handler         - Told about each pop.
+  /// @param checkpoint_file - Where the timers are saved.  If empty they are
+  ///                          not saved.
+  /// @param tick_ms         - The wheel's resolution.
+  /// @param pop_threads     - The number of threads handling pops.  0 means
+  ///                          pops are handled on the thread that finds them.
+  /// @param checkpoint_interval_ms - How often the snapshot is rewritten, if
+  ///                          any timers have changed.
+  LocalTimerWheel(PopHandler* handler,
+                  const std::string& checkpoint_file = "",
+                  int tick_ms = DEFAULT_TICK_MS,
+                  int pop_threads = DEFAULT_POP_THREADS,
+                  int checkpoint_interval_ms = DEFAULT_CHECKPOINT_INTERVAL_MS);
+  virtual ~LocalTimerWheel();
+
+  /// Restores any checkpointed timers and starts the threads.
+  bool start();
+
+  /// Stops the threads, handling any pops that are waiting, and saves the
+  /// timers.
+  void stop();
+
+  /// ChronosConnection methods.  Intervals are in seconds, as they are in
+  /// Chronos.  A PUT of a timer we don't know about creates it under the
+  /// given ID.
+  HTTPCode send_delete(const std::string& delete_id, SAS::TrailId trail);
+  HTTPCode send_put(std::string& put_identity,
+                    uint32_t timer_interval,
+                    uint32_t repeat_for,
+                    const std::string& callback_uri,
+                    const std::string& opaque_data,
+                    SAS::TrailId trail,
+                    const std::map<std::string, uint32_t>& tags);
+  HTTPCode send_post(std::string& post_identity,
+                     uint32_t timer_interval,
+                     uint32_t repeat_for,
+                     const std::string& callback_uri,
+                     const std::string& opaque_data,
+                     SAS::TrailId trail,
+                     const std::map<std::string, uint32_t>& tags);
+
+  /// Pops every timer due by the given time (on the monotonic clock), and
+  /// appends the changes made since the last poll to the checkpoint file.
+  /// Called by the tick thread each tick.
+  void poll(uint64_t now_ms);
+
+  /// Rewrites the checkpoint file with a snapshot of the timers, after
+  /// which each change to them is appended to it.  Restores the timers from
+  /// the file.
+  bool checkpoint();
+  bool recover();
+
+  /// The number of timers, and the number of times they have popped.
+  size_t size();
+  uint64_t pop_count();
+
+  static const int SLOT_BITS = 6;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const int LEVELS = 4;
+
+private:
+  struct Timer
+  {
+    std::string id;
+    uint64_t interval_ms;
+
+    // Monotonic times the timer should next pop, and stops repeating.
+    uint64_t pop_ms;
+    uint64_t end_ms;
+
+    std::string callback_uri;
+    std::string opaque_data;
+
+    // Where the timer is in the wheel.
+    int level;
+    int slot;
+    std::list<Timer*>::iterator pos;
+  };
+
+  struct Pop
+  {
+    std::string callback_uri;
+    std::string opaque_data;
+  };
+
+  void set_timer(const std::string& id,
+                 uint32_t interval,
+                 uint32_t repeat_for,
+                 const std::string& callback_uri,
+                 const std::string& opaque_data);
+  void insert(Timer* timer);
+  void remove(Timer* timer);
+  void run_tick(std::vector<Pop>& pops);
+  void dispatch(std::vector<Pop>& pops);
+  std::string new_timer_id();
+  std::string timer_record(Timer* timer);
+  void journal(const std::string& record);
+  void flush_journal();
+
+  static void* tick_thread_fn(void* wheel_ptr);
+  void tick_thread();
+  static void* pop_thread_fn(void* wheel_ptr);
+  void pop_thread();
+
+  PopHandler* _handler;
+  const std::string _checkpoint_file;
+  const uint64_t _tick_ms;
+  const int _num_pop_threads;
+  const int _checkpoint_interval_ms;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _tick_cond;
+  pthread_cond_t _pop_cond;
+  bool _terminated;
+
+  // The last tick processed, and the timers in each slot of each level.
+  uint64_t _tick;
+  std::list<Timer*> _wheel[LEVELS][SLOTS];
+  std::map<std::string, Timer*> _timers;
+  uint64_t _next_id;
+  uint64_t _pop_count;
+
+  // The changes waiting to be appended to the checkpoint file, and the
+  // number of changes since the snapshot.
+  std::string _journal_buffer;
+  uint64_t _journal_records;
+
+  // The checkpoint file, open for appending changes.  Guarded by
+  // _journal_lock, which is taken before _lock if both are needed, so that
+  // changes are written in order and never to a file being replaced.
+  pthread_mutex_t _journal_lock;
+  int _journal_fd;
+
+  // Pops waiting for a pop thread.
+  std::deque<Pop> _pops;
+
+  pthread_t _tick_thread;
+  bool _tick_thread_running;
+  std::vector<pthread_t> _pop_threads;
+};
+
+#endif /* LOCAL_TIMER_WHEEL_HPP_ */
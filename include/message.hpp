@@ -15,6 +15,7 @@
 #include "rapidjson/document.h"
 #include "rf.h"
 #include "sas.h"
+#include "flight_recorder.hpp"
 
 enum role_of_node_t
 {
@@ -79,6 +80,23 @@ struct Message
   uint32_t interim_interval;
   uint32_t session_refresh_time;
   SAS::TrailId trail;
+
+  /* The time (from RalfTime::now_ms) by which we must have finished
+     trying to send this message to the CCFs, or 0 if there is no
+     deadline.  Set by the controller when the request arrives. */
+  uint64_t deadline_ms;
+
+  /* The timeline of this message's progress through Ralf, which is
+     handed to the flight recorder when the message is deleted.  Only
+     started if the flight recorder is enabled. */
+  FlightRecorder::Timeline timeline;
+
+  /* The URI Chronos calls back on when this message's INTERIM timer
+     pops.  Built the first time it's needed. */
+  const std::string& callback_uri();
+
+private:
+  std::string _callback_uri;
 };
 
 #endif
@@ -0,0 +1,165 @@
+/**
+ * @file peer_concurrency_limiter.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+#ifndef PEER_CONCURRENCY_LIMITER_HPP_
+#define PEER_CONCURRENCY_LIMITER_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+// Limits the number of ACRs that Ralf has outstanding to each CCF.
+//
+// The limit for each peer adapts using AIMD: it grows by roughly one for each
+// window of answers that come back within the target RTT, and is cut
+// multiplicatively when the peer answers DIAMETER_TOO_BUSY (3004), times out,
+// or answers slower than the target RTT.  This stops a slow CDF from being
+// buried under a growing pile of requests that will only time out.
+//
+// Requests that arrive when a peer is at its limit are either queued until a
+// slot frees up, or shed so that the caller can move on to the next CCF,
+// depending on the configured policy.  Queued requests are shed once they
+// have waited too long - checked whenever a slot is asked for or released,
+// and periodically by a background thread, so they don't sit in the queue
+// of a peer that has stopped answering.
+class PeerConcurrencyLimiter
+{
+public:
+  enum Policy
+  {
+    QUEUE = 0,
+    SHED = 1
+  };
+
+  enum Admission
+  {
+    ADMITTED = 0,
+    QUEUED = 1,
+    REJECTED = 2
+  };
+
+  // Something that can wait in the queue for a peer.
+  class Waiter
+  {
+  public:
+    virtual ~Waiter() {}
+
+    // A slot has been reserved for this waiter - it should now send its
+    // request, and release the slot when it completes.
+    virtual void admitted() = 0;
+
+    // The waiter has been queued for too long and has been removed from the
+    // queue without being given a slot.
+    virtual void shed() = 0;
+  };
+
+  /// @param max_limit        - The most requests we will ever have
+  ///                           outstanding to one peer.
+  /// @param min_limit        - The limit is never cut below this.
+  /// @param target_rtt_ms    - Answers slower than this are treated as a
+  ///                           sign that the peer is overloaded.
+  /// @param policy           - What to do with requests over the limit.
+  /// @param max_queue_depth  - The most requests that can be queued for one
+  ///                           peer (requests beyond this are shed).
+  /// @param max_queue_time_ms- How long a request may be queued before it is
+  ///                           shed.
+  PeerConcurrencyLimiter(int max_limit,
+                         int min_limit,
+                         int target_rtt_ms,
+                         Policy policy,
+                         int max_queue_depth,
+                         int max_queue_time_ms);
+  virtual ~PeerConcurrencyLimiter();
+
+  /// Starts and stops the thread that sheds requests that have been queued
+  /// for too long.
+  bool start();
+  void stop();
+
+  /// Asks for a slot to send a request to the peer.  If the request is
+  /// QUEUED, the waiter's admitted() or shed() method will be called later
+  /// (from the thread that releases a slot).
+  Admission acquire(const std::string& host, Waiter* waiter);
+
+  /// Releases a slot, feeding the outcome of the request into the limit.
+  void release(const std::string& host,
+               int result_code,
+               unsigned long rtt_us,
+               bool timed_out);
+
+  /// Gets the current state of a peer.  Returns false if we have never sent
+  /// to it.
+  bool get_peer_stats(const std::string& host,
+                      int& in_flight,
+                      int& queue_depth,
+                      int& limit);
+
+  /// Returns the peers we have sent requests to.
+  std::vector<std::string> peers();
+
+  /// Returns the total number of requests shed.
+  uint64_t shed_count();
+
+  /// Sheds every request that has been queued for too long, as of the given
+  /// time (on the monotonic clock).  Called periodically by the background
+  /// thread.
+  void shed_expired(uint64_t now_ms);
+
+  static const float DECREASE_FACTOR;
+
+private:
+  struct QueuedWaiter
+  {
+    Waiter* waiter;
+    uint64_t queued_ms;
+  };
+
+  struct PeerState
+  {
+    int in_flight;
+    double limit;
+    uint64_t last_decrease_ms;
+    std::deque<QueuedWaiter> queue;
+  };
+
+  PeerState& get_peer(const std::string& host);
+  void remove_expired(PeerState& peer,
+                      uint64_t now_ms,
+                      std::vector<Waiter*>& shed);
+  static void shed_waiters(std::vector<Waiter*>& shed);
+
+  static void* shed_thread_fn(void* limiter_ptr);
+  void shed_thread();
+  void adapt_limit(PeerState& peer,
+                   int result_code,
+                   unsigned long rtt_us,
+                   bool timed_out);
+
+  const int _max_limit;
+  const int _min_limit;
+  const int _target_rtt_ms;
+  const Policy _policy;
+  const int _max_queue_depth;
+  const int _max_queue_time_ms;
+
+  pthread_mutex_t _lock;
+  std::map<std::string, PeerState> _peers;
+  uint64_t _shed_count;
+
+  pthread_cond_t _cond;
+  pthread_t _shed_thread;
+  bool _shed_thread_running;
+  bool _terminated;
+};
+
+#endif /* PEER_CONCURRENCY_LIMITER_HPP_ */
@@ -0,0 +1,107 @@
+/**
+ * @file peer_health_scorer.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+#ifndef PEER_HEALTH_SCORER_HPP_
+#define PEER_HEALTH_SCORER_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Scores the health of each CCF (keyed on the Destination-Host we send to)
+// from the answers we get back.  For each peer it keeps exponentially weighted
+// moving averages of
+//   - the ACA latency
+//   - the proportion of requests that time out
+//   - the proportion of requests that get a protocol error (3xxx) answer.
+//
+// A peer is outside its SLO if any of these exceeds the configured limit.
+// PeerMessageSender uses this to move unhealthy CCFs behind healthy ones,
+// while otherwise keeping the priority order that Sprout supplied.
+class PeerHealthScorer
+{
+public:
+  /// @param latency_slo_ms   - Average latency above which a peer is unhealthy.
+  /// @param max_timeout_rate - Proportion of timeouts above which a peer is
+  ///                           unhealthy.
+  /// @param max_error_rate   - Proportion of protocol errors above which a peer
+  ///                           is unhealthy.
+  /// @param ewma_alpha       - Weight given to each new sample.
+  /// @param min_samples      - Samples needed before a peer can be unhealthy.
+  /// @param probe_interval_ms- How often an unhealthy peer is given a request
+  ///                           in its normal position, so we notice when it
+  ///                           recovers.
+  PeerHealthScorer(int latency_slo_ms,
+                   float max_timeout_rate,
+                   float max_error_rate,
+                   float ewma_alpha = DEFAULT_EWMA_ALPHA,
+                   int min_samples = DEFAULT_MIN_SAMPLES,
+                   int probe_interval_ms = DEFAULT_PROBE_INTERVAL_MS);
+  virtual ~PeerHealthScorer();
+
+  /// Records an answer from a peer.
+  void record_response(const std::string& host,
+                       int result_code,
+                       unsigned long latency_us);
+
+  /// Records a request to a peer that timed out.
+  void record_timeout(const std::string& host,
+                      unsigned long latency_us);
+
+  /// Returns true if the peer is within its SLO (or we don't yet know enough
+  /// about it to say otherwise).
+  bool is_healthy(const std::string& host);
+
+  /// Reorders a priority list of CCFs so that those within their SLO come
+  /// first.  The relative order of the healthy CCFs, and of the unhealthy
+  /// ones, is preserved.  If no CCF is healthy the list is left alone.
+  void order_ccfs(std::vector<std::string>& ccfs);
+
+  /// Gets the current score for a peer.  Returns false if we have no samples
+  /// for it.
+  bool get_score(const std::string& host,
+                 double& latency_ms,
+                 double& timeout_rate,
+                 double& error_rate);
+
+  static const float DEFAULT_EWMA_ALPHA;
+  static const int DEFAULT_MIN_SAMPLES = 20;
+  static const int DEFAULT_PROBE_INTERVAL_MS = 1000;
+
+private:
+  struct Score
+  {
+    double latency_ms;
+    double timeout_rate;
+    double error_rate;
+    uint64_t samples;
+    uint64_t last_probe_ms;
+  };
+
+  void record_sample(const std::string& host,
+                     unsigned long latency_us,
+                     bool timed_out,
+                     bool error);
+  bool within_slo(const Score& score) const;
+
+  const int _latency_slo_ms;
+  const float _max_timeout_rate;
+  const float _max_error_rate;
+  const float _ewma_alpha;
+  const int _min_samples;
+  const int _probe_interval_ms;
+
+  pthread_mutex_t _lock;
+  std::map<std::string, Score> _scores;
+};
+
+#endif /* PEER_HEALTH_SCORER_HPP_ */
@@ -17,16 +17,32 @@
 #include "rf.h"
 #include "message.hpp"
 #include "session_manager.hpp"
+#include "peer_state_cache.hpp"
+#include "peer_health_scorer.hpp"
+#include "peer_concurrency_limiter.hpp"
+#include "ccf_stripes.hpp"
+#include "peer_timeout_estimator.hpp"
+#include "acr_forwarder.hpp"
+#include "stage_statistics.hpp"
+#include "peer_statistics.hpp"
 
 // A PeerMessageSender is responsible for ensuring that a connection is open
 // to either the primary or backup CCF, and once a connection has been opened,
 // sending the message to it.
-class PeerMessageSender
+class PeerMessageSender : public PeerConcurrencyLimiter::Waiter
 {
 public:
   PeerMessageSender(SAS::TrailId trail,
                     const std::string& dest_realm,
-                    const int diameter_timeout);
+                    const int diameter_timeout,
+                    PeerStateCache* peer_state_cache = NULL,
+                    PeerHealthScorer* health_scorer = NULL,
+                    PeerConcurrencyLimiter* concurrency_limiter = NULL,
+                    const CcfStripes* ccf_stripes = NULL,
+                    PeerTimeoutEstimator* timeout_estimator = NULL,
+                    AcrForwarder* acr_forwarder = NULL,
+                    StageStatistics* stats = NULL,
+                    PeerStatistics* peer_stats = NULL);
   virtual ~PeerMessageSender();
   virtual void send(Message* msg,
                     SessionManager* sm,
@@ -34,9 +50,20 @@ public:
                     Diameter::Stack* diameter_stack);
 
   void send_cb(int result_cdoe, int interim_interval, std::string session_id);
+  void timeout_cb();
+
+  // PeerConcurrencyLimiter::Waiter methods.
+  void admitted();
+  void shed();
 
 private:
   void int_send_msg();
+  void send_acr();
+  void skip_down_ccfs();
+  void record_outcome(int result_code);
+  int remaining_budget_ms();
+  void deadline_expired();
+  void spool_undelivered();
 
   Message* _msg;
   unsigned int _which;
@@ -47,6 +74,19 @@ private:
   SAS::TrailId _trail;
   const std::string _dest_realm;
   const int _diameter_timeout;
+  PeerStateCache* _peer_state_cache;
+  PeerHealthScorer* _health_scorer;
+  PeerConcurrencyLimiter* _concurrency_limiter;
+  const CcfStripes* _ccf_stripes;
+  PeerTimeoutEstimator* _timeout_estimator;
+  AcrForwarder* _acr_forwarder;
+  StageStatistics* _stats;
+  PeerStatistics* _peer_stats;
+  int _attempt_timeout_ms;
+  bool _attempt_capped;
+  uint64_t _send_time_us;
+  bool _timed_out;
+  bool _sent;
 };
 
 #endif /* PEER_MESSAGE_SENDER_HPP_ */
@@ -17,21 +17,55 @@ class PeerMessageSenderFactory
 {
 public:
   PeerMessageSenderFactory(const std::string& dest_realm,
-                           const int diameter_timeout) :
+                           const int diameter_timeout,
+                           PeerStateCache* peer_state_cache = NULL,
+                           PeerHealthScorer* health_scorer = NULL,
+                           PeerConcurrencyLimiter* concurrency_limiter = NULL,
+                           const CcfStripes* ccf_stripes = NULL,
+                           PeerTimeoutEstimator* timeout_estimator = NULL,
+                           AcrForwarder* acr_forwarder = NULL,
+                           StageStatistics* stats = NULL,
+                           PeerStatistics* peer_stats = NULL) :
     _dest_realm(dest_realm),
-    _diameter_timeout(diameter_timeout)
+    _diameter_timeout(diameter_timeout),
+    _peer_state_cache(peer_state_cache),
+    _health_scorer(health_scorer),
+    _concurrency_limiter(concurrency_limiter),
+    _ccf_stripes(ccf_stripes),
+    _timeout_estimator(timeout_estimator),
+    _acr_forwarder(acr_forwarder),
+    _stats(stats),
+    _peer_stats(peer_stats)
   {};
 
   virtual ~PeerMessageSenderFactory() {};
 
   virtual PeerMessageSender* newSender(SAS::TrailId trail)
   {
-    return new PeerMessageSender(trail, _dest_realm, _diameter_timeout);
+    return new PeerMessageSender(trail,
+                                 _dest_realm,
+                                 _diameter_timeout,
+                                 _peer_state_cache,
+                                 _health_scorer,
+                                 _concurrency_limiter,
+                                 _ccf_stripes,
+                                 _timeout_estimator,
+                                 _acr_forwarder,
+                                 _stats,
+                                 _peer_stats);
   }
 
 private:
   const std::string _dest_realm;
   const int _diameter_timeout;
+  PeerStateCache* _peer_state_cache;
+  PeerHealthScorer* _health_scorer;
+  PeerConcurrencyLimiter* _concurrency_limiter;
+  const CcfStripes* _ccf_stripes;
+  PeerTimeoutEstimator* _timeout_estimator;
+  AcrForwarder* _acr_forwarder;
+  StageStatistics* _stats;
+  PeerStatistics* _peer_stats;
 };
 
 
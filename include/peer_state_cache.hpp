@@ -0,0 +1,102 @@
+/**
+ * @file peer_state_cache.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+#ifndef PEER_STATE_CACHE_HPP_
+#define PEER_STATE_CACHE_HPP_
+
+#include <pthread.h>
+#include <atomic>
+#include <map>
+#include <string>
+
+#include <freeDiameter/freeDiameter-host.h>
+#include <freeDiameter/libfdcore.h>
+
+// Caches whether each Diameter peer (identified by its Diameter identity, as
+// used in the Destination-Host of our ACRs) currently has an open connection.
+//
+// The cache is fed by freeDiameter's peer connection hooks, and entries are
+// refreshed from freeDiameter's own peer state once they are older than the
+// refresh interval (freeDiameter doesn't raise a hook when an open connection
+// is closed).  PeerMessageSender uses the cache to skip CCFs that are known to
+// be unreachable rather than waiting for the Diameter timeout to expire.
+class PeerStateCache
+{
+public:
+  enum PeerState
+  {
+    UNKNOWN = 0,
+    UP = 1,
+    DOWN = 2
+  };
+
+  /// @param refresh_interval_ms - How long a cached state is trusted before it
+  ///                              is refreshed from freeDiameter.
+  PeerStateCache(int refresh_interval_ms = DEFAULT_REFRESH_INTERVAL_MS);
+  virtual ~PeerStateCache();
+
+  /// Registers the cache with freeDiameter's peer connection hooks.  Must be
+  /// called after the Diameter stack has been initialized.
+  void start();
+
+  /// Deregisters the freeDiameter hooks.
+  void stop();
+
+  /// Returns true if the peer is known to be unreachable.  Peers that the
+  /// cache (and freeDiameter) knows nothing about are not treated as down.
+  bool is_down(const std::string& host);
+
+  /// Records the state of a peer (called from the freeDiameter hook).
+  void update_peer_state(const std::string& host, bool up);
+
+  /// Forgets the cached state for a peer, so that it is refreshed from
+  /// freeDiameter on the next lookup (for example, because we have just
+  /// failed to deliver a request to it).
+  void invalidate(const std::string& host);
+
+  /// Records that an ACR skipped this peer because it was known to be down.
+  void record_skip(const std::string& host);
+
+  /// Returns the total number of times a CCF has been skipped.
+  uint64_t skip_count() const { return _skip_count.load(); }
+
+  /// Returns the number of times the specified CCF has been skipped.
+  uint64_t skip_count(const std::string& host);
+
+  static const int DEFAULT_REFRESH_INTERVAL_MS = 1000;
+
+protected:
+  /// Queries freeDiameter for the current state of the peer.  Virtual so it
+  /// can be overridden in UT, where there is no running Diameter stack.
+  virtual PeerState query_peer_state(const std::string& host);
+
+private:
+  struct Entry
+  {
+    PeerState state;
+    uint64_t updated_ms;
+    uint64_t skips;
+  };
+
+  static void fd_peer_hook_cb(enum fd_hook_type type,
+                              struct msg* msg,
+                              struct peer_hdr* peer,
+                              void* other,
+                              struct fd_hook_permsgdata* pmd,
+                              void* cache_ptr);
+
+  const int _refresh_interval_ms;
+  pthread_mutex_t _lock;
+  std::map<std::string, Entry> _peers;
+  std::atomic<uint64_t> _skip_count;
+  struct fd_hook_hdl* _peer_hook_hdl;
+};
+
+#endif /* PEER_STATE_CACHE_HPP_ */
@@ -0,0 +1,183 @@
+/**
+ * @file peer_statistics.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef PEER_STATISTICS_HPP_
+#define PEER_STATISTICS_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "latency_histogram.hpp"
+#include "peer_state_cache.hpp"
+#include "peer_concurrency_limiter.hpp"
+#include "peer_timeout_estimator.hpp"
+#include "acr_forwarder.hpp"
+
+// A table of statistics for each CCF (Destination-Host) we send ACRs to:
+// requests sent, round trip times, result codes, timeouts, failures to
+// deliver and failovers.
+//
+// Each thread records into its own cells for each CCF, so threads sending to
+// the same CCF don't contend.  A thread only takes a lock the first time it
+// records something for a CCF or result code.  snapshot() and to_json()
+// merge every thread's cells.  The figures are cumulative until reset.
+class PeerStatistics
+{
+public:
+  /// The remaining parameters are optional.  If set, the state they hold
+  /// for each CCF is included in the exported statistics.
+  /// The ACR forwarder's spool and replay figures are included as well.
+  PeerStatistics(PeerStateCache* peer_state_cache = NULL,
+                 PeerConcurrencyLimiter* concurrency_limiter = NULL,
+                 PeerTimeoutEstimator* timeout_estimator = NULL,
+                 AcrForwarder* acr_forwarder = NULL);
+  virtual ~PeerStatistics();
+
+  /// Records that an ACR was sent to the CCF.
+  void record_request(const std::string& host);
+
+  /// Records that the CCF answered an ACR.
+  void record_response(const std::string& host,
+                       int result_code,
+                       unsigned long rtt_us);
+
+  /// Records that the CCF didn't answer an ACR in time.
+  void record_timeout(const std::string& host);
+
+  /// Records that an ACR couldn't be delivered to the CCF, for whatever
+  /// reason (a DIAMETER_UNABLE_TO_DELIVER answer, a timeout or the CCF
+  /// being overloaded).
+  void record_unable_to_deliver(const std::string& host);
+
+  /// Records that an ACR wasn't sent to the CCF because it had too many
+  /// requests outstanding.
+  void record_shed(const std::string& host);
+
+  /// Records that an ACR that couldn't be delivered to one CCF was sent to
+  /// another instead.
+  void record_failover(const std::string& from_host,
+                       const std::string& to_host);
+
+  struct PeerSnapshot
+  {
+    std::string host;
+    uint64_t requests;
+    uint64_t responses;
+    uint64_t timeouts;
+    uint64_t unable_to_deliver;
+    uint64_t shed;
+    uint64_t failovers_out;
+    uint64_t failovers_in;
+    std::map<int, uint64_t> result_codes;
+    uint64_t rtt_p50_us;
+    uint64_t rtt_p90_us;
+    uint64_t rtt_p99_us;
+    uint64_t rtt_max_us;
+  };
+
+  /// Returns the current figures for every CCF, ordered by host.
+  std::vector<PeerSnapshot> snapshot();
+
+  /// Returns the current figures as a JSON document, including the state
+  /// held by the objects passed in on construction.
+  std::string to_json();
+
+  /// Clears all the figures.
+  void reset();
+
+private:
+  // The merged figures for a CCF.
+  struct PeerStats
+  {
+    PeerStats() :
+      requests(0),
+      responses(0),
+      timeouts(0),
+      unable_to_deliver(0),
+      shed(0),
+      failovers_out(0),
+      failovers_in(0)
+    {}
+
+    uint64_t requests;
+    uint64_t responses;
+    uint64_t timeouts;
+    uint64_t unable_to_deliver;
+    uint64_t shed;
+    uint64_t failovers_out;
+    uint64_t failovers_in;
+    std::map<int, uint64_t> result_codes;
+    LatencyHistogram rtt_us;
+  };
+
+  // One thread's figures for a CCF.  Only the owning thread writes to
+  // these, and snapshot() and reset() read and clear them, so they are
+  // atomic but need no ordering.
+  struct PeerCells
+  {
+    PeerCells();
+
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> responses;
+    std::atomic<uint64_t> timeouts;
+    std::atomic<uint64_t> unable_to_deliver;
+    std::atomic<uint64_t> shed;
+    std::atomic<uint64_t> failovers_out;
+    std::atomic<uint64_t> failovers_in;
+    std::map<int, std::atomic<uint64_t>> result_codes;
+    std::atomic<uint64_t> rtt_buckets[LatencyHistogram::NUM_BUCKETS];
+    std::atomic<uint64_t> rtt_max_us;
+  };
+
+  // One thread's cells.  The owning thread is the only one that adds CCFs
+  // or result codes, so it finds its cells without the lock.  It takes the
+  // lock to add them, so that snapshot() and reset() don't see the maps
+  // change under them.
+  struct ThreadStats
+  {
+    ThreadStats();
+    ~ThreadStats();
+
+    pthread_t owner;
+    pthread_mutex_t lock;
+    std::map<std::string, PeerCells*> peers;
+  };
+
+  ThreadStats* thread_stats();
+
+  // This thread's cells for a CCF, created if need be.
+  PeerCells& cells(ThreadStats* stats, const std::string& host);
+
+  static void incr(std::atomic<uint64_t>& cell)
+  {
+    cell.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  PeerStateCache* _peer_state_cache;
+  PeerConcurrencyLimiter* _concurrency_limiter;
+  PeerTimeoutEstimator* _timeout_estimator;
+  AcrForwarder* _acr_forwarder;
+
+  // Identifies this object in each thread's cache of its ThreadStats, so a
+  // new object at the same address doesn't pick up a deleted one's cache.
+  const uint64_t _id;
+  static std::atomic<uint64_t> _next_id;
+
+  // Protects the list of threads' cells.
+  pthread_mutex_t _lock;
+  std::vector<ThreadStats*> _threads;
+};
+
+#endif /* PEER_STATISTICS_HPP_ */
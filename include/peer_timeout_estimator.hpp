@@ -0,0 +1,85 @@
+/**
+ * @file peer_timeout_estimator.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+#ifndef PEER_TIMEOUT_ESTIMATOR_HPP_
+#define PEER_TIMEOUT_ESTIMATOR_HPP_
+
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Works out how long to wait for an answer from each CCF, from the RTTs we
+// have recently seen from it.
+//
+// The timeout for a peer is a high percentile of its last WINDOW_SIZE RTTs,
+// plus a margin, clamped between a floor and a ceiling.  This lets us fail
+// over quickly from a CCF that normally answers fast, without giving up on a
+// CCF that is slow but healthy.  Until we have enough samples for a peer we
+// use the ceiling (which is the configured Diameter timeout).
+//
+// Requests that time out are recorded as taking as long as the timeout, so
+// that a peer that has slowed down sees its timeout grow again.
+class PeerTimeoutEstimator
+{
+public:
+  /// @param floor_ms    - The shortest timeout we will use.
+  /// @param ceiling_ms  - The longest timeout we will use, and the timeout
+  ///                      for peers we know little about.
+  /// @param margin_ms   - Added to the RTT percentile.
+  /// @param percentile  - Which RTT percentile to use (0-100).
+  PeerTimeoutEstimator(int floor_ms,
+                       int ceiling_ms,
+                       int margin_ms,
+                       int percentile = DEFAULT_PERCENTILE);
+  virtual ~PeerTimeoutEstimator();
+
+  /// Returns the timeout to use for a request to the peer.
+  int get_timeout(const std::string& host);
+
+  /// Records the RTT of an answer from the peer.
+  void record_rtt(const std::string& host, unsigned long rtt_us);
+
+  /// Records a request to the peer that timed out after the specified time.
+  void record_timeout(const std::string& host, int timeout_ms);
+
+  /// Returns the peers we have timeouts for.
+  std::vector<std::string> peers();
+
+  static const int DEFAULT_PERCENTILE = 99;
+  static const int WINDOW_SIZE = 256;
+  static const int MIN_SAMPLES = 32;
+
+  // The timeout is recalculated after this many new samples, rather than on
+  // every request.
+  static const int RECALCULATE_INTERVAL = 16;
+
+private:
+  struct Peer
+  {
+    std::vector<unsigned long> rtts_us;
+    size_t next;
+    int samples_since_calculation;
+    int timeout_ms;
+  };
+
+  void record_sample(const std::string& host, unsigned long rtt_us);
+  int calculate_timeout(const Peer& peer) const;
+
+  const int _floor_ms;
+  const int _ceiling_ms;
+  const int _margin_ms;
+  const int _percentile;
+
+  pthread_mutex_t _lock;
+  std::map<std::string, Peer> _peers;
+};
+
+#endif /* PEER_TIMEOUT_ESTIMATOR_HPP_ */
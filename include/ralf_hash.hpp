@@ -0,0 +1,36 @@
+/**
+ * @file ralf_hash.hpp Hash helpers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RALF_HASH_HPP_
+#define RALF_HASH_HPP_
+
+#include <stdint.h>
+#include <string>
+
+namespace RalfHash
+{
+  // 32-bit FNV-1a.  Use this rather than std::hash where every Ralf must get
+  // the same answer for the same key, whatever it was built with.
+  inline uint32_t fnv1a(const std::string& key)
+  {
+    uint32_t hash = 2166136261u;
+
+    for (std::string::const_iterator it = key.begin(); it != key.end(); ++it)
+    {
+      hash ^= (uint8_t)*it;
+      hash *= 16777619u;
+    }
+
+    return hash;
+  }
+}
+
+#endif /* RALF_HASH_HPP_ */
@@ -0,0 +1,72 @@
+/**
+ * @file ralf_time.hpp Time helpers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RALF_TIME_HPP_
+#define RALF_TIME_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+namespace RalfTime
+{
+  // Microseconds on the monotonic clock.  Only useful for measuring
+  // intervals - it bears no relation to wall-clock time.
+  inline uint64_t now_us()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+
+  // Milliseconds on the monotonic clock.
+  inline uint64_t now_ms()
+  {
+    return now_us() / 1000;
+  }
+
+  // Milliseconds since the epoch, for times that must mean something after
+  // a restart.
+  inline uint64_t wall_clock_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+  }
+
+  // Initialises a condition variable whose timed waits (see timed_wait) are
+  // measured on the monotonic clock, so they aren't cut short or stretched
+  // when the wall clock is stepped.
+  inline void init_cond(pthread_cond_t* cond)
+  {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+
+  // Waits on a condition variable set up by init_cond for up to the given
+  // time.  The lock must be held, as for pthread_cond_timedwait.
+  inline int timed_wait(pthread_cond_t* cond,
+                        pthread_mutex_t* lock,
+                        uint64_t timeout_ms)
+  {
+    struct timespec wake;
+    clock_gettime(CLOCK_MONOTONIC, &wake);
+    uint64_t wake_ns = ((uint64_t)wake.tv_nsec) + ((timeout_ms % 1000) * 1000000);
+    wake.tv_sec += (timeout_ms / 1000) + (wake_ns / 1000000000);
+    wake.tv_nsec = wake_ns % 1000000000;
+    return pthread_cond_timedwait(cond, lock, &wake);
+  }
+}
+
+#endif
@@ -16,6 +16,9 @@
 #include "chronosconnection.h"
 #include "rf.h"
 #include "health_checker.h"
+#include "stage_statistics.hpp"
+#include "chronos_queue.hpp"
+#include "duplicate_cache.hpp"
 
 class PeerMessageSenderFactory;
 
@@ -28,20 +31,80 @@ public:
                  PeerMessageSenderFactory* factory,
                  ChronosConnection* timer_conn,
                  Diameter::Stack* diameter_stack,
-                 HealthChecker* hc): _local_store(local_store),
-                                     _remote_stores(remote_stores),
-                                     _timer_conn(timer_conn),
-                                     _dict(dict),
-                                     _factory(factory),
-                                     _diameter_stack(diameter_stack),
-                                     _health_checker(hc) {};
+                 HealthChecker* hc,
+                 StageStatistics* stats = NULL,
+                 ChronosQueue* timer_queue = NULL,
+                 uint32_t interim_timer_jitter = 0,
+                 DuplicateCache* duplicates = NULL): _local_store(local_store),
+                                                  _remote_stores(remote_stores),
+                                                  _timer_conn(timer_conn),
+                                                  _dict(dict),
+                                                  _factory(factory),
+                                                  _diameter_stack(diameter_stack),
+                                                  _health_checker(hc),
+                                                  _stats(stats),
+                                                  _timer_queue(timer_queue),
+                                                  _interim_timer_jitter(interim_timer_jitter),
+                                                  _duplicates(duplicates) {};
   ~SessionManager() {};
   void handle(Message* msg);
   void on_ccf_response (bool accepted, uint32_t interim_interval, std::string session_id, int rc, Message* msg);
 
+  // Create the body that Chronos sends back to us when an INTERIM timer pops.
+  // The body depends only on the role and function, so the bodies are built
+  // once for every role and function, rather than for every timer.
+  static std::string create_opaque_data(Message* msg);
+
+  // The interval of the message's INTERIM timer, given the interim interval
+  // the CDF asked for.  To stop sessions that start together sending their
+  // INTERIMs together for ever after, each session's timer is shortened by
+  // its own amount of up to the given jitter (but no more than a quarter of
+  // the interval), so their pops drift apart.  The amount depends only on
+  // the session, so every Ralf sets the same interval whenever the timer is
+  // renewed.
+  static uint32_t timer_interval(Message* msg,
+                                 uint32_t interim_interval,
+                                 uint32_t jitter);
+
 private:
-  std::string create_opaque_data(Message* msg);
+  class TimerCompletion;
+
   void update_timer_id(Message* msg, std::string timer_id);
+
+  // Fills in the ID of the timer created for a new session, or deletes the
+  // timer if the session no longer wants it.
+  void record_new_timer(Message* msg, const std::string& timer_id);
+
+  // The timer pop pipeline.  Timer pops are most of our ACRs on long calls,
+  // and only ever send an INTERIM, so they skip the general handling of
+  // START, INTERIM and STOP.  Returns false if the pop should be ignored,
+  // because the session has gone or the pop is a repeat.
+  bool read_session_for_timer_pop(Message* msg);
+  void on_timer_pop_response(bool accepted, int rc, Message* msg);
+
+  // Brings the given stores' accounting record numbers up to date after a
+  // timer pop.  If restore is set, sessions missing from a store are put
+  // back from the message.
+  void write_back_record_number(Message* msg,
+                                const std::vector<SessionStore*>& stores,
+                                bool restore);
+  void delete_session(Message* msg);
+  void store_new_session(Message* msg,
+                         const std::string& session_id,
+                         uint32_t interim_interval,
+                         const std::string& timer_id);
+
+  // Queues the creation or update of the message's INTERIM timer, if we have
+  // a queue.  If this returns true, the message now belongs to the queued
+  // operation, and is deleted once the operation completes.
+  bool queue_interim_timer(Message* msg,
+                           uint32_t interim_interval,
+                           const std::string& session_id);
+  void on_timer_complete(HTTPCode rc,
+                         const std::string& timer_id,
+                         uint32_t interim_interval,
+                         Message* msg);
+
   void send_chronos_update(std::string& timer_id,
                            uint32_t interim_interval,
                            uint32_t session_refresh_time,
@@ -59,6 +122,10 @@ private:
   PeerMessageSenderFactory* _factory;
   Diameter::Stack* _diameter_stack;
   HealthChecker* _health_checker;
+  StageStatistics* _stats;
+  ChronosQueue* _timer_queue;
+  uint32_t _interim_timer_jitter;
+  DuplicateCache* _duplicates;
 };
 
 #endif /* SESSION_MANAGER_HPP_ */
@@ -12,11 +12,14 @@
 #ifndef SESSION_STORE_H__
 #define SESSION_STORE_H__
 
+#include <pthread.h>
+#include <map>
 #include <string>
 #include <vector>
 
 #include "store.h"
 #include "message.hpp"
+#include "stage_statistics.hpp"
 
 class SessionStore
 {
@@ -80,15 +83,33 @@ public:
     Session* deserialize_session(const std::string& data);
   };
 
+  static const int DEFAULT_PROBE_INTERVAL_MS = 5000;
+  static const size_t MAX_PENDING_WRITES = 100000;
+
   /// Constructor that creates a SessionStore.
   ///
   /// @param store              - Pointer to the underlying data store.
-  SessionStore(Store *store);
+  /// @param stats              - If set, the time spent in the store is
+  ///                             recorded against the given stage.
+  /// @param breaker_threshold  - If set, the store is treated as down after
+  ///                             this many errors in a row.  Requests then
+  ///                             fail straight away, without going to the
+  ///                             store, until a background probe finds that
+  ///                             it has come back.  Writes skipped in the
+  ///                             meantime are replayed when it does.
+  /// @param probe_interval_ms  - How often a store that is down is probed.
+  SessionStore(Store *store,
+               StageStatistics* stats = NULL,
+               StageStatistics::Stage stage = StageStatistics::LOCAL_STORE,
+               int breaker_threshold = 0,
+               int probe_interval_ms = DEFAULT_PROBE_INTERVAL_MS);
 
   /// Destructor
   ~SessionStore();
 
-  // Retrieve session state for a given Call-ID.
+  // Retrieve session state for a given Call-ID.  If another thread is
+  // already reading the same session, this waits for its read and returns a
+  // copy of what it found rather than reading the store again.
   Session* get_session_data(const std::string& call_id,
                             const role_of_node_t role,
                             const node_functionality_t function,
@@ -118,19 +139,82 @@ public:
                                     const node_functionality_t function,
                                     SAS::TrailId trail);
 
+  // Whether the store is currently treated as down, and the number of
+  // skipped writes waiting to be replayed.
+  bool breaker_open();
+  size_t pending_writes();
+
+  // If the store is treated as down, checks whether it has come back and, if
+  // so, replays the skipped writes.  Called periodically by the probe
+  // thread.  Returns true if the store is up.
+  bool probe();
+
+  // Create the key under which a session is stored.
+  static std::string create_key(const std::string& call_id,
+                                const role_of_node_t role,
+                                const node_functionality_t function);
+
 private:
   // Serialise a session to a string, ready to store in the DB.
   std::string serialize_session(Session *session);
   Session* deserialize_session(const std::string& s);
 
-  std::string create_key(const std::string& call_id,
-                         const role_of_node_t role,
-                         const node_functionality_t function);
+  // A read from the store that other threads are waiting on.  The thread
+  // doing the read sets the session (which may be NULL) and wakes them, and
+  // the last of them to take a copy deletes it.
+  struct InFlightRead
+  {
+    pthread_cond_t cond;
+    bool done;
+    Session* session;
+    int waiters;
+  };
+
+  Session* read_session_data(const std::string& call_id,
+                             const std::string& key,
+                             SAS::TrailId trail);
+  Session* wait_for_read(InFlightRead* read);
+
+  // A write (or, if the data is empty, a delete) skipped while the store was
+  // down, and when the session would have expired.
+  struct PendingWrite
+  {
+    std::string data;
+    uint64_t expires_ms;
+  };
+
+  bool skip_request(const std::string& key,
+                    const std::string* data = NULL,
+                    int expiry = 0);
+  void record_status(Store::Status status);
+  bool reconcile();
+
+  static void* probe_thread_fn(void* store_ptr);
+  void probe_thread();
 
   Store* _store;
+  StageStatistics* _stats;
+  StageStatistics::Stage _stage;
 
   JsonSerializerDeserializer* _serializer;
   std::vector<JsonSerializerDeserializer*> _deserializers;
+
+  // The reads in progress, by key.
+  pthread_mutex_t _in_flight_lock;
+  std::map<std::string, InFlightRead*> _in_flight;
+
+  // The circuit breaker.  The number of errors in a row, whether the store
+  // is treated as down, and the writes skipped while it was.
+  const int _breaker_threshold;
+  const int _probe_interval_ms;
+  pthread_mutex_t _breaker_lock;
+  pthread_cond_t _breaker_cond;
+  int _failures;
+  bool _open;
+  bool _terminated;
+  std::map<std::string, PendingWrite> _pending;
+  pthread_t _probe_thread;
+  bool _probe_thread_running;
 };
 
 #endif
@@ -0,0 +1,295 @@
+/**
+ * @file stage_statistics.hpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STAGE_STATISTICS_HPP_
+#define STAGE_STATISTICS_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "zmq_lvc.h"
+#include "statistic.h"
+#include "ralf_time.hpp"
+#include "flight_recorder.hpp"
+
+class LoadFeedback;
+
+// Latency histograms for each stage of handling an ACR, gauges of the
+// requests in flight, counts of the result codes returned by CDFs and a
+// histogram of the number of INTERIM timer pops in each second.
+//
+// Each thread records into its own set of histograms and counters, so
+// recording never takes a lock or shares a cache line with another thread.
+// A background thread periodically collects (and resets) every thread's
+// figures and publishes them through the last value cache, from where they
+// are available over ZMQ.  (Ralf has no SNMP agent, so they aren't
+// available over SNMP.)
+class StageStatistics
+{
+public:
+  enum Stage
+  {
+    PARSE = 0,
+    LOCAL_STORE,
+    REMOTE_STORE,
+    CHRONOS,
+    CDF,
+    NUM_STAGES
+  };
+
+  enum Gauge
+  {
+    HTTP_IN_FLIGHT = 0,
+    CDF_IN_FLIGHT,
+    NUM_GAUGES
+  };
+
+  // The result codes counted individually.  Other codes are counted by
+  // class.
+  enum ResultCodeSlot
+  {
+    RC_2001 = 0,
+    RC_3002,
+    RC_3004,
+    RC_OTHER_3XXX,
+    RC_4XXX,
+    RC_5XXX,
+    RC_TIMEOUT,
+    RC_OTHER,
+    NUM_RESULT_CODE_SLOTS
+  };
+
+  // Events counted in each period.
+  enum Counter
+  {
+    CHRONOS_SENT = 0,
+    CHRONOS_COALESCED,
+    DUPLICATES_SUPPRESSED,
+    SESSION_READS,
+    SESSION_READS_COALESCED,
+    STORE_REQUESTS_SKIPPED,
+    STORE_WRITES_RECONCILED,
+    NUM_COUNTERS
+  };
+
+  // Pass this to record_result() for a request that timed out.
+  static const int TIMEOUT = 0;
+
+  // The statistics we publish, in the order they must be registered with the
+  // last value cache.
+  static const int NUM_STATS = NUM_STAGES + NUM_GAUGES + 1 + NUM_COUNTERS + 1;
+  static const std::string STAT_NAMES[NUM_STATS];
+  static const char* const STAGE_NAMES[NUM_STAGES];
+
+  static const int DEFAULT_PERIOD_MS = 5000;
+
+  /// @param lvc       - The last value cache to publish to.  If NULL the
+  ///                    statistics are collected but not published.
+  /// @param period_ms - How often to collect and publish the statistics.
+  /// @param feedback  - If set, latencies and the number of requests in
+  ///                    flight to CDFs are passed on to this as well.
+  StageStatistics(LastValueCache* lvc,
+                  int period_ms = DEFAULT_PERIOD_MS,
+                  LoadFeedback* feedback = NULL);
+  virtual ~StageStatistics();
+
+  /// Starts and stops the thread that collects and publishes the statistics.
+  bool start();
+  void stop();
+
+  void record_latency(Stage stage, uint64_t latency_us);
+  void record_result(int result_code);
+  void incr_gauge(Gauge gauge);
+  void decr_gauge(Gauge gauge);
+  void incr_counter(Counter counter);
+
+  /// Counts an INTERIM timer popping at the given time (on the monotonic
+  /// clock).
+  void record_timer_pop(uint64_t now_ms = RalfTime::now_ms());
+
+  /// Collects every thread's figures and publishes them.  Called
+  /// periodically by the background thread.  The timer pops are summarised
+  /// for each whole second since the last call, up to the given time.
+  void aggregate(uint64_t now_ms = RalfTime::now_ms());
+
+  // The figures for a single stage from the last aggregation period.
+  struct StageSummary
+  {
+    uint64_t count;
+    uint64_t mean_us;
+    uint64_t p50_us;
+    uint64_t p90_us;
+    uint64_t p99_us;
+    uint64_t max_us;
+  };
+
+  // The figures for a gauge from the last aggregation period.
+  struct GaugeSummary
+  {
+    int64_t current;
+    int64_t high_water_mark;
+  };
+
+  // The distribution of the number of timer pops in each second of the last
+  // aggregation period.  If INTERIM timers are well spread, the percentiles
+  // and maximum are close to the mean.
+  struct TimerPopSummary
+  {
+    uint64_t seconds;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+  };
+
+  StageSummary stage_summary(Stage stage);
+  GaugeSummary gauge_summary(Gauge gauge);
+  uint64_t result_count(ResultCodeSlot slot);
+  uint64_t counter_count(Counter counter);
+  TimerPopSummary timer_pop_summary();
+
+  // Times a stage from construction until stop() is called or the timer is
+  // destroyed.  The start and end of the stage are also marked on the
+  // current thread's flight recorder timeline, if it has one.  Does nothing
+  // if stats is NULL and there is no timeline.
+  class StageTimer
+  {
+  public:
+    StageTimer(StageStatistics* stats, Stage stage) :
+      _stats(stats),
+      _timeline(FlightRecorder::current()),
+      _stage(stage),
+      _start_us(0)
+    {
+      if ((_stats != NULL) || (_timeline != NULL))
+      {
+        _start_us = RalfTime::now_us();
+
+        if (_timeline != NULL)
+        {
+          _timeline->mark_at(FlightRecorder::STAGE_START, _stage, _start_us);
+        }
+      }
+    }
+
+    ~StageTimer() { stop(); }
+
+    void stop()
+    {
+      if ((_stats != NULL) || (_timeline != NULL))
+      {
+        uint64_t now_us = RalfTime::now_us();
+
+        if (_stats != NULL)
+        {
+          _stats->record_latency(_stage, now_us - _start_us);
+        }
+
+        if (_timeline != NULL)
+        {
+          _timeline->mark_at(FlightRecorder::STAGE_END, _stage, now_us);
+        }
+
+        _stats = NULL;
+        _timeline = NULL;
+      }
+    }
+
+  private:
+    StageStatistics* _stats;
+    FlightRecorder::Timeline* _timeline;
+    Stage _stage;
+    uint64_t _start_us;
+  };
+
+  // Latencies are recorded in buckets: values below 16us exactly, and above
+  // that 8 buckets per power of two, so to within 12.5%.  This is coarser
+  // than LatencyHistogram, but keeps each thread's histograms small.
+  static const int EXACT = 16;
+  static const int SUB_BUCKETS = 8;
+  static const int NUM_BUCKETS = EXACT + (60 * SUB_BUCKETS);
+  static int bucket_index(uint64_t value);
+  static uint64_t bucket_value(int index);
+  static uint64_t bucket_percentile(const std::vector<uint64_t>& buckets,
+                                    uint64_t count,
+                                    uint64_t max,
+                                    double pct);
+
+  // The number of seconds of timer pops remembered between aggregations.
+  // Longer periods only summarise the latest seconds.
+  static const int POP_SECONDS = 64;
+
+private:
+  // One thread's figures.  Only the owning thread writes to these, and the
+  // aggregation thread reads and resets them, so they are atomic but need
+  // no ordering.
+  struct ThreadStats
+  {
+    std::atomic<uint64_t> buckets[NUM_STAGES][NUM_BUCKETS];
+    std::atomic<uint64_t> sum_us[NUM_STAGES];
+    std::atomic<uint64_t> max_us[NUM_STAGES];
+    std::atomic<uint64_t> results[NUM_RESULT_CODE_SLOTS];
+    std::atomic<uint64_t> counters[NUM_COUNTERS];
+    pthread_t owner;
+
+    ThreadStats();
+  };
+
+  ThreadStats* thread_stats();
+  static ResultCodeSlot result_code_slot(int result_code);
+  void aggregate_timer_pops(uint64_t now_ms);
+  void publish();
+
+  static void* aggregation_thread_fn(void* stats_ptr);
+  void aggregation_thread();
+
+  // Identifies this object in each thread's cache of its ThreadStats, so a
+  // new object at the same address doesn't pick up a deleted one's cache.
+  const uint64_t _id;
+  static std::atomic<uint64_t> _next_id;
+
+  const int _period_ms;
+  LoadFeedback* _feedback;
+
+  // Protects the list of threads' figures, and the summaries.
+  pthread_mutex_t _lock;
+  std::vector<ThreadStats*> _threads;
+
+  std::atomic<int64_t> _gauges[NUM_GAUGES];
+  std::atomic<int64_t> _gauge_hwms[NUM_GAUGES];
+
+  StageSummary _stage_summaries[NUM_STAGES];
+  GaugeSummary _gauge_summaries[NUM_GAUGES];
+  uint64_t _result_counts[NUM_RESULT_CODE_SLOTS];
+  uint64_t _counter_counts[NUM_COUNTERS];
+
+  // The timer pops in each of the last POP_SECONDS seconds.  Each entry
+  // holds the second (in the top 32 bits) and the number of pops in it (in
+  // the bottom 32), so that a thread moving an entry on to a new second
+  // doesn't need a lock.  Pops come from many threads, but far less often
+  // than latencies are recorded, so these are shared.
+  std::atomic<uint64_t> _pops[POP_SECONDS];
+  uint64_t _last_pop_second;
+  TimerPopSummary _timer_pop_summary;
+
+  std::vector<Statistic*> _statistics;
+
+  pthread_cond_t _cond;
+  pthread_t _aggregation_thread;
+  bool _aggregation_thread_running;
+  bool _terminated;
+};
+
+#endif /* STAGE_STATISTICS_HPP_ */
@@ -0,0 +1,510 @@
+/**
+ * @file acr_forwarder.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include "log.h"
+#include "sas.h"
+#include "json_parse_utils.h"
+#include "ralf_time.hpp"
+#include "acr_forwarder.hpp"
+
+// The DIAMETER_TOO_BUSY protocol error (RFC 6733).
+static const int DIAMETER_TOO_BUSY = 3004;
+
+// Diameter transaction for a replayed ACR, which reports the outcome back to
+// the forwarder (unless it has stopped since).
+class ReplayTransaction : public Diameter::Transaction
+{
+public:
+  ReplayTransaction(Diameter::Dictionary* dict,
+                    std::shared_ptr<AcrForwarder::ReplayLink> link,
+                    SAS::TrailId trail) :
+    Diameter::Transaction(dict, trail),
+    _link(link)
+  {
+  }
+
+  void on_response(Diameter::Message& rsp)
+  {
+    int result_code = 0;
+    rsp.result_code(result_code);
+    _link->response(result_code);
+  }
+
+  void on_timeout()
+  {
+    _link->timeout();
+  }
+
+private:
+  std::shared_ptr<AcrForwarder::ReplayLink> _link;
+};
+
+AcrForwarder::ReplayLink::ReplayLink(AcrForwarder* forwarder) :
+  _forwarder(forwarder)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+AcrForwarder::ReplayLink::~ReplayLink()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+// The lock is held while calling into the forwarder, so once detach()
+// returns the forwarder won't be called again.
+void AcrForwarder::ReplayLink::response(int result_code)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_forwarder != NULL)
+  {
+    _forwarder->replay_response(result_code);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void AcrForwarder::ReplayLink::timeout()
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_forwarder != NULL)
+  {
+    _forwarder->replay_timeout();
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void AcrForwarder::ReplayLink::detach()
+{
+  pthread_mutex_lock(&_lock);
+  _forwarder = NULL;
+  pthread_mutex_unlock(&_lock);
+}
+
+AcrForwarder::AcrForwarder(AcrSpool* spool,
+                           Rf::Dictionary* dict,
+                           Diameter::Stack* diameter_stack,
+                           const std::string& dest_realm,
+                           int diameter_timeout_ms,
+                           int replay_rate,
+                           PeerStateCache* peer_state_cache,
+                           const CcfStripes* ccf_stripes) :
+  _spool(spool),
+  _dict(dict),
+  _diameter_stack(diameter_stack),
+  _dest_realm(dest_realm),
+  _diameter_timeout_ms(diameter_timeout_ms),
+  _replay_interval_ms((replay_rate >= 1000) ? 1 : (1000 / replay_rate)),
+  _peer_state_cache(peer_state_cache),
+  _ccf_stripes(ccf_stripes),
+  _link(new ReplayLink(this)),
+  _replay_thread_running(false),
+  _terminated(false),
+  _replay_in_flight(false),
+  _backoff(false),
+  _failure_backoff_ms(0),
+  _spooled(0),
+  _replayed(0),
+  _rate_window_start_ms(RalfTime::now_ms()),
+  _rate_window_count(0),
+  _last_rate(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  RalfTime::init_cond(&_cond);
+  RalfTime::init_cond(&_idle_cond);
+}
+
+AcrForwarder::~AcrForwarder()
+{
+  stop();
+  pthread_cond_destroy(&_idle_cond);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool AcrForwarder::start()
+{
+  _terminated = false;
+  int rc = pthread_create(&_replay_thread, NULL, replay_thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start ACR replay thread (%d)", rc);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _replay_thread_running = true;
+  return true;
+}
+
+void AcrForwarder::stop()
+{
+  if (_replay_thread_running)
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_replay_thread, NULL);
+    _replay_thread_running = false;
+  }
+
+  // Give a replay in flight the chance to finish, so its ACR is removed from
+  // the spool if it was delivered.
+  uint64_t give_up_ms = RalfTime::now_ms() + _diameter_timeout_ms + BACKOFF_MS;
+
+  pthread_mutex_lock(&_lock);
+
+  while ((_replay_in_flight) && (RalfTime::now_ms() < give_up_ms))
+  {
+    RalfTime::timed_wait(&_idle_cond, &_lock, give_up_ms - RalfTime::now_ms());
+  }
+
+  bool in_flight = _replay_in_flight;
+  pthread_mutex_unlock(&_lock);
+
+  if (in_flight)
+  {
+    // LCOV_EXCL_START - the Diameter stack always answers or times out.
+    TRC_WARNING("Replayed ACR still outstanding on shutdown - it will be replayed again");
+    // LCOV_EXCL_STOP
+  }
+
+  _link->detach();
+}
+
+bool AcrForwarder::spool_acr(const Message* msg)
+{
+  if (!_spool->append(encode(msg)))
+  {
+    TRC_ERROR("Failed to spool ACR for %s - it has been lost", msg->call_id.c_str());
+    return false;
+  }
+
+  TRC_INFO("Spooled ACR for %s to replay later", msg->call_id.c_str());
+
+  pthread_mutex_lock(&_lock);
+  _spooled++;
+  pthread_mutex_unlock(&_lock);
+
+  return true;
+}
+
+static const char* const JSON_CALL_ID = "call_id";
+static const char* const JSON_SESSION_ID = "session_id";
+static const char* const JSON_CCFS = "ccfs";
+static const char* const JSON_ACCT_RECORD_NUM = "acct_record_num";
+static const char* const JSON_EVENT = "event";
+
+std::string AcrForwarder::encode(const Message* msg)
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String(JSON_CALL_ID); writer.String(msg->call_id.c_str());
+    writer.String(JSON_SESSION_ID); writer.String(msg->session_id.c_str());
+
+    writer.String(JSON_CCFS);
+    writer.StartArray();
+    {
+      for (std::vector<std::string>::const_iterator ccf = msg->ccfs.begin();
+           ccf != msg->ccfs.end();
+           ++ccf)
+      {
+        writer.String(ccf->c_str());
+      }
+    }
+    writer.EndArray();
+
+    writer.String(JSON_ACCT_RECORD_NUM); writer.Int(msg->accounting_record_number);
+
+    writer.String(JSON_EVENT);
+    msg->received_json->FindMember("event")->value.Accept(writer);
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+bool AcrForwarder::decode(const std::string& data, SpooledAcr& acr)
+{
+  rapidjson::Document doc;
+  doc.Parse<0>(data.c_str());
+
+  if (doc.HasParseError())
+  {
+    TRC_ERROR("Failed to parse spooled ACR");
+    return false;
+  }
+
+  try
+  {
+    JSON_GET_STRING_MEMBER(doc, JSON_CALL_ID, acr.call_id);
+    JSON_GET_STRING_MEMBER(doc, JSON_SESSION_ID, acr.session_id);
+
+    JSON_ASSERT_CONTAINS(doc, JSON_CCFS);
+    JSON_ASSERT_ARRAY(doc[JSON_CCFS]);
+    acr.ccfs.clear();
+
+    for (rapidjson::Value::ConstValueIterator ccfs_it = doc[JSON_CCFS].Begin();
+         ccfs_it != doc[JSON_CCFS].End();
+         ++ccfs_it)
+    {
+      JSON_ASSERT_STRING(*ccfs_it);
+      acr.ccfs.push_back(ccfs_it->GetString());
+    }
+
+    int record_number;
+    JSON_GET_INT_MEMBER(doc, JSON_ACCT_RECORD_NUM, record_number);
+    acr.accounting_record_number = record_number;
+
+    JSON_ASSERT_CONTAINS(doc, JSON_EVENT);
+    JSON_ASSERT_OBJECT(doc[JSON_EVENT]);
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+    doc[JSON_EVENT].Accept(writer);
+    acr.event = sb.GetString();
+  }
+  catch(JsonFormatError& err)
+  {
+    TRC_ERROR("Invalid spooled ACR (hit error at %s:%d)", err._file, err._line);
+    return false;
+  }
+
+  return true;
+}
+
+void* AcrForwarder::replay_thread_fn(void* forwarder_ptr)
+{
+  ((AcrForwarder*)forwarder_ptr)->replay_thread();
+  return NULL;
+}
+
+void AcrForwarder::replay_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    int wait_ms = !_backoff ? _replay_interval_ms :
+                  (_failure_backoff_ms > BACKOFF_MS) ? _failure_backoff_ms :
+                                                       BACKOFF_MS;
+    _backoff = false;
+
+    RalfTime::timed_wait(&_cond, &_lock, wait_ms);
+
+    if ((_terminated) || (_replay_in_flight))
+    {
+      continue;
+    }
+
+    pthread_mutex_unlock(&_lock);
+    bool sent = replay_next();
+    pthread_mutex_lock(&_lock);
+
+    if (!sent)
+    {
+      _backoff = true;
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+// Replays the ACR at the head of the spool.  Returns false if there was
+// nothing we could send.
+bool AcrForwarder::replay_next()
+{
+  std::string data;
+  uint64_t spooled_ms;
+
+  if (!_spool->peek(data, spooled_ms))
+  {
+    return false;
+  }
+
+  SpooledAcr spooled;
+
+  if (!decode(data, spooled))
+  {
+    // This will never succeed, so throw it away.
+    _spool->pop();
+    return true;
+  }
+
+  // Replay to the first CCF that isn't known to be down, over the
+  // connection picked for the session.
+  std::string ccf;
+
+  for (std::vector<std::string>::const_iterator it = spooled.ccfs.begin();
+       it != spooled.ccfs.end();
+       ++it)
+  {
+    std::string connection = (_ccf_stripes != NULL) ?
+                               _ccf_stripes->select(*it, spooled.call_id) :
+                               *it;
+
+    if ((_peer_state_cache == NULL) || (!_peer_state_cache->is_down(connection)))
+    {
+      ccf = connection;
+      break;
+    }
+  }
+
+  if (ccf.empty())
+  {
+    TRC_DEBUG("No CCF available to replay spooled ACR for %s", spooled.call_id.c_str());
+    return false;
+  }
+
+  rapidjson::Document event;
+  event.Parse<0>(spooled.event.c_str());
+
+  TRC_DEBUG("Replaying ACR for %s to %s (spooled at %ld)",
+            spooled.call_id.c_str(), ccf.c_str(), (long)spooled_ms);
+
+  SAS::TrailId trail = SAS::new_trail(0);
+  Rf::AccountingRequest acr(_dict,
+                            _diameter_stack,
+                            spooled.session_id,
+                            ccf,
+                            _dest_realm,
+                            spooled.accounting_record_number,
+                            event);
+
+  // Mark the ACR as potentially retransmitted.
+  struct msg_hdr* hdr = NULL;
+
+  if ((fd_msg_hdr(acr.fd_msg(), &hdr) == 0) && (hdr != NULL))
+  {
+    hdr->msg_flags |= CMD_FLAG_RETRANSMIT;
+  }
+
+  pthread_mutex_lock(&_lock);
+  _replay_in_flight = true;
+  pthread_mutex_unlock(&_lock);
+
+  acr.send(new ReplayTransaction(_dict, _link, trail), _diameter_timeout_ms);
+  return true;
+}
+
+// The result codes that RFC 6733 says may succeed if the request is sent
+// again later: DIAMETER_UNABLE_TO_DELIVER and DIAMETER_TOO_BUSY, which a
+// recovering CDF sends, and the transient failures (4xxx).
+bool AcrForwarder::is_transient(int result_code)
+{
+  return ((result_code == ER_DIAMETER_UNABLE_TO_DELIVER) ||
+          (result_code == DIAMETER_TOO_BUSY) ||
+          ((result_code >= 4000) && (result_code < 5000)));
+}
+
+void AcrForwarder::replay_response(int result_code)
+{
+  if (is_transient(result_code))
+  {
+    TRC_DEBUG("Replayed ACR failed (%d) - will try again", result_code);
+    replay_complete(false);
+  }
+  else
+  {
+    if (result_code != ER_DIAMETER_SUCCESS)
+    {
+      // Sending the ACR again would get the same answer.
+      TRC_WARNING("Replayed ACR was rejected by the CDF (%d)", result_code);
+    }
+
+    replay_complete(true);
+  }
+}
+
+void AcrForwarder::replay_timeout()
+{
+  replay_complete(false);
+}
+
+void AcrForwarder::replay_complete(bool delivered)
+{
+  if (delivered)
+  {
+    _spool->pop();
+  }
+
+  uint64_t now = RalfTime::now_ms();
+
+  pthread_mutex_lock(&_lock);
+  _replay_in_flight = false;
+  pthread_cond_signal(&_idle_cond);
+
+  if (delivered)
+  {
+    _replayed++;
+    _failure_backoff_ms = 0;
+
+    if (now - _rate_window_start_ms >= 1000)
+    {
+      _last_rate = _rate_window_count;
+      _rate_window_count = 0;
+      _rate_window_start_ms = now;
+    }
+
+    _rate_window_count++;
+  }
+  else
+  {
+    _failure_backoff_ms = (_failure_backoff_ms == 0) ? BACKOFF_MS :
+                          (_failure_backoff_ms * 2 < MAX_BACKOFF_MS) ? _failure_backoff_ms * 2 :
+                                                                       MAX_BACKOFF_MS;
+    _backoff = true;
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+uint64_t AcrForwarder::spooled_count()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t spooled = _spooled;
+  pthread_mutex_unlock(&_lock);
+
+  return spooled;
+}
+
+uint64_t AcrForwarder::replayed_count()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t replayed = _replayed;
+  pthread_mutex_unlock(&_lock);
+
+  return replayed;
+}
+
+uint64_t AcrForwarder::replay_rate()
+{
+  uint64_t now = RalfTime::now_ms();
+
+  pthread_mutex_lock(&_lock);
+
+  // If the current window is more than a second old then nothing has been
+  // replayed for over a second.
+  uint64_t rate = (now - _rate_window_start_ms >= 2000) ? 0 : _last_rate;
+  pthread_mutex_unlock(&_lock);
+
+  return rate;
+}
@@ -0,0 +1,405 @@
+/**
+ * @file acr_spool.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "ralf_time.hpp"
+#include "acr_spool.hpp"
+
+AcrSpool::AcrSpool(const std::string& path,
+                   size_t size_bytes,
+                   int sync_interval_ms) :
+  _path(path),
+  _size_bytes(size_bytes),
+  _sync_interval_ms(sync_interval_ms),
+  _fd(-1),
+  _base(NULL),
+  _header(NULL),
+  _dirty(false),
+  _dropped(0),
+  _sync_thread_running(false),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  RalfTime::init_cond(&_cond);
+}
+
+AcrSpool::~AcrSpool()
+{
+  close();
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool AcrSpool::open()
+{
+  if (_size_bytes <= DATA_START + sizeof(RecordHeader))
+  {
+    TRC_ERROR("ACR spool size %ld is too small", (long)_size_bytes);
+    return false;
+  }
+
+  _fd = ::open(_path.c_str(), O_RDWR | O_CREAT, 0600);
+
+  if (_fd < 0)
+  {
+    TRC_ERROR("Failed to open ACR spool %s: %s", _path.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Size the file.  Any records already in it are recovered below, so we
+  // never shrink it here.
+  struct stat st;
+
+  if ((fstat(_fd, &st) != 0) ||
+      (((size_t)st.st_size < _size_bytes) && (ftruncate(_fd, _size_bytes) != 0)))
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to size ACR spool %s: %s", _path.c_str(), strerror(errno));
+    ::close(_fd); _fd = -1;
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  void* base = mmap(NULL, _size_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+
+  if (base == MAP_FAILED)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to map ACR spool %s: %s", _path.c_str(), strerror(errno));
+    ::close(_fd); _fd = -1;
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _base = (uint8_t*)base;
+  _header = (Header*)_base;
+  recover();
+
+  _terminated = false;
+  int rc = pthread_create(&_sync_thread, NULL, sync_thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start ACR spool sync thread (%d)", rc);
+    munmap(_base, _size_bytes); _base = NULL; _header = NULL;
+    ::close(_fd); _fd = -1;
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _sync_thread_running = true;
+  return true;
+}
+
+void AcrSpool::close()
+{
+  if (_sync_thread_running)
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_sync_thread, NULL);
+    _sync_thread_running = false;
+  }
+
+  if (_base != NULL)
+  {
+    _dirty = true;
+    sync();
+    munmap(_base, _size_bytes);
+    _base = NULL;
+    _header = NULL;
+  }
+
+  if (_fd >= 0)
+  {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+// Checks the records in the spool, discarding any that are damaged.  Called
+// before the sync thread starts, so doesn't need the lock.
+void AcrSpool::recover()
+{
+  if ((_header->magic != MAGIC) ||
+      (_header->version != VERSION) ||
+      (_header->head < DATA_START) ||
+      (_header->head > _header->tail) ||
+      (_header->tail > _size_bytes))
+  {
+    TRC_STATUS("Initializing ACR spool %s", _path.c_str());
+    memset(_header, 0, sizeof(Header));
+    _header->magic = MAGIC;
+    _header->version = VERSION;
+    _header->head = DATA_START;
+    _header->tail = DATA_START;
+    _header->count = 0;
+    _dirty = true;
+    return;
+  }
+
+  uint64_t offset = _header->head;
+  uint64_t count = 0;
+
+  while (offset + sizeof(RecordHeader) <= _header->tail)
+  {
+    RecordHeader rec;
+    memcpy(&rec, _base + offset, sizeof(rec));
+
+    if ((offset + sizeof(rec) + rec.length > _header->tail) ||
+        (record_crc(rec, _base + offset + sizeof(rec)) != rec.crc))
+    {
+      TRC_WARNING("Discarding damaged records from offset %ld of ACR spool %s",
+                  (long)offset, _path.c_str());
+      break;
+    }
+
+    offset += sizeof(rec) + rec.length;
+    count++;
+  }
+
+  _header->tail = offset;
+  _header->count = count;
+  _dirty = true;
+
+  if (count > 0)
+  {
+    TRC_STATUS("Recovered %ld ACRs from spool %s", (long)count, _path.c_str());
+  }
+}
+
+bool AcrSpool::append(const std::string& payload)
+{
+  RecordHeader rec;
+  rec.length = payload.length();
+  rec.spooled_ms = RalfTime::wall_clock_ms();
+  rec.crc = record_crc(rec, (const uint8_t*)payload.data());
+  size_t record_size = sizeof(rec) + payload.length();
+
+  pthread_mutex_lock(&_lock);
+
+  if ((_header != NULL) &&
+      (_header->tail + record_size > _size_bytes))
+  {
+    compact();
+  }
+
+  if ((_header == NULL) ||
+      (_header->tail + record_size > _size_bytes))
+  {
+    _dropped++;
+    pthread_mutex_unlock(&_lock);
+    TRC_ERROR("No room in ACR spool for %ld byte record", (long)record_size);
+    return false;
+  }
+
+  // Write the record before moving the tail past it.
+  uint8_t* dest = _base + _header->tail;
+  memcpy(dest, &rec, sizeof(rec));
+  memcpy(dest + sizeof(rec), payload.data(), payload.length());
+  _header->tail += record_size;
+  _header->count++;
+  _dirty = true;
+
+  pthread_mutex_unlock(&_lock);
+  return true;
+}
+
+// Moves the live records to the start of the file to make room at the end.
+// We only do this if the live records fit entirely in the space that has
+// already been consumed, so that the old copy is intact until the header is
+// updated.  The kernel may write the pages of the mapping back in any order,
+// so the moved records are flushed to disk before the header is changed to
+// point at them, and the header straight after.  Must be called with the
+// lock held.
+void AcrSpool::compact()
+{
+  uint64_t live = _header->tail - _header->head;
+
+  if ((_header->head == DATA_START) ||
+      (live > _header->head - DATA_START))
+  {
+    return;
+  }
+
+  memmove(_base + DATA_START, _base + _header->head, live);
+
+  if (msync(_base, DATA_START + live, MS_SYNC) != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to sync ACR spool %s: %s", _path.c_str(), strerror(errno));
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  _header->head = DATA_START;
+  _header->tail = DATA_START + live;
+
+  if (msync(_base, sizeof(Header), MS_SYNC) != 0)
+  {
+    TRC_ERROR("Failed to sync ACR spool %s: %s", _path.c_str(), strerror(errno)); // LCOV_EXCL_LINE
+  }
+
+  _dirty = true;
+}
+
+bool AcrSpool::peek(std::string& payload, uint64_t& spooled_ms)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&_lock);
+
+  if ((_header != NULL) && (_header->count > 0))
+  {
+    RecordHeader rec;
+    memcpy(&rec, _base + _header->head, sizeof(rec));
+    payload.assign((const char*)_base + _header->head + sizeof(rec), rec.length);
+    spooled_ms = rec.spooled_ms;
+    found = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return found;
+}
+
+void AcrSpool::pop()
+{
+  pthread_mutex_lock(&_lock);
+
+  if ((_header != NULL) && (_header->count > 0))
+  {
+    RecordHeader rec;
+    memcpy(&rec, _base + _header->head, sizeof(rec));
+    _header->head += sizeof(rec) + rec.length;
+    _header->count--;
+
+    if (_header->count == 0)
+    {
+      // The spool is empty, so start again from the beginning of the file.
+      _header->head = DATA_START;
+      _header->tail = DATA_START;
+    }
+
+    _dirty = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void AcrSpool::sync()
+{
+  pthread_mutex_lock(&_lock);
+  bool dirty = _dirty;
+  _dirty = false;
+  pthread_mutex_unlock(&_lock);
+
+  // msync only writes the pages that have changed, so this is cheap if only a
+  // few records have been added.
+  if ((dirty) && (_base != NULL) && (msync(_base, _size_bytes, MS_SYNC) != 0))
+  {
+    TRC_ERROR("Failed to sync ACR spool %s: %s", _path.c_str(), strerror(errno)); // LCOV_EXCL_LINE
+  }
+}
+
+uint64_t AcrSpool::depth()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t count = (_header != NULL) ? _header->count : 0;
+  pthread_mutex_unlock(&_lock);
+
+  return count;
+}
+
+uint64_t AcrSpool::oldest_age_ms()
+{
+  std::string payload;
+  uint64_t spooled_ms;
+
+  if (!peek(payload, spooled_ms))
+  {
+    return 0;
+  }
+
+  uint64_t now = RalfTime::wall_clock_ms();
+  return (now > spooled_ms) ? (now - spooled_ms) : 0;
+}
+
+uint64_t AcrSpool::dropped_count()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t dropped = _dropped;
+  pthread_mutex_unlock(&_lock);
+
+  return dropped;
+}
+
+void* AcrSpool::sync_thread_fn(void* spool_ptr)
+{
+  ((AcrSpool*)spool_ptr)->sync_thread();
+  return NULL;
+}
+
+void AcrSpool::sync_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    RalfTime::timed_wait(&_cond, &_lock, _sync_interval_ms);
+
+    if (!_terminated)
+    {
+      pthread_mutex_unlock(&_lock);
+      sync();
+      pthread_mutex_lock(&_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+// The CRC covers the record's length, time and payload.
+uint32_t AcrSpool::record_crc(const RecordHeader& hdr, const uint8_t* payload)
+{
+  uint32_t crc = crc32(0, (const uint8_t*)&hdr.length, sizeof(hdr.length));
+  crc = crc32(crc, (const uint8_t*)&hdr.spooled_ms, sizeof(hdr.spooled_ms));
+  return crc32(crc, payload, hdr.length);
+}
+
+// Standard (IEEE 802.3) CRC-32, computed bitwise - records are small and are
+// only written when we have failed to reach any CCF.
+uint32_t AcrSpool::crc32(uint32_t crc, const uint8_t* data, size_t length)
+{
+  crc = ~crc;
+
+  for (size_t ii = 0; ii < length; ii++)
+  {
+    crc ^= data[ii];
+
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320u & (0 - (crc & 1)));
+    }
+  }
+
+  return ~crc;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file ccf_stripes.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <boost/algorithm/string.hpp>
+
+#include "log.h"
+#include "ccf_stripes.hpp"
+#include "ralf_hash.hpp"
+
+CcfStripes::CcfStripes()
+{
+}
+
+CcfStripes::~CcfStripes()
+{
+}
+
+bool CcfStripes::configure(const std::vector<std::string>& config)
+{
+  for (std::vector<std::string>::const_iterator it = config.begin();
+       it != config.end();
+       ++it)
+  {
+    size_t sep = it->find('=');
+
+    if ((sep == std::string::npos) || (sep == 0) || (sep == it->length() - 1))
+    {
+      TRC_ERROR("Invalid CCF stripe configuration: %s", it->c_str());
+      return false;
+    }
+
+    std::string ccf = it->substr(0, sep);
+    std::string identities = it->substr(sep + 1);
+    std::vector<std::string> stripes;
+    boost::split(stripes, identities, boost::is_any_of(";"));
+
+    for (std::vector<std::string>::const_iterator stripe = stripes.begin();
+         stripe != stripes.end();
+         ++stripe)
+    {
+      if (stripe->empty())
+      {
+        TRC_ERROR("Invalid CCF stripe configuration: %s", it->c_str());
+        return false;
+      }
+    }
+
+    TRC_STATUS("Striping ACRs for CCF %s across %d connections",
+               ccf.c_str(), (int)stripes.size());
+    _stripes[ccf] = stripes;
+  }
+
+  return true;
+}
+
+std::string CcfStripes::select(const std::string& ccf,
+                               const std::string& key) const
+{
+  std::map<std::string, std::vector<std::string>>::const_iterator it =
+                                                           _stripes.find(ccf);
+
+  if (it == _stripes.end())
+  {
+    return ccf;
+  }
+
+  const std::vector<std::string>& stripes = it->second;
+  // Every Ralf must pick the same stripe for a session, whichever node
+  // handles each of its ACRs.
+  return stripes[RalfHash::fnv1a(key) % stripes.size()];
+}
@@ -0,0 +1,452 @@
+/**
+ * @file chronos_queue.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "ralf_time.hpp"
+#include "chronos_queue.hpp"
+
+ChronosQueue::ChronosQueue(ChronosConnection* conn,
+                           int threads,
+                           int max_depth,
+                           StageStatistics* stats,
+                           int coalesce_ms) :
+  _conn(conn),
+  _num_threads(threads),
+  _max_depth(max_depth),
+  _stats(stats),
+  _coalesce_ms(coalesce_ms),
+  _terminated(true),
+  _flush_thread_running(false),
+  _sent(0),
+  _coalesced(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+  RalfTime::init_cond(&_flush_cond);
+}
+
+ChronosQueue::~ChronosQueue()
+{
+  stop();
+  pthread_cond_destroy(&_flush_cond);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool ChronosQueue::start()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = false;
+  pthread_mutex_unlock(&_lock);
+
+  for (int ii = 0; ii < _num_threads; ii++)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, worker_thread_fn, this);
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start Chronos thread (%d)", rc);
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    _threads.push_back(thread);
+  }
+
+  if (_coalesce_ms > 0)
+  {
+    int rc = pthread_create(&_flush_thread, NULL, flush_thread_fn, this);
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start Chronos flush thread (%d)", rc);
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    _flush_thread_running = true;
+  }
+
+  return true;
+}
+
+void ChronosQueue::stop()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_flush_cond);
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  // The flush thread passes any operations still waiting to be coalesced to
+  // the worker threads before it exits.
+  if (_flush_thread_running)
+  {
+    pthread_join(_flush_thread, NULL);
+    _flush_thread_running = false;
+  }
+
+  for (std::vector<pthread_t>::iterator it = _threads.begin();
+       it != _threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  _threads.clear();
+}
+
+bool ChronosQueue::send(Method method,
+                        const std::string& timer_id,
+                        uint32_t interval,
+                        uint32_t repeat_for,
+                        const std::string& callback_uri,
+                        const std::string& opaque_data,
+                        SAS::TrailId trail,
+                        const std::map<std::string, uint32_t>& tags,
+                        Callback* callback)
+{
+  Operation* op = new Operation();
+  op->method = method;
+  op->timer_id = timer_id;
+  op->interval = interval;
+  op->repeat_for = repeat_for;
+  op->callback_uri = callback_uri;
+  op->opaque_data = opaque_data;
+  op->trail = trail;
+  op->tags = tags;
+
+  if (callback != NULL)
+  {
+    op->callbacks.push_back(callback);
+  }
+
+  return enqueue(op);
+}
+
+bool ChronosQueue::send_delete(const std::string& timer_id, SAS::TrailId trail)
+{
+  Operation* op = new Operation();
+  op->method = DELETE;
+  op->timer_id = timer_id;
+  op->interval = 0;
+  op->repeat_for = 0;
+  op->trail = trail;
+
+  return enqueue(op);
+}
+
+size_t ChronosQueue::depth()
+{
+  pthread_mutex_lock(&_lock);
+  size_t depth = _queue.size() + _pending.size();
+  pthread_mutex_unlock(&_lock);
+  return depth;
+}
+
+uint64_t ChronosQueue::sent_count()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t sent = _sent;
+  pthread_mutex_unlock(&_lock);
+  return sent;
+}
+
+uint64_t ChronosQueue::coalesced_count()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t coalesced = _coalesced;
+  pthread_mutex_unlock(&_lock);
+  return coalesced;
+}
+
+bool ChronosQueue::enqueue(Operation* op)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_terminated)
+  {
+    pthread_mutex_unlock(&_lock);
+    TRC_WARNING("Chronos queue is stopped, not queuing timer operation");
+    delete op; op = NULL;
+    return false;
+  }
+
+  bool coalescing = (_coalesce_ms > 0) && (op->method == PUT);
+  bool dropped_update = false;
+
+  if ((_coalesce_ms > 0) && (op->method == DELETE))
+  {
+    // Deletions are never delayed, but any update still waiting for the
+    // timer is dropped, so it can't re-create the timer afterwards.  Its
+    // callbacks are told the deletion's outcome.
+    std::map<std::string, Operation*>::iterator pending = _pending.find(op->timer_id);
+
+    if (pending != _pending.end())
+    {
+      op->callbacks.insert(op->callbacks.begin(),
+                           pending->second->callbacks.begin(),
+                           pending->second->callbacks.end());
+      delete pending->second;
+      _pending.erase(pending);
+      _coalesced++;
+      dropped_update = true;
+    }
+  }
+
+  if (coalescing)
+  {
+    std::map<std::string, Operation*>::iterator pending = _pending.find(op->timer_id);
+
+    if (pending != _pending.end())
+    {
+      // Coalescing never makes the queue longer, so is always allowed.
+      coalesce(pending->second, op);
+      _coalesced++;
+      pthread_mutex_unlock(&_lock);
+
+      if (_stats != NULL)
+      {
+        _stats->incr_counter(StageStatistics::CHRONOS_COALESCED);
+      }
+
+      return true;
+    }
+  }
+
+  if (_queue.size() + _pending.size() >= _max_depth)
+  {
+    pthread_mutex_unlock(&_lock);
+    TRC_WARNING("Chronos queue is full, not queuing timer operation");
+    delete op; op = NULL;
+    return false;
+  }
+
+  if (coalescing)
+  {
+    _pending[op->timer_id] = op;
+  }
+  else
+  {
+    _queue.push_back(op);
+    pthread_cond_signal(&_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if ((dropped_update) && (_stats != NULL))
+  {
+    _stats->incr_counter(StageStatistics::CHRONOS_COALESCED);
+  }
+
+  return true;
+}
+
+// Merges a new update of a timer into the one already waiting for it, and
+// deletes the new update.  Only the latest update needs sending.  Must be
+// called with the lock held.
+void ChronosQueue::coalesce(Operation* pending, Operation* op)
+{
+  TRC_DEBUG("Coalescing timer operation for %s", op->timer_id.c_str());
+
+  pending->method = op->method;
+  pending->interval = op->interval;
+  pending->repeat_for = op->repeat_for;
+  pending->callback_uri = op->callback_uri;
+  pending->opaque_data = op->opaque_data;
+  pending->trail = op->trail;
+  pending->tags = op->tags;
+  pending->callbacks.insert(pending->callbacks.end(),
+                            op->callbacks.begin(),
+                            op->callbacks.end());
+
+  delete op; op = NULL;
+}
+
+// Passes every operation waiting to be coalesced to the worker threads.
+// Must be called with the lock held.
+void ChronosQueue::flush()
+{
+  if (_pending.empty())
+  {
+    return;
+  }
+
+  TRC_DEBUG("Flushing %lu timer operations", _pending.size());
+
+  for (std::map<std::string, Operation*>::iterator it = _pending.begin();
+       it != _pending.end();
+       ++it)
+  {
+    _queue.push_back(it->second);
+  }
+
+  _pending.clear();
+  pthread_cond_broadcast(&_cond);
+}
+
+void ChronosQueue::process(Operation* op)
+{
+  StageStatistics::StageTimer timer(_stats, StageStatistics::CHRONOS);
+  HTTPCode rc;
+
+  switch (op->method)
+  {
+  case POST:
+    rc = _conn->send_post(op->timer_id,
+                          op->interval,
+                          op->repeat_for,
+                          op->callback_uri,
+                          op->opaque_data,
+                          op->trail,
+                          op->tags);
+    break;
+
+  case PUT:
+    rc = _conn->send_put(op->timer_id,
+                         op->interval,
+                         op->repeat_for,
+                         op->callback_uri,
+                         op->opaque_data,
+                         op->trail,
+                         op->tags);
+    break;
+
+  case DELETE:
+  default:
+    rc = _conn->send_delete(op->timer_id, op->trail);
+    break;
+  }
+
+  timer.stop();
+
+  if (_stats != NULL)
+  {
+    _stats->incr_counter(StageStatistics::CHRONOS_SENT);
+  }
+
+  if (rc != HTTP_OK)
+  {
+    TRC_WARNING("Chronos request for timer %s failed (%ld)", op->timer_id.c_str(), rc);
+  }
+
+  for (std::vector<Callback*>::iterator it = op->callbacks.begin();
+       it != op->callbacks.end();
+       ++it)
+  {
+    (*it)->on_timer_complete(rc, op->timer_id);
+  }
+}
+
+void* ChronosQueue::worker_thread_fn(void* queue_ptr)
+{
+  ((ChronosQueue*)queue_ptr)->worker_thread();
+  return NULL;
+}
+
+// Finds the first queued operation that can be sent now, which is one on a
+// timer with nothing else in flight.  New timers have no ID yet, so can
+// always be sent.  Must be called with the lock held.
+std::deque<ChronosQueue::Operation*>::iterator ChronosQueue::next_ready()
+{
+  std::deque<Operation*>::iterator it = _queue.begin();
+
+  while ((it != _queue.end()) &&
+         (!(*it)->timer_id.empty()) &&
+         (_in_flight.find((*it)->timer_id) != _in_flight.end()))
+  {
+    ++it;
+  }
+
+  return it;
+}
+
+void ChronosQueue::worker_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    std::deque<Operation*>::iterator ready = next_ready();
+
+    if (ready != _queue.end())
+    {
+      Operation* op = *ready;
+      _queue.erase(ready);
+      std::string timer_id = op->timer_id;
+
+      if (!timer_id.empty())
+      {
+        _in_flight.insert(timer_id);
+      }
+
+      pthread_mutex_unlock(&_lock);
+
+      process(op);
+      delete op; op = NULL;
+
+      pthread_mutex_lock(&_lock);
+      _sent++;
+
+      if (!timer_id.empty())
+      {
+        _in_flight.erase(timer_id);
+
+        // Another thread may be waiting for this timer's next operation.
+        if (!_queue.empty())
+        {
+          pthread_cond_broadcast(&_cond);
+        }
+      }
+    }
+    else if ((_terminated) && (_queue.empty()) && (_pending.empty()))
+    {
+      // Only stop once everything queued has been sent.
+      break;
+    }
+    else
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void* ChronosQueue::flush_thread_fn(void* queue_ptr)
+{
+  ((ChronosQueue*)queue_ptr)->flush_thread();
+  return NULL;
+}
+
+void ChronosQueue::flush_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    if (_terminated)
+    {
+      // Pass on anything that's still waiting before exiting.
+      flush();
+      break;
+    }
+
+    RalfTime::timed_wait(&_flush_cond, &_lock, _coalesce_ms);
+
+    flush();
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,126 @@
+/**
+ * @file duplicate_cache.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <functional>
+
+#include "duplicate_cache.hpp"
+
+DuplicateCache::DuplicateCache(int window_ms) :
+  _window_ms(window_ms),
+  _suppressed(0)
+{
+  for (int ii = 0; ii < NUM_SHARDS; ii++)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+  }
+}
+
+DuplicateCache::~DuplicateCache()
+{
+  for (int ii = 0; ii < NUM_SHARDS; ii++)
+  {
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
+}
+
+std::string DuplicateCache::key(const std::string& call_id,
+                                int role,
+                                int function,
+                                int record_type,
+                                const std::string& body)
+{
+  // The body is only fingerprinted, to keep the entries small.  The key is
+  // only used within this process, so std::hash is good enough.
+  char fields[64];
+  snprintf(fields, sizeof(fields), " %d %d %d %zx",
+           role, function, record_type, std::hash<std::string>()(body));
+  return call_id + fields;
+}
+
+std::string DuplicateCache::timer_pop_key(const std::string& call_id,
+                                          int role,
+                                          int function)
+{
+  char fields[32];
+  snprintf(fields, sizeof(fields), " %d %d pop", role, function);
+  return call_id + fields;
+}
+
+bool DuplicateCache::check(const std::string& key, uint64_t now_ms)
+{
+  return check_within(key, _window_ms, now_ms);
+}
+
+bool DuplicateCache::check_within(const std::string& key,
+                                  uint64_t max_window_ms,
+                                  uint64_t now_ms)
+{
+  uint64_t window_ms = (max_window_ms < _window_ms) ? max_window_ms : _window_ms;
+  Shard& shard = _shards[std::hash<std::string>()(key) % NUM_SHARDS];
+  bool duplicate = false;
+
+  pthread_mutex_lock(&shard.lock);
+
+  // Forget the entries that have expired.  The map only holds the latest
+  // entry for each ACR, which is a later one if the times we've been given
+  // haven't always increased.  Entries with shorter windows can expire
+  // before those ahead of them in the queue, so the map is checked for them
+  // too.
+  while ((!shard.queue.empty()) && (shard.queue.front().first <= now_ms))
+  {
+    std::unordered_map<std::string, uint64_t>::iterator it =
+      shard.expiries.find(shard.queue.front().second);
+
+    if ((it != shard.expiries.end()) && (it->second == shard.queue.front().first))
+    {
+      shard.expiries.erase(it);
+    }
+
+    shard.queue.pop_front();
+  }
+
+  std::unordered_map<std::string, uint64_t>::iterator it = shard.expiries.find(key);
+
+  if ((it != shard.expiries.end()) && (it->second > now_ms))
+  {
+    duplicate = true;
+  }
+  else
+  {
+    uint64_t expiry_ms = now_ms + window_ms;
+    shard.expiries[key] = expiry_ms;
+    shard.queue.push_back(std::make_pair(expiry_ms, key));
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+
+  if (duplicate)
+  {
+    _suppressed++;
+  }
+
+  return duplicate;
+}
+
+size_t DuplicateCache::size()
+{
+  size_t size = 0;
+
+  for (int ii = 0; ii < NUM_SHARDS; ii++)
+  {
+    pthread_mutex_lock(&_shards[ii].lock);
+    size += _shards[ii].expiries.size();
+    pthread_mutex_unlock(&_shards[ii].lock);
+  }
+
+  return size;
+}
@@ -0,0 +1,379 @@
+/**
+ * @file flight_recorder.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "log.h"
+#include "flight_recorder.hpp"
+#include "stage_statistics.hpp"
+
+static __thread FlightRecorder::Timeline* tls_current_timeline = NULL;
+
+FlightRecorder::Timeline* FlightRecorder::current()
+{
+  return tls_current_timeline;
+}
+
+FlightRecorder::CurrentTimeline::CurrentTimeline(Timeline* timeline)
+{
+  tls_current_timeline = timeline;
+}
+
+FlightRecorder::CurrentTimeline::~CurrentTimeline()
+{
+  clear();
+}
+
+void FlightRecorder::CurrentTimeline::clear()
+{
+  tls_current_timeline = NULL;
+}
+
+void FlightRecorder::Timeline::start(FlightRecorder* recorder,
+                                     uint64_t arrival_us,
+                                     const std::string& call_id,
+                                     SAS::TrailId trail)
+{
+  _recorder = recorder;
+  _arrival_us = arrival_us;
+
+  size_t len = std::min(call_id.size(), (size_t)MAX_CALL_ID);
+  memcpy(_entry.call_id, call_id.data(), len);
+  _entry.call_id[len] = '\0';
+  _entry.trail = trail;
+  _entry.arrival_ms = RalfTime::wall_clock_ms() - ((RalfTime::now_us() - arrival_us) / 1000);
+  _entry.total_us = 0;
+  _entry.num_events = 0;
+  _entry.truncated = false;
+}
+
+void FlightRecorder::Timeline::mark_at(EventType type, int32_t detail, uint64_t now_us)
+{
+  if (_recorder == NULL)
+  {
+    return;
+  }
+
+  // Always leave room for the COMPLETE event.
+  if ((_entry.num_events >= MAX_EVENTS - 1) && (type != COMPLETE))
+  {
+    _entry.truncated = true;
+    return;
+  }
+
+  Event& event = _entry.events[_entry.num_events++];
+  event.offset_us = (uint32_t)(now_us - _arrival_us);
+  event.detail = detail;
+  event.type = type;
+}
+
+void FlightRecorder::Timeline::finish()
+{
+  if (_recorder == NULL)
+  {
+    return;
+  }
+
+  uint64_t now_us = RalfTime::now_us();
+  mark_at(COMPLETE, 0, now_us);
+  _entry.total_us = (uint32_t)(now_us - _arrival_us);
+  _recorder->record(_entry);
+  _recorder = NULL;
+}
+
+FlightRecorder::Ring::Ring(int capacity) :
+  _slots(new Slot[capacity]),
+  _capacity(capacity),
+  _next(0)
+{
+  for (int ii = 0; ii < capacity; ii++)
+  {
+    _slots[ii].seq.store(0);
+  }
+}
+
+FlightRecorder::Ring::~Ring()
+{
+  delete[] _slots; _slots = NULL;
+}
+
+// Writes an entry into the next slot.  Each slot has a sequence number which
+// is odd while the slot is being written, so readers can tell if they have
+// read a slot while it was changing.
+void FlightRecorder::Ring::write(const Entry& entry)
+{
+  uint64_t index = _next.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = _slots[index % _capacity];
+
+  slot.seq.store((index * 2) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.entry = entry;
+  slot.seq.store((index * 2) + 2, std::memory_order_release);
+}
+
+// Reads the entries in the ring, oldest first.  Entries that are being
+// written while we read them are skipped.
+void FlightRecorder::Ring::read(std::vector<Entry>& entries)
+{
+  uint64_t next = _next.load(std::memory_order_acquire);
+  uint64_t first = (next > _capacity) ? (next - _capacity) : 0;
+
+  for (uint64_t index = first; index < next; index++)
+  {
+    Slot& slot = _slots[index % _capacity];
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+
+    if (seq != (index * 2) + 2)
+    {
+      // Still being written, or already overwritten.
+      continue;
+    }
+
+    Entry entry = slot.entry;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (slot.seq.load(std::memory_order_relaxed) == seq)
+    {
+      entries.push_back(entry);
+    }
+  }
+}
+
+FlightRecorder::FlightRecorder(int slow_threshold_ms,
+                               int recent_capacity,
+                               int slow_capacity) :
+  _slow_threshold_us((uint32_t)slow_threshold_ms * 1000),
+  _recent(recent_capacity),
+  _slow(slow_capacity),
+  _dump_thread_running(false),
+  _terminated(false)
+{
+  sem_init(&_dump_sem, 0, 0);
+}
+
+FlightRecorder::~FlightRecorder()
+{
+  stop();
+  sem_destroy(&_dump_sem);
+}
+
+void FlightRecorder::record(const Entry& entry)
+{
+  _recent.write(entry);
+
+  if (entry.total_us >= _slow_threshold_us)
+  {
+    _slow.write(entry);
+  }
+}
+
+static const char* event_name(uint8_t type)
+{
+  switch (type)
+  {
+  case FlightRecorder::PARSED:
+    return "parsed";
+  case FlightRecorder::STAGE_START:
+    return "start";
+  case FlightRecorder::STAGE_END:
+    return "end";
+  case FlightRecorder::CDF_SEND:
+    return "cdf_send";
+  case FlightRecorder::CDF_ANSWER:
+    return "cdf_answer";
+  case FlightRecorder::CDF_TIMEOUT:
+    return "cdf_timeout";
+  case FlightRecorder::CDF_SHED:
+    return "cdf_shed";
+  case FlightRecorder::COMPLETE:
+    return "complete";
+  default:
+    return "unknown"; // LCOV_EXCL_LINE
+  }
+}
+
+// Formats an entry as a single line, for example
+//
+//   2017-06-01 12:00:00.123 call-id=abc trail=1 total_us=20100 parsed@120
+//   local_store_start@130 local_store_end@900 cdf_send(0)@950
+//   cdf_answer(2001)@20000 complete@20100
+std::string FlightRecorder::format(const Entry& entry)
+{
+  std::ostringstream oss;
+
+  time_t secs = entry.arrival_ms / 1000;
+  struct tm tm;
+  char timestamp[32];
+  localtime_r(&secs, &tm);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+  char millis[8];
+  snprintf(millis, sizeof(millis), ".%03d", (int)(entry.arrival_ms % 1000));
+
+  oss << timestamp << millis
+      << " call-id=" << entry.call_id
+      << " trail=" << entry.trail
+      << " total_us=" << entry.total_us;
+
+  for (int ii = 0; ii < entry.num_events; ii++)
+  {
+    const Event& event = entry.events[ii];
+    oss << " ";
+
+    if ((event.type == STAGE_START) || (event.type == STAGE_END))
+    {
+      if ((event.detail >= 0) && (event.detail < StageStatistics::NUM_STAGES))
+      {
+        oss << StageStatistics::STAGE_NAMES[event.detail] << "_";
+      }
+
+      oss << event_name(event.type);
+    }
+    else if ((event.type == CDF_SEND) ||
+             (event.type == CDF_ANSWER) ||
+             (event.type == CDF_SHED))
+    {
+      oss << event_name(event.type) << "(" << event.detail << ")";
+    }
+    else
+    {
+      oss << event_name(event.type);
+    }
+
+    oss << "@" << event.offset_us;
+  }
+
+  if (entry.truncated)
+  {
+    oss << " (truncated)";
+  }
+
+  return oss.str();
+}
+
+std::string FlightRecorder::dump(bool include_recent)
+{
+  std::ostringstream oss;
+  std::vector<Entry> entries;
+
+  _slow.read(entries);
+  oss << "# Requests taking at least " << (_slow_threshold_us / 1000) << "ms: "
+      << entries.size() << "\n";
+
+  for (std::vector<Entry>::const_iterator it = entries.begin();
+       it != entries.end();
+       ++it)
+  {
+    oss << format(*it) << "\n";
+  }
+
+  if (include_recent)
+  {
+    entries.clear();
+    _recent.read(entries);
+    oss << "# Recent requests: " << entries.size() << "\n";
+
+    for (std::vector<Entry>::const_iterator it = entries.begin();
+         it != entries.end();
+         ++it)
+    {
+      oss << format(*it) << "\n";
+    }
+  }
+
+  return oss.str();
+}
+
+bool FlightRecorder::start(const std::string& dump_dir)
+{
+  _dump_dir = dump_dir;
+  _terminated = false;
+  int rc = pthread_create(&_dump_thread, NULL, dump_thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start flight recorder dump thread (%d)", rc);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _dump_thread_running = true;
+  return true;
+}
+
+void FlightRecorder::stop()
+{
+  if (_dump_thread_running)
+  {
+    _terminated = true;
+    sem_post(&_dump_sem);
+    pthread_join(_dump_thread, NULL);
+    _dump_thread_running = false;
+  }
+}
+
+void FlightRecorder::request_dump()
+{
+  sem_post(&_dump_sem);
+}
+
+std::string FlightRecorder::dump_to_file()
+{
+  time_t now = time(NULL);
+  struct tm tm;
+  char timestamp[32];
+  localtime_r(&now, &tm);
+  strftime(timestamp, sizeof(timestamp), "%Y%m%dT%H%M%S", &tm);
+  std::string filename = _dump_dir + "/flight_recorder_" + timestamp + ".txt";
+
+  std::ofstream file(filename.c_str(), std::ios::out | std::ios::trunc);
+  file << dump(true);
+  file.close();
+
+  if (file.fail())
+  {
+    TRC_ERROR("Failed to write flight recorder dump to %s: %s",
+              filename.c_str(), strerror(errno));
+    return "";
+  }
+
+  TRC_STATUS("Wrote flight recorder dump to %s", filename.c_str());
+  return filename;
+}
+
+void* FlightRecorder::dump_thread_fn(void* recorder_ptr)
+{
+  ((FlightRecorder*)recorder_ptr)->dump_thread();
+  return NULL;
+}
+
+void FlightRecorder::dump_thread()
+{
+  while (true)
+  {
+    while ((sem_wait(&_dump_sem) != 0) && (errno == EINTR))
+    {
+    }
+
+    if (_terminated)
+    {
+      break;
+    }
+
+    dump_to_file();
+  }
+}
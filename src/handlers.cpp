@@ -12,6 +12,8 @@
 #include "handlers.hpp"
 #include "message.hpp"
 #include "log.h"
+#include "ralf_time.hpp"
+#include "utils.h"
 
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/writer.h"
@@ -27,45 +29,190 @@ void BillingTask::run()
     return;
   }
 
-  bool timer_interim = false;
-  if (_req.param(TIMER_INTERIM_PARAM) == "true")
+  uint64_t arrival_us = (_cfg->recorder != NULL) ? RalfTime::now_us() : 0;
+
+  if (_cfg->stats != NULL)
   {
-    timer_interim = true;
-    SAS::Marker cid_assoc(trail(), MARKER_ID_SIP_CALL_ID, 0);
-    cid_assoc.add_var_param(call_id());
+    _cfg->stats->incr_gauge(StageStatistics::HTTP_IN_FLIGHT);
+  }
+
+  HTTPCode rc = handle_request(_cfg,
+                               call_id(),
+                               (_req.param(TIMER_INTERIM_PARAM) == "true"),
+                               _req.get_rx_body(),
+                               arrival_us,
+                               trail());
+
+  // The HTTP reply won't be sent until afer we leave this function, so by
+  // putting this last we ensure that the load monitor will get a sensible
+  // value for the latency
+  send_http_reply(rc);
+
+  if (_cfg->stats != NULL)
+  {
+    _cfg->stats->decr_gauge(StageStatistics::HTTP_IN_FLIGHT);
+  }
+
+  delete this;
+}
+
+HTTPCode BillingTask::handle_request(const BillingHandlerConfig* cfg,
+                                     const std::string& call_id,
+                                     bool timer_interim,
+                                     const std::string& body,
+                                     uint64_t arrival_us,
+                                     SAS::TrailId trail)
+{
+  uint64_t timer_pop_start_us = 0;
+
+  if (timer_interim)
+  {
+    SAS::Marker cid_assoc(trail, MARKER_ID_SIP_CALL_ID, 0);
+    cid_assoc.add_var_param(call_id);
     SAS::report_marker(cid_assoc);
 
-    SAS::Event timer_pop(trail(), SASEvent::INTERIM_TIMER_POPPED, 0);
+    SAS::Event timer_pop(trail, SASEvent::INTERIM_TIMER_POPPED, 0);
     SAS::report_event(timer_pop);
+
+    if (cfg->stats != NULL)
+    {
+      cfg->stats->record_timer_pop();
+    }
+
+    if (cfg->timer_pop_load_monitor != NULL)
+    {
+      if (!cfg->timer_pop_load_monitor->admit_request(trail))
+      {
+        TRC_DEBUG("Rejecting timer pop for %s due to overload", call_id.c_str());
+        return HTTP_SERVER_UNAVAILABLE;
+      }
+
+      timer_pop_start_us = RalfTime::now_us();
+    }
   }
 
   Message* msg = NULL;
-  HTTPCode rc = parse_body(call_id(), timer_interim, _req.get_rx_body(), &msg, trail());
+  StageStatistics::StageTimer parse_timer(cfg->stats, StageStatistics::PARSE);
+  HTTPCode rc = parse_body(call_id, timer_interim, body, &msg, trail);
+  parse_timer.stop();
 
   if (rc != HTTP_OK)
   {
-    SAS::Event rejected(trail(), SASEvent::REQUEST_REJECTED_INVALID_JSON, 0);
+    SAS::Event rejected(trail, SASEvent::REQUEST_REJECTED_INVALID_JSON, 0);
     SAS::report_event(rejected);
-    send_http_reply(rc);
   }
-  else
+  else if ((msg != NULL) &&
+           (!timer_interim) &&
+           (cfg->duplicates != NULL) &&
+           (cfg->duplicates->check(DuplicateCache::key(msg->call_id,
+                                                       msg->role,
+                                                       msg->function,
+                                                       msg->record_type.code(),
+                                                       body))))
   {
-    if (msg != NULL)
+    // We've already handled this request (it's a retry from Sprout), so just
+    // answer it as we did before.  Timer pops all have the same body, so the
+    // session manager checks them for repeats once it knows their session's
+    // interim interval.
+    TRC_INFO("Ignoring duplicate ACR for %s", call_id.c_str());
+
+    if (cfg->stats != NULL)
     {
-      TRC_DEBUG("Handle the received message");
+      cfg->stats->incr_counter(StageStatistics::DUPLICATES_SUPPRESSED);
+    }
 
-      // The session manager takes ownership of the message object and is
-      // responsible for deleting it.
-      _sess_mgr->handle(msg);
-      msg = NULL;
+    delete msg; msg = NULL;
+  }
+  else if (msg != NULL)
+  {
+    TRC_DEBUG("Handle the received message");
+
+    if (cfg->recorder != NULL)
+    {
+      msg->timeline.start(cfg->recorder, arrival_us, call_id, trail);
+      msg->timeline.mark(FlightRecorder::PARSED);
     }
 
-    // The HTTP reply won't be sent until afer we leave this function, so by
-    // putting this last we ensure that the load monitor will get a sensible
-    // value for the latency
-    send_http_reply(rc);
+    if (cfg->acr_deadline_ms > 0)
+    {
+      msg->deadline_ms = RalfTime::now_ms() + cfg->acr_deadline_ms;
+    }
+
+    // The session manager takes ownership of the message object and is
+    // responsible for deleting it.
+    cfg->mgr->handle(msg);
+    msg = NULL;
+  }
+
+  if (timer_pop_start_us != 0)
+  {
+    cfg->timer_pop_load_monitor->request_complete(RalfTime::now_us() - timer_pop_start_us,
+                                                  trail);
+  }
+
+  return rc;
+}
+
+void LocalTimerPopHandler::on_timer_pop(const std::string& callback_uri,
+                                        const std::string& opaque_data)
+{
+  uint64_t arrival_us = (_cfg->recorder != NULL) ? RalfTime::now_us() : 0;
+
+  // The callback URI is the one we'd have given Chronos, which is
+  // /call-id/<call ID>?timer-interim=true
+  const std::string prefix = "/call-id/";
+  std::string path = callback_uri.substr(0, callback_uri.find('?'));
+
+  if (path.compare(0, prefix.size(), prefix) != 0)
+  {
+    // LCOV_EXCL_START - we only create timers with this URI
+    TRC_ERROR("Unexpected callback URI on local timer: %s", callback_uri.c_str());
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  // There's no HTTP request, so nobody is told the result.
+  BillingTask::handle_request(_cfg,
+                              Utils::url_unescape(path.substr(prefix.size())),
+                              true,
+                              opaque_data,
+                              arrival_us,
+                              SAS::new_trail(0));
+}
+
+void PeerStatisticsTask::run()
+{
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(405);
+    delete this;
+    return;
+  }
+
+  _req.add_content(_peer_stats->to_json());
+  _req.add_header("Content-Type", "application/json");
+
+  if (_req.param("reset") == "true")
+  {
+    _peer_stats->reset();
+  }
+
+  send_http_reply(HTTP_OK);
+  delete this;
+}
+
+void FlightRecorderTask::run()
+{
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(405);
+    delete this;
+    return;
   }
 
+  _req.add_content(_recorder->dump(_req.param("recent") == "true"));
+  _req.add_header("Content-Type", "text/plain");
+  send_http_reply(HTTP_OK);
   delete this;
 }
 
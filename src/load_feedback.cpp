@@ -0,0 +1,105 @@
+/**
+ * @file load_feedback.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "ralf_time.hpp"
+#include "load_feedback.hpp"
+
+LoadFeedback::LoadFeedback(LoadMonitor* load_monitor,
+                           int max_cdf_in_flight,
+                           int cdf_target_latency_us,
+                           int store_target_latency_us) :
+  _load_monitor(load_monitor),
+  _max_cdf_in_flight(max_cdf_in_flight),
+  _last_penalty_us(0),
+  _penalties(0)
+{
+  for (int ii = 0; ii < StageStatistics::NUM_STAGES; ii++)
+  {
+    _target_latency_us[ii] = 0;
+    _smoothed_latency_us[ii].store(0);
+  }
+
+  _target_latency_us[StageStatistics::CDF] = cdf_target_latency_us;
+  _target_latency_us[StageStatistics::LOCAL_STORE] = store_target_latency_us;
+  _target_latency_us[StageStatistics::REMOTE_STORE] = store_target_latency_us;
+}
+
+void LoadFeedback::record_latency(StageStatistics::Stage stage, uint64_t latency_us)
+{
+  uint64_t target_us = _target_latency_us[stage];
+
+  if (target_us == 0)
+  {
+    return;
+  }
+
+  // Move the smoothed latency part of the way towards the new value.  Lots
+  // of threads record latencies, so this needs a compare-and-swap.
+  uint64_t smoothed_us = _smoothed_latency_us[stage].load(std::memory_order_relaxed);
+  uint64_t new_smoothed_us;
+
+  do
+  {
+    new_smoothed_us = (uint64_t)((int64_t)smoothed_us +
+                                 ((int64_t)latency_us - (int64_t)smoothed_us) / SMOOTHING_DIVISOR);
+  }
+  while (!_smoothed_latency_us[stage].compare_exchange_weak(smoothed_us,
+                                                            new_smoothed_us,
+                                                            std::memory_order_relaxed));
+
+  if (new_smoothed_us > target_us)
+  {
+    TRC_DEBUG("Smoothed %s latency %lu us is above target %lu us",
+              StageStatistics::STAGE_NAMES[stage], new_smoothed_us, target_us);
+    penalize();
+  }
+}
+
+void LoadFeedback::record_cdf_in_flight(int64_t in_flight)
+{
+  if ((_max_cdf_in_flight > 0) && (in_flight > _max_cdf_in_flight))
+  {
+    TRC_DEBUG("%ld ACRs waiting for a CDF, limit is %ld",
+              in_flight, _max_cdf_in_flight);
+    penalize();
+  }
+}
+
+uint64_t LoadFeedback::smoothed_latency_us(StageStatistics::Stage stage) const
+{
+  return _smoothed_latency_us[stage].load(std::memory_order_relaxed);
+}
+
+uint64_t LoadFeedback::penalties() const
+{
+  return _penalties.load(std::memory_order_relaxed);
+}
+
+// Penalizes the load monitor, unless we have done so very recently.  This
+// stops every thread calling into the load monitor (which takes a lock) for
+// every request while a backend is struggling.
+void LoadFeedback::penalize()
+{
+  uint64_t now_us = RalfTime::now_us();
+  uint64_t last_penalty_us = _last_penalty_us.load(std::memory_order_relaxed);
+
+  if ((now_us - last_penalty_us < MIN_PENALTY_INTERVAL_US) ||
+      (!_last_penalty_us.compare_exchange_strong(last_penalty_us,
+                                                 now_us,
+                                                 std::memory_order_relaxed)))
+  {
+    return;
+  }
+
+  _penalties.fetch_add(1, std::memory_order_relaxed);
+  _load_monitor->incr_penalties();
+}
@@ -0,0 +1,809 @@
+/**
+ * @file local_timer_wheel.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "log.h"
+#include "local_timer_wheel.hpp"
+#include "ralf_time.hpp"
+
+static const std::string TIMER_ID_PREFIX = "local-";
+static const std::string CHECKPOINT_HEADER = "# ralf local timers v2";
+
+// Escapes the separators in a field of a checkpoint record, so any callback
+// URI or body can be saved.
+static std::string escape_field(const std::string& field)
+{
+  std::string escaped;
+  escaped.reserve(field.size());
+
+  for (std::string::const_iterator it = field.begin(); it != field.end(); ++it)
+  {
+    switch (*it)
+    {
+    case '\\':
+      escaped += "\\\\";
+      break;
+
+    case '\t':
+      escaped += "\\t";
+      break;
+
+    case '\n':
+      escaped += "\\n";
+      break;
+
+    default:
+      escaped += *it;
+      break;
+    }
+  }
+
+  return escaped;
+}
+
+// Reverses escape_field.  Returns false if the field isn't validly escaped.
+static bool unescape_field(const std::string& escaped, std::string& field)
+{
+  field.clear();
+  field.reserve(escaped.size());
+
+  for (size_t ii = 0; ii < escaped.size(); ii++)
+  {
+    if (escaped[ii] != '\\')
+    {
+      field += escaped[ii];
+      continue;
+    }
+
+    if (++ii == escaped.size())
+    {
+      return false;
+    }
+
+    switch (escaped[ii])
+    {
+    case '\\':
+      field += '\\';
+      break;
+
+    case 't':
+      field += '\t';
+      break;
+
+    case 'n':
+      field += '\n';
+      break;
+
+    default:
+      return false;
+    }
+  }
+
+  return true;
+}
+
+LocalTimerWheel::LocalTimerWheel(PopHandler* handler,
+                                 const std::string& checkpoint_file,
+                                 int tick_ms,
+                                 int pop_threads,
+                                 int checkpoint_interval_ms) :
+  ChronosConnection("", NULL),
+  _handler(handler),
+  _checkpoint_file(checkpoint_file),
+  _tick_ms(tick_ms),
+  _num_pop_threads(pop_threads),
+  _checkpoint_interval_ms(checkpoint_interval_ms),
+  _terminated(false),
+  _tick(RalfTime::now_ms() / tick_ms),
+  _next_id(RalfTime::wall_clock_ms() << 12),
+  _pop_count(0),
+  _journal_records(0),
+  _journal_fd(-1),
+  _tick_thread_running(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_mutex_init(&_journal_lock, NULL);
+  RalfTime::init_cond(&_tick_cond);
+  pthread_cond_init(&_pop_cond, NULL);
+}
+
+LocalTimerWheel::~LocalTimerWheel()
+{
+  stop();
+
+  for (std::map<std::string, Timer*>::iterator it = _timers.begin();
+       it != _timers.end();
+       ++it)
+  {
+    delete it->second;
+  }
+
+  _timers.clear();
+
+  flush_journal();
+
+  if (_journal_fd >= 0)
+  {
+    close(_journal_fd);
+    _journal_fd = -1;
+  }
+
+  pthread_cond_destroy(&_pop_cond);
+  pthread_cond_destroy(&_tick_cond);
+  pthread_mutex_destroy(&_journal_lock);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool LocalTimerWheel::start()
+{
+  // Start a new file from the restored timers, so that changes can be
+  // recorded in it.
+  recover();
+  checkpoint();
+
+  pthread_mutex_lock(&_lock);
+  _terminated = false;
+  pthread_mutex_unlock(&_lock);
+
+  for (int ii = 0; ii < _num_pop_threads; ii++)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, pop_thread_fn, this);
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start timer pop thread (%d)", rc);
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    _pop_threads.push_back(thread);
+  }
+
+  int rc = pthread_create(&_tick_thread, NULL, tick_thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start timer tick thread (%d)", rc);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _tick_thread_running = true;
+  return true;
+}
+
+void LocalTimerWheel::stop()
+{
+  bool running = _tick_thread_running;
+
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_signal(&_tick_cond);
+  pthread_cond_broadcast(&_pop_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (_tick_thread_running)
+  {
+    pthread_join(_tick_thread, NULL);
+    _tick_thread_running = false;
+  }
+
+  for (std::vector<pthread_t>::iterator it = _pop_threads.begin();
+       it != _pop_threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  _pop_threads.clear();
+
+  if (running)
+  {
+    checkpoint();
+  }
+}
+
+HTTPCode LocalTimerWheel::send_delete(const std::string& delete_id,
+                                      SAS::TrailId trail)
+{
+  HTTPCode rc = HTTP_NOT_FOUND;
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, Timer*>::iterator it = _timers.find(delete_id);
+
+  if (it != _timers.end())
+  {
+    remove(it->second);
+    journal("-\t" + escape_field(delete_id) + "\n");
+    rc = HTTP_OK;
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return rc;
+}
+
+HTTPCode LocalTimerWheel::send_put(std::string& put_identity,
+                                   uint32_t timer_interval,
+                                   uint32_t repeat_for,
+                                   const std::string& callback_uri,
+                                   const std::string& opaque_data,
+                                   SAS::TrailId trail,
+                                   const std::map<std::string, uint32_t>& tags)
+{
+  pthread_mutex_lock(&_lock);
+  set_timer(put_identity, timer_interval, repeat_for, callback_uri, opaque_data);
+  pthread_mutex_unlock(&_lock);
+  return HTTP_OK;
+}
+
+HTTPCode LocalTimerWheel::send_post(std::string& post_identity,
+                                    uint32_t timer_interval,
+                                    uint32_t repeat_for,
+                                    const std::string& callback_uri,
+                                    const std::string& opaque_data,
+                                    SAS::TrailId trail,
+                                    const std::map<std::string, uint32_t>& tags)
+{
+  pthread_mutex_lock(&_lock);
+  post_identity = new_timer_id();
+  set_timer(post_identity, timer_interval, repeat_for, callback_uri, opaque_data);
+  pthread_mutex_unlock(&_lock);
+  return HTTP_OK;
+}
+
+// Creates or replaces a timer.  Must be called with the lock held.
+void LocalTimerWheel::set_timer(const std::string& id,
+                                uint32_t interval,
+                                uint32_t repeat_for,
+                                const std::string& callback_uri,
+                                const std::string& opaque_data)
+{
+  std::map<std::string, Timer*>::iterator it = _timers.find(id);
+
+  if (it != _timers.end())
+  {
+    remove(it->second);
+  }
+
+  Timer* timer = new Timer();
+  timer->id = id;
+  uint64_t now_ms = RalfTime::now_ms();
+  timer->interval_ms = (uint64_t)interval * 1000;
+  timer->pop_ms = now_ms + timer->interval_ms;
+  timer->end_ms = now_ms + ((uint64_t)repeat_for * 1000);
+  timer->callback_uri = callback_uri;
+  timer->opaque_data = opaque_data;
+
+  _timers[id] = timer;
+  insert(timer);
+  journal(timer_record(timer));
+}
+
+// Puts a timer in the wheel, in the lowest level whose span reaches its
+// expiry.  Timers further away than the top level's span go in the top
+// level's furthest slot, and are placed again when that slot comes round.
+// Must be called with the lock held.
+void LocalTimerWheel::insert(Timer* timer)
+{
+  uint64_t expiry = (timer->pop_ms + _tick_ms - 1) / _tick_ms;
+
+  if (expiry <= _tick)
+  {
+    expiry = _tick + 1;
+  }
+
+  const uint64_t max_delta = (1ULL << (SLOT_BITS * LEVELS)) - 1;
+
+  if (expiry - _tick > max_delta)
+  {
+    expiry = _tick + max_delta;
+  }
+
+  uint64_t delta = expiry - _tick;
+  int level = 0;
+
+  while ((level < LEVELS - 1) &&
+         (delta >= (1ULL << (SLOT_BITS * (level + 1)))))
+  {
+    level++;
+  }
+
+  timer->level = level;
+  timer->slot = (expiry >> (SLOT_BITS * level)) & (SLOTS - 1);
+  std::list<Timer*>& slot = _wheel[level][timer->slot];
+  timer->pos = slot.insert(slot.end(), timer);
+}
+
+// Takes a timer out of the wheel and deletes it.  Must be called with the
+// lock held.
+void LocalTimerWheel::remove(Timer* timer)
+{
+  _wheel[timer->level][timer->slot].erase(timer->pos);
+  _timers.erase(timer->id);
+  delete timer;
+}
+
+// Moves on one tick.  If this is the start of a slot in a higher level, the
+// timers in it are cascaded into the levels below first.  Then the timers in
+// the current bottom level slot pop, and are put back in the wheel if they
+// repeat.  Must be called with the lock held.
+void LocalTimerWheel::run_tick(std::vector<Pop>& pops)
+{
+  _tick++;
+
+  for (int level = 1; level < LEVELS; level++)
+  {
+    if ((_tick & ((1ULL << (SLOT_BITS * level)) - 1)) != 0)
+    {
+      break;
+    }
+
+    std::list<Timer*> cascading;
+    cascading.swap(_wheel[level][(_tick >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+
+    for (std::list<Timer*>::iterator it = cascading.begin();
+         it != cascading.end();
+         ++it)
+    {
+      insert(*it);
+    }
+  }
+
+  std::list<Timer*> popping;
+  popping.swap(_wheel[0][_tick & (SLOTS - 1)]);
+  uint64_t now_ms = _tick * _tick_ms;
+
+  for (std::list<Timer*>::iterator it = popping.begin();
+       it != popping.end();
+       ++it)
+  {
+    Timer* timer = *it;
+    Pop pop = { timer->callback_uri, timer->opaque_data };
+    pops.push_back(pop);
+    _pop_count++;
+
+    // Work out when the timer next pops, skipping any pops we've missed
+    // (which only happens if the interval is shorter than a tick).
+    uint64_t next_ms = timer->pop_ms + timer->interval_ms;
+
+    while ((timer->interval_ms > 0) && (next_ms <= now_ms))
+    {
+      next_ms += timer->interval_ms;
+    }
+
+    if ((timer->interval_ms == 0) ||
+        (next_ms > timer->end_ms))
+    {
+      // That was the last pop.  The timer is no longer in any slot.
+      _timers.erase(timer->id);
+      delete timer;
+    }
+    else
+    {
+      timer->pop_ms = next_ms;
+      insert(timer);
+    }
+  }
+}
+
+void LocalTimerWheel::poll(uint64_t now_ms)
+{
+  std::vector<Pop> pops;
+  uint64_t target = now_ms / _tick_ms;
+
+  pthread_mutex_lock(&_lock);
+
+  while (_tick < target)
+  {
+    run_tick(pops);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  flush_journal();
+  dispatch(pops);
+}
+
+// Hands pops to the pop threads, or handles them here if there aren't any.
+void LocalTimerWheel::dispatch(std::vector<Pop>& pops)
+{
+  if (pops.empty())
+  {
+    return;
+  }
+
+  if (_pop_threads.empty())
+  {
+    for (std::vector<Pop>::iterator it = pops.begin(); it != pops.end(); ++it)
+    {
+      _handler->on_timer_pop(it->callback_uri, it->opaque_data);
+    }
+
+    return;
+  }
+
+  pthread_mutex_lock(&_lock);
+  _pops.insert(_pops.end(), pops.begin(), pops.end());
+  pthread_cond_broadcast(&_pop_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+// Timer IDs only need to be unique to this process, and not to clash with
+// the IDs of timers restored from a previous run.  The counter starts from
+// the time we started, so IDs from earlier runs are lower.
+std::string LocalTimerWheel::new_timer_id()
+{
+  char id[32];
+  snprintf(id, sizeof(id), "%lx", (unsigned long)_next_id++);
+  return TIMER_ID_PREFIX + id;
+}
+
+size_t LocalTimerWheel::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _timers.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+uint64_t LocalTimerWheel::pop_count()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t count = _pop_count;
+  pthread_mutex_unlock(&_lock);
+  return count;
+}
+
+// The checkpoint file is a header line followed by records, one per line,
+// with tab-separated fields.  A timer being created or updated is recorded
+// as
+//   + id interval_ms pop_ms end_ms callback_uri opaque_data
+// with times on the wall clock so they still mean something after a
+// restart, and a timer being deleted as
+//   - id
+// The timers are restored by replaying the records in order.  Timers that
+// pop aren't recorded, so after a crash a timer that had popped since it
+// was last recorded pops again straight away.  Must be called with the lock
+// held.
+std::string LocalTimerWheel::timer_record(Timer* timer)
+{
+  int64_t offset_ms = (int64_t)RalfTime::wall_clock_ms() - (int64_t)RalfTime::now_ms();
+  std::ostringstream oss;
+  oss << "+\t" << escape_field(timer->id) << "\t"
+      << timer->interval_ms << "\t"
+      << (int64_t)timer->pop_ms + offset_ms << "\t"
+      << (int64_t)timer->end_ms + offset_ms << "\t"
+      << escape_field(timer->callback_uri) << "\t"
+      << escape_field(timer->opaque_data) << "\n";
+  return oss.str();
+}
+
+// Records a change, to be appended to the checkpoint file on the next tick.
+// Must be called with the lock held.
+void LocalTimerWheel::journal(const std::string& record)
+{
+  if (_checkpoint_file.empty())
+  {
+    return;
+  }
+
+  _journal_buffer += record;
+  _journal_records++;
+}
+
+// Appends the changes recorded since the last flush to the checkpoint file,
+// if it's open.  They are written in one go, so if we crash part way through
+// only the last record can be incomplete, and it is skipped on recovery.
+void LocalTimerWheel::flush_journal()
+{
+  pthread_mutex_lock(&_journal_lock);
+
+  std::string records;
+  pthread_mutex_lock(&_lock);
+  records.swap(_journal_buffer);
+  pthread_mutex_unlock(&_lock);
+
+  if ((!records.empty()) && (_journal_fd >= 0))
+  {
+    ssize_t written = write(_journal_fd, records.data(), records.size());
+
+    if (written != (ssize_t)records.size())
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to write timer records to %s: %s",
+                _checkpoint_file.c_str(), strerror(errno));
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  pthread_mutex_unlock(&_journal_lock);
+}
+
+// Writes a snapshot of every timer to a new file, which then replaces the
+// checkpoint file, so a crash part way through leaves the previous one in
+// place.  Changes made since the snapshot are appended to the new file.  The
+// journal lock is held throughout so that no change is written to the file
+// being replaced, but the timers are only locked while the snapshot is
+// taken.
+bool LocalTimerWheel::checkpoint()
+{
+  if (_checkpoint_file.empty())
+  {
+    return true;
+  }
+
+  std::string snapshot = CHECKPOINT_HEADER + "\n";
+  std::string tmp_file = _checkpoint_file + ".tmp";
+
+  pthread_mutex_lock(&_journal_lock);
+  pthread_mutex_lock(&_lock);
+
+  for (std::map<std::string, Timer*>::iterator it = _timers.begin();
+       it != _timers.end();
+       ++it)
+  {
+    snapshot += timer_record(it->second);
+  }
+
+  // The snapshot includes the changes waiting to be written so far.
+  size_t covered_bytes = _journal_buffer.size();
+  uint64_t covered_records = _journal_records;
+  int num_timers = _timers.size();
+  pthread_mutex_unlock(&_lock);
+
+  int fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+  if ((fd < 0) ||
+      (write(fd, snapshot.data(), snapshot.size()) != (ssize_t)snapshot.size()) ||
+      (rename(tmp_file.c_str(), _checkpoint_file.c_str()) != 0))
+  {
+    TRC_ERROR("Failed to write timer checkpoint to %s: %s",
+              _checkpoint_file.c_str(), strerror(errno));
+
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+
+    // The waiting changes still go in the old file.
+    pthread_mutex_unlock(&_journal_lock);
+    return false;
+  }
+
+  if (_journal_fd >= 0)
+  {
+    close(_journal_fd);
+  }
+
+  _journal_fd = fd;
+
+  pthread_mutex_lock(&_lock);
+  _journal_buffer.erase(0, covered_bytes);
+  _journal_records -= covered_records;
+  pthread_mutex_unlock(&_lock);
+
+  pthread_mutex_unlock(&_journal_lock);
+
+  TRC_DEBUG("Checkpointed %d timers to %s", num_timers, _checkpoint_file.c_str());
+  return true;
+}
+
+// Restores the timers by replaying the records in the checkpoint file.
+// Timers that finished while we were down are dropped, and pops that were
+// missed happen on the next tick.  Records that can't be parsed, including
+// a last record cut short by a crash, are skipped.
+bool LocalTimerWheel::recover()
+{
+  if (_checkpoint_file.empty())
+  {
+    return true;
+  }
+
+  std::ifstream file(_checkpoint_file.c_str());
+
+  if (!file.is_open())
+  {
+    TRC_STATUS("No timer checkpoint at %s", _checkpoint_file.c_str());
+    return false;
+  }
+
+  std::string line;
+  std::getline(file, line);
+
+  if (line != CHECKPOINT_HEADER)
+  {
+    TRC_ERROR("Ignoring timer checkpoint %s with unknown format",
+              _checkpoint_file.c_str());
+    return false;
+  }
+
+  // The latest record of each timer.
+  std::map<std::string, std::vector<std::string>> records;
+
+  while (std::getline(file, line))
+  {
+    std::vector<std::string> fields;
+    size_t pos = 0;
+
+    while (pos != std::string::npos)
+    {
+      size_t sep = line.find('\t', pos);
+      std::string field;
+
+      if (!unescape_field(line.substr(pos, sep - pos), field))
+      {
+        break;
+      }
+
+      fields.push_back(field);
+      pos = (sep == std::string::npos) ? sep : sep + 1;
+    }
+
+    if ((file.eof()) ||
+        (fields.size() < 2) ||
+        (fields[1].empty()) ||
+        !(((fields[0] == "+") && (fields.size() == 7)) ||
+          ((fields[0] == "-") && (fields.size() == 2))))
+    {
+      TRC_WARNING("Skipping invalid timer checkpoint line: %s", line.c_str());
+      continue;
+    }
+
+    if (fields[0] == "+")
+    {
+      records[fields[1]] = fields;
+    }
+    else
+    {
+      records.erase(fields[1]);
+    }
+  }
+
+  int restored = 0;
+  int expired = 0;
+
+  pthread_mutex_lock(&_lock);
+  int64_t now_ms = RalfTime::now_ms();
+  int64_t offset_ms = (int64_t)RalfTime::wall_clock_ms() - now_ms;
+
+  for (std::map<std::string, std::vector<std::string>>::iterator it = records.begin();
+       it != records.end();
+       ++it)
+  {
+    std::vector<std::string>& fields = it->second;
+
+    if (_timers.find(fields[1]) != _timers.end())
+    {
+      continue;
+    }
+
+    // The monotonic clock may have restarted since the checkpoint, so the
+    // times are converted without letting them go below now.
+    int64_t pop_ms = strtoll(fields[3].c_str(), NULL, 10) - offset_ms;
+    int64_t end_ms = strtoll(fields[4].c_str(), NULL, 10) - offset_ms;
+
+    if ((pop_ms < now_ms) && (end_ms < now_ms))
+    {
+      // The timer would have finished by now.
+      expired++;
+      continue;
+    }
+
+    Timer* timer = new Timer();
+    timer->id = fields[1];
+    timer->interval_ms = strtoull(fields[2].c_str(), NULL, 10);
+    timer->pop_ms = std::max(pop_ms, now_ms);
+    timer->end_ms = std::max(end_ms, now_ms);
+    timer->callback_uri = fields[5];
+    timer->opaque_data = fields[6];
+
+    _timers[timer->id] = timer;
+    insert(timer);
+    restored++;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  TRC_STATUS("Restored %d timers from %s (%d had expired)",
+             restored, _checkpoint_file.c_str(), expired);
+  return true;
+}
+
+void* LocalTimerWheel::tick_thread_fn(void* wheel_ptr)
+{
+  ((LocalTimerWheel*)wheel_ptr)->tick_thread();
+  return NULL;
+}
+
+void LocalTimerWheel::tick_thread()
+{
+  uint64_t last_checkpoint_ms = RalfTime::now_ms();
+
+  while (true)
+  {
+    pthread_mutex_lock(&_lock);
+
+    if (!_terminated)
+    {
+      RalfTime::timed_wait(&_tick_cond, &_lock, _tick_ms);
+    }
+
+    bool terminated = _terminated;
+    pthread_mutex_unlock(&_lock);
+
+    if (terminated)
+    {
+      break;
+    }
+
+    uint64_t now_ms = RalfTime::now_ms();
+    poll(now_ms);
+
+    if (now_ms - last_checkpoint_ms >= (uint64_t)_checkpoint_interval_ms)
+    {
+      pthread_mutex_lock(&_lock);
+      bool changed = (_journal_records > 0);
+      pthread_mutex_unlock(&_lock);
+
+      if (changed)
+      {
+        checkpoint();
+      }
+
+      last_checkpoint_ms = now_ms;
+    }
+  }
+}
+
+void* LocalTimerWheel::pop_thread_fn(void* wheel_ptr)
+{
+  ((LocalTimerWheel*)wheel_ptr)->pop_thread();
+  return NULL;
+}
+
+void LocalTimerWheel::pop_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    if (!_pops.empty())
+    {
+      Pop pop = _pops.front();
+      _pops.pop_front();
+      pthread_mutex_unlock(&_lock);
+
+      _handler->on_timer_pop(pop.callback_uri, pop.opaque_data);
+
+      pthread_mutex_lock(&_lock);
+    }
+    else if (_terminated)
+    {
+      break;
+    }
+    else
+    {
+      pthread_cond_wait(&_pop_cond, &_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
@@ -28,6 +28,20 @@
 #include "logger.h"
 #include "rf.h"
 #include "peer_message_sender_factory.hpp"
+#include "peer_state_cache.hpp"
+#include "peer_health_scorer.hpp"
+#include "peer_concurrency_limiter.hpp"
+#include "ccf_stripes.hpp"
+#include "peer_timeout_estimator.hpp"
+#include "acr_spool.hpp"
+#include "acr_forwarder.hpp"
+#include "stage_statistics.hpp"
+#include "peer_statistics.hpp"
+#include "flight_recorder.hpp"
+#include "load_feedback.hpp"
+#include "chronos_queue.hpp"
+#include "local_timer_wheel.hpp"
+#include "duplicate_cache.hpp"
 #include "load_monitor.h"
 #include "diameterresolver.h"
 #include "realmmanager.h"
@@ -63,6 +77,31 @@ enum OptionTypes
   RALF_HOSTNAME,
   HTTP_ACR_LOGGING,
   RAM_RECORD_EVERYTHING,
+  CCF_LATENCY_SLO_MS,
+  CCF_MAX_TIMEOUT_RATE,
+  CCF_MAX_ERROR_RATE,
+  CCF_MAX_OUTSTANDING,
+  CCF_MAX_QUEUE,
+  CCF_OVERLOAD_POLICY,
+  CCF_STRIPES,
+  CCF_TIMEOUT_FLOOR_MS,
+  CCF_TIMEOUT_CEILING_MS,
+  CCF_TIMEOUT_MARGIN_MS,
+  ACR_DEADLINE_MS,
+  ACR_SPOOL_FILE,
+  ACR_SPOOL_SIZE_MB,
+  ACR_REPLAY_RATE,
+  SLOW_REQUEST_THRESHOLD_MS,
+  CDF_TARGET_LATENCY_US,
+  STORE_TARGET_LATENCY_US,
+  MAX_CDF_IN_FLIGHT,
+  CHRONOS_THREADS,
+  CHRONOS_COALESCE_MS,
+  LOCAL_TIMERS_FILE,
+  INTERIM_TIMER_JITTER,
+  TIMER_POP_TARGET_LATENCY_US,
+  DUPLICATE_WINDOW_MS,
+  REMOTE_STORE_BREAKER_THRESHOLD,
 };
 
 struct options
@@ -103,6 +142,31 @@ struct options
   std::string ralf_hostname;
   bool http_acr_logging;
   bool ram_record_everything;
+  int ccf_latency_slo_ms;
+  float ccf_max_timeout_rate;
+  float ccf_max_error_rate;
+  int ccf_max_outstanding;
+  int ccf_max_queue;
+  PeerConcurrencyLimiter::Policy ccf_overload_policy;
+  std::vector<std::string> ccf_stripes;
+  int ccf_timeout_floor_ms;
+  int ccf_timeout_ceiling_ms;
+  int ccf_timeout_margin_ms;
+  int acr_deadline_ms;
+  std::string acr_spool_file;
+  int acr_spool_size_mb;
+  int acr_replay_rate;
+  int slow_request_threshold_ms;
+  int cdf_target_latency_us;
+  int store_target_latency_us;
+  int max_cdf_in_flight;
+  int chronos_threads;
+  int chronos_coalesce_ms;
+  std::string local_timers_file;
+  int interim_timer_jitter;
+  int timer_pop_target_latency_us;
+  int duplicate_window_ms;
+  int remote_store_breaker_threshold;
 };
 
 const static struct option long_opt[] =
@@ -123,7 +187,16 @@ const static struct option long_opt[] =
   {"sas",                         required_argument, NULL, 's'},
   {"help",                        no_argument,       NULL, 'h'},
   {"target-latency-us",           required_argument, NULL, TARGET_LATENCY_US},
+  {"cdf-target-latency-us",       required_argument, NULL, CDF_TARGET_LATENCY_US},
+  {"store-target-latency-us",     required_argument, NULL, STORE_TARGET_LATENCY_US},
+  {"timer-pop-target-latency-us", required_argument, NULL, TIMER_POP_TARGET_LATENCY_US},
+  {"max-cdf-in-flight",           required_argument, NULL, MAX_CDF_IN_FLIGHT},
   {"diameter-timeout-ms",         required_argument, NULL, DIAMETER_TIMEOUT_MS},
+  {"acr-deadline-ms",             required_argument, NULL, ACR_DEADLINE_MS},
+  {"acr-spool-file",              required_argument, NULL, ACR_SPOOL_FILE},
+  {"acr-spool-size-mb",           required_argument, NULL, ACR_SPOOL_SIZE_MB},
+  {"acr-replay-rate",             required_argument, NULL, ACR_REPLAY_RATE},
+  {"slow-request-threshold-ms",   required_argument, NULL, SLOW_REQUEST_THRESHOLD_MS},
   {"max-tokens",                  required_argument, NULL, MAX_TOKENS},
   {"init-token-rate",             required_argument, NULL, INIT_TOKEN_RATE},
   {"min-token-rate",              required_argument, NULL, MIN_TOKEN_RATE},
@@ -138,9 +211,25 @@ const static struct option long_opt[] =
   {"sas-use-signaling-interface", no_argument,       NULL, SAS_USE_SIGNALING_IF},
   {"chronos-hostname",            required_argument, NULL, CHRONOS_HOSTNAME},
   {"ralf-chronos-callback-uri",   required_argument, NULL, RALF_CHRONOS_CALLBACK_URI},
+  {"chronos-threads",             required_argument, NULL, CHRONOS_THREADS},
+  {"chronos-coalesce-ms",         required_argument, NULL, CHRONOS_COALESCE_MS},
+  {"local-timers-file",           required_argument, NULL, LOCAL_TIMERS_FILE},
+  {"interim-timer-jitter",        required_argument, NULL, INTERIM_TIMER_JITTER},
+  {"duplicate-window-ms",         required_argument, NULL, DUPLICATE_WINDOW_MS},
+  {"remote-store-breaker-threshold", required_argument, NULL, REMOTE_STORE_BREAKER_THRESHOLD},
   {"ralf-hostname",               required_argument, NULL, RALF_HOSTNAME},
   {"http-acr-logging",            required_argument, NULL, HTTP_ACR_LOGGING},
   { "ram-record-everything",      no_argument,       NULL, RAM_RECORD_EVERYTHING},
+  {"ccf-latency-slo-ms",          required_argument, NULL, CCF_LATENCY_SLO_MS},
+  {"ccf-max-timeout-rate",        required_argument, NULL, CCF_MAX_TIMEOUT_RATE},
+  {"ccf-max-error-rate",          required_argument, NULL, CCF_MAX_ERROR_RATE},
+  {"ccf-max-outstanding",         required_argument, NULL, CCF_MAX_OUTSTANDING},
+  {"ccf-max-queue",               required_argument, NULL, CCF_MAX_QUEUE},
+  {"ccf-overload-policy",         required_argument, NULL, CCF_OVERLOAD_POLICY},
+  {"ccf-stripes",                 required_argument, NULL, CCF_STRIPES},
+  {"ccf-timeout-floor-ms",        required_argument, NULL, CCF_TIMEOUT_FLOOR_MS},
+  {"ccf-timeout-ceiling-ms",      required_argument, NULL, CCF_TIMEOUT_CEILING_MS},
+  {"ccf-timeout-margin-ms",       required_argument, NULL, CCF_TIMEOUT_MARGIN_MS},
   {NULL,                          0,                 NULL, 0},
 };
 
@@ -176,8 +265,37 @@ void usage(void)
        "                            Use specified system name to identify this system to SAS.\n"
        "     --target-latency-us <usecs>\n"
        "                            Target latency above which throttling applies (default: 100000)\n"
+       "     --cdf-target-latency-us <usecs>\n"
+       "                            Smoothed CDF round trip time above which throttling applies, as\n"
+       "                            well as throttling on HTTP latency.  If not set, CDF latency is\n"
+       "                            ignored.  For example, 100000\n"
+       "     --store-target-latency-us <usecs>\n"
+       "                            Smoothed session store latency above which throttling applies.\n"
+       "                            If not set, store latency is ignored.  For example, 20000\n"
+       "     --timer-pop-target-latency-us <usecs>\n"
+       "                            Target latency above which INTERIM timer pops are throttled, separately\n"
+       "                            from (and as well as) other requests.  A throttled timer pop is answered\n"
+       "                            with a 503 and its INTERIM isn't sent.  0 means timer pops are only\n"
+       "                            throttled with other requests (default: 0)\n"
+       "     --max-cdf-in-flight N  Number of ACRs waiting for a CDF above which throttling applies.\n"
+       "                            If not set, there is no limit.  For example, 5000\n"
        "     --diameter-timeout <milliseconds>\n"
        "                            Length of time (in ms) before timing out a Diameter request to the CDF\n"
+       "     --acr-deadline-ms <milliseconds>\n"
+       "                            Length of time (in ms) Ralf spends trying to deliver each ACR, across\n"
+       "                            all the CDFs it tries.  If not set, each CDF gets the full Diameter\n"
+       "                            timeout\n"
+       "     --acr-spool-file <filename>\n"
+       "                            If set, ACRs that can't be delivered to any CDF are stored in this file\n"
+       "                            and sent again once a CDF is available\n"
+       "     --acr-spool-size-mb N  Size of the ACR spool file in MB (default: 256)\n"
+       "     --acr-replay-rate N    Maximum number of spooled ACRs to send per second.  Spooled ACRs\n"
+       "                            are sent one at a time, so the CDF's response time may hold the\n"
+       "                            rate below this (default: 100)\n"
+       "     --slow-request-threshold-ms <milliseconds>\n"
+       "                            ACRs that take at least this long are kept by the flight recorder,\n"
+       "                            which can be dumped from /flight-recorder or by sending SIGUSR2.\n"
+       "                            0 disables the flight recorder (default: 500)\n"
        "     --max-tokens N         Maximum number of tokens allowed in the token bucket (used by\n"
        "                            the throttling code (default: 1000))\n"
        "     --dns-timeout <milliseconds>\n"
@@ -205,6 +323,35 @@ void usage(void)
        "                            The ralf hostname used for Chronos callbacks. If unset the default \n"
        "                            is to use the ralf-hostname.\n"
        "                            Ignored if chronos-hostname is not set.\n"
+       "     --chronos-threads N    Number of threads (and connections) used to send timer requests to\n"
+       "                            Chronos.  0 means timer requests are sent by the thread handling the\n"
+       "                            ACR (default: 4)\n"
+       "     --chronos-coalesce-ms <milliseconds>\n"
+       "                            How long updates of Chronos timers are held so that later updates\n"
+       "                            of the same timer can replace them.  Deletions are never held.  0\n"
+       "                            means updates are sent straight away.  Ignored if chronos-threads\n"
+       "                            is 0 (default: 0)\n"
+       "     --local-timers-file <filename>\n"
+       "                            If set, INTERIM timers are run within Ralf, rather than in Chronos,\n"
+       "                            and saved to this file so they survive a restart.  Only suitable for\n"
+       "                            single-site deployments.  The Chronos options are then ignored\n"
+       "     --interim-timer-jitter <seconds>\n"
+       "                            The most by which each session's INTERIM timer is shortened, so that\n"
+       "                            sessions that start together don't send their INTERIMs together.  The\n"
+       "                            amount is fixed for each session, and never more than a quarter of the\n"
+       "                            interim interval.  0 means timers use the CDF's interim interval\n"
+       "                            (default: 0)\n"
+       "     --duplicate-window-ms <milliseconds>\n"
+       "                            How long each ACR is remembered, so that a repeat of it (a retry from\n"
+       "                            Sprout, or a timer that Chronos pops twice) is answered without being\n"
+       "                            sent to the CDF again.  Timer pops are remembered for no more than\n"
+       "                            half the session's interim interval.  0 means repeats are not\n"
+       "                            detected (default: 0)\n"
+       "     --remote-store-breaker-threshold <errors>\n"
+       "                            The number of errors in a row after which a remote site's session store\n"
+       "                            is skipped, rather than waited for, until a background probe finds it\n"
+       "                            has come back.  Writes skipped in the meantime are replayed then.  0\n"
+       "                            means remote stores are never skipped (default: 0)\n"
        "     --ralf-hostname <hostname:port>\n"
        "                            The hostname and port of the cluster of Ralf nodes to which this Ralf is\n"
        "                            a member. The port should be the HTTP port the nodes are listening on.\n"
@@ -213,6 +360,40 @@ void usage(void)
        "                            to SAS\n"
        "     --ram-record-everything\n"
        "                            Write all logs to RAM and dump them to file on abnormal termination\n"
+       "     --ccf-latency-slo-ms <milliseconds>\n"
+       "                            Average CCF response time above which Ralf prefers the next CCF in the\n"
+       "                            list.  If not set, Ralf always tries the CCFs in the order it was\n"
+       "                            given them, and --ccf-max-timeout-rate and --ccf-max-error-rate are\n"
+       "                            ignored.  For example, 100\n"
+       "     --ccf-max-timeout-rate <proportion>\n"
+       "                            Proportion of timed out requests above which Ralf prefers the next CCF\n"
+       "                            in the list, if --ccf-latency-slo-ms is set (default: 0.2)\n"
+       "     --ccf-max-error-rate <proportion>\n"
+       "                            Proportion of Diameter protocol errors above which Ralf prefers the\n"
+       "                            next CCF in the list, if --ccf-latency-slo-ms is set (default: 0.5)\n"
+       "     --ccf-max-outstanding <n>\n"
+       "                            Maximum number of ACRs outstanding to each CCF.  The limit adapts\n"
+       "                            downwards when the CCF is slow or busy.  0 means no limit\n"
+       "                            (default: 0)\n"
+       "     --ccf-max-queue <n>    Maximum number of ACRs queued for each CCF when it is at its limit\n"
+       "                            (default: 1000)\n"
+       "     --ccf-overload-policy <queue|shed>\n"
+       "                            Whether ACRs for a CCF that is at its limit are queued, or sent to\n"
+       "                            the next CCF in the list (default: queue)\n"
+       "     --ccf-stripes <ccf>=<identity>;<identity>[,<ccf>=<identity>;<identity>,...]\n"
+       "                            Diameter identities to spread each CCF's ACRs across, so that they\n"
+       "                            use several connections.  Each identity must be configured as a peer\n"
+       "                            in the Diameter configuration.  All the ACRs for a session are sent\n"
+       "                            to the same identity\n"
+       "     --ccf-timeout-floor-ms <milliseconds>\n"
+       "                            If set, the Diameter timeout for each CCF adapts to the 99th\n"
+       "                            percentile of its recent response times (plus a margin), but is never\n"
+       "                            less than this\n"
+       "     --ccf-timeout-ceiling-ms <milliseconds>\n"
+       "                            The longest adaptive Diameter timeout (default: the Diameter timeout)\n"
+       "     --ccf-timeout-margin-ms <milliseconds>\n"
+       "                            Added to the response time percentile to give the adaptive Diameter\n"
+       "                            timeout (default: 20)\n"
        "     --pidfile=<filename>   Write pidfile\n"
        "     --daemon               Run as a daemon\n"
        " -h, --help                 Show this help screen\n"
@@ -361,12 +542,137 @@ int init_options(int argc, char**argv, struct options& options)
       }
       break;
 
+    case CDF_TARGET_LATENCY_US:
+      options.cdf_target_latency_us = atoi(optarg);
+      if (options.cdf_target_latency_us < 0)
+      {
+        TRC_ERROR("Invalid --cdf-target-latency-us option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case STORE_TARGET_LATENCY_US:
+      options.store_target_latency_us = atoi(optarg);
+      if (options.store_target_latency_us < 0)
+      {
+        TRC_ERROR("Invalid --store-target-latency-us option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case TIMER_POP_TARGET_LATENCY_US:
+      options.timer_pop_target_latency_us = atoi(optarg);
+      if (options.timer_pop_target_latency_us < 0)
+      {
+        TRC_ERROR("Invalid --timer-pop-target-latency-us option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case MAX_CDF_IN_FLIGHT:
+      options.max_cdf_in_flight = atoi(optarg);
+      if (options.max_cdf_in_flight < 0)
+      {
+        TRC_ERROR("Invalid --max-cdf-in-flight option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case CHRONOS_THREADS:
+      options.chronos_threads = atoi(optarg);
+      if (options.chronos_threads < 0)
+      {
+        TRC_ERROR("Invalid --chronos-threads option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case CHRONOS_COALESCE_MS:
+      options.chronos_coalesce_ms = atoi(optarg);
+      if (options.chronos_coalesce_ms < 0)
+      {
+        TRC_ERROR("Invalid --chronos-coalesce-ms option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case LOCAL_TIMERS_FILE:
+      options.local_timers_file = std::string(optarg);
+      break;
+
+    case DUPLICATE_WINDOW_MS:
+      options.duplicate_window_ms = atoi(optarg);
+      if (options.duplicate_window_ms < 0)
+      {
+        TRC_ERROR("Invalid --duplicate-window-ms option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case REMOTE_STORE_BREAKER_THRESHOLD:
+      options.remote_store_breaker_threshold = atoi(optarg);
+      if (options.remote_store_breaker_threshold < 0)
+      {
+        TRC_ERROR("Invalid --remote-store-breaker-threshold option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case INTERIM_TIMER_JITTER:
+      options.interim_timer_jitter = atoi(optarg);
+      if (options.interim_timer_jitter < 0)
+      {
+        TRC_ERROR("Invalid --interim-timer-jitter option %s", optarg);
+        return -1;
+      }
+      break;
+
     case DIAMETER_TIMEOUT_MS:
       TRC_INFO("Diameter timeout: %s", optarg);
       diameter_timeout_set = true;
       options.diameter_timeout_ms = atoi(optarg);
       break;
 
+    case ACR_DEADLINE_MS:
+      options.acr_deadline_ms = atoi(optarg);
+      if (options.acr_deadline_ms <= 0)
+      {
+        TRC_ERROR("Invalid --acr-deadline-ms option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case ACR_SPOOL_FILE:
+      options.acr_spool_file = std::string(optarg);
+      break;
+
+    case ACR_SPOOL_SIZE_MB:
+      options.acr_spool_size_mb = atoi(optarg);
+      if (options.acr_spool_size_mb <= 0)
+      {
+        TRC_ERROR("Invalid --acr-spool-size-mb option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case ACR_REPLAY_RATE:
+      options.acr_replay_rate = atoi(optarg);
+      if (options.acr_replay_rate <= 0)
+      {
+        TRC_ERROR("Invalid --acr-replay-rate option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case SLOW_REQUEST_THRESHOLD_MS:
+      options.slow_request_threshold_ms = atoi(optarg);
+      if (options.slow_request_threshold_ms < 0)
+      {
+        TRC_ERROR("Invalid --slow-request-threshold-ms option %s", optarg);
+        return -1;
+      }
+      break;
+
     case MAX_TOKENS:
       options.max_tokens = atoi(optarg);
       if (options.max_tokens <= 0)
@@ -456,6 +762,107 @@ int init_options(int argc, char**argv, struct options& options)
       options.http_acr_logging = true;
       break;
 
+    case CCF_LATENCY_SLO_MS:
+      options.ccf_latency_slo_ms = atoi(optarg);
+      if (options.ccf_latency_slo_ms <= 0)
+      {
+        TRC_ERROR("Invalid --ccf-latency-slo-ms option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case CCF_MAX_TIMEOUT_RATE:
+      options.ccf_max_timeout_rate = atof(optarg);
+      if ((options.ccf_max_timeout_rate < 0) || (options.ccf_max_timeout_rate > 1))
+      {
+        TRC_ERROR("Invalid --ccf-max-timeout-rate option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case CCF_MAX_ERROR_RATE:
+      options.ccf_max_error_rate = atof(optarg);
+      if ((options.ccf_max_error_rate < 0) || (options.ccf_max_error_rate > 1))
+      {
+        TRC_ERROR("Invalid --ccf-max-error-rate option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case CCF_MAX_OUTSTANDING:
+      options.ccf_max_outstanding = atoi(optarg);
+      if (options.ccf_max_outstanding < 0)
+      {
+        TRC_ERROR("Invalid --ccf-max-outstanding option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case CCF_MAX_QUEUE:
+      options.ccf_max_queue = atoi(optarg);
+      if (options.ccf_max_queue < 0)
+      {
+        TRC_ERROR("Invalid --ccf-max-queue option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case CCF_OVERLOAD_POLICY:
+      if (std::string(optarg) == "queue")
+      {
+        options.ccf_overload_policy = PeerConcurrencyLimiter::QUEUE;
+      }
+      else if (std::string(optarg) == "shed")
+      {
+        options.ccf_overload_policy = PeerConcurrencyLimiter::SHED;
+      }
+      else
+      {
+        TRC_ERROR("Invalid --ccf-overload-policy option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case CCF_STRIPES:
+      {
+        // This option has the format
+        // <ccf>=<identity>;<identity>,[<ccf>=<identity>;<identity>,...].
+        // Split it into a vector of <ccf>=<identity>;<identity> strings here -
+        // CcfStripes parses the rest.
+        std::string stripes_arg = std::string(optarg);
+        boost::split(options.ccf_stripes,
+                     stripes_arg,
+                     boost::is_any_of(","));
+      }
+      break;
+
+    case CCF_TIMEOUT_FLOOR_MS:
+      options.ccf_timeout_floor_ms = atoi(optarg);
+      if (options.ccf_timeout_floor_ms <= 0)
+      {
+        TRC_ERROR("Invalid --ccf-timeout-floor-ms option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case CCF_TIMEOUT_CEILING_MS:
+      options.ccf_timeout_ceiling_ms = atoi(optarg);
+      if (options.ccf_timeout_ceiling_ms <= 0)
+      {
+        TRC_ERROR("Invalid --ccf-timeout-ceiling-ms option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case CCF_TIMEOUT_MARGIN_MS:
+      options.ccf_timeout_margin_ms = atoi(optarg);
+      if (options.ccf_timeout_margin_ms < 0)
+      {
+        TRC_ERROR("Invalid --ccf-timeout-margin-ms option %s", optarg);
+        return -1;
+      }
+      break;
+
     default:
       CL_RALF_INVALID_OPTION_C.log();
       TRC_ERROR("Unknown option: %d.  Run with --help for options.", opt);
@@ -469,11 +876,24 @@ int init_options(int argc, char**argv, struct options& options)
                                       options.diameter_timeout_ms);
   }
 
+  if (options.ccf_timeout_ceiling_ms == 0)
+  {
+    options.ccf_timeout_ceiling_ms = options.diameter_timeout_ms;
+  }
+
+  if (options.ccf_timeout_floor_ms > options.ccf_timeout_ceiling_ms)
+  {
+    TRC_ERROR("--ccf-timeout-floor-ms (%d) must not be greater than the ceiling (%d)",
+              options.ccf_timeout_floor_ms, options.ccf_timeout_ceiling_ms);
+    return -1;
+  }
+
   return 0;
 }
 
 static sem_t term_sem;
 ExceptionHandler* exception_handler;
+static FlightRecorder* flight_recorder = NULL;
 
 // Signal handler that triggers homestead termination.
 void terminate_handler(int sig)
@@ -481,6 +901,15 @@ void terminate_handler(int sig)
   sem_post(&term_sem);
 }
 
+// Signal handler that asks the flight recorder to write a dump.
+void flight_recorder_dump_handler(int sig)
+{
+  if (flight_recorder != NULL)
+  {
+    flight_recorder->request_dump();
+  }
+}
+
 // Signal handler that simply dumps the stack and then crashes out.
 void signal_handler(int sig)
 {
@@ -521,6 +950,7 @@ int main(int argc, char**argv)
 
   sem_init(&term_sem, 0, 0);
   signal(SIGTERM, terminate_handler);
+  signal(SIGUSR2, flight_recorder_dump_handler);
 
   struct options options;
   options.local_host = "127.0.0.1";
@@ -537,6 +967,16 @@ int main(int argc, char**argv)
   options.log_level = 0;
   options.sas_system_name = "";
   options.target_latency_us = 100000;
+  options.cdf_target_latency_us = 0;
+  options.store_target_latency_us = 0;
+  options.max_cdf_in_flight = 0;
+  options.chronos_threads = ChronosQueue::DEFAULT_THREADS;
+  options.chronos_coalesce_ms = 0;
+  options.local_timers_file = "";
+  options.interim_timer_jitter = 0;
+  options.timer_pop_target_latency_us = 0;
+  options.duplicate_window_ms = 0;
+  options.remote_store_breaker_threshold = 0;
   options.diameter_timeout_ms = 200;
   options.max_tokens = 1000;
   options.init_token_rate = 100.0;
@@ -552,6 +992,20 @@ int main(int argc, char**argv)
   options.daemon = false;
   options.sas_signaling_if = false;
   options.ram_record_everything = false;
+  options.ccf_latency_slo_ms = 0;
+  options.ccf_max_timeout_rate = 0.2;
+  options.ccf_max_error_rate = 0.5;
+  options.ccf_max_outstanding = 0;
+  options.ccf_max_queue = 1000;
+  options.ccf_overload_policy = PeerConcurrencyLimiter::QUEUE;
+  options.ccf_timeout_floor_ms = 0;
+  options.ccf_timeout_ceiling_ms = 0;
+  options.ccf_timeout_margin_ms = 20;
+  options.acr_deadline_ms = 0;
+  options.acr_spool_file = "";
+  options.acr_spool_size_mb = 256;
+  options.acr_replay_rate = 100;
+  options.slow_request_threshold_ms = 500;
 
   if (init_logging_options(argc, argv, options) != 0)
   {
@@ -621,6 +1075,14 @@ int main(int argc, char**argv)
     return 1;
   }
 
+  CcfStripes* ccf_stripes = new CcfStripes();
+
+  if (!ccf_stripes->configure(options.ccf_stripes))
+  {
+    delete ccf_stripes; ccf_stripes = NULL;
+    return 1;
+  }
+
   start_signal_handlers();
 
   // Create Ralf's alarm objects. Note that the alarm identifier strings must match those
@@ -681,6 +1143,7 @@ int main(int argc, char**argv)
 
   Diameter::Stack* diameter_stack = Diameter::Stack::get_instance();
   Rf::Dictionary* dict = NULL;
+  PeerStateCache* peer_state_cache = new PeerStateCache();
 
   try
   {
@@ -692,6 +1155,7 @@ int main(int argc, char**argv)
     diameter_stack->advertize_application(Diameter::Dictionary::Application::ACCT,
                                           dict->RF);
     diameter_stack->start();
+    peer_state_cache->start();
   }
   catch (Diameter::Stack::Exception& e)
   {
@@ -723,7 +1187,33 @@ int main(int argc, char**argv)
                                                         false,
                                                         astaire_comm_monitor);
 
-  SessionStore* local_session_store = new SessionStore(local_memstore);
+  // Publish per-stage latencies, in-flight requests and CDF result codes
+  // through the last value cache.
+  LastValueCache* lvc = new LastValueCache(StageStatistics::NUM_STATS,
+                                           StageStatistics::STAT_NAMES,
+                                           "ralf");
+  // If asked to, throttle on the state of the CDFs and session stores, as
+  // well as on HTTP latency.
+  LoadFeedback* load_feedback = NULL;
+
+  if ((options.max_cdf_in_flight > 0) ||
+      (options.cdf_target_latency_us > 0) ||
+      (options.store_target_latency_us > 0))
+  {
+    load_feedback = new LoadFeedback(load_monitor,
+                                     options.max_cdf_in_flight,
+                                     options.cdf_target_latency_us,
+                                     options.store_target_latency_us);
+  }
+
+  StageStatistics* stage_stats = new StageStatistics(lvc,
+                                                     StageStatistics::DEFAULT_PERIOD_MS,
+                                                     load_feedback);
+  stage_stats->start();
+
+  SessionStore* local_session_store = new SessionStore(local_memstore,
+                                                       stage_stats,
+                                                       StageStatistics::LOCAL_STORE);
 
   std::vector<Store*> remote_memstores;
   std::vector<SessionStore*> remote_session_stores;
@@ -738,13 +1228,137 @@ int main(int argc, char**argv)
                                                        true,
                                                        remote_astaire_comm_monitor);
     remote_memstores.push_back(remote_memstore);
-    SessionStore* remote_session_store = new SessionStore(remote_memstore);
+    SessionStore* remote_session_store = new SessionStore(remote_memstore,
+                                                          stage_stats,
+                                                          StageStatistics::REMOTE_STORE,
+                                                          options.remote_store_breaker_threshold);
     remote_session_stores.push_back(remote_session_store);
   }
 
   BillingHandlerConfig* cfg = new BillingHandlerConfig();
+  cfg->acr_deadline_ms = options.acr_deadline_ms;
+  cfg->stats = stage_stats;
+
+  // Keep a timeline of recent and slow ACRs, which can be dumped on demand.
+  if (options.slow_request_threshold_ms > 0)
+  {
+    flight_recorder = new FlightRecorder(options.slow_request_threshold_ms);
+    flight_recorder->start(options.log_directory.empty() ?
+                             "/var/log/ralf" : options.log_directory);
+  }
+  cfg->recorder = flight_recorder;
+
+  // Timer pops can be throttled on their own, with the same token bucket
+  // settings as other requests.
+  LoadMonitor* timer_pop_load_monitor = NULL;
+
+  if (options.timer_pop_target_latency_us > 0)
+  {
+    timer_pop_load_monitor = new LoadMonitor(options.timer_pop_target_latency_us,
+                                             options.max_tokens,
+                                             options.init_token_rate,
+                                             options.min_token_rate,
+                                             options.max_token_rate);
+  }
+  cfg->timer_pop_load_monitor = timer_pop_load_monitor;
+
+  DuplicateCache* duplicates = NULL;
+
+  if (options.duplicate_window_ms > 0)
+  {
+    duplicates = new DuplicateCache(options.duplicate_window_ms);
+  }
+  cfg->duplicates = duplicates;
+  FlightRecorderHandlerConfig flight_recorder_cfg = { flight_recorder };
+
+  // Prefer healthy CCFs over unhealthy ones, if configured.
+  PeerHealthScorer* health_scorer = NULL;
+
+  if (options.ccf_latency_slo_ms > 0)
+  {
+    health_scorer = new PeerHealthScorer(options.ccf_latency_slo_ms,
+                                         options.ccf_max_timeout_rate,
+                                         options.ccf_max_error_rate);
+  }
+
+  // Limit the number of ACRs outstanding to each CCF.  Requests are only
+  // queued for as long as they would have waited for an answer.  Answers
+  // slower than the latency SLO (or half the Diameter timeout, if there isn't
+  // one) cut the limit.
+  PeerConcurrencyLimiter* concurrency_limiter = NULL;
+
+  if (options.ccf_max_outstanding > 0)
+  {
+    int target_rtt_ms = (options.ccf_latency_slo_ms > 0) ?
+                          options.ccf_latency_slo_ms :
+                          options.diameter_timeout_ms / 2;
+    concurrency_limiter = new PeerConcurrencyLimiter(options.ccf_max_outstanding,
+                                                     1,
+                                                     target_rtt_ms,
+                                                     options.ccf_overload_policy,
+                                                     options.ccf_max_queue,
+                                                     options.diameter_timeout_ms);
+    concurrency_limiter->start();
+  }
+
+  // Adapt the Diameter timeout for each CCF to its response times, if
+  // configured.
+  PeerTimeoutEstimator* timeout_estimator = NULL;
+
+  if (options.ccf_timeout_floor_ms > 0)
+  {
+    timeout_estimator = new PeerTimeoutEstimator(options.ccf_timeout_floor_ms,
+                                                 options.ccf_timeout_ceiling_ms,
+                                                 options.ccf_timeout_margin_ms);
+  }
+
+  // Spool ACRs that can't be delivered to any CDF, if configured.  If the
+  // spool can't be opened we carry on without it.
+  AcrSpool* acr_spool = NULL;
+  AcrForwarder* acr_forwarder = NULL;
+
+  if (!options.acr_spool_file.empty())
+  {
+    acr_spool = new AcrSpool(options.acr_spool_file,
+                             (size_t)options.acr_spool_size_mb * 1024 * 1024);
+
+    if (acr_spool->open())
+    {
+      acr_forwarder = new AcrForwarder(acr_spool,
+                                       dict,
+                                       diameter_stack,
+                                       options.billing_realm,
+                                       options.diameter_timeout_ms,
+                                       options.acr_replay_rate,
+                                       peer_state_cache,
+                                       ccf_stripes);
+      acr_forwarder->start();
+    }
+    else
+    {
+      TRC_ERROR("Failed to open ACR spool %s - undeliverable ACRs will be lost",
+                options.acr_spool_file.c_str());
+      delete acr_spool; acr_spool = NULL;
+    }
+  }
+
+  // Keep statistics for each CCF, which are available over HTTP.
+  PeerStatistics* peer_stats = new PeerStatistics(peer_state_cache,
+                                                  concurrency_limiter,
+                                                  timeout_estimator,
+                                                  acr_forwarder);
+  PeerStatisticsHandlerConfig peer_stats_cfg = { peer_stats };
+
   PeerMessageSenderFactory* factory = new PeerMessageSenderFactory(options.billing_realm,
-                                                                   options.diameter_timeout_ms);
+                                                                   options.diameter_timeout_ms,
+                                                                   peer_state_cache,
+                                                                   health_scorer,
+                                                                   concurrency_limiter,
+                                                                   ccf_stripes,
+                                                                   timeout_estimator,
+                                                                   acr_forwarder,
+                                                                   stage_stats,
+                                                                   peer_stats);
 
   // Create a connection to Chronos.
   std::string port_str = std::to_string(options.http_port);
@@ -811,10 +1425,44 @@ int main(int argc, char**argv)
   HttpConnection* chronos_http_conn = new HttpConnection(chronos_service,
                                                          chronos_http_client);
 
-  ChronosConnection* timer_conn = new ChronosConnection(chronos_callback_addr,
-                                                        chronos_http_conn);
+  // Pops of local timers are handled like timer pops from Chronos.  The
+  // session manager is filled in on the config below, before the timers are
+  // started.
+  LocalTimerPopHandler local_timer_pop_handler(cfg);
+  LocalTimerWheel* local_timers = NULL;
+  ChronosConnection* timer_conn = NULL;
 
-  cfg->mgr = new SessionManager(local_session_store, remote_session_stores, dict, factory, timer_conn, diameter_stack, hc);
+  if (!options.local_timers_file.empty())
+  {
+    TRC_STATUS("Running INTERIM timers locally, saving them to %s",
+               options.local_timers_file.c_str());
+    local_timers = new LocalTimerWheel(&local_timer_pop_handler,
+                                       options.local_timers_file);
+    timer_conn = local_timers;
+  }
+  else
+  {
+    timer_conn = new ChronosConnection(chronos_callback_addr,
+                                       chronos_http_conn);
+  }
+
+  // Send timer requests to Chronos from a few threads of their own, rather
+  // than waiting for them on the threads handling ACRs, and (if configured)
+  // coalesce repeated updates of the same timer.  Local timers are quick to set,
+  // so don't need this.
+  ChronosQueue* timer_queue = NULL;
+
+  if ((local_timers == NULL) && (options.chronos_threads > 0))
+  {
+    timer_queue = new ChronosQueue(timer_conn,
+                                   options.chronos_threads,
+                                   ChronosQueue::DEFAULT_MAX_DEPTH,
+                                   stage_stats,
+                                   options.chronos_coalesce_ms);
+    timer_queue->start();
+  }
+
+  cfg->mgr = new SessionManager(local_session_store, remote_session_stores, dict, factory, timer_conn, diameter_stack, hc, stage_stats, timer_queue, options.interim_timer_jitter, duplicates);
 
   HttpStack* http_stack = new HttpStack(options.http_threads,
                                         exception_handler,
@@ -822,6 +1470,10 @@ int main(int argc, char**argv)
                                         load_monitor);
   HttpStackUtils::PingHandler ping_handler;
   BillingHandler billing_handler(cfg, options.http_acr_logging);
+  HttpStackUtils::SpawningHandler<PeerStatisticsTask, PeerStatisticsHandlerConfig>
+    peer_stats_handler(&peer_stats_cfg);
+  HttpStackUtils::SpawningHandler<FlightRecorderTask, FlightRecorderHandlerConfig>
+    flight_recorder_handler(&flight_recorder_cfg);
   try
   {
     http_stack->initialize();
@@ -829,6 +1481,12 @@ int main(int argc, char**argv)
                                 options.http_port);
     http_stack->register_handler("^/ping$", &ping_handler);
     http_stack->register_handler("^/call-id/[^/]*$", &billing_handler);
+    http_stack->register_handler("^/statistics/peers$", &peer_stats_handler);
+
+    if (flight_recorder != NULL)
+    {
+      http_stack->register_handler("^/flight-recorder$", &flight_recorder_handler);
+    }
     http_stack->start();
   }
   catch (HttpStack::Exception& e)
@@ -856,6 +1514,12 @@ int main(int argc, char**argv)
                                                  diameter_resolver);
   realm_manager->start();
 
+  // Start local timers once we can send the ACRs they generate.
+  if (local_timers != NULL)
+  {
+    local_timers->start();
+  }
+
   sem_wait(&term_sem);
 
   CL_RALF_ENDED.log();
@@ -870,6 +1534,23 @@ int main(int argc, char**argv)
     fprintf(stderr, "Caught HttpStack::Exception - %s - %d\n", e._func, e._rc);
   }
 
+  if (acr_forwarder != NULL)
+  {
+    acr_forwarder->stop();
+  }
+
+  if (local_timers != NULL)
+  {
+    local_timers->stop();
+  }
+
+  peer_state_cache->stop();
+
+  if (concurrency_limiter != NULL)
+  {
+    concurrency_limiter->stop();
+  }
+
   try
   {
     diameter_stack->stop();
@@ -883,14 +1564,42 @@ int main(int argc, char**argv)
 
   realm_manager->stop();
 
+  if (timer_queue != NULL)
+  {
+    timer_queue->stop();
+  }
+
+  stage_stats->stop();
+
+  if (flight_recorder != NULL)
+  {
+    flight_recorder->stop();
+  }
+
   delete realm_manager; realm_manager = NULL;
   delete diameter_resolver; diameter_resolver = NULL;
+  delete peer_stats; peer_stats = NULL;
+  delete peer_state_cache; peer_state_cache = NULL;
+  delete health_scorer; health_scorer = NULL;
+  delete concurrency_limiter; concurrency_limiter = NULL;
+  delete ccf_stripes; ccf_stripes = NULL;
+  delete timeout_estimator; timeout_estimator = NULL;
+  delete acr_forwarder; acr_forwarder = NULL;
+  delete acr_spool; acr_spool = NULL;
+  delete timer_queue; timer_queue = NULL;
   delete timer_conn; timer_conn = NULL;
   delete chronos_http_conn; chronos_http_conn = NULL;
   delete chronos_http_client; chronos_http_client = NULL;
   delete http_resolver; http_resolver = NULL;
   delete dns_resolver; dns_resolver = NULL;
+  delete stage_stats; stage_stats = NULL;
+  delete load_feedback; load_feedback = NULL;
   delete load_monitor; load_monitor = NULL;
+  delete timer_pop_load_monitor; timer_pop_load_monitor = NULL;
+  delete duplicates; duplicates = NULL;
+  signal(SIGUSR2, SIG_DFL);
+  delete flight_recorder; flight_recorder = NULL;
+  delete lvc; lvc = NULL;
 
   delete local_session_store; local_session_store = NULL;
   delete local_memstore; local_memstore = NULL;
@@ -10,6 +10,7 @@
 #include <string>
 #include "rapidjson/document.h"
 #include "message.hpp"
+#include "utils.h"
 
 /* Constructor of Message. Takes ownership of the passed-in
    rapidjson::Document pointer. */
@@ -29,11 +30,24 @@ Message::Message(const std::string& call_id,
   timer_interim(timer_interim),
   interim_interval(0),
   session_refresh_time(session_refresh_time),
-  trail(trail)
+  trail(trail),
+  deadline_ms(0)
 {};
 
-/* Deletes the enclosed rapidjson::Document. */
+/* Deletes the enclosed rapidjson::Document, and records the message's
+   timeline. */
 Message::~Message()
 {
     delete this->received_json;
+    this->timeline.finish();
+}
+
+const std::string& Message::callback_uri()
+{
+  if (_callback_uri.empty())
+  {
+    _callback_uri = "/call-id/" + Utils::url_escape(call_id) + "?timer-interim=true";
+  }
+
+  return _callback_uri;
 }
@@ -0,0 +1,346 @@
+/**
+ * @file peer_concurrency_limiter.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "log.h"
+#include "rf.h"
+#include "ralf_time.hpp"
+#include "peer_concurrency_limiter.hpp"
+
+const float PeerConcurrencyLimiter::DECREASE_FACTOR = 0.7;
+
+// The DIAMETER_TOO_BUSY protocol error (RFC 6733).
+static const int DIAMETER_TOO_BUSY_RESULT_CODE = 3004;
+
+// The shortest interval between checks for requests that have been queued
+// for too long.
+static const int MIN_SHED_INTERVAL_MS = 10;
+
+PeerConcurrencyLimiter::PeerConcurrencyLimiter(int max_limit,
+                                               int min_limit,
+                                               int target_rtt_ms,
+                                               Policy policy,
+                                               int max_queue_depth,
+                                               int max_queue_time_ms) :
+  _max_limit(max_limit),
+  _min_limit((min_limit < 1) ? 1 : min_limit),
+  _target_rtt_ms(target_rtt_ms),
+  _policy(policy),
+  _max_queue_depth(max_queue_depth),
+  _max_queue_time_ms(max_queue_time_ms),
+  _shed_count(0),
+  _shed_thread_running(false),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  RalfTime::init_cond(&_cond);
+}
+
+PeerConcurrencyLimiter::~PeerConcurrencyLimiter()
+{
+  stop();
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool PeerConcurrencyLimiter::start()
+{
+  _terminated = false;
+  int rc = pthread_create(&_shed_thread, NULL, shed_thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start CCF queue shedding thread (%d)", rc);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _shed_thread_running = true;
+  return true;
+}
+
+void PeerConcurrencyLimiter::stop()
+{
+  if (_shed_thread_running)
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_shed_thread, NULL);
+    _shed_thread_running = false;
+  }
+}
+
+// Must be called with the lock held.
+PeerConcurrencyLimiter::PeerState& PeerConcurrencyLimiter::get_peer(const std::string& host)
+{
+  std::map<std::string, PeerState>::iterator it = _peers.find(host);
+
+  if (it == _peers.end())
+  {
+    // Start new peers at the maximum limit, so that we behave as before until
+    // the peer shows signs of overload.
+    PeerState& peer = _peers[host];
+    peer.in_flight = 0;
+    peer.limit = _max_limit;
+    peer.last_decrease_ms = 0;
+    return peer;
+  }
+
+  return it->second;
+}
+
+// Removes the requests that have been queued for too long from the front of
+// the peer's queue, adding them to the given list to be told they've been
+// shed.  Must be called with the lock held.
+void PeerConcurrencyLimiter::remove_expired(PeerState& peer,
+                                            uint64_t now_ms,
+                                            std::vector<Waiter*>& shed)
+{
+  while ((!peer.queue.empty()) &&
+         (now_ms - peer.queue.front().queued_ms >= (uint64_t)_max_queue_time_ms))
+  {
+    shed.push_back(peer.queue.front().waiter);
+    peer.queue.pop_front();
+    _shed_count++;
+  }
+}
+
+// Tells waiters they've been shed.  Must be called without the lock held, as
+// they will go on to try other peers (and so may call back into us).
+void PeerConcurrencyLimiter::shed_waiters(std::vector<Waiter*>& shed)
+{
+  for (std::vector<Waiter*>::iterator it = shed.begin(); it != shed.end(); ++it)
+  {
+    (*it)->shed();
+  }
+}
+
+PeerConcurrencyLimiter::Admission PeerConcurrencyLimiter::acquire(const std::string& host,
+                                                                  Waiter* waiter)
+{
+  Admission admission;
+  std::vector<Waiter*> shed;
+
+  pthread_mutex_lock(&_lock);
+  PeerState& peer = get_peer(host);
+  remove_expired(peer, RalfTime::now_ms(), shed);
+
+  if (peer.in_flight < (int)peer.limit)
+  {
+    peer.in_flight++;
+    admission = ADMITTED;
+  }
+  else if ((_policy == QUEUE) &&
+           ((int)peer.queue.size() < _max_queue_depth))
+  {
+    QueuedWaiter queued = {waiter, RalfTime::now_ms()};
+    peer.queue.push_back(queued);
+    admission = QUEUED;
+    TRC_DEBUG("CCF %s is at its limit of %d outstanding requests, queued request (queue depth %d)",
+              host.c_str(), (int)peer.limit, (int)peer.queue.size());
+  }
+  else
+  {
+    _shed_count++;
+    admission = REJECTED;
+    TRC_DEBUG("CCF %s is at its limit of %d outstanding requests, shedding request",
+              host.c_str(), (int)peer.limit);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  shed_waiters(shed);
+
+  return admission;
+}
+
+// Must be called with the lock held.
+void PeerConcurrencyLimiter::adapt_limit(PeerState& peer,
+                                         int result_code,
+                                         unsigned long rtt_us,
+                                         bool timed_out)
+{
+  bool congested = (timed_out ||
+                    (result_code == DIAMETER_TOO_BUSY_RESULT_CODE) ||
+                    ((_target_rtt_ms > 0) &&
+                     (rtt_us > (unsigned long)_target_rtt_ms * 1000)));
+
+  if (congested)
+  {
+    // Only cut the limit once per target RTT, otherwise a burst of timeouts
+    // for requests that were all sent at the same time would collapse the
+    // limit to the minimum.
+    uint64_t now = RalfTime::now_ms();
+
+    if (now - peer.last_decrease_ms >= (uint64_t)_target_rtt_ms)
+    {
+      peer.limit = peer.limit * DECREASE_FACTOR;
+
+      if (peer.limit < _min_limit)
+      {
+        peer.limit = _min_limit;
+      }
+
+      peer.last_decrease_ms = now;
+      TRC_DEBUG("Reduced concurrency limit to %d", (int)peer.limit);
+    }
+  }
+  else if (result_code != ER_DIAMETER_UNABLE_TO_DELIVER)
+  {
+    // Grow by roughly one for each window's worth of good answers.  Failures
+    // to deliver tell us nothing about the peer's load, so leave the limit
+    // alone for those.
+    peer.limit += 1.0 / peer.limit;
+
+    if (peer.limit > _max_limit)
+    {
+      peer.limit = _max_limit;
+    }
+  }
+}
+
+void PeerConcurrencyLimiter::release(const std::string& host,
+                                     int result_code,
+                                     unsigned long rtt_us,
+                                     bool timed_out)
+{
+  std::vector<Waiter*> admitted;
+  std::vector<Waiter*> shed;
+  uint64_t now = RalfTime::now_ms();
+
+  pthread_mutex_lock(&_lock);
+  PeerState& peer = get_peer(host);
+
+  if (peer.in_flight > 0)
+  {
+    peer.in_flight--;
+  }
+
+  adapt_limit(peer, result_code, rtt_us, timed_out);
+
+  // Shed anything that has been queued for too long, then hand out any free
+  // slots to the requests at the front of the queue.
+  remove_expired(peer, now, shed);
+
+  while ((!peer.queue.empty()) &&
+         (peer.in_flight < (int)peer.limit))
+  {
+    admitted.push_back(peer.queue.front().waiter);
+    peer.queue.pop_front();
+    peer.in_flight++;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  // Call back into the waiters without the lock held, as they will go on to
+  // send requests (and so may call back into us).
+  shed_waiters(shed);
+
+  for (std::vector<Waiter*>::iterator it = admitted.begin(); it != admitted.end(); ++it)
+  {
+    (*it)->admitted();
+  }
+}
+
+bool PeerConcurrencyLimiter::get_peer_stats(const std::string& host,
+                                            int& in_flight,
+                                            int& queue_depth,
+                                            int& limit)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, PeerState>::iterator it = _peers.find(host);
+
+  if (it != _peers.end())
+  {
+    in_flight = it->second.in_flight;
+    queue_depth = it->second.queue.size();
+    limit = (int)it->second.limit;
+    found = true;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return found;
+}
+
+std::vector<std::string> PeerConcurrencyLimiter::peers()
+{
+  std::vector<std::string> hosts;
+
+  pthread_mutex_lock(&_lock);
+  for (std::map<std::string, PeerState>::iterator it = _peers.begin();
+       it != _peers.end();
+       ++it)
+  {
+    hosts.push_back(it->first);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return hosts;
+}
+
+uint64_t PeerConcurrencyLimiter::shed_count()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t count = _shed_count;
+  pthread_mutex_unlock(&_lock);
+
+  return count;
+}
+
+void PeerConcurrencyLimiter::shed_expired(uint64_t now_ms)
+{
+  std::vector<Waiter*> shed;
+
+  pthread_mutex_lock(&_lock);
+  for (std::map<std::string, PeerState>::iterator it = _peers.begin();
+       it != _peers.end();
+       ++it)
+  {
+    remove_expired(it->second, now_ms, shed);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  shed_waiters(shed);
+}
+
+void* PeerConcurrencyLimiter::shed_thread_fn(void* limiter_ptr)
+{
+  ((PeerConcurrencyLimiter*)limiter_ptr)->shed_thread();
+  return NULL;
+}
+
+void PeerConcurrencyLimiter::shed_thread()
+{
+  // Check a few times per queue time, so nothing waits much longer than it
+  // should.
+  uint64_t interval_ms = std::max(_max_queue_time_ms / 4, MIN_SHED_INTERVAL_MS);
+
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    RalfTime::timed_wait(&_cond, &_lock, interval_ms);
+
+    if (!_terminated)
+    {
+      pthread_mutex_unlock(&_lock);
+      shed_expired(RalfTime::now_ms());
+      pthread_mutex_lock(&_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,177 @@
+/**
+ * @file peer_health_scorer.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "ralf_time.hpp"
+#include "peer_health_scorer.hpp"
+
+const float PeerHealthScorer::DEFAULT_EWMA_ALPHA = 0.1;
+
+PeerHealthScorer::PeerHealthScorer(int latency_slo_ms,
+                                   float max_timeout_rate,
+                                   float max_error_rate,
+                                   float ewma_alpha,
+                                   int min_samples,
+                                   int probe_interval_ms) :
+  _latency_slo_ms(latency_slo_ms),
+  _max_timeout_rate(max_timeout_rate),
+  _max_error_rate(max_error_rate),
+  _ewma_alpha(ewma_alpha),
+  _min_samples(min_samples),
+  _probe_interval_ms(probe_interval_ms)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+PeerHealthScorer::~PeerHealthScorer()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void PeerHealthScorer::record_response(const std::string& host,
+                                       int result_code,
+                                       unsigned long latency_us)
+{
+  // Protocol errors (3xxx) say something about the peer or the path to it.
+  // Other failures (for example 5002 - session unknown) are about the request
+  // itself, so don't count against the peer.
+  bool error = ((result_code >= 3000) && (result_code < 4000));
+  record_sample(host, latency_us, false, error);
+}
+
+void PeerHealthScorer::record_timeout(const std::string& host,
+                                      unsigned long latency_us)
+{
+  record_sample(host, latency_us, true, false);
+}
+
+void PeerHealthScorer::record_sample(const std::string& host,
+                                     unsigned long latency_us,
+                                     bool timed_out,
+                                     bool error)
+{
+  double latency_ms = latency_us / 1000.0;
+
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, Score>::iterator it = _scores.find(host);
+
+  if (it == _scores.end())
+  {
+    Score score;
+    score.latency_ms = latency_ms;
+    score.timeout_rate = timed_out ? 1.0 : 0.0;
+    score.error_rate = error ? 1.0 : 0.0;
+    score.samples = 1;
+    score.last_probe_ms = RalfTime::now_ms();
+    _scores[host] = score;
+  }
+  else
+  {
+    Score& score = it->second;
+    score.latency_ms += _ewma_alpha * (latency_ms - score.latency_ms);
+    score.timeout_rate += _ewma_alpha * ((timed_out ? 1.0 : 0.0) - score.timeout_rate);
+    score.error_rate += _ewma_alpha * ((error ? 1.0 : 0.0) - score.error_rate);
+    score.samples++;
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+bool PeerHealthScorer::within_slo(const Score& score) const
+{
+  if (score.samples < (uint64_t)_min_samples)
+  {
+    return true;
+  }
+
+  return ((score.latency_ms <= _latency_slo_ms) &&
+          (score.timeout_rate <= _max_timeout_rate) &&
+          (score.error_rate <= _max_error_rate));
+}
+
+bool PeerHealthScorer::is_healthy(const std::string& host)
+{
+  bool healthy = true;
+
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, Score>::iterator it = _scores.find(host);
+
+  if ((it != _scores.end()) && (!within_slo(it->second)))
+  {
+    // The peer is outside its SLO.  Let a request through in its normal
+    // position every so often, otherwise we'd never notice it recovering.
+    uint64_t now_ms = RalfTime::now_ms();
+
+    if (now_ms - it->second.last_probe_ms >= (uint64_t)_probe_interval_ms)
+    {
+      TRC_DEBUG("Probing unhealthy CCF %s", host.c_str());
+      it->second.last_probe_ms = now_ms;
+    }
+    else
+    {
+      healthy = false;
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return healthy;
+}
+
+void PeerHealthScorer::order_ccfs(std::vector<std::string>& ccfs)
+{
+  std::vector<std::string> healthy;
+  std::vector<std::string> unhealthy;
+
+  for (std::vector<std::string>::const_iterator ccf = ccfs.begin();
+       ccf != ccfs.end();
+       ++ccf)
+  {
+    if (is_healthy(*ccf))
+    {
+      healthy.push_back(*ccf);
+    }
+    else
+    {
+      TRC_DEBUG("CCF %s is outside its SLO, deprioritizing it", ccf->c_str());
+      unhealthy.push_back(*ccf);
+    }
+  }
+
+  if ((healthy.empty()) || (unhealthy.empty()))
+  {
+    // Nothing to reorder.
+    return;
+  }
+
+  healthy.insert(healthy.end(), unhealthy.begin(), unhealthy.end());
+  ccfs.swap(healthy);
+}
+
+bool PeerHealthScorer::get_score(const std::string& host,
+                                 double& latency_ms,
+                                 double& timeout_rate,
+                                 double& error_rate)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, Score>::iterator it = _scores.find(host);
+
+  if (it != _scores.end())
+  {
+    latency_ms = it->second.latency_ms;
+    timeout_rate = it->second.timeout_rate;
+    error_rate = it->second.error_rate;
+    found = true;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return found;
+}
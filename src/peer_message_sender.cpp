@@ -11,7 +11,9 @@
 
 #include <stddef.h>
 #include <errno.h>
+#include <algorithm>
 #include "log.h"
+#include "ralf_time.hpp"
 #include "peer_message_sender.hpp"
 #include "ralf_transaction.hpp"
 #include "rf.h"
@@ -26,11 +28,32 @@
  */
 PeerMessageSender::PeerMessageSender(SAS::TrailId trail,
                                      const std::string& dest_realm,
-                                     const int diameter_timeout) :
+                                     const int diameter_timeout,
+                                     PeerStateCache* peer_state_cache,
+                                     PeerHealthScorer* health_scorer,
+                                     PeerConcurrencyLimiter* concurrency_limiter,
+                                     const CcfStripes* ccf_stripes,
+                                     PeerTimeoutEstimator* timeout_estimator,
+                                     AcrForwarder* acr_forwarder,
+                                     StageStatistics* stats,
+                                     PeerStatistics* peer_stats) :
   _which(0),
   _trail(trail),
   _dest_realm(dest_realm),
-  _diameter_timeout(diameter_timeout)
+  _diameter_timeout(diameter_timeout),
+  _peer_state_cache(peer_state_cache),
+  _health_scorer(health_scorer),
+  _concurrency_limiter(concurrency_limiter),
+  _ccf_stripes(ccf_stripes),
+  _timeout_estimator(timeout_estimator),
+  _acr_forwarder(acr_forwarder),
+  _stats(stats),
+  _peer_stats(peer_stats),
+  _attempt_timeout_ms(diameter_timeout),
+  _attempt_capped(false),
+  _send_time_us(0),
+  _timed_out(false),
+  _sent(false)
 {
 }
 
@@ -39,24 +62,180 @@ PeerMessageSender::~PeerMessageSender()
 }
 
 /* Sends the message to the sequence of given CCFs.
+ *
+ * Where a CCF has several connections configured, the ACR is sent on the one
+ * selected by the session's Call-ID, so that a session's ACRs stay in order.
  *
  * Does not retry on errors - only on failed sends (DIAMETER_UNABLE_TO_SEND).
+ * CCFs that are outside their SLO are tried after the healthy ones, and CCFs
+ * whose Diameter connection is known to be down are skipped.
  */
 void PeerMessageSender::send(Message* msg, SessionManager* sm, Rf::Dictionary* dict, Diameter::Stack* diameter_stack)
 {
   _msg = msg;
   _ccfs = msg->ccfs;
+
+  // Pick which connection to use for each CCF.  Everything after this point
+  // (connection state, health, concurrency limits) applies to the connection
+  // we have chosen.
+  if (_ccf_stripes != NULL)
+  {
+    for (std::vector<std::string>::iterator it = _ccfs.begin(); it != _ccfs.end(); ++it)
+    {
+      *it = _ccf_stripes->select(*it, msg->call_id);
+    }
+  }
+
+  if (_health_scorer != NULL)
+  {
+    _health_scorer->order_ccfs(_ccfs);
+  }
+
   _sm = sm;
   _dict = dict;
   _diameter_stack = diameter_stack;
+  skip_down_ccfs();
   int_send_msg();
 }
 
+/* Moves on past any CCFs that are known to be unreachable, as long as there is
+ * a later CCF that isn't known to be down.  If all the remaining CCFs are down
+ * we try them anyway - the cached state may be out of date, and it's better to
+ * wait for a timeout than to drop the ACR.
+ */
+void PeerMessageSender::skip_down_ccfs()
+{
+  if (_peer_state_cache == NULL)
+  {
+    return;
+  }
+
+  unsigned int candidate = _which;
+
+  while ((candidate < _ccfs.size()) &&
+         (_peer_state_cache->is_down(_ccfs[candidate])))
+  {
+    candidate++;
+  }
+
+  if (candidate == _ccfs.size())
+  {
+    TRC_DEBUG("All remaining CCFs are down, trying %s anyway", _ccfs[_which].c_str());
+    return;
+  }
+
+  for (; _which < candidate; _which++)
+  {
+    TRC_DEBUG("Skipping CCF %s (number %d) as its connection is down",
+              _ccfs[_which].c_str(), _which);
+    _peer_state_cache->record_skip(_ccfs[_which]);
+  }
+}
+
+/* Sends the message to the current active CCF, once the CCF has room for
+ * another outstanding request.  If the CCF is at its concurrency limit the
+ * request is either queued (and sent when a slot frees up) or shed, in which
+ * case we move on to the next CCF.
+ */
+void PeerMessageSender::int_send_msg()
+{
+  if (remaining_budget_ms() == 0)
+  {
+    deadline_expired(); return;
+  }
+
+  if (_concurrency_limiter != NULL)
+  {
+    PeerConcurrencyLimiter::Admission admission =
+                         _concurrency_limiter->acquire(_ccfs[_which], this);
+
+    if (admission == PeerConcurrencyLimiter::QUEUED)
+    {
+      // We'll be called back on admitted() or shed().
+      return;
+    }
+    else if (admission == PeerConcurrencyLimiter::REJECTED)
+    {
+      shed(); return;
+    }
+  }
+
+  send_acr(); return;
+}
+
+/* Called by the concurrency limiter when a queued request has been given a
+ * slot.
+ */
+void PeerMessageSender::admitted()
+{
+  if (remaining_budget_ms() == 0)
+  {
+    // We ran out of time while we were queued, so give the slot back.
+    _concurrency_limiter->release(_ccfs[_which], ER_DIAMETER_UNABLE_TO_DELIVER, 0, false);
+    deadline_expired(); return;
+  }
+
+  send_acr(); return;
+}
+
+/* Returns how long is left before the message's deadline, in milliseconds, or
+ * -1 if it has no deadline.
+ */
+int PeerMessageSender::remaining_budget_ms()
+{
+  if (_msg->deadline_ms == 0)
+  {
+    return -1;
+  }
+
+  uint64_t now = RalfTime::now_ms();
+  return (now >= _msg->deadline_ms) ? 0 : (int)(_msg->deadline_ms - now);
+}
+
+/* Called when the message's deadline has passed before it could be delivered
+ * to a CCF.  Fails the message without trying any further CCFs.
+ */
+void PeerMessageSender::deadline_expired()
+{
+  TRC_WARNING("Deadline expired after trying %d CCF(s), message not sent", _which);
+  spool_undelivered();
+  _sm->on_ccf_response(false, 0, "", ER_DIAMETER_UNABLE_TO_DELIVER, _msg);
+  delete this; return;
+}
+
+/* Stores a message that we couldn't deliver to any CCF, so that it can be
+ * replayed later (if spooling is enabled).
+ */
+void PeerMessageSender::spool_undelivered()
+{
+  if (_acr_forwarder != NULL)
+  {
+    _acr_forwarder->spool_acr(_msg);
+  }
+}
+
+/* Called when the current CCF has no room for this request.  This is treated
+ * as a failure to deliver the message, so we move on to the next CCF.
+ */
+void PeerMessageSender::shed()
+{
+  TRC_DEBUG("CCF %s is overloaded, not sending ACR to it", _ccfs[_which].c_str());
+
+  if (_peer_stats != NULL)
+  {
+    _peer_stats->record_shed(_ccfs[_which]);
+  }
+
+  _msg->timeline.mark(FlightRecorder::CDF_SHED, _which);
+
+  send_cb(ER_DIAMETER_UNABLE_TO_DELIVER, 0, ""); return;
+}
+
 /* Actually sends the message to the current active CCF.
  *
  * After sending the message, deletes this PeerMessageSender.
  */
-void PeerMessageSender::int_send_msg()
+void PeerMessageSender::send_acr()
 {
   std::string ccf = _ccfs[_which];
   TRC_DEBUG("Sending message to %s (number %d)", ccf.c_str(), _which);
@@ -75,10 +254,129 @@ void PeerMessageSender::int_send_msg()
                             _msg->accounting_record_number,
                             _msg->received_json->FindMember("event")->value);
 
+  // Wait for as long as this CCF normally needs to answer, if we know that.
+  _attempt_timeout_ms = (_timeout_estimator != NULL) ?
+                          _timeout_estimator->get_timeout(ccf) :
+                          _diameter_timeout;
+
+  // Don't wait beyond the message's deadline.
+  int budget_ms = remaining_budget_ms();
+  _attempt_capped = ((budget_ms >= 0) && (budget_ms < _attempt_timeout_ms));
+
+  if (_attempt_capped)
+  {
+    _attempt_timeout_ms = std::max(budget_ms, 1);
+  }
+  _send_time_us = RalfTime::now_us();
+  _sent = true;
+
+  if (_stats != NULL)
+  {
+    _stats->incr_gauge(StageStatistics::CDF_IN_FLIGHT);
+  }
+
+  if (_peer_stats != NULL)
+  {
+    _peer_stats->record_request(ccf);
+  }
+
+  _msg->timeline.mark(FlightRecorder::CDF_SEND, _which);
+
   // Send the message to freeDiameter.  This object could get modified by a
   // callback (including being deleted) so is not safe to reference after this
   // point.
-  acr.send(tsx, _diameter_timeout); return;
+  acr.send(tsx, _attempt_timeout_ms); return;
+}
+
+/* Called when a message has been sent but no response was received in time.
+ * This is treated as a failure to deliver the message.
+ */
+void PeerMessageSender::timeout_cb()
+{
+  _timed_out = true;
+  send_cb(ER_DIAMETER_UNABLE_TO_DELIVER, 0, ""); return;
+}
+
+/* Feeds the outcome of the current attempt into the peer health scores and
+ * timeouts, and releases its slot with the concurrency limiter.  Does nothing
+ * if the ACR was never sent to the current CCF (because it was shed).
+ */
+void PeerMessageSender::record_outcome(int result_code)
+{
+  if (!_sent)
+  {
+    return;
+  }
+
+  unsigned long latency_us = RalfTime::now_us() - _send_time_us;
+
+  if (_stats != NULL)
+  {
+    _stats->record_latency(StageStatistics::CDF, latency_us);
+    _stats->record_result(_timed_out ? StageStatistics::TIMEOUT : result_code);
+    _stats->decr_gauge(StageStatistics::CDF_IN_FLIGHT);
+  }
+
+  if (_timed_out)
+  {
+    _msg->timeline.mark(FlightRecorder::CDF_TIMEOUT);
+  }
+  else
+  {
+    _msg->timeline.mark(FlightRecorder::CDF_ANSWER, result_code);
+  }
+
+  if (_peer_stats != NULL)
+  {
+    if (_timed_out)
+    {
+      _peer_stats->record_timeout(_ccfs[_which]);
+    }
+    else
+    {
+      _peer_stats->record_response(_ccfs[_which], result_code, latency_us);
+    }
+  }
+
+  // If we cut the timeout short to meet the ACR's deadline, a timeout tells
+  // us nothing about the CCF, so don't hold it against the CCF.
+  bool informative = !(_timed_out && _attempt_capped);
+
+  if ((_health_scorer != NULL) && (informative))
+  {
+    if (_timed_out)
+    {
+      _health_scorer->record_timeout(_ccfs[_which], latency_us);
+    }
+    else
+    {
+      _health_scorer->record_response(_ccfs[_which], result_code, latency_us);
+    }
+  }
+
+  if ((_timeout_estimator != NULL) && (informative))
+  {
+    if (_timed_out)
+    {
+      _timeout_estimator->record_timeout(_ccfs[_which], _attempt_timeout_ms);
+    }
+    else
+    {
+      _timeout_estimator->record_rtt(_ccfs[_which], latency_us);
+    }
+  }
+
+  if (_concurrency_limiter != NULL)
+  {
+    // This may send queued requests for the same CCF.
+    _concurrency_limiter->release(_ccfs[_which],
+                                  result_code,
+                                  latency_us,
+                                  _timed_out && informative);
+  }
+
+  _timed_out = false;
+  _sent = false;
 }
 
 /* Called when a message has been sent and a response has been received.
@@ -91,6 +389,9 @@ void PeerMessageSender::send_cb(int result_code,
                                 int interim_interval,
                                 std::string session_id)
 {
+  bool sent = _sent;
+  record_outcome(result_code);
+
   if (result_code != ER_DIAMETER_UNABLE_TO_DELIVER)
   {
     // Send succeeded, notify the SessionManager.
@@ -105,10 +406,30 @@ void PeerMessageSender::send_cb(int result_code,
     cdf_failed.add_var_param(_ccfs[_which]);
     SAS::report_event(cdf_failed);
 
+    // Our view of this peer's state may be out of date - make sure we check
+    // it again before we next use it.
+    if ((sent) && (_peer_state_cache != NULL))
+    {
+      _peer_state_cache->invalidate(_ccfs[_which]);
+    }
+
+    if (_peer_stats != NULL)
+    {
+      _peer_stats->record_unable_to_deliver(_ccfs[_which]);
+    }
+
     // Do we have a backup CCF?
+    unsigned int failed = _which;
     _which++;
     if (_which < _ccfs.size())
     {
+      skip_down_ccfs();
+
+      if (_peer_stats != NULL)
+      {
+        _peer_stats->record_failover(_ccfs[failed], _ccfs[_which]);
+      }
+
       SAS::Event cdf_failover(_msg->trail, SASEvent::CDF_FAILOVER, 0);
       cdf_failover.add_var_param(_ccfs[_which]);
       SAS::report_event(cdf_failover);
@@ -121,6 +442,7 @@ void PeerMessageSender::send_cb(int result_code,
     {
       // No, we've run out, fail
       TRC_ERROR("Failed to connect to all CCFs, message not sent");
+      spool_undelivered();
       _sm->on_ccf_response(false, 0, "", result_code, _msg);
       delete this; return;
     }
@@ -0,0 +1,166 @@
+/**
+ * @file peer_state_cache.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "ralf_time.hpp"
+#include "peer_state_cache.hpp"
+
+PeerStateCache::PeerStateCache(int refresh_interval_ms) :
+  _refresh_interval_ms(refresh_interval_ms),
+  _skip_count(0),
+  _peer_hook_hdl(NULL)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+PeerStateCache::~PeerStateCache()
+{
+  stop();
+  pthread_mutex_destroy(&_lock);
+}
+
+void PeerStateCache::start()
+{
+  int rc = fd_hook_register(HOOK_MASK(HOOK_PEER_CONNECT_SUCCESS,
+                                      HOOK_PEER_CONNECT_FAILED),
+                            fd_peer_hook_cb,
+                            this,
+                            NULL,
+                            &_peer_hook_hdl);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to register peer state hook (%d) - peer states will only be polled", rc);
+    _peer_hook_hdl = NULL;
+    // LCOV_EXCL_STOP
+  }
+}
+
+void PeerStateCache::stop()
+{
+  if (_peer_hook_hdl != NULL)
+  {
+    fd_hook_unregister(_peer_hook_hdl);
+    _peer_hook_hdl = NULL;
+  }
+}
+
+bool PeerStateCache::is_down(const std::string& host)
+{
+  uint64_t now = RalfTime::now_ms();
+
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, Entry>::iterator it = _peers.find(host);
+
+  if ((it != _peers.end()) &&
+      (now - it->second.updated_ms < (uint64_t)_refresh_interval_ms))
+  {
+    bool down = (it->second.state == DOWN);
+    pthread_mutex_unlock(&_lock);
+    return down;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  // The entry is missing or stale, so ask freeDiameter.  We do this without
+  // holding the lock as it takes freeDiameter's peer list lock.
+  PeerState state = query_peer_state(host);
+
+  pthread_mutex_lock(&_lock);
+  Entry& entry = _peers[host];
+  entry.state = state;
+  entry.updated_ms = now;
+  pthread_mutex_unlock(&_lock);
+
+  return (state == DOWN);
+}
+
+void PeerStateCache::update_peer_state(const std::string& host, bool up)
+{
+  TRC_DEBUG("Diameter peer %s is now %s", host.c_str(), up ? "up" : "down");
+
+  pthread_mutex_lock(&_lock);
+  Entry& entry = _peers[host];
+  entry.state = up ? UP : DOWN;
+  entry.updated_ms = RalfTime::now_ms();
+  pthread_mutex_unlock(&_lock);
+}
+
+void PeerStateCache::invalidate(const std::string& host)
+{
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, Entry>::iterator it = _peers.find(host);
+
+  if (it != _peers.end())
+  {
+    it->second.updated_ms = 0;
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+void PeerStateCache::record_skip(const std::string& host)
+{
+  _skip_count++;
+
+  pthread_mutex_lock(&_lock);
+  _peers[host].skips++;
+  pthread_mutex_unlock(&_lock);
+}
+
+uint64_t PeerStateCache::skip_count(const std::string& host)
+{
+  uint64_t skips = 0;
+
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, Entry>::iterator it = _peers.find(host);
+
+  if (it != _peers.end())
+  {
+    skips = it->second.skips;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return skips;
+}
+
+// LCOV_EXCL_START - needs a running Diameter stack
+PeerStateCache::PeerState PeerStateCache::query_peer_state(const std::string& host)
+{
+  struct peer_hdr* peer = NULL;
+  int rc = fd_peer_getbyid((DiamId_t)host.c_str(), host.length(), 1, &peer);
+
+  if ((rc != 0) || (peer == NULL))
+  {
+    // freeDiameter doesn't know about this peer (it may be reachable via a
+    // relay), so we can't say that it is down.
+    return UNKNOWN;
+  }
+
+  return (fd_peer_get_state(peer) == STATE_OPEN) ? UP : DOWN;
+}
+
+void PeerStateCache::fd_peer_hook_cb(enum fd_hook_type type,
+                                     struct msg* msg,
+                                     struct peer_hdr* peer,
+                                     void* other,
+                                     struct fd_hook_permsgdata* pmd,
+                                     void* cache_ptr)
+{
+  if ((peer == NULL) || (peer->info.pi_diamid == NULL))
+  {
+    // A connection attempt from an unknown peer - nothing to record.
+    return;
+  }
+
+  PeerStateCache* cache = (PeerStateCache*)cache_ptr;
+  std::string host(peer->info.pi_diamid, peer->info.pi_diamidlen);
+  cache->update_peer_state(host, (type == HOOK_PEER_CONNECT_SUCCESS));
+}
+// LCOV_EXCL_STOP
@@ -0,0 +1,431 @@
+/**
+ * @file peer_statistics.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <tuple>
+#include <utility>
+
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include "peer_statistics.hpp"
+
+std::atomic<uint64_t> PeerStatistics::_next_id(1);
+
+// Each thread's cached pointer to its cells, and the PeerStatistics they
+// belong to.
+static __thread uint64_t tls_owner_id = 0;
+static __thread void* tls_thread_stats = NULL;
+
+PeerStatistics::PeerCells::PeerCells() :
+  requests(0),
+  responses(0),
+  timeouts(0),
+  unable_to_deliver(0),
+  shed(0),
+  failovers_out(0),
+  failovers_in(0),
+  rtt_max_us(0)
+{
+  for (int ii = 0; ii < LatencyHistogram::NUM_BUCKETS; ii++)
+  {
+    rtt_buckets[ii].store(0, std::memory_order_relaxed);
+  }
+}
+
+PeerStatistics::ThreadStats::ThreadStats() : owner(pthread_self())
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+PeerStatistics::ThreadStats::~ThreadStats()
+{
+  for (std::map<std::string, PeerCells*>::iterator it = peers.begin();
+       it != peers.end();
+       ++it)
+  {
+    delete it->second;
+  }
+
+  pthread_mutex_destroy(&lock);
+}
+
+PeerStatistics::PeerStatistics(PeerStateCache* peer_state_cache,
+                               PeerConcurrencyLimiter* concurrency_limiter,
+                               PeerTimeoutEstimator* timeout_estimator,
+                               AcrForwarder* acr_forwarder) :
+  _peer_state_cache(peer_state_cache),
+  _concurrency_limiter(concurrency_limiter),
+  _timeout_estimator(timeout_estimator),
+  _acr_forwarder(acr_forwarder),
+  _id(_next_id++)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+PeerStatistics::~PeerStatistics()
+{
+  for (std::vector<ThreadStats*>::iterator it = _threads.begin();
+       it != _threads.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  pthread_mutex_destroy(&_lock);
+}
+
+// Returns this thread's cells, creating them the first time the thread
+// records anything.  Each thread caches the cells it last used, so this
+// only takes the lock if the thread is new or records to more than one
+// PeerStatistics.
+PeerStatistics::ThreadStats* PeerStatistics::thread_stats()
+{
+  if (tls_owner_id != _id)
+  {
+    ThreadStats* stats = NULL;
+
+    pthread_mutex_lock(&_lock);
+
+    for (std::vector<ThreadStats*>::iterator it = _threads.begin();
+         it != _threads.end();
+         ++it)
+    {
+      if (pthread_equal((*it)->owner, pthread_self()))
+      {
+        stats = *it;
+        break;
+      }
+    }
+
+    if (stats == NULL)
+    {
+      stats = new ThreadStats();
+      _threads.push_back(stats);
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    tls_owner_id = _id;
+    tls_thread_stats = stats;
+  }
+
+  return (ThreadStats*)tls_thread_stats;
+}
+
+PeerStatistics::PeerCells& PeerStatistics::cells(ThreadStats* stats,
+                                                 const std::string& host)
+{
+  std::map<std::string, PeerCells*>::iterator it = stats->peers.find(host);
+
+  if (it == stats->peers.end())
+  {
+    pthread_mutex_lock(&stats->lock);
+    it = stats->peers.insert(std::make_pair(host, new PeerCells())).first;
+    pthread_mutex_unlock(&stats->lock);
+  }
+
+  return *it->second;
+}
+
+void PeerStatistics::record_request(const std::string& host)
+{
+  incr(cells(thread_stats(), host).requests);
+}
+
+void PeerStatistics::record_response(const std::string& host,
+                                     int result_code,
+                                     unsigned long rtt_us)
+{
+  ThreadStats* stats = thread_stats();
+  PeerCells& peer = cells(stats, host);
+  incr(peer.responses);
+
+  std::map<int, std::atomic<uint64_t>>::iterator rc = peer.result_codes.find(result_code);
+
+  if (rc == peer.result_codes.end())
+  {
+    pthread_mutex_lock(&stats->lock);
+    rc = peer.result_codes.emplace(std::piecewise_construct,
+                                   std::forward_as_tuple(result_code),
+                                   std::forward_as_tuple(0)).first;
+    pthread_mutex_unlock(&stats->lock);
+  }
+
+  incr(rc->second);
+  incr(peer.rtt_buckets[LatencyHistogram::index(rtt_us)]);
+
+  // Only this thread raises the maximum, so there's no need for a
+  // compare-and-swap.
+  if (rtt_us > peer.rtt_max_us.load(std::memory_order_relaxed))
+  {
+    peer.rtt_max_us.store(rtt_us, std::memory_order_relaxed);
+  }
+}
+
+void PeerStatistics::record_timeout(const std::string& host)
+{
+  incr(cells(thread_stats(), host).timeouts);
+}
+
+void PeerStatistics::record_unable_to_deliver(const std::string& host)
+{
+  incr(cells(thread_stats(), host).unable_to_deliver);
+}
+
+void PeerStatistics::record_shed(const std::string& host)
+{
+  incr(cells(thread_stats(), host).shed);
+}
+
+void PeerStatistics::record_failover(const std::string& from_host,
+                                     const std::string& to_host)
+{
+  ThreadStats* stats = thread_stats();
+  incr(cells(stats, from_host).failovers_out);
+  incr(cells(stats, to_host).failovers_in);
+}
+
+std::vector<PeerStatistics::PeerSnapshot> PeerStatistics::snapshot()
+{
+  // Merge every thread's cells for each CCF.
+  std::map<std::string, PeerStats> merged;
+
+  pthread_mutex_lock(&_lock);
+
+  for (std::vector<ThreadStats*>::const_iterator thread = _threads.begin();
+       thread != _threads.end();
+       ++thread)
+  {
+    pthread_mutex_lock(&(*thread)->lock);
+
+    for (std::map<std::string, PeerCells*>::const_iterator it = (*thread)->peers.begin();
+         it != (*thread)->peers.end();
+         ++it)
+    {
+      const PeerCells& peer = *it->second;
+      PeerStats& stats = merged[it->first];
+      stats.requests += peer.requests.load(std::memory_order_relaxed);
+      stats.responses += peer.responses.load(std::memory_order_relaxed);
+      stats.timeouts += peer.timeouts.load(std::memory_order_relaxed);
+      stats.unable_to_deliver += peer.unable_to_deliver.load(std::memory_order_relaxed);
+      stats.shed += peer.shed.load(std::memory_order_relaxed);
+      stats.failovers_out += peer.failovers_out.load(std::memory_order_relaxed);
+      stats.failovers_in += peer.failovers_in.load(std::memory_order_relaxed);
+
+      for (std::map<int, std::atomic<uint64_t>>::const_iterator rc = peer.result_codes.begin();
+           rc != peer.result_codes.end();
+           ++rc)
+      {
+        uint64_t count = rc->second.load(std::memory_order_relaxed);
+
+        if (count > 0)
+        {
+          stats.result_codes[rc->first] += count;
+        }
+      }
+
+      for (int ii = 0; ii < LatencyHistogram::NUM_BUCKETS; ii++)
+      {
+        uint64_t count = peer.rtt_buckets[ii].load(std::memory_order_relaxed);
+
+        if (count > 0)
+        {
+          stats.rtt_us.add_bucket(ii, count);
+        }
+      }
+
+      stats.rtt_us.add_max(peer.rtt_max_us.load(std::memory_order_relaxed));
+    }
+
+    pthread_mutex_unlock(&(*thread)->lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  std::vector<PeerSnapshot> snapshots;
+
+  for (std::map<std::string, PeerStats>::const_iterator it = merged.begin();
+       it != merged.end();
+       ++it)
+  {
+    const PeerStats& stats = it->second;
+
+    if (stats.requests + stats.responses + stats.timeouts +
+        stats.unable_to_deliver + stats.shed +
+        stats.failovers_out + stats.failovers_in == 0)
+    {
+      // Nothing has been recorded for this CCF since the figures were reset.
+      continue;
+    }
+
+    PeerSnapshot snapshot;
+    snapshot.host = it->first;
+    snapshot.requests = stats.requests;
+    snapshot.responses = stats.responses;
+    snapshot.timeouts = stats.timeouts;
+    snapshot.unable_to_deliver = stats.unable_to_deliver;
+    snapshot.shed = stats.shed;
+    snapshot.failovers_out = stats.failovers_out;
+    snapshot.failovers_in = stats.failovers_in;
+    snapshot.result_codes = stats.result_codes;
+    snapshot.rtt_p50_us = stats.rtt_us.percentile(50.0);
+    snapshot.rtt_p90_us = stats.rtt_us.percentile(90.0);
+    snapshot.rtt_p99_us = stats.rtt_us.percentile(99.0);
+    snapshot.rtt_max_us = stats.rtt_us.max();
+    snapshots.push_back(snapshot);
+  }
+
+  return snapshots;
+}
+
+std::string PeerStatistics::to_json()
+{
+  std::vector<PeerSnapshot> snapshots = snapshot();
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String("peers");
+    writer.StartArray();
+
+    for (std::vector<PeerSnapshot>::const_iterator it = snapshots.begin();
+         it != snapshots.end();
+         ++it)
+    {
+      writer.StartObject();
+      {
+        writer.String("host"); writer.String(it->host.c_str());
+        writer.String("requests"); writer.Uint64(it->requests);
+        writer.String("responses"); writer.Uint64(it->responses);
+        writer.String("timeouts"); writer.Uint64(it->timeouts);
+        writer.String("unable_to_deliver"); writer.Uint64(it->unable_to_deliver);
+        writer.String("shed"); writer.Uint64(it->shed);
+        writer.String("failovers_out"); writer.Uint64(it->failovers_out);
+        writer.String("failovers_in"); writer.Uint64(it->failovers_in);
+
+        writer.String("rtt_us");
+        writer.StartObject();
+        {
+          writer.String("p50"); writer.Uint64(it->rtt_p50_us);
+          writer.String("p90"); writer.Uint64(it->rtt_p90_us);
+          writer.String("p99"); writer.Uint64(it->rtt_p99_us);
+          writer.String("max"); writer.Uint64(it->rtt_max_us);
+        }
+        writer.EndObject();
+
+        writer.String("result_codes");
+        writer.StartObject();
+        {
+          for (std::map<int, uint64_t>::const_iterator rc = it->result_codes.begin();
+               rc != it->result_codes.end();
+               ++rc)
+          {
+            writer.String(std::to_string(rc->first).c_str());
+            writer.Uint64(rc->second);
+          }
+        }
+        writer.EndObject();
+
+        if (_peer_state_cache != NULL)
+        {
+          writer.String("skipped"); writer.Uint64(_peer_state_cache->skip_count(it->host));
+        }
+
+        int in_flight;
+        int queue_depth;
+        int limit;
+
+        if ((_concurrency_limiter != NULL) &&
+            (_concurrency_limiter->get_peer_stats(it->host, in_flight, queue_depth, limit)))
+        {
+          writer.String("in_flight"); writer.Int(in_flight);
+          writer.String("queue_depth"); writer.Int(queue_depth);
+          writer.String("concurrency_limit"); writer.Int(limit);
+        }
+
+        if (_timeout_estimator != NULL)
+        {
+          writer.String("timeout_ms"); writer.Int(_timeout_estimator->get_timeout(it->host));
+        }
+      }
+      writer.EndObject();
+    }
+
+    writer.EndArray();
+
+    if (_acr_forwarder != NULL)
+    {
+      // ACRs that couldn't be delivered to any CCF.
+      writer.String("spool");
+      writer.StartObject();
+      {
+        writer.String("depth"); writer.Uint64(_acr_forwarder->spool_depth());
+        writer.String("oldest_age_ms"); writer.Uint64(_acr_forwarder->spool_age_ms());
+        writer.String("dropped"); writer.Uint64(_acr_forwarder->spool_dropped_count());
+        writer.String("spooled"); writer.Uint64(_acr_forwarder->spooled_count());
+        writer.String("replayed"); writer.Uint64(_acr_forwarder->replayed_count());
+        writer.String("replay_rate"); writer.Uint64(_acr_forwarder->replay_rate());
+      }
+      writer.EndObject();
+    }
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+// Clears every thread's cells.  An update racing with this may be lost or
+// counted after the reset, which doesn't matter for statistics.
+void PeerStatistics::reset()
+{
+  pthread_mutex_lock(&_lock);
+
+  for (std::vector<ThreadStats*>::const_iterator thread = _threads.begin();
+       thread != _threads.end();
+       ++thread)
+  {
+    pthread_mutex_lock(&(*thread)->lock);
+
+    for (std::map<std::string, PeerCells*>::iterator it = (*thread)->peers.begin();
+         it != (*thread)->peers.end();
+         ++it)
+    {
+      PeerCells& peer = *it->second;
+      peer.requests.store(0, std::memory_order_relaxed);
+      peer.responses.store(0, std::memory_order_relaxed);
+      peer.timeouts.store(0, std::memory_order_relaxed);
+      peer.unable_to_deliver.store(0, std::memory_order_relaxed);
+      peer.shed.store(0, std::memory_order_relaxed);
+      peer.failovers_out.store(0, std::memory_order_relaxed);
+      peer.failovers_in.store(0, std::memory_order_relaxed);
+
+      for (std::map<int, std::atomic<uint64_t>>::iterator rc = peer.result_codes.begin();
+           rc != peer.result_codes.end();
+           ++rc)
+      {
+        rc->second.store(0, std::memory_order_relaxed);
+      }
+
+      for (int ii = 0; ii < LatencyHistogram::NUM_BUCKETS; ii++)
+      {
+        peer.rtt_buckets[ii].store(0, std::memory_order_relaxed);
+      }
+
+      peer.rtt_max_us.store(0, std::memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&(*thread)->lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,141 @@
+/**
+ * @file peer_timeout_estimator.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "log.h"
+#include "peer_timeout_estimator.hpp"
+
+PeerTimeoutEstimator::PeerTimeoutEstimator(int floor_ms,
+                                           int ceiling_ms,
+                                           int margin_ms,
+                                           int percentile) :
+  _floor_ms(floor_ms),
+  _ceiling_ms(ceiling_ms),
+  _margin_ms(margin_ms),
+  _percentile(percentile)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+PeerTimeoutEstimator::~PeerTimeoutEstimator()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+int PeerTimeoutEstimator::get_timeout(const std::string& host)
+{
+  int timeout_ms = _ceiling_ms;
+
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, Peer>::iterator it = _peers.find(host);
+
+  if (it != _peers.end())
+  {
+    timeout_ms = it->second.timeout_ms;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return timeout_ms;
+}
+
+void PeerTimeoutEstimator::record_rtt(const std::string& host,
+                                      unsigned long rtt_us)
+{
+  record_sample(host, rtt_us);
+}
+
+void PeerTimeoutEstimator::record_timeout(const std::string& host,
+                                          int timeout_ms)
+{
+  record_sample(host, (unsigned long)timeout_ms * 1000);
+}
+
+void PeerTimeoutEstimator::record_sample(const std::string& host,
+                                         unsigned long rtt_us)
+{
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, Peer>::iterator it = _peers.find(host);
+
+  if (it == _peers.end())
+  {
+    Peer peer;
+    peer.rtts_us.reserve(WINDOW_SIZE);
+    peer.next = 0;
+    peer.samples_since_calculation = 0;
+    peer.timeout_ms = _ceiling_ms;
+    it = _peers.insert(std::make_pair(host, peer)).first;
+  }
+
+  Peer& peer = it->second;
+
+  if (peer.rtts_us.size() < (size_t)WINDOW_SIZE)
+  {
+    peer.rtts_us.push_back(rtt_us);
+  }
+  else
+  {
+    peer.rtts_us[peer.next] = rtt_us;
+    peer.next = (peer.next + 1) % WINDOW_SIZE;
+  }
+
+  peer.samples_since_calculation++;
+
+  if ((peer.rtts_us.size() >= (size_t)MIN_SAMPLES) &&
+      (peer.samples_since_calculation >= RECALCULATE_INTERVAL))
+  {
+    int old_timeout_ms = peer.timeout_ms;
+    peer.timeout_ms = calculate_timeout(peer);
+    peer.samples_since_calculation = 0;
+
+    if (peer.timeout_ms != old_timeout_ms)
+    {
+      TRC_DEBUG("Diameter timeout for %s is now %dms",
+                host.c_str(), peer.timeout_ms);
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+// Must be called with the lock held.
+int PeerTimeoutEstimator::calculate_timeout(const Peer& peer) const
+{
+  std::vector<unsigned long> rtts_us = peer.rtts_us;
+  size_t index = (rtts_us.size() * _percentile) / 100;
+
+  if (index >= rtts_us.size())
+  {
+    index = rtts_us.size() - 1;
+  }
+
+  std::nth_element(rtts_us.begin(), rtts_us.begin() + index, rtts_us.end());
+
+  // Round the RTT up to the next millisecond.
+  int timeout_ms = (int)((rtts_us[index] + 999) / 1000) + _margin_ms;
+
+  return std::min(std::max(timeout_ms, _floor_ms), _ceiling_ms);
+}
+
+std::vector<std::string> PeerTimeoutEstimator::peers()
+{
+  std::vector<std::string> hosts;
+
+  pthread_mutex_lock(&_lock);
+  for (std::map<std::string, Peer>::iterator it = _peers.begin();
+       it != _peers.end();
+       ++it)
+  {
+    hosts.push_back(it->first);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return hosts;
+}
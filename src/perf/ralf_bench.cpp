@@ -0,0 +1,279 @@
+/**
+ * @file ralf_bench.cpp Microbenchmarks for Ralf's per-request code paths
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// As well as the time per operation, each benchmark reports the number of
+// heap allocations and bytes allocated per operation, counted by replacing
+// the global operator new.
+
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#include <string>
+
+#include "benchmark/benchmark.h"
+#include "rapidjson/document.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include "diameterstack.h"
+#include "rf.h"
+#include "message.hpp"
+#include "handlers.hpp"
+#include "session_store.h"
+#include "session_manager.hpp"
+
+// Allocation counting.
+static std::atomic<uint64_t> alloc_count(0);
+static std::atomic<uint64_t> alloc_bytes(0);
+
+void* operator new(size_t size)
+{
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  void* ptr = malloc(size);
+
+  if (ptr == NULL)
+  {
+    throw std::bad_alloc();
+  }
+
+  return ptr;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept
+{
+  free(ptr);
+}
+
+// Counts the allocations made while a benchmark runs, and reports them per
+// iteration.
+class AllocationTracker
+{
+public:
+  AllocationTracker() :
+    _start_count(alloc_count.load()),
+    _start_bytes(alloc_bytes.load())
+  {
+  }
+
+  void report(benchmark::State& state)
+  {
+    double iterations = (state.iterations() > 0) ? state.iterations() : 1;
+    state.counters["allocs/op"] = (alloc_count.load() - _start_count) / iterations;
+    state.counters["bytes/op"] = (alloc_bytes.load() - _start_bytes) / iterations;
+  }
+
+private:
+  uint64_t _start_count;
+  uint64_t _start_bytes;
+};
+
+// The Diameter dictionary is needed to build ACRs.  This path is relative to
+// the src directory, which is where "make bench" runs the benchmarks from.
+static const std::string DIAMETER_CONF = "ut/diameterstack.conf";
+
+static Diameter::Stack* diameter_stack = NULL;
+static Rf::Dictionary* dict = NULL;
+
+// A typical body, as in docs/API.md.
+static const std::string TYPICAL_BODY =
+  "{\"peers\":{\"ccf\":[\"cdf.example.com\"]},"
+  "\"event\":{\"Accounting-Record-Type\":2,\"Acct-Interim-Interval\":600,"
+  "\"Event-Timestamp\":1444118158,"
+  "\"Service-Information\":{\"IMS-Information\":{"
+  "\"Event-Type\":{\"SIP-Method\":\"INVITE\"},\"Role-Of-Node\":1,\"Node-Functionality\":2,"
+  "\"User-Session-Id\":\"084972d9749c214876eb0ba4700ab1fa\","
+  "\"Calling-Party-Address\":[\"sip:6515550098@example.com\"],"
+  "\"Called-Party-Address\":\"sip:6515550026@example.com\","
+  "\"Time-Stamps\":{\"SIP-Request-Timestamp\":1444118158,\"SIP-Request-Timestamp-Fraction\":92},"
+  "\"Inter-Operator-Identifier\":[{\"Originating-IOI\":\"example.com\"}],"
+  "\"IMS-Charging-Identifier\":\"084972d9749c214876eb0ba4700ab1fa\","
+  "\"Server-Capabilities\":{\"Mandatory-Capability\":[],\"Optional-Capability\":[],"
+  "\"Server-Name\":[\"sip:sprout.example.com\"]},"
+  "\"From-Address\":\"<sip:6515550098@example.com>;tag=d8d2645dea83f80087c5a4b8167e59e1\"}}}}";
+
+// A large body, with many of the repeated fields filled in.
+static std::string large_body()
+{
+  rapidjson::Document doc;
+  doc.Parse<0>(TYPICAL_BODY.c_str());
+  rapidjson::Value& ims_info = doc["event"]["Service-Information"]["IMS-Information"];
+
+  for (int ii = 0; ii < 32; ii++)
+  {
+    std::string uri = "sip:65155500" + std::to_string(ii) + "@example.com";
+    rapidjson::Value address(uri.c_str(), doc.GetAllocator());
+    ims_info["Calling-Party-Address"].PushBack(address, doc.GetAllocator());
+  }
+
+  for (int ii = 0; ii < 8; ii++)
+  {
+    std::string ioi = "ioi" + std::to_string(ii) + ".example.com";
+    rapidjson::Value entry(rapidjson::kObjectType);
+    entry.AddMember("Terminating-IOI",
+                    rapidjson::Value(ioi.c_str(), doc.GetAllocator()),
+                    doc.GetAllocator());
+    ims_info["Inter-Operator-Identifier"].PushBack(entry, doc.GetAllocator());
+
+    std::string server = "sip:as" + std::to_string(ii) + ".example.com";
+    rapidjson::Value server_name(server.c_str(), doc.GetAllocator());
+    ims_info["Server-Capabilities"]["Server-Name"].PushBack(server_name, doc.GetAllocator());
+  }
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  doc.Accept(writer);
+  return sb.GetString();
+}
+
+static const std::string& body_for(int size)
+{
+  static const std::string large = large_body();
+  return (size == 0) ? TYPICAL_BODY : large;
+}
+
+// Benchmarks take an argument of 0 for the typical body and 1 for the large
+// one.
+static void BM_ParseBody(benchmark::State& state)
+{
+  const std::string& body = body_for(state.range(0));
+  AllocationTracker tracker;
+
+  while (state.KeepRunning())
+  {
+    Message* msg = NULL;
+    BillingTask::parse_body("call-id", false, body, &msg, 0);
+    delete msg;
+  }
+
+  tracker.report(state);
+}
+BENCHMARK(BM_ParseBody)->Arg(0)->Arg(1);
+
+static void BM_AccountingRequest(benchmark::State& state)
+{
+  rapidjson::Document doc;
+  doc.Parse<0>(body_for(state.range(0)).c_str());
+  const rapidjson::Value& event = doc["event"];
+  AllocationTracker tracker;
+
+  while (state.KeepRunning())
+  {
+    Rf::AccountingRequest acr(dict,
+                              diameter_stack,
+                              "ralf.example.com;1234567890;1",
+                              "cdf.example.com",
+                              "example.com",
+                              1,
+                              event);
+    benchmark::DoNotOptimize(acr.fd_msg());
+  }
+
+  tracker.report(state);
+}
+BENCHMARK(BM_AccountingRequest)->Arg(0)->Arg(1);
+
+static void BM_SessionRoundTrip(benchmark::State& state)
+{
+  SessionStore::JsonSerializerDeserializer serializer;
+  SessionStore::Session session;
+  session.session_id = "ralf.example.com;1234567890;1";
+  session.ccf.push_back("cdf1.example.com");
+  session.ccf.push_back("cdf2.example.com");
+  session.acct_record_number = 2;
+  session.timer_id = "1234567890123456-1";
+  session.session_refresh_time = 600;
+  session.interim_interval = 300;
+  AllocationTracker tracker;
+
+  while (state.KeepRunning())
+  {
+    std::string data = serializer.serialize_session(&session);
+    delete serializer.deserialize_session(data);
+  }
+
+  tracker.report(state);
+}
+BENCHMARK(BM_SessionRoundTrip);
+
+static void BM_CreateKey(benchmark::State& state)
+{
+  std::string call_id = "084972d9749c214876eb0ba4700ab1fa@example.com";
+  AllocationTracker tracker;
+
+  while (state.KeepRunning())
+  {
+    benchmark::DoNotOptimize(SessionStore::create_key(call_id, TERMINATING, PCSCF));
+  }
+
+  tracker.report(state);
+}
+BENCHMARK(BM_CreateKey);
+
+static void BM_CreateOpaqueData(benchmark::State& state)
+{
+  rapidjson::Document* doc = new rapidjson::Document();
+  doc->Parse<0>(TYPICAL_BODY.c_str());
+  Message msg("call-id",
+              TERMINATING,
+              PCSCF,
+              doc,
+              Rf::AccountingRecordType(2),
+              600,
+              0);
+  AllocationTracker tracker;
+
+  while (state.KeepRunning())
+  {
+    benchmark::DoNotOptimize(SessionManager::create_opaque_data(&msg));
+  }
+
+  tracker.report(state);
+}
+BENCHMARK(BM_CreateOpaqueData);
+
+int main(int argc, char** argv)
+{
+  benchmark::Initialize(&argc, argv);
+
+  diameter_stack = Diameter::Stack::get_instance();
+  diameter_stack->initialize();
+  diameter_stack->configure(DIAMETER_CONF, NULL);
+  dict = new Rf::Dictionary();
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  diameter_stack->stop();
+  diameter_stack->wait_stopped();
+  delete dict; dict = NULL;
+
+  return 0;
+}
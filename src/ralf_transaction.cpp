@@ -14,7 +14,7 @@
 
 void RalfTransaction::on_timeout()
 {
-  _peer_sender->send_cb(ER_DIAMETER_UNABLE_TO_DELIVER, 0, "");
+  _peer_sender->timeout_cb();
 }
 
 // Handles the Accounting-Control-Answer from the CCF, parsing out the data the SessionManager needs.
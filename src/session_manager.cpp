@@ -9,8 +9,10 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <stdio.h>
 #include <string>
 #include <map>
+#include <algorithm>
 
 #include "utils.h"
 #include "message.hpp"
@@ -21,6 +23,7 @@
 #include "sas.h"
 #include "ralfsasevent.h"
 #include "peer_message_sender_factory.hpp"
+#include "ralf_hash.hpp"
 #include "rapidjson/document.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
@@ -30,6 +33,8 @@ static const std::string NO_TIMER = "NO_TIMER";
 
 void SessionManager::handle(Message* msg)
 {
+  // Let the session stores and Chronos mark the message's timeline.
+  FlightRecorder::CurrentTimeline current_timeline(&msg->timeline);
   SessionStore::Session* sess = NULL;
 
   // This flag is used to add a session from a store in one site to another
@@ -37,7 +42,16 @@ void SessionManager::handle(Message* msg)
   // add the session to the store with a CAS of 0.
   bool new_session = false;
 
-  if (msg->record_type.isInterim() || msg->record_type.isStop())
+  if (msg->timer_interim && msg->record_type.isInterim())
+  {
+    if (!read_session_for_timer_pop(msg))
+    {
+      current_timeline.clear();
+      delete msg; msg = NULL;
+      return;
+    }
+  }
+  else if (msg->record_type.isInterim() || msg->record_type.isStop())
   {
     // This relates to an existing session
     sess = _local_store->get_session_data(msg->call_id,
@@ -66,6 +80,7 @@ void SessionManager::handle(Message* msg)
       {
         // No record of the session - ignore the request
         TRC_INFO("Session for %s not found in database, ignoring message", msg->call_id.c_str());
+        current_timeline.clear();
         delete msg; msg = NULL;
         return;
       }
@@ -162,8 +177,11 @@ void SessionManager::handle(Message* msg)
 
       TRC_INFO("Received STOP for session %s, deleting session and timer using timer ID %s", msg->call_id.c_str(), sess->timer_id.c_str());
 
-      if (sess->timer_id != "NO_TIMER")
+      if ((sess->timer_id != "NO_TIMER") &&
+          ((_timer_queue == NULL) ||
+           (!_timer_queue->send_delete(sess->timer_id, msg->trail))))
       {
+        StageStatistics::StageTimer timer(_stats, StageStatistics::CHRONOS);
         _timer_conn->send_delete(sess->timer_id,
                                  msg->trail);
       }
@@ -195,12 +213,15 @@ void SessionManager::handle(Message* msg)
     msg->accounting_record_number = 1;
   };
 
-  // go to the Diameter stack
+  // go to the Diameter stack.  The message may be deleted as soon as it is
+  // sent, so stop marking its timeline.
+  current_timeline.clear();
   PeerMessageSender* pm = _factory->newSender(msg->trail); // self-deleting
   pm->send(msg, this, _dict, _diameter_stack);
 }
 
-std::string SessionManager::create_opaque_data(Message* msg)
+// Builds the body of an INTERIM timer for the given role and function.
+static std::string build_opaque_data(int role, int function)
 {
   // Create the doc object so we can share the allocator during construction
   // of the child objects.  This prevents huge numbers of re-allocs.
@@ -209,8 +230,8 @@ std::string SessionManager::create_opaque_data(Message* msg)
 
   // The IMS-Information object
   rapidjson::Value ims_info(rapidjson::kObjectType);
-  ims_info.AddMember("Role-Of-Node", msg->role, doc.GetAllocator());
-  ims_info.AddMember("Node-Functionality", msg->function, doc.GetAllocator());
+  ims_info.AddMember("Role-Of-Node", role, doc.GetAllocator());
+  ims_info.AddMember("Node-Functionality", function, doc.GetAllocator());
 
   // The Service-Information object
   rapidjson::Value service_info(rapidjson::kObjectType);
@@ -228,13 +249,275 @@ std::string SessionManager::create_opaque_data(Message* msg)
   rapidjson::StringBuffer s;
   rapidjson::Writer<rapidjson::StringBuffer> w(s);
   doc.Accept(w);
-  std::string body = s.GetString();
+  return s.GetString();
+}
+
+// The bodies of INTERIM timers for every valid role and function, built
+// once, the first time a timer is set.
+struct OpaqueDataTable
+{
+  static const int NUM_ROLES = TERMINATING + 1;
+  static const int NUM_FUNCTIONS = ATCF + 1;
+
+  OpaqueDataTable()
+  {
+    for (int role = 0; role < NUM_ROLES; role++)
+    {
+      for (int function = 0; function < NUM_FUNCTIONS; function++)
+      {
+        bodies[role][function] = build_opaque_data(role, function);
+      }
+    }
+  }
+
+  std::string bodies[NUM_ROLES][NUM_FUNCTIONS];
+};
+
+std::string SessionManager::create_opaque_data(Message* msg)
+{
+  int role = msg->role;
+  int function = msg->function;
+  std::string body;
+
+  if ((role >= 0) && (role < OpaqueDataTable::NUM_ROLES) &&
+      (function >= 0) && (function < OpaqueDataTable::NUM_FUNCTIONS))
+  {
+    static const OpaqueDataTable table;
+    body = table.bodies[role][function];
+  }
+  else
+  {
+    // parse_body accepts any role and function, so build bodies for ones
+    // that aren't in the table as we need them.
+    body = build_opaque_data(role, function);
+  }
 
   TRC_DEBUG("Built INTERIM request body: %s", body.c_str());
 
   return body;
 }
 
+uint32_t SessionManager::timer_interval(Message* msg,
+                                        uint32_t interim_interval,
+                                        uint32_t jitter)
+{
+  jitter = std::min(jitter, interim_interval / 4);
+
+  if (jitter == 0)
+  {
+    return interim_interval;
+  }
+
+  // The offset must be the same on every Ralf.
+  std::string key = msg->call_id + " " + std::to_string(msg->role) + " " +
+                    std::to_string(msg->function);
+  return interim_interval - (RalfHash::fnv1a(key) % (jitter + 1));
+}
+
+// Fills in a timer pop from the session in the local store (or, failing
+// that, a remote store), and takes the next accounting record number for it
+// in the local store.  The remote stores are brought up to date once the CDF
+// has answered, so they don't hold up the INTERIM.
+bool SessionManager::read_session_for_timer_pop(Message* msg)
+{
+  bool first_read = true;
+
+  while (true)
+  {
+    bool new_session = false;
+    SessionStore::Session* sess = _local_store->get_session_data(msg->call_id,
+                                                                 msg->role,
+                                                                 msg->function,
+                                                                 msg->trail);
+
+    for (std::vector<SessionStore*>::iterator it = _remote_stores.begin();
+         (it != _remote_stores.end()) && (sess == NULL);
+         ++it)
+    {
+      new_session = true;
+      sess = (*it)->get_session_data(msg->call_id,
+                                     msg->role,
+                                     msg->function,
+                                     msg->trail);
+    }
+
+    if (sess == NULL)
+    {
+      // No record of the session - ignore the request
+      TRC_INFO("Session for %s not found in database, ignoring timer pop", msg->call_id.c_str());
+      return false;
+    }
+
+    // Chronos can pop a timer twice while its cluster is resized.  A pop
+    // within half the session's interim interval of the last one must be a
+    // repeat, as the timer is never set shorter than that.  Only check once,
+    // not again if we have to read the session again.
+    if ((first_read) &&
+        (_duplicates != NULL) &&
+        (_duplicates->check_within(DuplicateCache::timer_pop_key(msg->call_id,
+                                                                 msg->role,
+                                                                 msg->function),
+                                   (uint64_t)sess->interim_interval * 1000 / 2)))
+    {
+      TRC_INFO("Ignoring repeated timer pop for %s", msg->call_id.c_str());
+
+      if (_stats != NULL)
+      {
+        _stats->incr_counter(StageStatistics::DUPLICATES_SUPPRESSED);
+      }
+
+      delete sess; sess = NULL;
+      return false;
+    }
+
+    first_read = false;
+    sess->acct_record_number += 1;
+    Store::Status rc = _local_store->set_session_data(msg->call_id,
+                                                      msg->role,
+                                                      msg->function,
+                                                      sess,
+                                                      new_session,
+                                                      msg->trail);
+
+    if (rc != Store::Status::DATA_CONTENTION)
+    {
+      msg->accounting_record_number = sess->acct_record_number;
+      msg->ccfs = sess->ccf;
+      msg->session_id = sess->session_id;
+      msg->timer_id = sess->timer_id;
+      msg->interim_interval = sess->interim_interval;
+
+      if (msg->session_refresh_time == 0)
+      {
+        msg->session_refresh_time = sess->session_refresh_time;
+      }
+
+      delete sess; sess = NULL;
+      return true;
+    }
+
+    // Someone has written conflicting data since we read this, so try again.
+    delete sess; sess = NULL; // LCOV_EXCL_LINE - no conflicts in UT
+  }
+}
+
+// Finishes a timer pop once the CDF has answered.  A timer pop never changes
+// the INTERIM timer, so this only needs to bring the stores up to date.
+void SessionManager::on_timer_pop_response(bool accepted, int rc, Message* msg)
+{
+  if (accepted)
+  {
+    _health_checker->health_check_passed();
+  }
+  else
+  {
+    TRC_WARNING("Session for %s received error (%d) from CDF", msg->call_id.c_str(), rc);
+
+    if (rc == 5002)
+    {
+      // 5002 means the CDF has no record of this session. It's pointless to send any
+      // more messages - delete the session from the store.
+      TRC_INFO("Session for %s received 5002 error from CDF, deleting", msg->call_id.c_str());
+      delete_session(msg);
+      return;
+    }
+  }
+
+  // Whatever the CDF said, the accounting record number has been used, so
+  // bring the remote stores up to date, putting the session back where it
+  // has been lost.  If it has gone from the local store, though, a STOP has
+  // ended it while we waited for the CDF, and it mustn't be put back.
+  if (!_remote_stores.empty())
+  {
+    SessionStore::Session* sess = _local_store->get_session_data(msg->call_id,
+                                                                 msg->role,
+                                                                 msg->function,
+                                                                 msg->trail);
+
+    if (sess == NULL)
+    {
+      TRC_DEBUG("Session for %s has ended, not updating remote stores",
+                msg->call_id.c_str());
+      return;
+    }
+
+    delete sess; sess = NULL;
+    write_back_record_number(msg, _remote_stores, true);
+  }
+}
+
+// Deletes the message's session from the local and remote stores.
+void SessionManager::delete_session(Message* msg)
+{
+  _local_store->delete_session_data(msg->call_id,
+                                    msg->role,
+                                    msg->function,
+                                    msg->trail);
+
+  for (std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
+       remote_store != _remote_stores.end();
+       ++remote_store)
+  {
+    (*remote_store)->delete_session_data(msg->call_id,
+                                         msg->role,
+                                         msg->function,
+                                         msg->trail);
+  }
+}
+
+// Raise the accounting record number in each of the stores to the one we've
+// just sent.  This is best effort - if the session already has a later
+// number it is left alone, and if it has gone it is only put back (from the
+// message) if restore is set.
+void SessionManager::write_back_record_number(Message* msg,
+                                              const std::vector<SessionStore*>& stores,
+                                              bool restore)
+{
+  for (std::vector<SessionStore*>::const_iterator store = stores.begin();
+       store != stores.end();
+       ++store)
+  {
+    Store::Status rc = Store::Status::DATA_CONTENTION;
+
+    while (rc == Store::Status::DATA_CONTENTION)
+    {
+      SessionStore::Session* sess = (*store)->get_session_data(msg->call_id,
+                                                               msg->role,
+                                                               msg->function,
+                                                               msg->trail);
+      bool new_session = false;
+
+      if ((sess == NULL) && (restore))
+      {
+        sess = new SessionStore::Session();
+        sess->session_id = msg->session_id;
+        sess->ccf = msg->ccfs;
+        sess->timer_id = msg->timer_id;
+        sess->session_refresh_time = msg->session_refresh_time;
+        sess->interim_interval = msg->interim_interval;
+        sess->acct_record_number = 0;
+        new_session = true;
+      }
+
+      if ((sess == NULL) ||
+          (sess->acct_record_number >= msg->accounting_record_number))
+      {
+        delete sess; sess = NULL;
+        break;
+      }
+
+      sess->acct_record_number = msg->accounting_record_number;
+      rc = (*store)->set_session_data(msg->call_id,
+                                      msg->role,
+                                      msg->function,
+                                      sess,
+                                      new_session,
+                                      msg->trail);
+      delete sess; sess = NULL;
+    }
+  }
+}
+
 // This function generates a SAS event based on the response from the CCF. This
 // describes the *logical* impact of the event (other events cover the protocol
 // flows).
@@ -280,8 +563,19 @@ void SessionManager::on_ccf_response(bool accepted,
                                      int rc,
                                      Message* msg)
 {
+  FlightRecorder::CurrentTimeline current_timeline(&msg->timeline);
   sas_log_ccf_response(accepted, session_id, msg);
 
+  if (msg->timer_interim)
+  {
+    // Timer pops don't touch the timer, so skip working out its interval and
+    // body.
+    on_timer_pop_response(accepted, rc, msg);
+    current_timeline.clear();
+    delete msg; msg = NULL;
+    return;
+  }
+
   if (interim_interval == 0)
   {
     // No interim interval was set on the response. Use the interval from the store
@@ -292,24 +586,32 @@ void SessionManager::on_ccf_response(bool accepted,
 
   if (accepted)
   {
+    // Successful ACAs are an indication of healthy behaviour
+    _health_checker->health_check_passed();
+
     if (msg->record_type.isInterim() &&
-        (!msg->timer_interim) &&
         (msg->session_refresh_time > interim_interval))
     {
       // Interim message generated by Sprout, so update a timer to generate recurring INTERIMs
+      SAS::Event updated_timer(msg->trail, SASEvent::INTERIM_TIMER_RENEWED, 0);
+      updated_timer.add_static_param(interim_interval);
+      SAS::report_event(updated_timer);
+
+      if (queue_interim_timer(msg, interim_interval, session_id))
+      {
+        current_timeline.clear();
+        return;
+      }
+
       std::string timer_id = msg->timer_id;
 
       send_chronos_update(timer_id,
-                          interim_interval,
+                          timer_interval(msg, interim_interval, _interim_timer_jitter),
                           msg->session_refresh_time,
-                          "/call-id/"+Utils::url_escape(msg->call_id)+"?timer-interim=true",
+                          msg->callback_uri(),
                           create_opaque_data(msg),
                           msg->trail);
 
-      SAS::Event updated_timer(msg->trail, SASEvent::INTERIM_TIMER_RENEWED, 0);
-      updated_timer.add_static_param(interim_interval);
-      SAS::report_event(updated_timer);
-
       // Update the timer_id if it has changed
       if (timer_id != msg->timer_id)
       {
@@ -323,16 +625,34 @@ void SessionManager::on_ccf_response(bool accepted,
       // Set the timer id initially to NO_TIMER - this isn't included in the path of the POST
       std::string timer_id = NO_TIMER;
       std::map<std::string, uint32_t> tags; tags["CALL"] = 1;
+      bool stored = false;
 
       if (msg->session_refresh_time > interim_interval)
       {
+         if (_timer_queue != NULL)
+         {
+           // Write the session before queueing its timer, so that an INTERIM
+           // or STOP that arrives before Chronos answers finds it.  Its timer
+           // ID is filled in once Chronos has answered.
+           store_new_session(msg, session_id, interim_interval, NO_TIMER);
+           stored = true;
+
+           if (queue_interim_timer(msg, interim_interval, session_id))
+           {
+             current_timeline.clear();
+             return;
+           }
+         }
+
+         StageStatistics::StageTimer timer(_stats, StageStatistics::CHRONOS);
          HTTPCode status = _timer_conn->send_post(timer_id,  // Chronos returns a timer ID which is filled in to this parameter
-                                                  interim_interval, // interval
+                                                  timer_interval(msg, interim_interval, _interim_timer_jitter), // interval
                                                   msg->session_refresh_time, // repeat-for
-                                                  "/call-id/"+Utils::url_escape(msg->call_id)+"?timer-interim=true",
+                                                  msg->callback_uri(),
                                                   create_opaque_data(msg),
                                                   msg->trail,
                                                   tags);
+         timer.stop();
 
          if (status == HTTP_OK)
          {
@@ -348,43 +668,17 @@ void SessionManager::on_ccf_response(bool accepted,
          }
       };
 
-      TRC_INFO("Writing session to store");
-      SessionStore::Session* sess = new SessionStore::Session();
-      sess->session_id = session_id;
-      sess->interim_interval = interim_interval;
-
-      sess->timer_id = timer_id;
-      msg->timer_id = timer_id;
-
-      sess->ccf = msg->ccfs;
-      sess->acct_record_number = msg->accounting_record_number;
-      sess->session_refresh_time = msg->session_refresh_time;
-
-      // Do this unconditionally - if it fails, this processing has already been done elsewhere
-      _local_store->set_session_data(msg->call_id,
-                                     msg->role,
-                                     msg->function,
-                                     sess,
-                                     true,
-                                     msg->trail);
-
-      for (std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
-           remote_store != _remote_stores.end();
-           ++remote_store)
+      if (!stored)
       {
-        (*remote_store)->set_session_data(msg->call_id,
-                                          msg->role,
-                                          msg->function,
-                                          sess,
-                                          true,
-                                          msg->trail);
+        store_new_session(msg, session_id, interim_interval, timer_id);
+      }
+      else if (timer_id != NO_TIMER)
+      {
+        // LCOV_EXCL_START - the queue is never full in UT
+        record_new_timer(msg, timer_id);
+        // LCOV_EXCL_STOP
       }
-
-      delete sess; sess = NULL;
     }
-
-    // Successful ACAs are an indication of healthy behaviour
-    _health_checker->health_check_passed();
   }
   else
   {
@@ -397,22 +691,9 @@ void SessionManager::on_ccf_response(bool accepted,
         // 5002 means the CDF has no record of this session. It's pointless to send any
         // more messages - delete the session from the store.
         TRC_INFO("Session for %s received 5002 error from CDF, deleting", msg->call_id.c_str());
-        _local_store->delete_session_data(msg->call_id,
-                                          msg->role,
-                                          msg->function,
-                                          msg->trail);
-
-        for (std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
-             remote_store != _remote_stores.end();
-             ++remote_store)
-        {
-          (*remote_store)->delete_session_data(msg->call_id,
-                                               msg->role,
-                                               msg->function,
-                                               msg->trail);
-        }
+        delete_session(msg);
       }
-      else if (!msg->timer_interim)
+      else
       {
         // Interim failed, but the CDF probably still knows about the session,
         // so keep sending them. We don't do this for START - if a START fails we don't record the session.
@@ -421,11 +702,17 @@ void SessionManager::on_ccf_response(bool accepted,
         {
           TRC_INFO("Received INTERIM for session %s, updating timer using timer ID %s", msg->call_id.c_str(), msg->timer_id.c_str());
 
+          if (queue_interim_timer(msg, interim_interval, session_id))
+          {
+            current_timeline.clear();
+            return;
+          }
+
           std::string timer_id = msg->timer_id;
           send_chronos_update(timer_id,
-                              interim_interval,
+                              timer_interval(msg, interim_interval, _interim_timer_jitter),
                               msg->session_refresh_time,
-                              "/call-id/"+Utils::url_escape(msg->call_id)+"?timer-interim=true",
+                              msg->callback_uri(),
                               create_opaque_data(msg),
                               msg->trail);
 
@@ -440,9 +727,219 @@ void SessionManager::on_ccf_response(bool accepted,
   }
 
   // Everything is finished and we're the last holder of the Message object - delete it.
+  current_timeline.clear();
   delete msg; msg = NULL;
 }
 
+// Write a new session to the local and remote stores.
+void SessionManager::store_new_session(Message* msg,
+                                       const std::string& session_id,
+                                       uint32_t interim_interval,
+                                       const std::string& timer_id)
+{
+  TRC_INFO("Writing session to store");
+  SessionStore::Session* sess = new SessionStore::Session();
+  sess->session_id = session_id;
+  sess->interim_interval = interim_interval;
+
+  sess->timer_id = timer_id;
+  msg->timer_id = timer_id;
+
+  sess->ccf = msg->ccfs;
+  sess->acct_record_number = msg->accounting_record_number;
+  sess->session_refresh_time = msg->session_refresh_time;
+
+  // Do this unconditionally - if it fails, this processing has already been done elsewhere
+  _local_store->set_session_data(msg->call_id,
+                                 msg->role,
+                                 msg->function,
+                                 sess,
+                                 true,
+                                 msg->trail);
+
+  for (std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
+       remote_store != _remote_stores.end();
+       ++remote_store)
+  {
+    (*remote_store)->set_session_data(msg->call_id,
+                                      msg->role,
+                                      msg->function,
+                                      sess,
+                                      true,
+                                      msg->trail);
+  }
+
+  delete sess; sess = NULL;
+}
+
+// A timer operation queued on behalf of a message.  Once Chronos has
+// answered, it finishes handling the message.
+class SessionManager::TimerCompletion : public ChronosQueue::Callback
+{
+public:
+  TimerCompletion(SessionManager* mgr,
+                  Message* msg,
+                  uint32_t interim_interval) :
+    _mgr(mgr),
+    _msg(msg),
+    _interim_interval(interim_interval)
+  {
+  }
+
+  void on_timer_complete(HTTPCode rc, const std::string& timer_id)
+  {
+    _mgr->on_timer_complete(rc, timer_id, _interim_interval, _msg);
+    delete this;
+  }
+
+private:
+  SessionManager* _mgr;
+  Message* _msg;
+  uint32_t _interim_interval;
+};
+
+bool SessionManager::queue_interim_timer(Message* msg,
+                                         uint32_t interim_interval,
+                                         const std::string& session_id)
+{
+  if (_timer_queue == NULL)
+  {
+    return false;
+  }
+
+  // A START always creates a new timer.  Otherwise we update the session's
+  // timer, unless creating it failed, in which case we try again.
+  std::string timer_id = msg->record_type.isStart() ? NO_TIMER : msg->timer_id;
+  ChronosQueue::Method method = (timer_id == NO_TIMER) ? ChronosQueue::POST :
+                                                         ChronosQueue::PUT;
+  std::map<std::string, uint32_t> tags {{"CALL", 1}};
+  TimerCompletion* completion = new TimerCompletion(this, msg, interim_interval);
+
+  if (!_timer_queue->send(method,
+                          timer_id,
+                          timer_interval(msg, interim_interval, _interim_timer_jitter),
+                          msg->session_refresh_time,
+                          msg->callback_uri(),
+                          create_opaque_data(msg),
+                          msg->trail,
+                          tags,
+                          completion))
+  {
+    // The queue is full, so the caller sends the request itself.
+    delete completion; completion = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+void SessionManager::on_timer_complete(HTTPCode rc,
+                                       const std::string& timer_id,
+                                       uint32_t interim_interval,
+                                       Message* msg)
+{
+  FlightRecorder::CurrentTimeline current_timeline(&msg->timeline);
+
+  if (msg->record_type.isStart())
+  {
+    if (rc == HTTP_OK)
+    {
+      SAS::Event new_timer(msg->trail, SASEvent::INTERIM_TIMER_CREATED, 0);
+      new_timer.add_static_param(interim_interval);
+      SAS::report_event(new_timer);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Chronos POST failed");
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  if (msg->timer_id == NO_TIMER)
+  {
+    // We created a new timer.  Another message may have done the same while
+    // we waited for Chronos, so only keep it if the session still has none.
+    if (timer_id != NO_TIMER)
+    {
+      record_new_timer(msg, timer_id);
+    }
+  }
+  else if (timer_id != msg->timer_id)
+  {
+    // Update the timer_id if it has changed
+    update_timer_id(msg, timer_id);
+  }
+
+  current_timeline.clear();
+  delete msg; msg = NULL;
+}
+
+// Fill in the ID of the timer created for a new session, which was written
+// to the stores before the timer was created.  If the session has ended, or
+// has got another timer, in the meantime, the timer isn't wanted, so delete
+// it.
+void SessionManager::record_new_timer(Message* msg, const std::string& timer_id)
+{
+  std::vector<SessionStore*> stores = {_local_store};
+  stores.insert(stores.end(),
+                _remote_stores.begin(),
+                _remote_stores.end());
+  bool recorded = false;
+
+  for (std::vector<SessionStore*>::iterator store = stores.begin();
+       store != stores.end();
+       ++store)
+  {
+    Store::Status rc = Store::Status::DATA_CONTENTION;
+
+    while (rc == Store::Status::DATA_CONTENTION)
+    {
+      SessionStore::Session* sess = (*store)->get_session_data(msg->call_id,
+                                                               msg->role,
+                                                               msg->function,
+                                                               msg->trail);
+
+      if ((sess == NULL) || (sess->timer_id != NO_TIMER))
+      {
+        delete sess; sess = NULL;
+        break;
+      }
+
+      sess->timer_id = timer_id;
+      rc = (*store)->set_session_data(msg->call_id,
+                                      msg->role,
+                                      msg->function,
+                                      sess,
+                                      false,
+                                      msg->trail);
+      delete sess; sess = NULL;
+
+      if (rc == Store::Status::OK)
+      {
+        recorded = true;
+      }
+    }
+  }
+
+  if (recorded)
+  {
+    msg->timer_id = timer_id;
+  }
+  else
+  {
+    TRC_INFO("Session for %s no longer needs timer %s, deleting it",
+             msg->call_id.c_str(), timer_id.c_str());
+
+    if ((_timer_queue == NULL) ||
+        (!_timer_queue->send_delete(timer_id, msg->trail)))
+    {
+      StageStatistics::StageTimer timer(_stats, StageStatistics::CHRONOS);
+      _timer_conn->send_delete(timer_id, msg->trail);
+    }
+  }
+}
+
 // Update the timer ID for the session. This is a best effect change - if there's
 // contention then this update will fail
 void SessionManager::update_timer_id(Message* msg, std::string timer_id)
@@ -485,6 +982,7 @@ void SessionManager::send_chronos_update(std::string& timer_id,
                                          SAS::TrailId trail)
 {
   std::map<std::string, uint32_t> tags {{"CALL", 1}};
+  StageStatistics::StageTimer timer(_stats, StageStatistics::CHRONOS);
 
   if (timer_id == NO_TIMER)
   {
@@ -17,15 +17,60 @@
 #include "log.h"
 #include "json_parse_utils.h"
 #include "ralfsasevent.h"
-
-SessionStore::SessionStore(Store* store) : _store(store)
+#include "ralf_time.hpp"
+
+// The key read to find out whether a store that is down has come back.
+static const std::string PROBE_KEY = "circuit-breaker-probe";
+
+SessionStore::SessionStore(Store* store,
+                           StageStatistics* stats,
+                           StageStatistics::Stage stage,
+                           int breaker_threshold,
+                           int probe_interval_ms) :
+  _store(store),
+  _stats(stats),
+  _stage(stage),
+  _breaker_threshold(breaker_threshold),
+  _probe_interval_ms(probe_interval_ms),
+  _failures(0),
+  _open(false),
+  _terminated(false),
+  _probe_thread_running(false)
 {
+  pthread_mutex_init(&_in_flight_lock, NULL);
+  pthread_mutex_init(&_breaker_lock, NULL);
+  RalfTime::init_cond(&_breaker_cond);
   _serializer = new JsonSerializerDeserializer();
   _deserializers.push_back(new JsonSerializerDeserializer());
+
+  if (_breaker_threshold > 0)
+  {
+    int rc = pthread_create(&_probe_thread, NULL, probe_thread_fn, this);
+
+    if (rc == 0)
+    {
+      _probe_thread_running = true;
+    }
+    else
+    {
+      TRC_ERROR("Failed to start session store probe thread (%d)", rc); // LCOV_EXCL_LINE
+    }
+  }
 }
 
 SessionStore::~SessionStore()
 {
+  if (_probe_thread_running)
+  {
+    pthread_mutex_lock(&_breaker_lock);
+    _terminated = true;
+    pthread_cond_signal(&_breaker_cond);
+    pthread_mutex_unlock(&_breaker_lock);
+
+    pthread_join(_probe_thread, NULL);
+    _probe_thread_running = false;
+  }
+
   delete _serializer; _serializer = NULL;
 
   for(std::vector<JsonSerializerDeserializer*>::iterator it = _deserializers.begin();
@@ -34,6 +79,10 @@ SessionStore::~SessionStore()
   {
     delete *it; *it = NULL;
   }
+
+  pthread_cond_destroy(&_breaker_cond);
+  pthread_mutex_destroy(&_breaker_lock);
+  pthread_mutex_destroy(&_in_flight_lock);
 }
 
 SessionStore::Session* SessionStore::get_session_data(const std::string& call_id,
@@ -42,17 +91,105 @@ SessionStore::Session* SessionStore::get_session_data(const std::string& call_id
                                                       SAS::TrailId trail)
 {
   std::string key = create_key(call_id, role, function);
+
+  if (skip_request(key))
+  {
+    return NULL;
+  }
+
+  if (_stats != NULL)
+  {
+    _stats->incr_counter(StageStatistics::SESSION_READS);
+  }
+
+  pthread_mutex_lock(&_in_flight_lock);
+  std::map<std::string, InFlightRead*>::iterator it = _in_flight.find(key);
+
+  if (it != _in_flight.end())
+  {
+    // Another thread is already reading this session, so share its result.
+    TRC_DEBUG("Waiting for read of session data for %s", key.c_str());
+
+    if (_stats != NULL)
+    {
+      _stats->incr_counter(StageStatistics::SESSION_READS_COALESCED);
+    }
+
+    return wait_for_read(it->second);
+  }
+
+  InFlightRead* read = new InFlightRead();
+  pthread_cond_init(&read->cond, NULL);
+  read->done = false;
+  read->session = NULL;
+  read->waiters = 0;
+  _in_flight[key] = read;
+  pthread_mutex_unlock(&_in_flight_lock);
+
+  Session* session = read_session_data(call_id, key, trail);
+
+  pthread_mutex_lock(&_in_flight_lock);
+  _in_flight.erase(key);
+
+  if (read->waiters == 0)
+  {
+    pthread_cond_destroy(&read->cond);
+    delete read; read = NULL;
+  }
+  else
+  {
+    // Hand a copy to the waiting threads.
+    read->session = (session != NULL) ? new Session(*session) : NULL;
+    read->done = true;
+    pthread_cond_broadcast(&read->cond);
+  }
+
+  pthread_mutex_unlock(&_in_flight_lock);
+  return session;
+}
+
+// Called with the in-flight lock held, which is released before returning.
+SessionStore::Session* SessionStore::wait_for_read(InFlightRead* read)
+{
+  read->waiters++;
+
+  while (!read->done)
+  {
+    pthread_cond_wait(&read->cond, &_in_flight_lock);
+  }
+
+  Session* session = (read->session != NULL) ? new Session(*read->session) : NULL;
+  read->waiters--;
+
+  if (read->waiters == 0)
+  {
+    delete read->session; read->session = NULL;
+    pthread_cond_destroy(&read->cond);
+    delete read; read = NULL;
+  }
+
+  pthread_mutex_unlock(&_in_flight_lock);
+  return session;
+}
+
+SessionStore::Session* SessionStore::read_session_data(const std::string& call_id,
+                                                       const std::string& key,
+                                                       SAS::TrailId trail)
+{
   TRC_DEBUG("Retrieving session data for %s", key.c_str());
   Session* session = NULL;
 
   std::string data;
   uint64_t cas;
+  StageStatistics::StageTimer timer(_stats, _stage);
   Store::Status status = _store->get_data("session",
                                           key,
                                           data,
                                           cas,
                                           trail,
                                           Store::Format::JSON);
+  timer.stop();
+  record_status(status);
 
   if (status == Store::Status::OK && !data.empty())
   {
@@ -94,6 +231,12 @@ Store::Status SessionStore::set_session_data(const std::string& call_id,
 
   std::string data = serialize_session(session);
 
+  if (skip_request(key, &data, 2 * session->session_refresh_time))
+  {
+    return Store::Status::ERROR;
+  }
+
+  StageStatistics::StageTimer timer(_stats, _stage);
   Store::Status status = _store->set_data("session",
                                           key,
                                           data,
@@ -101,6 +244,8 @@ Store::Status SessionStore::set_session_data(const std::string& call_id,
                                           2 * session->session_refresh_time,
                                           trail,
                                           Store::Format::JSON);
+  timer.stop();
+  record_status(status);
   TRC_DEBUG("Store returned %d", status);
 
   return status;
@@ -115,12 +260,22 @@ Store::Status SessionStore::delete_session_data(const std::string& call_id,
   std::string key = create_key(call_id, role, function);
   TRC_DEBUG("Deleting session data for %s, CAS = %ld", key.c_str(), session->_cas);
 
+  std::string data;
+
+  if (skip_request(key, &data))
+  {
+    return Store::Status::ERROR;
+  }
+
+  StageStatistics::StageTimer timer(_stats, _stage);
   Store::Status status = _store->set_data("session",
                                           key,
                                           "",
                                           session->_cas,
                                           0,
                                           trail);
+  timer.stop();
+  record_status(status);
   TRC_DEBUG("Store returned %d", status);
 
   return status;
@@ -134,12 +289,273 @@ Store::Status SessionStore::delete_session_data(const std::string& call_id,
   std::string key = create_key(call_id, role, function);
   TRC_DEBUG("Deleting session data for %s", key.c_str());
 
+  std::string data;
+
+  if (skip_request(key, &data))
+  {
+    return Store::Status::ERROR;
+  }
+
+  StageStatistics::StageTimer timer(_stats, _stage);
   Store::Status status = _store->delete_data("session", key, trail);
+  timer.stop();
+  record_status(status);
   TRC_DEBUG("Store returned %d", status);
 
   return status;
 }
 
+// If the store is treated as down, fails a request without sending it.  A
+// write (given the data, which is empty for a delete, and the expiry in
+// seconds) is remembered so it can be replayed when the store comes back.
+// Only the latest write for each session is kept.
+bool SessionStore::skip_request(const std::string& key,
+                                const std::string* data,
+                                int expiry)
+{
+  if (_breaker_threshold == 0)
+  {
+    return false;
+  }
+
+  pthread_mutex_lock(&_breaker_lock);
+  bool open = _open;
+
+  if ((open) && (data != NULL))
+  {
+    if ((_pending.size() < MAX_PENDING_WRITES) ||
+        (_pending.find(key) != _pending.end()))
+    {
+      PendingWrite& write = _pending[key];
+      write.data = *data;
+      write.expires_ms = (expiry > 0) ? RalfTime::now_ms() + ((uint64_t)expiry * 1000) : 0;
+    }
+    else
+    {
+      TRC_DEBUG("Too many skipped writes, not keeping the write for %s", key.c_str());
+    }
+  }
+
+  pthread_mutex_unlock(&_breaker_lock);
+
+  if ((open) && (_stats != NULL))
+  {
+    _stats->incr_counter(StageStatistics::STORE_REQUESTS_SKIPPED);
+  }
+
+  return open;
+}
+
+// Counts errors in a row from the store, and treats it as down if there are
+// too many.
+void SessionStore::record_status(Store::Status status)
+{
+  if (_breaker_threshold == 0)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&_breaker_lock);
+
+  if (status == Store::Status::ERROR)
+  {
+    _failures++;
+
+    if ((!_open) && (_failures >= _breaker_threshold))
+    {
+      TRC_WARNING("Session store failed %d times in a row, skipping it until it comes back",
+                  _failures);
+      _open = true;
+      pthread_cond_signal(&_breaker_cond);
+    }
+  }
+  else
+  {
+    _failures = 0;
+  }
+
+  pthread_mutex_unlock(&_breaker_lock);
+}
+
+bool SessionStore::breaker_open()
+{
+  pthread_mutex_lock(&_breaker_lock);
+  bool open = _open;
+  pthread_mutex_unlock(&_breaker_lock);
+  return open;
+}
+
+size_t SessionStore::pending_writes()
+{
+  pthread_mutex_lock(&_breaker_lock);
+  size_t pending = _pending.size();
+  pthread_mutex_unlock(&_breaker_lock);
+  return pending;
+}
+
+bool SessionStore::probe()
+{
+  if (!breaker_open())
+  {
+    return true;
+  }
+
+  // Any answer other than an error means the store is reachable.
+  std::string data;
+  uint64_t cas;
+  Store::Status status = _store->get_data("session",
+                                          PROBE_KEY,
+                                          data,
+                                          cas,
+                                          0,
+                                          Store::Format::JSON);
+
+  if (status == Store::Status::ERROR)
+  {
+    TRC_DEBUG("Session store is still down");
+    return false;
+  }
+
+  return reconcile();
+}
+
+// Starts sending requests to the store again, and replays the writes skipped
+// while it was down.  A skipped write doesn't replace a session written
+// since (with a later accounting record number), or one that has expired.
+// If the store fails again, the writes not yet replayed are kept.
+bool SessionStore::reconcile()
+{
+  std::map<std::string, PendingWrite> pending;
+
+  pthread_mutex_lock(&_breaker_lock);
+  pending.swap(_pending);
+  _open = false;
+  _failures = 0;
+  pthread_mutex_unlock(&_breaker_lock);
+
+  TRC_STATUS("Session store has come back, replaying %zu skipped writes",
+             pending.size());
+
+  std::map<std::string, PendingWrite>::iterator it = pending.begin();
+  Store::Status status = Store::Status::OK;
+
+  while (it != pending.end())
+  {
+    const std::string& key = it->first;
+    PendingWrite& write = it->second;
+    uint64_t now_ms = RalfTime::now_ms();
+
+    if (write.data.empty())
+    {
+      status = _store->delete_data("session", key, 0);
+    }
+    else if (write.expires_ms > now_ms)
+    {
+      std::string data;
+      uint64_t cas = 0;
+      status = _store->get_data("session", key, data, cas, 0, Store::Format::JSON);
+
+      if ((status == Store::Status::OK) && (!data.empty()))
+      {
+        Session* current = deserialize_session(data);
+        Session* skipped = deserialize_session(write.data);
+
+        if ((current != NULL) &&
+            (skipped != NULL) &&
+            (current->acct_record_number >= skipped->acct_record_number))
+        {
+          // Written since, so leave it alone.
+          status = Store::Status::DATA_CONTENTION;
+        }
+
+        delete current; current = NULL;
+        delete skipped; skipped = NULL;
+      }
+      else if (status == Store::Status::NOT_FOUND)
+      {
+        cas = 0;
+        status = Store::Status::OK;
+      }
+
+      if (status == Store::Status::OK)
+      {
+        status = _store->set_data("session",
+                                  key,
+                                  write.data,
+                                  cas,
+                                  (write.expires_ms - now_ms + 999) / 1000,
+                                  0,
+                                  Store::Format::JSON);
+      }
+    }
+    else
+    {
+      // Expired, so there's nothing to replay.
+      status = Store::Status::NOT_FOUND;
+    }
+
+    if (status == Store::Status::ERROR)
+    {
+      break;
+    }
+
+    if ((status == Store::Status::OK) && (_stats != NULL))
+    {
+      _stats->incr_counter(StageStatistics::STORE_WRITES_RECONCILED);
+    }
+
+    ++it;
+  }
+
+  if (status == Store::Status::ERROR)
+  {
+    // Down again.  Keep the writes we haven't replayed, unless there are
+    // later ones for the same sessions.
+    TRC_WARNING("Session store failed while replaying skipped writes");
+
+    pthread_mutex_lock(&_breaker_lock);
+    _pending.insert(it, pending.end());
+    _open = true;
+    pthread_mutex_unlock(&_breaker_lock);
+
+    return false;
+  }
+
+  return true;
+}
+
+void* SessionStore::probe_thread_fn(void* store_ptr)
+{
+  ((SessionStore*)store_ptr)->probe_thread();
+  return NULL;
+}
+
+void SessionStore::probe_thread()
+{
+  pthread_mutex_lock(&_breaker_lock);
+
+  while (!_terminated)
+  {
+    if (_open)
+    {
+      RalfTime::timed_wait(&_breaker_cond, &_breaker_lock, _probe_interval_ms);
+
+      if (!_terminated)
+      {
+        pthread_mutex_unlock(&_breaker_lock);
+        probe();
+        pthread_mutex_lock(&_breaker_lock);
+      }
+    }
+    else
+    {
+      pthread_cond_wait(&_breaker_cond, &_breaker_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_breaker_lock);
+}
+
 // Serialize a session to a string that can later be loaded by deserialize_session().
 std::string SessionStore::serialize_session(Session* session)
 {
@@ -0,0 +1,636 @@
+/**
+ * @file stage_statistics.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "log.h"
+#include "stage_statistics.hpp"
+#include "load_feedback.hpp"
+
+const std::string StageStatistics::STAT_NAMES[StageStatistics::NUM_STATS] =
+{
+  "parse_latency_us",
+  "local_store_latency_us",
+  "remote_store_latency_us",
+  "chronos_latency_us",
+  "cdf_latency_us",
+  "http_requests_in_flight",
+  "cdf_requests_in_flight",
+  "cdf_result_codes",
+  "chronos_requests_sent",
+  "chronos_requests_coalesced",
+  "duplicate_acrs_suppressed",
+  "session_store_reads",
+  "session_store_reads_coalesced",
+  "session_store_requests_skipped",
+  "session_store_writes_reconciled",
+  "timer_pops_per_second"
+};
+
+const char* const StageStatistics::STAGE_NAMES[StageStatistics::NUM_STAGES] =
+{
+  "parse",
+  "local_store",
+  "remote_store",
+  "chronos",
+  "cdf"
+};
+
+static const char* const RESULT_CODE_NAMES[StageStatistics::NUM_RESULT_CODE_SLOTS] =
+{
+  "2001",
+  "3002",
+  "3004",
+  "3xxx",
+  "4xxx",
+  "5xxx",
+  "timeout",
+  "other"
+};
+
+std::atomic<uint64_t> StageStatistics::_next_id(1);
+
+// Each thread's cached pointer to its figures, and the StageStatistics they
+// belong to.
+static __thread uint64_t tls_owner_id = 0;
+static __thread void* tls_thread_stats = NULL;
+
+StageStatistics::ThreadStats::ThreadStats() : owner(pthread_self())
+{
+  for (int stage = 0; stage < NUM_STAGES; stage++)
+  {
+    for (int ii = 0; ii < NUM_BUCKETS; ii++)
+    {
+      buckets[stage][ii].store(0, std::memory_order_relaxed);
+    }
+
+    sum_us[stage].store(0, std::memory_order_relaxed);
+    max_us[stage].store(0, std::memory_order_relaxed);
+  }
+
+  for (int ii = 0; ii < NUM_RESULT_CODE_SLOTS; ii++)
+  {
+    results[ii].store(0, std::memory_order_relaxed);
+  }
+
+  for (int ii = 0; ii < NUM_COUNTERS; ii++)
+  {
+    counters[ii].store(0, std::memory_order_relaxed);
+  }
+}
+
+StageStatistics::StageStatistics(LastValueCache* lvc,
+                                 int period_ms,
+                                 LoadFeedback* feedback) :
+  _id(_next_id.fetch_add(1)),
+  _period_ms(period_ms),
+  _feedback(feedback),
+  _last_pop_second(RalfTime::now_ms() / 1000),
+  _aggregation_thread_running(false),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  RalfTime::init_cond(&_cond);
+
+  for (int ii = 0; ii < NUM_GAUGES; ii++)
+  {
+    _gauges[ii].store(0);
+    _gauge_hwms[ii].store(0);
+    _gauge_summaries[ii].current = 0;
+    _gauge_summaries[ii].high_water_mark = 0;
+  }
+
+  for (int ii = 0; ii < NUM_STAGES; ii++)
+  {
+    _stage_summaries[ii] = StageSummary();
+  }
+
+  for (int ii = 0; ii < NUM_RESULT_CODE_SLOTS; ii++)
+  {
+    _result_counts[ii] = 0;
+  }
+
+  for (int ii = 0; ii < NUM_COUNTERS; ii++)
+  {
+    _counter_counts[ii] = 0;
+  }
+
+  for (int ii = 0; ii < POP_SECONDS; ii++)
+  {
+    _pops[ii].store(0);
+  }
+
+  _timer_pop_summary = TimerPopSummary();
+
+  if (lvc != NULL)
+  {
+    for (int ii = 0; ii < NUM_STATS; ii++)
+    {
+      _statistics.push_back(new Statistic(STAT_NAMES[ii], lvc));
+    }
+  }
+}
+
+StageStatistics::~StageStatistics()
+{
+  stop();
+
+  for (std::vector<Statistic*>::iterator it = _statistics.begin();
+       it != _statistics.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  for (std::vector<ThreadStats*>::iterator it = _threads.begin();
+       it != _threads.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool StageStatistics::start()
+{
+  _terminated = false;
+  int rc = pthread_create(&_aggregation_thread, NULL, aggregation_thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start statistics aggregation thread (%d)", rc);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _aggregation_thread_running = true;
+  return true;
+}
+
+void StageStatistics::stop()
+{
+  if (_aggregation_thread_running)
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_aggregation_thread, NULL);
+    _aggregation_thread_running = false;
+  }
+}
+
+int StageStatistics::bucket_index(uint64_t value)
+{
+  if (value < EXACT)
+  {
+    return value;
+  }
+
+  // Shift the value so it lies in [8, 16).
+  int shift = (63 - __builtin_clzll(value)) - 3;
+  return EXACT + ((shift - 1) * SUB_BUCKETS) + ((value >> shift) - SUB_BUCKETS);
+}
+
+// Returns the highest value that is recorded in the given bucket.
+uint64_t StageStatistics::bucket_value(int index)
+{
+  if (index < EXACT)
+  {
+    return index;
+  }
+
+  int shift = ((index - EXACT) / SUB_BUCKETS) + 1;
+  uint64_t sub = ((index - EXACT) % SUB_BUCKETS) + SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+// Returns the value at the given percentile (0-100) of the values recorded
+// in the buckets.
+uint64_t StageStatistics::bucket_percentile(const std::vector<uint64_t>& buckets,
+                                            uint64_t count,
+                                            uint64_t max,
+                                            double pct)
+{
+  uint64_t target = std::max((uint64_t)1, (uint64_t)((pct / 100.0) * count + 0.5));
+  uint64_t seen = 0;
+
+  for (int ii = 0; (ii < NUM_BUCKETS) && (count > 0); ii++)
+  {
+    seen += buckets[ii];
+
+    if (seen >= target)
+    {
+      return std::min(bucket_value(ii), max);
+    }
+  }
+
+  return 0;
+}
+
+// Returns this thread's figures, creating them the first time the thread
+// records anything.  Each thread caches the figures it last used, so this
+// only takes the lock if the thread is new or records to more than one
+// StageStatistics.
+StageStatistics::ThreadStats* StageStatistics::thread_stats()
+{
+  if (tls_owner_id != _id)
+  {
+    ThreadStats* stats = NULL;
+
+    pthread_mutex_lock(&_lock);
+
+    for (std::vector<ThreadStats*>::iterator it = _threads.begin();
+         it != _threads.end();
+         ++it)
+    {
+      if (pthread_equal((*it)->owner, pthread_self()))
+      {
+        stats = *it;
+        break;
+      }
+    }
+
+    if (stats == NULL)
+    {
+      stats = new ThreadStats();
+      _threads.push_back(stats);
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    tls_owner_id = _id;
+    tls_thread_stats = stats;
+  }
+
+  return (ThreadStats*)tls_thread_stats;
+}
+
+void StageStatistics::record_latency(Stage stage, uint64_t latency_us)
+{
+  ThreadStats* stats = thread_stats();
+  stats->buckets[stage][bucket_index(latency_us)].fetch_add(1, std::memory_order_relaxed);
+  stats->sum_us[stage].fetch_add(latency_us, std::memory_order_relaxed);
+
+  // Only this thread raises the maximum, so there's no need for a
+  // compare-and-swap.  If the aggregation thread resets it in between, the
+  // new value just counts towards the next period.
+  if (latency_us > stats->max_us[stage].load(std::memory_order_relaxed))
+  {
+    stats->max_us[stage].store(latency_us, std::memory_order_relaxed);
+  }
+
+  if (_feedback != NULL)
+  {
+    _feedback->record_latency(stage, latency_us);
+  }
+}
+
+StageStatistics::ResultCodeSlot StageStatistics::result_code_slot(int result_code)
+{
+  switch (result_code)
+  {
+  case TIMEOUT:
+    return RC_TIMEOUT;
+
+  case 2001:
+    return RC_2001;
+
+  case 3002:
+    return RC_3002;
+
+  case 3004:
+    return RC_3004;
+
+  default:
+    break;
+  }
+
+  switch (result_code / 1000)
+  {
+  case 3:
+    return RC_OTHER_3XXX;
+
+  case 4:
+    return RC_4XXX;
+
+  case 5:
+    return RC_5XXX;
+
+  default:
+    return RC_OTHER;
+  }
+}
+
+void StageStatistics::record_result(int result_code)
+{
+  thread_stats()->results[result_code_slot(result_code)].fetch_add(1, std::memory_order_relaxed);
+}
+
+// The gauges are changed on whichever thread starts or finishes a request,
+// so they are shared between threads rather than kept per thread.
+void StageStatistics::incr_gauge(Gauge gauge)
+{
+  int64_t value = _gauges[gauge].fetch_add(1, std::memory_order_relaxed) + 1;
+  int64_t hwm = _gauge_hwms[gauge].load(std::memory_order_relaxed);
+
+  while ((value > hwm) &&
+         (!_gauge_hwms[gauge].compare_exchange_weak(hwm, value, std::memory_order_relaxed)))
+  {
+  }
+
+  if ((_feedback != NULL) && (gauge == CDF_IN_FLIGHT))
+  {
+    _feedback->record_cdf_in_flight(value);
+  }
+}
+
+void StageStatistics::decr_gauge(Gauge gauge)
+{
+  _gauges[gauge].fetch_sub(1, std::memory_order_relaxed);
+}
+
+void StageStatistics::incr_counter(Counter counter)
+{
+  thread_stats()->counters[counter].fetch_add(1, std::memory_order_relaxed);
+}
+
+void StageStatistics::record_timer_pop(uint64_t now_ms)
+{
+  uint64_t second = now_ms / 1000;
+  uint64_t tag = (second & 0xFFFFFFFF) << 32;
+  std::atomic<uint64_t>& entry = _pops[second % POP_SECONDS];
+  uint64_t old_value = entry.load(std::memory_order_relaxed);
+  uint64_t new_value;
+
+  do
+  {
+    // Start the count again if the entry was last used for an earlier
+    // second.
+    new_value = ((old_value & 0xFFFFFFFF00000000ULL) == tag) ? (old_value + 1) :
+                                                              (tag + 1);
+  }
+  while (!entry.compare_exchange_weak(old_value, new_value, std::memory_order_relaxed));
+}
+
+// Summarises the timer pops in each whole second since the last
+// aggregation.  Must be called with the lock held.
+void StageStatistics::aggregate_timer_pops(uint64_t now_ms)
+{
+  // The current second isn't over yet, so is left for next time.
+  uint64_t now_second = now_ms / 1000;
+  uint64_t first = _last_pop_second + 1;
+
+  if ((now_second >= POP_SECONDS) && (first < now_second - POP_SECONDS + 1))
+  {
+    first = now_second - POP_SECONDS + 1;
+  }
+
+  std::vector<uint64_t> buckets(NUM_BUCKETS);
+  uint64_t seconds = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+
+  for (uint64_t second = first; second < now_second; second++)
+  {
+    uint64_t value = _pops[second % POP_SECONDS].load(std::memory_order_relaxed);
+    uint64_t pops = ((value >> 32) == (second & 0xFFFFFFFF)) ? (value & 0xFFFFFFFF) : 0;
+    buckets[bucket_index(pops)]++;
+    seconds++;
+    sum += pops;
+    max = std::max(max, pops);
+  }
+
+  if (now_second > _last_pop_second + 1)
+  {
+    _last_pop_second = now_second - 1;
+  }
+
+  TimerPopSummary& summary = _timer_pop_summary;
+  summary.seconds = seconds;
+  summary.mean = (seconds > 0) ? (sum / seconds) : 0;
+  summary.max = max;
+  summary.p50 = bucket_percentile(buckets, seconds, max, 50.0);
+  summary.p90 = bucket_percentile(buckets, seconds, max, 90.0);
+  summary.p99 = bucket_percentile(buckets, seconds, max, 99.0);
+}
+
+void StageStatistics::aggregate(uint64_t now_ms)
+{
+  std::vector<uint64_t> buckets(NUM_BUCKETS);
+  uint64_t results[NUM_RESULT_CODE_SLOTS] = {0};
+  uint64_t counters[NUM_COUNTERS] = {0};
+
+  pthread_mutex_lock(&_lock);
+
+  for (int stage = 0; stage < NUM_STAGES; stage++)
+  {
+    std::fill(buckets.begin(), buckets.end(), 0);
+    uint64_t count = 0;
+    uint64_t sum_us = 0;
+    uint64_t max_us = 0;
+
+    for (std::vector<ThreadStats*>::iterator it = _threads.begin();
+         it != _threads.end();
+         ++it)
+    {
+      ThreadStats* stats = *it;
+
+      for (int ii = 0; ii < NUM_BUCKETS; ii++)
+      {
+        uint64_t bucket = stats->buckets[stage][ii].exchange(0, std::memory_order_relaxed);
+        buckets[ii] += bucket;
+        count += bucket;
+      }
+
+      sum_us += stats->sum_us[stage].exchange(0, std::memory_order_relaxed);
+      max_us = std::max(max_us, stats->max_us[stage].exchange(0, std::memory_order_relaxed));
+    }
+
+    // Work out the percentiles from the merged buckets.
+    StageSummary& summary = _stage_summaries[stage];
+    summary.count = count;
+    summary.mean_us = (count > 0) ? (sum_us / count) : 0;
+    summary.max_us = max_us;
+    summary.p50_us = bucket_percentile(buckets, count, max_us, 50.0);
+    summary.p90_us = bucket_percentile(buckets, count, max_us, 90.0);
+    summary.p99_us = bucket_percentile(buckets, count, max_us, 99.0);
+  }
+
+  for (std::vector<ThreadStats*>::iterator it = _threads.begin();
+       it != _threads.end();
+       ++it)
+  {
+    for (int ii = 0; ii < NUM_RESULT_CODE_SLOTS; ii++)
+    {
+      results[ii] += (*it)->results[ii].exchange(0, std::memory_order_relaxed);
+    }
+
+    for (int ii = 0; ii < NUM_COUNTERS; ii++)
+    {
+      counters[ii] += (*it)->counters[ii].exchange(0, std::memory_order_relaxed);
+    }
+  }
+
+  for (int ii = 0; ii < NUM_RESULT_CODE_SLOTS; ii++)
+  {
+    _result_counts[ii] = results[ii];
+  }
+
+  for (int ii = 0; ii < NUM_COUNTERS; ii++)
+  {
+    _counter_counts[ii] = counters[ii];
+  }
+
+  for (int ii = 0; ii < NUM_GAUGES; ii++)
+  {
+    // Start the next period's high water mark from the current value.
+    int64_t current = _gauges[ii].load(std::memory_order_relaxed);
+    _gauge_summaries[ii].current = current;
+    _gauge_summaries[ii].high_water_mark =
+      std::max(current, _gauge_hwms[ii].exchange(current, std::memory_order_relaxed));
+  }
+
+  aggregate_timer_pops(now_ms);
+  publish();
+
+  pthread_mutex_unlock(&_lock);
+}
+
+// Publishes the summaries to the last value cache.  Must be called with the
+// lock held.
+void StageStatistics::publish()
+{
+  if (_statistics.empty())
+  {
+    return;
+  }
+
+  int stat = 0;
+
+  for (int ii = 0; ii < NUM_STAGES; ii++)
+  {
+    const StageSummary& summary = _stage_summaries[ii];
+    std::vector<std::string> values;
+    values.push_back(std::to_string(summary.mean_us));
+    values.push_back(std::to_string(summary.p50_us));
+    values.push_back(std::to_string(summary.p90_us));
+    values.push_back(std::to_string(summary.p99_us));
+    values.push_back(std::to_string(summary.max_us));
+    values.push_back(std::to_string(summary.count));
+    _statistics[stat++]->report_change(values);
+  }
+
+  for (int ii = 0; ii < NUM_GAUGES; ii++)
+  {
+    std::vector<std::string> values;
+    values.push_back(std::to_string(_gauge_summaries[ii].current));
+    values.push_back(std::to_string(_gauge_summaries[ii].high_water_mark));
+    _statistics[stat++]->report_change(values);
+  }
+
+  std::vector<std::string> values;
+
+  for (int ii = 0; ii < NUM_RESULT_CODE_SLOTS; ii++)
+  {
+    values.push_back(RESULT_CODE_NAMES[ii]);
+    values.push_back(std::to_string(_result_counts[ii]));
+  }
+
+  _statistics[stat++]->report_change(values);
+
+  for (int ii = 0; ii < NUM_COUNTERS; ii++)
+  {
+    std::vector<std::string> values;
+    values.push_back(std::to_string(_counter_counts[ii]));
+    _statistics[stat++]->report_change(values);
+  }
+
+  values.clear();
+  values.push_back(std::to_string(_timer_pop_summary.mean));
+  values.push_back(std::to_string(_timer_pop_summary.p50));
+  values.push_back(std::to_string(_timer_pop_summary.p90));
+  values.push_back(std::to_string(_timer_pop_summary.p99));
+  values.push_back(std::to_string(_timer_pop_summary.max));
+  values.push_back(std::to_string(_timer_pop_summary.seconds));
+  _statistics[stat++]->report_change(values);
+}
+
+StageStatistics::StageSummary StageStatistics::stage_summary(Stage stage)
+{
+  pthread_mutex_lock(&_lock);
+  StageSummary summary = _stage_summaries[stage];
+  pthread_mutex_unlock(&_lock);
+  return summary;
+}
+
+StageStatistics::GaugeSummary StageStatistics::gauge_summary(Gauge gauge)
+{
+  pthread_mutex_lock(&_lock);
+  GaugeSummary summary = _gauge_summaries[gauge];
+  pthread_mutex_unlock(&_lock);
+  return summary;
+}
+
+uint64_t StageStatistics::result_count(ResultCodeSlot slot)
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t count = _result_counts[slot];
+  pthread_mutex_unlock(&_lock);
+  return count;
+}
+
+uint64_t StageStatistics::counter_count(Counter counter)
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t count = _counter_counts[counter];
+  pthread_mutex_unlock(&_lock);
+  return count;
+}
+
+StageStatistics::TimerPopSummary StageStatistics::timer_pop_summary()
+{
+  pthread_mutex_lock(&_lock);
+  TimerPopSummary summary = _timer_pop_summary;
+  pthread_mutex_unlock(&_lock);
+  return summary;
+}
+
+void* StageStatistics::aggregation_thread_fn(void* stats_ptr)
+{
+  ((StageStatistics*)stats_ptr)->aggregation_thread();
+  return NULL;
+}
+
+void StageStatistics::aggregation_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    RalfTime::timed_wait(&_cond, &_lock, _period_ms);
+
+    if (_terminated)
+    {
+      break;
+    }
+
+    pthread_mutex_unlock(&_lock);
+    aggregate();
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,631 @@
+/**
+ * @file ralf_cdf_sim.cpp Simulated CDF for load and failover testing of Ralf
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Answers Rf ACRs using the same Diameter stack as Ralf, so that Ralf's
+// throughput and failover behaviour can be measured on a single box.  The
+// simulator can delay answers according to a latency distribution, answer
+// with a mix of result codes, stall (stop answering for a period) and drop
+// its connections.
+//
+// The Diameter identity and listening address come from a freeDiameter
+// configuration file, as for Ralf.  Run one simulator per CDF being
+// simulated, each with its own configuration file.
+
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+
+#include "log.h"
+#include "logger.h"
+#include "rf.h"
+#include "diameterstack.h"
+#include "ralf_time.hpp"
+
+enum OptionTypes
+{
+  LATENCY=256+1,
+  RESULT_CODES,
+  INTERIM_INTERVAL,
+  STALL_EVERY_MS,
+  STALL_FOR_MS,
+  DROP_AFTER_MS,
+  STATS_INTERVAL_S,
+};
+
+struct options
+{
+  std::string diameter_conf;
+  std::string latency;
+  std::string result_codes;
+  int interim_interval;
+  int stall_every_ms;
+  int stall_for_ms;
+  int drop_after_ms;
+  int stats_interval_s;
+  int log_level;
+};
+
+const static struct option long_opt[] =
+{
+  {"diameter-conf",    required_argument, NULL, 'c'},
+  {"latency",          required_argument, NULL, LATENCY},
+  {"result-codes",     required_argument, NULL, RESULT_CODES},
+  {"interim-interval", required_argument, NULL, INTERIM_INTERVAL},
+  {"stall-every-ms",   required_argument, NULL, STALL_EVERY_MS},
+  {"stall-for-ms",     required_argument, NULL, STALL_FOR_MS},
+  {"drop-after-ms",    required_argument, NULL, DROP_AFTER_MS},
+  {"stats-interval",   required_argument, NULL, STATS_INTERVAL_S},
+  {"log-level",        required_argument, NULL, 'L'},
+  {"help",             no_argument,       NULL, 'h'},
+  {NULL,               0,                 NULL, 0},
+};
+
+static std::string options_description = "c:L:h";
+
+void usage(void)
+{
+  puts("Options:\n"
+       "\n"
+       " -c, --diameter-conf <file> File name for Diameter configuration\n"
+       "     --latency <distribution>\n"
+       "                            How long to wait before answering each ACR.  One of\n"
+       "                              fixed:<ms>\n"
+       "                              uniform:<min ms>:<max ms>\n"
+       "                              exponential:<mean ms>\n"
+       "                              lognormal:<median ms>:<sigma>\n"
+       "                            (default: fixed:0)\n"
+       "     --result-codes <code>=<weight>[,<code>=<weight>,...]\n"
+       "                            Result codes to answer with, in proportion to their weights\n"
+       "                            (default: 2001=1).  A code of 0 means don't answer at all\n"
+       "     --interim-interval N   Acct-Interim-Interval to return on START and INTERIM answers, in\n"
+       "                            seconds (default: not returned)\n"
+       "     --stall-every-ms N     Stop answering every N milliseconds (default: never)\n"
+       "     --stall-for-ms N       How long each stall lasts.  ACRs received during a stall are\n"
+       "                            answered when it ends (default: 1000)\n"
+       "     --drop-after-ms N      Exit without closing Diameter connections cleanly after N\n"
+       "                            milliseconds, to simulate a CDF failure.  Run the simulator in a\n"
+       "                            loop to simulate repeated connection drops (default: never)\n"
+       "     --stats-interval N     How often to print counts of ACRs handled, in seconds\n"
+       "                            (default: 1)\n"
+       " -L, --log-level N          Set log level to N (default: 0)\n"
+       " -h, --help                 Show this help screen\n"
+      );
+}
+
+int init_options(int argc, char**argv, struct options& options)
+{
+  int opt;
+  int long_opt_ind;
+
+  optind = 0;
+  while ((opt = getopt_long(argc, argv, options_description.c_str(), long_opt, &long_opt_ind)) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      options.diameter_conf = std::string(optarg);
+      break;
+
+    case LATENCY:
+      options.latency = std::string(optarg);
+      break;
+
+    case RESULT_CODES:
+      options.result_codes = std::string(optarg);
+      break;
+
+    case INTERIM_INTERVAL:
+      options.interim_interval = atoi(optarg);
+      break;
+
+    case STALL_EVERY_MS:
+      options.stall_every_ms = atoi(optarg);
+      break;
+
+    case STALL_FOR_MS:
+      options.stall_for_ms = atoi(optarg);
+      break;
+
+    case DROP_AFTER_MS:
+      options.drop_after_ms = atoi(optarg);
+      break;
+
+    case STATS_INTERVAL_S:
+      options.stats_interval_s = atoi(optarg);
+      if (options.stats_interval_s <= 0)
+      {
+        fprintf(stderr, "Invalid --stats-interval option %s\n", optarg);
+        return -1;
+      }
+      break;
+
+    case 'L':
+      options.log_level = atoi(optarg);
+      break;
+
+    case 'h':
+      usage();
+      return -1;
+
+    default:
+      fprintf(stderr, "Unknown option.  Run with --help for options.\n");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Generates the delay before answering each ACR.
+class LatencyDistribution
+{
+public:
+  LatencyDistribution() : _type(FIXED), _a(0), _b(0), _rng(std::random_device()()) {}
+
+  // Parses a distribution of the form <type>:<param>[:<param>].
+  bool parse(const std::string& spec)
+  {
+    std::vector<std::string> parts;
+    boost::split(parts, spec, boost::is_any_of(":"));
+
+    if ((parts[0] == "fixed") && (parts.size() == 2))
+    {
+      _type = FIXED;
+    }
+    else if ((parts[0] == "uniform") && (parts.size() == 3))
+    {
+      _type = UNIFORM;
+    }
+    else if ((parts[0] == "exponential") && (parts.size() == 2))
+    {
+      _type = EXPONENTIAL;
+    }
+    else if ((parts[0] == "lognormal") && (parts.size() == 3))
+    {
+      _type = LOGNORMAL;
+    }
+    else
+    {
+      return false;
+    }
+
+    _a = atof(parts[1].c_str());
+    _b = (parts.size() == 3) ? atof(parts[2].c_str()) : 0;
+
+    return ((_a >= 0) && (_b >= 0) && ((_type != UNIFORM) || (_b >= _a)));
+  }
+
+  uint64_t sample_ms()
+  {
+    double ms = 0;
+
+    switch (_type)
+    {
+    case FIXED:
+      ms = _a;
+      break;
+
+    case UNIFORM:
+      ms = std::uniform_real_distribution<double>(_a, _b)(_rng);
+      break;
+
+    case EXPONENTIAL:
+      ms = (_a > 0) ? std::exponential_distribution<double>(1.0 / _a)(_rng) : 0;
+      break;
+
+    case LOGNORMAL:
+      ms = (_a > 0) ? std::lognormal_distribution<double>(log(_a), _b)(_rng) : 0;
+      break;
+    }
+
+    return (uint64_t)ms;
+  }
+
+private:
+  enum Type { FIXED, UNIFORM, EXPONENTIAL, LOGNORMAL };
+
+  Type _type;
+  double _a;
+  double _b;
+  std::mt19937 _rng;
+};
+
+// Picks the result code for each ACR.
+class ResultCodeMix
+{
+public:
+  ResultCodeMix() : _rng(std::random_device()()) {}
+
+  // Parses a list of the form <code>=<weight>[,<code>=<weight>,...].
+  bool parse(const std::string& spec)
+  {
+    std::vector<std::string> entries;
+    boost::split(entries, spec, boost::is_any_of(","));
+    std::vector<double> weights;
+
+    for (std::vector<std::string>::const_iterator it = entries.begin();
+         it != entries.end();
+         ++it)
+    {
+      std::vector<std::string> parts;
+      boost::split(parts, *it, boost::is_any_of("="));
+
+      if ((parts.size() != 2) || (atof(parts[1].c_str()) <= 0))
+      {
+        return false;
+      }
+
+      _codes.push_back(atoi(parts[0].c_str()));
+      weights.push_back(atof(parts[1].c_str()));
+    }
+
+    _dist = std::discrete_distribution<int>(weights.begin(), weights.end());
+    return true;
+  }
+
+  int32_t sample()
+  {
+    return _codes[_dist(_rng)];
+  }
+
+private:
+  std::vector<int32_t> _codes;
+  std::discrete_distribution<int> _dist;
+  std::mt19937 _rng;
+};
+
+// Answers ACRs.  Answers are built as soon as the ACR arrives and then held
+// until they are due to be sent, so the responder thread only has to send
+// them.
+class CdfSimulator : public Diameter::Stack::HandlerInterface
+{
+public:
+  CdfSimulator(const Rf::Dictionary* dict,
+               Diameter::Stack* diameter_stack,
+               const struct options& options,
+               LatencyDistribution* latency,
+               ResultCodeMix* result_codes) :
+    _dict(dict),
+    _diameter_stack(diameter_stack),
+    _interim_interval(options.interim_interval),
+    _stall_every_ms(options.stall_every_ms),
+    _stall_for_ms(options.stall_for_ms),
+    _latency(latency),
+    _result_codes(result_codes),
+    _start_ms(RalfTime::now_ms()),
+    _terminated(false),
+    _received(0),
+    _answered(0),
+    _ignored(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+    pthread_create(&_responder_thread, NULL, responder_thread_fn, this);
+  }
+
+  virtual ~CdfSimulator()
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_responder_thread, NULL);
+
+    for (std::multimap<uint64_t, struct msg*>::iterator it = _pending.begin();
+         it != _pending.end();
+         ++it)
+    {
+      fd_msg_free(it->second);
+    }
+
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  void process_request(struct msg** req, SAS::TrailId trail)
+  {
+    uint64_t now = RalfTime::now_ms();
+
+    pthread_mutex_lock(&_lock);
+    int32_t result_code = _result_codes->sample();
+    uint64_t due = now + _latency->sample_ms();
+    _received++;
+    pthread_mutex_unlock(&_lock);
+
+    if (result_code == 0)
+    {
+      // Never answer this one.
+      fd_msg_free(*req);
+      *req = NULL;
+
+      pthread_mutex_lock(&_lock);
+      _ignored++;
+      pthread_mutex_unlock(&_lock);
+      return;
+    }
+
+    // Anything that would be answered during a stall is held until the end
+    // of the stall.
+    if (_stall_every_ms > 0)
+    {
+      uint64_t elapsed = due - _start_ms;
+      uint64_t into_period = elapsed % (_stall_every_ms + _stall_for_ms);
+
+      if (into_period >= (uint64_t)_stall_every_ms)
+      {
+        due += (_stall_every_ms + _stall_for_ms) - into_period;
+      }
+    }
+
+    struct msg* ans = build_answer(req, result_code);
+
+    if (ans != NULL)
+    {
+      pthread_mutex_lock(&_lock);
+      _pending.insert(std::make_pair(due, ans));
+      pthread_cond_signal(&_cond);
+      pthread_mutex_unlock(&_lock);
+    }
+  }
+
+  void get_stats(uint64_t& received, uint64_t& answered, uint64_t& ignored, uint64_t& pending)
+  {
+    pthread_mutex_lock(&_lock);
+    received = _received;
+    answered = _answered;
+    ignored = _ignored;
+    pending = _pending.size();
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  // Turns the ACR into its answer.
+  struct msg* build_answer(struct msg** req, int32_t result_code)
+  {
+    Diameter::Message acr(_dict, *req, _diameter_stack);
+    int32_t record_type = 0;
+    int32_t record_number = 0;
+    acr.get_i32_from_avp(Diameter::Dictionary::AVP("Accounting-Record-Type"), record_type);
+    acr.get_i32_from_avp(Diameter::Dictionary::AVP("Accounting-Record-Number"), record_number);
+    acr.revoke_ownership();
+
+    if (fd_msg_new_answer_from_req(fd_g_config->cnf_dict, req, 0) != 0)
+    {
+      TRC_ERROR("Failed to build ACA");
+      fd_msg_free(*req);
+      *req = NULL;
+      return NULL;
+    }
+
+    Diameter::Message aca(_dict, *req, _diameter_stack);
+    *req = NULL;
+    aca.add_origin();
+    aca.add(Diameter::AVP(_dict->RESULT_CODE).val_i32(result_code));
+
+    Diameter::AVP record_type_avp(Diameter::Dictionary::AVP("Accounting-Record-Type"));
+    aca.add(record_type_avp.val_i32(record_type));
+    Diameter::AVP record_number_avp(Diameter::Dictionary::AVP("Accounting-Record-Number"));
+    aca.add(record_number_avp.val_i32(record_number));
+
+    Rf::AccountingRecordType type(record_type);
+
+    if ((_interim_interval > 0) && ((type.isStart()) || (type.isInterim())))
+    {
+      aca.add(Diameter::AVP(_dict->ACCT_INTERIM_INTERVAL).val_i32(_interim_interval));
+    }
+
+    aca.revoke_ownership();
+    return aca.fd_msg();
+  }
+
+  static void* responder_thread_fn(void* sim_ptr)
+  {
+    ((CdfSimulator*)sim_ptr)->responder_thread();
+    return NULL;
+  }
+
+  void responder_thread()
+  {
+    pthread_mutex_lock(&_lock);
+
+    while (!_terminated)
+    {
+      uint64_t now = RalfTime::now_ms();
+
+      if ((!_pending.empty()) && (_pending.begin()->first <= now))
+      {
+        struct msg* ans = _pending.begin()->second;
+        _pending.erase(_pending.begin());
+        _answered++;
+
+        pthread_mutex_unlock(&_lock);
+        _diameter_stack->send(ans, (SAS::TrailId)0);
+        pthread_mutex_lock(&_lock);
+        continue;
+      }
+
+      // Wait until the next answer is due, or for at most a second.
+      uint64_t wait_ms = _pending.empty() ? 1000 : (_pending.begin()->first - now);
+      struct timespec wake;
+      clock_gettime(CLOCK_REALTIME, &wake);
+      uint64_t wake_ns = ((uint64_t)wake.tv_sec * 1000000000) + wake.tv_nsec +
+                         (wait_ms * 1000000);
+      wake.tv_sec = wake_ns / 1000000000;
+      wake.tv_nsec = wake_ns % 1000000000;
+      pthread_cond_timedwait(&_cond, &_lock, &wake);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  const Rf::Dictionary* _dict;
+  Diameter::Stack* _diameter_stack;
+  const int _interim_interval;
+  const int _stall_every_ms;
+  const int _stall_for_ms;
+  LatencyDistribution* _latency;
+  ResultCodeMix* _result_codes;
+  const uint64_t _start_ms;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  pthread_t _responder_thread;
+  bool _terminated;
+
+  // Answers waiting to be sent, keyed by when they are due.
+  std::multimap<uint64_t, struct msg*> _pending;
+
+  uint64_t _received;
+  uint64_t _answered;
+  uint64_t _ignored;
+};
+
+static sem_t term_sem;
+
+void terminate_handler(int sig)
+{
+  sem_post(&term_sem);
+}
+
+int main(int argc, char**argv)
+{
+  sem_init(&term_sem, 0, 0);
+  signal(SIGTERM, terminate_handler);
+  signal(SIGINT, terminate_handler);
+
+  struct options options;
+  options.diameter_conf = "cdf_sim.conf";
+  options.latency = "fixed:0";
+  options.result_codes = "2001=1";
+  options.interim_interval = 0;
+  options.stall_every_ms = 0;
+  options.stall_for_ms = 1000;
+  options.drop_after_ms = 0;
+  options.stats_interval_s = 1;
+  options.log_level = 0;
+
+  if (init_options(argc, argv, options) != 0)
+  {
+    return 1;
+  }
+
+  Log::setLoggingLevel(options.log_level);
+  Log::setLogger(new Logger());
+
+  LatencyDistribution latency;
+  if (!latency.parse(options.latency))
+  {
+    fprintf(stderr, "Invalid --latency option %s\n", options.latency.c_str());
+    return 1;
+  }
+
+  ResultCodeMix result_codes;
+  if (!result_codes.parse(options.result_codes))
+  {
+    fprintf(stderr, "Invalid --result-codes option %s\n", options.result_codes.c_str());
+    return 1;
+  }
+
+  Diameter::Stack* diameter_stack = Diameter::Stack::get_instance();
+  Rf::Dictionary* dict = NULL;
+  CdfSimulator* sim = NULL;
+
+  try
+  {
+    diameter_stack->initialize();
+    diameter_stack->configure(options.diameter_conf);
+    dict = new Rf::Dictionary();
+    sim = new CdfSimulator(dict, diameter_stack, options, &latency, &result_codes);
+    diameter_stack->advertize_application(Diameter::Dictionary::Application::ACCT,
+                                          dict->RF);
+    diameter_stack->register_handler(dict->RF, dict->ACCOUNTING_REQUEST, sim);
+    diameter_stack->start();
+  }
+  catch (Diameter::Stack::Exception& e)
+  {
+    fprintf(stderr, "Failed to initialize Diameter stack - function %s, rc %d\n", e._func, e._rc);
+    return 2;
+  }
+
+  printf("Simulated CDF started\n");
+
+  uint64_t start_ms = RalfTime::now_ms();
+  uint64_t last_answered = 0;
+  bool terminated = false;
+
+  while (!terminated)
+  {
+    // Wake up to print stats, or when it's time to drop our connections.
+    uint64_t wait_ms = options.stats_interval_s * 1000;
+
+    if (options.drop_after_ms > 0)
+    {
+      uint64_t drop_ms = start_ms + options.drop_after_ms;
+      uint64_t now = RalfTime::now_ms();
+      wait_ms = std::min(wait_ms, (drop_ms > now) ? (drop_ms - now) : 0);
+    }
+
+    struct timespec wake;
+    clock_gettime(CLOCK_REALTIME, &wake);
+    uint64_t wake_ns = ((uint64_t)wake.tv_sec * 1000000000) + wake.tv_nsec +
+                       (wait_ms * 1000000);
+    wake.tv_sec = wake_ns / 1000000000;
+    wake.tv_nsec = wake_ns % 1000000000;
+    terminated = (sem_timedwait(&term_sem, &wake) == 0);
+
+    uint64_t received, answered, ignored, pending;
+    sim->get_stats(received, answered, ignored, pending);
+    printf("received %lu answered %lu (%lu/s) ignored %lu pending %lu\n",
+           (unsigned long)received,
+           (unsigned long)answered,
+           (unsigned long)((answered - last_answered) * 1000 / std::max(wait_ms, (uint64_t)1)),
+           (unsigned long)ignored,
+           (unsigned long)pending);
+    fflush(stdout);
+    last_answered = answered;
+
+    if ((options.drop_after_ms > 0) &&
+        (RalfTime::now_ms() - start_ms >= (uint64_t)options.drop_after_ms))
+    {
+      // Exit without disconnecting from our peers, so they see the
+      // connection drop rather than a clean shutdown.
+      printf("Dropping connections\n");
+      fflush(stdout);
+      _exit(3);
+    }
+  }
+
+  try
+  {
+    diameter_stack->stop();
+    diameter_stack->wait_stopped();
+  }
+  catch (Diameter::Stack::Exception& e)
+  {
+    fprintf(stderr, "Failed to stop Diameter stack - function %s, rc %d\n", e._func, e._rc);
+  }
+
+  delete sim; sim = NULL;
+  delete dict; dict = NULL;
+  sem_destroy(&term_sem);
+
+  return 0;
+}
@@ -0,0 +1,759 @@
+/**
+ * @file ralf_loadgen.cpp Open-loop HTTP load generator for Ralf
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Sends billing requests to Ralf's /call-id/<call ID> API, as Sprout and
+// Chronos would.  Calls are started at a fixed rate, regardless of how
+// quickly Ralf responds (so the load is open-loop), and each call sends
+// either a single EVENT, or a START, INTERIMs while the call is up, and a
+// STOP.
+//
+// Latency is measured from when each request was due to be sent rather
+// than when it was actually sent, so that a backlog in the load generator
+// shows up as latency rather than being hidden.
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <curl/curl.h>
+
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include "ralf_time.hpp"
+#include "latency_histogram.hpp"
+
+enum OptionTypes
+{
+  RATE=256+1,
+  DURATION_S,
+  CCFS,
+  EVENT_RATIO,
+  HOLDING_TIME_S,
+  INTERIM_INTERVAL_S,
+  TIMER_INTERIM_RATIO,
+  ROLES,
+  FUNCTIONS,
+  MAX_OUTSTANDING,
+  CONNECTIONS,
+  STATS_INTERVAL_S,
+};
+
+struct options
+{
+  std::string server;
+  double rate;
+  int duration_s;
+  std::vector<std::string> ccfs;
+  double event_ratio;
+  double holding_time_s;
+  int interim_interval_s;
+  double timer_interim_ratio;
+  std::string roles;
+  std::string functions;
+  int max_outstanding;
+  int connections;
+  int stats_interval_s;
+};
+
+const static struct option long_opt[] =
+{
+  {"server",              required_argument, NULL, 's'},
+  {"rate",                required_argument, NULL, RATE},
+  {"duration",            required_argument, NULL, DURATION_S},
+  {"ccfs",                required_argument, NULL, CCFS},
+  {"event-ratio",         required_argument, NULL, EVENT_RATIO},
+  {"holding-time",        required_argument, NULL, HOLDING_TIME_S},
+  {"interim-interval",    required_argument, NULL, INTERIM_INTERVAL_S},
+  {"timer-interim-ratio", required_argument, NULL, TIMER_INTERIM_RATIO},
+  {"roles",               required_argument, NULL, ROLES},
+  {"functions",           required_argument, NULL, FUNCTIONS},
+  {"max-outstanding",     required_argument, NULL, MAX_OUTSTANDING},
+  {"connections",         required_argument, NULL, CONNECTIONS},
+  {"stats-interval",      required_argument, NULL, STATS_INTERVAL_S},
+  {"help",                no_argument,       NULL, 'h'},
+  {NULL,                  0,                 NULL, 0},
+};
+
+static std::string options_description = "s:h";
+
+void usage(void)
+{
+  puts("Options:\n"
+       "\n"
+       " -s, --server <address>[:<port>]\n"
+       "                            Ralf's HTTP address (default: 127.0.0.1:10888)\n"
+       "     --rate N               Number of new calls to start per second (default: 100)\n"
+       "     --duration N           How long to run for, in seconds.  Calls still in progress at the\n"
+       "                            end are abandoned (default: 60)\n"
+       "     --ccfs <ccf>[,<ccf>,...]\n"
+       "                            The CCFs to put in each request (default: cdf.example.com)\n"
+       "     --event-ratio N        The fraction of calls that send a single EVENT rather than\n"
+       "                            START, INTERIM and STOP (default: 0.5)\n"
+       "     --holding-time N       Mean call length in seconds.  Call lengths are exponentially\n"
+       "                            distributed (default: 120)\n"
+       "     --interim-interval N   How often each call sends an INTERIM, in seconds (default: 30)\n"
+       "     --timer-interim-ratio N\n"
+       "                            The fraction of INTERIMs sent as Chronos timer pops rather\n"
+       "                            than by Sprout (default: 0.5)\n"
+       "     --roles <role>=<weight>[,<role>=<weight>,...]\n"
+       "                            Mix of Role-Of-Node values (default: 0=1,1=1)\n"
+       "     --functions <function>=<weight>[,<function>=<weight>,...]\n"
+       "                            Mix of Node-Functionality values (default: 0=1)\n"
+       "     --max-outstanding N    The most requests to have outstanding at once.  Requests due\n"
+       "                            while at this limit are counted as errors (default: 10000)\n"
+       "     --connections N        The most HTTP connections to open to Ralf (default: 100)\n"
+       "     --stats-interval N     How often to print statistics, in seconds (default: 1)\n"
+       " -h, --help                 Show this help screen\n"
+      );
+}
+
+int init_options(int argc, char**argv, struct options& options)
+{
+  int opt;
+  int long_opt_ind;
+
+  optind = 0;
+  while ((opt = getopt_long(argc, argv, options_description.c_str(), long_opt, &long_opt_ind)) != -1)
+  {
+    switch (opt)
+    {
+    case 's':
+      options.server = std::string(optarg);
+      break;
+
+    case RATE:
+      options.rate = atof(optarg);
+      if (options.rate <= 0)
+      {
+        fprintf(stderr, "Invalid --rate option %s\n", optarg);
+        return -1;
+      }
+      break;
+
+    case DURATION_S:
+      options.duration_s = atoi(optarg);
+      break;
+
+    case CCFS:
+      {
+        std::string ccfs_arg = std::string(optarg);
+        options.ccfs.clear();
+        boost::split(options.ccfs, ccfs_arg, boost::is_any_of(","));
+      }
+      break;
+
+    case EVENT_RATIO:
+      options.event_ratio = atof(optarg);
+      break;
+
+    case HOLDING_TIME_S:
+      options.holding_time_s = atof(optarg);
+      if (options.holding_time_s <= 0)
+      {
+        fprintf(stderr, "Invalid --holding-time option %s\n", optarg);
+        return -1;
+      }
+      break;
+
+    case INTERIM_INTERVAL_S:
+      options.interim_interval_s = atoi(optarg);
+      break;
+
+    case TIMER_INTERIM_RATIO:
+      options.timer_interim_ratio = atof(optarg);
+      break;
+
+    case ROLES:
+      options.roles = std::string(optarg);
+      break;
+
+    case FUNCTIONS:
+      options.functions = std::string(optarg);
+      break;
+
+    case MAX_OUTSTANDING:
+      options.max_outstanding = atoi(optarg);
+      break;
+
+    case CONNECTIONS:
+      options.connections = atoi(optarg);
+      break;
+
+    case STATS_INTERVAL_S:
+      options.stats_interval_s = atoi(optarg);
+      if (options.stats_interval_s <= 0)
+      {
+        fprintf(stderr, "Invalid --stats-interval option %s\n", optarg);
+        return -1;
+      }
+      break;
+
+    case 'h':
+      usage();
+      return -1;
+
+    default:
+      fprintf(stderr, "Unknown option.  Run with --help for options.\n");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Picks values from a weighted list of the form <value>=<weight>,...
+class WeightedMix
+{
+public:
+  bool parse(const std::string& spec)
+  {
+    std::vector<std::string> entries;
+    boost::split(entries, spec, boost::is_any_of(","));
+    std::vector<double> weights;
+
+    for (std::vector<std::string>::const_iterator it = entries.begin();
+         it != entries.end();
+         ++it)
+    {
+      std::vector<std::string> parts;
+      boost::split(parts, *it, boost::is_any_of("="));
+
+      if ((parts.size() != 2) || (atof(parts[1].c_str()) <= 0))
+      {
+        return false;
+      }
+
+      _values.push_back(atoi(parts[0].c_str()));
+      weights.push_back(atof(parts[1].c_str()));
+    }
+
+    _dist = std::discrete_distribution<int>(weights.begin(), weights.end());
+    return true;
+  }
+
+  int sample(std::mt19937& rng)
+  {
+    return _values[_dist(rng)];
+  }
+
+private:
+  std::vector<int> _values;
+  std::discrete_distribution<int> _dist;
+};
+
+// The kinds of request a call sends.
+enum RequestType
+{
+  EVENT = 1,
+  START = 2,
+  INTERIM = 3,
+  STOP = 4,
+  TIMER_INTERIM = 5,
+};
+
+static const char* REQUEST_TYPE_NAMES[] = {"", "EVENT", "START", "INTERIM", "STOP", "TIMER-INTERIM"};
+
+struct Call
+{
+  std::string call_id;
+  int role;
+  int function;
+  uint64_t end_ms;
+};
+
+// A request that is due to be sent.
+struct ScheduledRequest
+{
+  Call* call;
+  RequestType type;
+};
+
+// A request that has been sent and is waiting for a response.
+struct OutstandingRequest
+{
+  CURL* curl;
+  std::string url;
+  std::string body;
+  RequestType type;
+  uint64_t due_us;
+};
+
+class LoadGenerator
+{
+public:
+  LoadGenerator(const struct options& options,
+                WeightedMix* roles,
+                WeightedMix* functions) :
+    _options(options),
+    _roles(roles),
+    _functions(functions),
+    _rng(std::random_device()()),
+    _multi(curl_multi_init()),
+    _next_call_id(0),
+    _calls_in_progress(0),
+    _outstanding(0),
+    _interval_sent(0),
+    _total_sent(0)
+  {
+    curl_multi_setopt(_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)options.connections);
+    _url_prefix = "http://" + options.server + "/call-id/";
+  }
+
+  ~LoadGenerator()
+  {
+    for (std::multimap<uint64_t, ScheduledRequest>::iterator it = _schedule.begin();
+         it != _schedule.end();
+         ++it)
+    {
+      if ((it->second.type == STOP) || (it->second.type == EVENT))
+      {
+        delete it->second.call;
+      }
+    }
+
+    curl_multi_cleanup(_multi);
+  }
+
+  void run(volatile bool* terminated)
+  {
+    uint64_t start_us = RalfTime::now_us();
+    uint64_t end_us = start_us + ((uint64_t)_options.duration_s * 1000000);
+    uint64_t call_interval_us = (uint64_t)(1000000.0 / _options.rate);
+    uint64_t next_call_us = start_us;
+    uint64_t next_stats_us = start_us + ((uint64_t)_options.stats_interval_s * 1000000);
+
+    // Keep going until we've stopped starting calls and everything we've
+    // sent has been answered.
+    while ((!*terminated) && ((next_call_us < end_us) || (_outstanding > 0)))
+    {
+      uint64_t now = RalfTime::now_us();
+
+      // Start any calls that are due.  We don't wait for earlier calls to be
+      // answered.
+      while ((next_call_us <= now) && (next_call_us < end_us))
+      {
+        start_call(next_call_us);
+        next_call_us += call_interval_us;
+      }
+
+      // Send any requests that are due on calls already in progress.
+      while ((!_schedule.empty()) &&
+             (_schedule.begin()->first <= now) &&
+             (_schedule.begin()->first < end_us))
+      {
+        uint64_t due_us = _schedule.begin()->first;
+        ScheduledRequest req = _schedule.begin()->second;
+        _schedule.erase(_schedule.begin());
+        send_request(req, due_us);
+      }
+
+      int running;
+      curl_multi_perform(_multi, &running);
+      collect_responses();
+
+      if (now >= next_stats_us)
+      {
+        print_interval_stats();
+        next_stats_us += (uint64_t)_options.stats_interval_s * 1000000;
+      }
+
+      // Wait for a response, or until the next request is due.
+      uint64_t next_due_us = std::min(next_call_us, next_stats_us);
+
+      if (!_schedule.empty())
+      {
+        next_due_us = std::min(next_due_us, _schedule.begin()->first);
+      }
+
+      now = RalfTime::now_us();
+      int wait_ms = (next_due_us > now) ? (int)std::min((uint64_t)100, (next_due_us - now) / 1000) : 0;
+      curl_multi_wait(_multi, NULL, 0, wait_ms, NULL);
+    }
+
+    print_summary(RalfTime::now_us() - start_us);
+  }
+
+private:
+  void start_call(uint64_t due_us)
+  {
+    Call* call = new Call();
+    char call_id[64];
+    snprintf(call_id, sizeof(call_id), "loadgen-%d-%lu", getpid(), (unsigned long)_next_call_id++);
+    call->call_id = call_id;
+    call->role = _roles->sample(_rng);
+    call->function = _functions->sample(_rng);
+
+    if (std::uniform_real_distribution<double>(0, 1)(_rng) < _options.event_ratio)
+    {
+      call->end_ms = 0;
+      send_request(ScheduledRequest{call, EVENT}, due_us);
+      return;
+    }
+
+    // Schedule the INTERIMs and the STOP now, so they go out on time
+    // whatever happens to the START.
+    double holding_s = std::exponential_distribution<double>(1.0 / _options.holding_time_s)(_rng);
+    uint64_t end_us = due_us + (uint64_t)(holding_s * 1000000);
+    call->end_ms = end_us / 1000;
+
+    if (_options.interim_interval_s > 0)
+    {
+      uint64_t interval_us = (uint64_t)_options.interim_interval_s * 1000000;
+
+      for (uint64_t interim_us = due_us + interval_us; interim_us < end_us; interim_us += interval_us)
+      {
+        bool timer = (std::uniform_real_distribution<double>(0, 1)(_rng) < _options.timer_interim_ratio);
+        _schedule.insert(std::make_pair(interim_us, ScheduledRequest{call, timer ? TIMER_INTERIM : INTERIM}));
+      }
+    }
+
+    _schedule.insert(std::make_pair(end_us, ScheduledRequest{call, STOP}));
+    _calls_in_progress++;
+    send_request(ScheduledRequest{call, START}, due_us);
+  }
+
+  void send_request(const ScheduledRequest& req, uint64_t due_us)
+  {
+    if (_outstanding >= _options.max_outstanding)
+    {
+      _errors["too many outstanding requests"]++;
+    }
+    else
+    {
+      OutstandingRequest* out = new OutstandingRequest();
+      out->type = req.type;
+      out->due_us = due_us;
+      out->url = _url_prefix + req.call->call_id;
+
+      if (req.type == TIMER_INTERIM)
+      {
+        out->url += "?timer-interim=true";
+      }
+
+      out->body = build_body(*req.call, req.type);
+      out->curl = curl_easy_init();
+      curl_easy_setopt(out->curl, CURLOPT_URL, out->url.c_str());
+      curl_easy_setopt(out->curl, CURLOPT_POST, 1L);
+      curl_easy_setopt(out->curl, CURLOPT_POSTFIELDS, out->body.c_str());
+      curl_easy_setopt(out->curl, CURLOPT_POSTFIELDSIZE, (long)out->body.length());
+      curl_easy_setopt(out->curl, CURLOPT_WRITEFUNCTION, discard_response);
+      curl_easy_setopt(out->curl, CURLOPT_PRIVATE, out);
+      curl_easy_setopt(out->curl, CURLOPT_NOSIGNAL, 1L);
+
+      curl_multi_add_handle(_multi, out->curl);
+      _outstanding++;
+      _interval_sent++;
+      _total_sent++;
+    }
+
+    // The call is over once its STOP (or EVENT) has gone.
+    if ((req.type == STOP) || (req.type == EVENT))
+    {
+      if (req.type == STOP)
+      {
+        _calls_in_progress--;
+      }
+
+      delete req.call;
+    }
+  }
+
+  static size_t discard_response(char* ptr, size_t size, size_t nmemb, void* userdata)
+  {
+    return size * nmemb;
+  }
+
+  // Builds a request body in the format described in docs/API.md.  Timer
+  // pops carry the same body as Ralf gives Chronos.
+  std::string build_body(const Call& call, RequestType type)
+  {
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+    uint64_t now_s = RalfTime::wall_clock_ms() / 1000;
+
+    writer.StartObject();
+    {
+      if ((type == EVENT) || (type == START))
+      {
+        writer.String("peers");
+        writer.StartObject();
+        {
+          writer.String("ccf");
+          writer.StartArray();
+          for (std::vector<std::string>::const_iterator ccf = _options.ccfs.begin();
+               ccf != _options.ccfs.end();
+               ++ccf)
+          {
+            writer.String(ccf->c_str());
+          }
+          writer.EndArray();
+        }
+        writer.EndObject();
+      }
+
+      writer.String("event");
+      writer.StartObject();
+      {
+        writer.String("Accounting-Record-Type");
+        writer.Int((type == TIMER_INTERIM) ? (int)INTERIM : (int)type);
+
+        if (type != TIMER_INTERIM)
+        {
+          writer.String("Event-Timestamp"); writer.Uint64(now_s);
+
+          if ((type == START) || (type == INTERIM))
+          {
+            writer.String("Acct-Interim-Interval"); writer.Int(_options.interim_interval_s);
+          }
+        }
+
+        writer.String("Service-Information");
+        writer.StartObject();
+        {
+          writer.String("IMS-Information");
+          writer.StartObject();
+          {
+            writer.String("Role-Of-Node"); writer.Int(call.role);
+            writer.String("Node-Functionality"); writer.Int(call.function);
+
+            if (type != TIMER_INTERIM)
+            {
+              writer.String("Event-Type");
+              writer.StartObject();
+              writer.String("SIP-Method");
+              writer.String((type == STOP) ? "BYE" : "INVITE");
+              writer.EndObject();
+              writer.String("User-Session-Id"); writer.String(call.call_id.c_str());
+              writer.String("IMS-Charging-Identifier"); writer.String(call.call_id.c_str());
+              writer.String("Calling-Party-Address");
+              writer.StartArray();
+              writer.String("sip:6505550000@example.com");
+              writer.EndArray();
+              writer.String("Called-Party-Address"); writer.String("sip:6505550001@example.com");
+            }
+          }
+          writer.EndObject();
+        }
+        writer.EndObject();
+      }
+      writer.EndObject();
+    }
+    writer.EndObject();
+
+    return sb.GetString();
+  }
+
+  void collect_responses()
+  {
+    CURLMsg* msg;
+    int remaining;
+
+    while ((msg = curl_multi_info_read(_multi, &remaining)) != NULL)
+    {
+      if (msg->msg != CURLMSG_DONE)
+      {
+        continue;
+      }
+
+      OutstandingRequest* out = NULL;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&out);
+      uint64_t latency_us = RalfTime::now_us() - out->due_us;
+
+      if (msg->data.result != CURLE_OK)
+      {
+        _errors[curl_easy_strerror(msg->data.result)]++;
+      }
+      else
+      {
+        long http_rc = 0;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &http_rc);
+
+        if (http_rc == 200)
+        {
+          _interval_latency.record(latency_us);
+          _total_latency.record(latency_us);
+          _type_latency[out->type].record(latency_us);
+        }
+        else
+        {
+          char error[64];
+          snprintf(error, sizeof(error), "HTTP %ld (%s)", http_rc, REQUEST_TYPE_NAMES[out->type]);
+          _errors[error]++;
+        }
+      }
+
+      curl_multi_remove_handle(_multi, out->curl);
+      curl_easy_cleanup(out->curl);
+      delete out;
+      _outstanding--;
+    }
+  }
+
+  void print_interval_stats()
+  {
+    printf("sent %lu/s ok %lu p50 %.1fms p99 %.1fms p99.9 %.1fms max %.1fms outstanding %d calls %lu errors %lu\n",
+           (unsigned long)(_interval_sent / _options.stats_interval_s),
+           (unsigned long)_interval_latency.count(),
+           _interval_latency.percentile(50) / 1000.0,
+           _interval_latency.percentile(99) / 1000.0,
+           _interval_latency.percentile(99.9) / 1000.0,
+           _interval_latency.max() / 1000.0,
+           _outstanding,
+           (unsigned long)_calls_in_progress,
+           (unsigned long)error_count());
+    fflush(stdout);
+
+    _interval_sent = 0;
+    _interval_latency.reset();
+  }
+
+  void print_summary(uint64_t elapsed_us)
+  {
+    printf("\nSent %lu requests in %.1fs (%.1f/s)\n",
+           (unsigned long)_total_sent,
+           elapsed_us / 1000000.0,
+           _total_sent * 1000000.0 / std::max(elapsed_us, (uint64_t)1));
+
+    printf("\n%-14s %10s %10s %10s %10s %10s %10s\n",
+           "Latency (ms)", "count", "p50", "p90", "p99", "p99.9", "max");
+    print_latency_row("ALL", _total_latency);
+
+    for (std::map<int, LatencyHistogram>::const_iterator it = _type_latency.begin();
+         it != _type_latency.end();
+         ++it)
+    {
+      print_latency_row(REQUEST_TYPE_NAMES[it->first], it->second);
+    }
+
+    printf("\nErrors: %lu\n", (unsigned long)error_count());
+
+    for (std::map<std::string, uint64_t>::const_iterator it = _errors.begin();
+         it != _errors.end();
+         ++it)
+    {
+      printf("  %-40s %10lu\n", it->first.c_str(), (unsigned long)it->second);
+    }
+  }
+
+  void print_latency_row(const char* name, const LatencyHistogram& hist)
+  {
+    printf("%-14s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           name,
+           (unsigned long)hist.count(),
+           hist.percentile(50) / 1000.0,
+           hist.percentile(90) / 1000.0,
+           hist.percentile(99) / 1000.0,
+           hist.percentile(99.9) / 1000.0,
+           hist.max() / 1000.0);
+  }
+
+  uint64_t error_count()
+  {
+    uint64_t count = 0;
+
+    for (std::map<std::string, uint64_t>::const_iterator it = _errors.begin();
+         it != _errors.end();
+         ++it)
+    {
+      count += it->second;
+    }
+
+    return count;
+  }
+
+  const struct options& _options;
+  WeightedMix* _roles;
+  WeightedMix* _functions;
+  std::mt19937 _rng;
+  CURLM* _multi;
+  std::string _url_prefix;
+
+  // Requests on calls in progress, keyed by when they are due in
+  // microseconds.
+  std::multimap<uint64_t, ScheduledRequest> _schedule;
+
+  uint64_t _next_call_id;
+  uint64_t _calls_in_progress;
+  int _outstanding;
+  uint64_t _interval_sent;
+  uint64_t _total_sent;
+
+  LatencyHistogram _interval_latency;
+  LatencyHistogram _total_latency;
+  std::map<int, LatencyHistogram> _type_latency;
+  std::map<std::string, uint64_t> _errors;
+};
+
+static volatile bool terminated = false;
+
+void terminate_handler(int sig)
+{
+  terminated = true;
+}
+
+int main(int argc, char**argv)
+{
+  signal(SIGTERM, terminate_handler);
+  signal(SIGINT, terminate_handler);
+
+  struct options options;
+  options.server = "127.0.0.1:10888";
+  options.rate = 100;
+  options.duration_s = 60;
+  options.ccfs.push_back("cdf.example.com");
+  options.event_ratio = 0.5;
+  options.holding_time_s = 120;
+  options.interim_interval_s = 30;
+  options.timer_interim_ratio = 0.5;
+  options.roles = "0=1,1=1";
+  options.functions = "0=1";
+  options.max_outstanding = 10000;
+  options.connections = 100;
+  options.stats_interval_s = 1;
+
+  if (init_options(argc, argv, options) != 0)
+  {
+    return 1;
+  }
+
+  WeightedMix roles;
+  if (!roles.parse(options.roles))
+  {
+    fprintf(stderr, "Invalid --roles option %s\n", options.roles.c_str());
+    return 1;
+  }
+
+  WeightedMix functions;
+  if (!functions.parse(options.functions))
+  {
+    fprintf(stderr, "Invalid --functions option %s\n", options.functions.c_str());
+    return 1;
+  }
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+
+  LoadGenerator* loadgen = new LoadGenerator(options, &roles, &functions);
+  loadgen->run(&terminated);
+  delete loadgen; loadgen = NULL;
+
+  curl_global_cleanup();
+
+  return 0;
+}
@@ -0,0 +1,197 @@
+/**
+ * @file test_acr_spool.cpp UT for the ACR spool.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "acr_spool.hpp"
+#include "acr_forwarder.hpp"
+
+static const size_t SPOOL_SIZE = 4096;
+
+class AcrSpoolTest : public ::testing::Test
+{
+public:
+  AcrSpoolTest()
+  {
+    char path[] = "/tmp/ralf_acr_spool_XXXXXX";
+    int fd = mkstemp(path);
+    ::close(fd);
+    _path = path;
+    _spool = new AcrSpool(_path, SPOOL_SIZE);
+  }
+
+  virtual ~AcrSpoolTest()
+  {
+    delete _spool; _spool = NULL;
+    unlink(_path.c_str());
+  }
+
+  // Closes the spool and opens it again, as if Ralf had restarted.
+  void reopen()
+  {
+    delete _spool;
+    _spool = new AcrSpool(_path, SPOOL_SIZE);
+    ASSERT_TRUE(_spool->open());
+  }
+
+  std::string pop()
+  {
+    std::string payload;
+    uint64_t spooled_ms;
+    EXPECT_TRUE(_spool->peek(payload, spooled_ms));
+    _spool->pop();
+    return payload;
+  }
+
+  std::string _path;
+  AcrSpool* _spool;
+};
+
+TEST_F(AcrSpoolTest, FirstInFirstOut)
+{
+  ASSERT_TRUE(_spool->open());
+  EXPECT_EQ(0u, _spool->depth());
+
+  EXPECT_TRUE(_spool->append("acr1"));
+  EXPECT_TRUE(_spool->append("acr2"));
+  EXPECT_EQ(2u, _spool->depth());
+
+  EXPECT_EQ("acr1", pop());
+  EXPECT_EQ("acr2", pop());
+  EXPECT_EQ(0u, _spool->depth());
+
+  std::string payload;
+  uint64_t spooled_ms;
+  EXPECT_FALSE(_spool->peek(payload, spooled_ms));
+  EXPECT_EQ(0u, _spool->oldest_age_ms());
+}
+
+TEST_F(AcrSpoolTest, SurvivesRestart)
+{
+  ASSERT_TRUE(_spool->open());
+  _spool->append("acr1");
+  _spool->append("acr2");
+  _spool->append("acr3");
+  _spool->pop();
+
+  reopen();
+  EXPECT_EQ(2u, _spool->depth());
+  EXPECT_EQ("acr2", pop());
+  EXPECT_EQ("acr3", pop());
+}
+
+TEST_F(AcrSpoolTest, DamagedRecordsDiscarded)
+{
+  ASSERT_TRUE(_spool->open());
+  _spool->append("acr1");
+  _spool->append("acr2");
+  _spool->append("acr3");
+  _spool->close();
+
+  // Corrupt the payload of the second record.  It and everything after it
+  // is discarded on recovery.
+  int fd = ::open(_path.c_str(), O_RDWR);
+  off_t offset = 64 + 16 + 4 + 16 + 1;
+  ASSERT_EQ(1, pwrite(fd, "X", 1, offset));
+  ::close(fd);
+
+  reopen();
+  EXPECT_EQ(1u, _spool->depth());
+  EXPECT_EQ("acr1", pop());
+
+  // The spool can be used as normal afterwards.
+  EXPECT_TRUE(_spool->append("acr4"));
+  EXPECT_EQ("acr4", pop());
+}
+
+TEST_F(AcrSpoolTest, FullSpoolDrops)
+{
+  ASSERT_TRUE(_spool->open());
+  std::string big(1000, 'a');
+
+  int appended = 0;
+  while (_spool->append(big))
+  {
+    appended++;
+  }
+
+  EXPECT_EQ(3, appended);
+  EXPECT_EQ(1u, _spool->dropped_count());
+  EXPECT_EQ(3u, _spool->depth());
+}
+
+TEST_F(AcrSpoolTest, CompactsToMakeRoom)
+{
+  ASSERT_TRUE(_spool->open());
+  std::string big(1000, 'a');
+  _spool->append(big);
+  _spool->append(big);
+  _spool->append("acr3");
+
+  // Consuming the first two records leaves room to move the remaining one to
+  // the start of the file.
+  _spool->pop();
+  _spool->pop();
+  EXPECT_TRUE(_spool->append(big));
+  EXPECT_TRUE(_spool->append(big));
+  EXPECT_EQ(0u, _spool->dropped_count());
+
+  EXPECT_EQ("acr3", pop());
+  EXPECT_EQ(big, pop());
+  EXPECT_EQ(big, pop());
+}
+
+TEST_F(AcrSpoolTest, CompactionSurvivesRestart)
+{
+  ASSERT_TRUE(_spool->open());
+  std::string big(1000, 'a');
+  _spool->append(big);
+  _spool->append(big);
+  _spool->append("acr3");
+  _spool->pop();
+  _spool->pop();
+  EXPECT_TRUE(_spool->append(big));
+  EXPECT_TRUE(_spool->append(big));
+
+  reopen();
+  EXPECT_EQ(3u, _spool->depth());
+  EXPECT_EQ("acr3", pop());
+  EXPECT_EQ(big, pop());
+  EXPECT_EQ(big, pop());
+}
+
+TEST_F(AcrSpoolTest, TransientRejectionsReplayed)
+{
+  ASSERT_TRUE(_spool->open());
+  _spool->append("acr1");
+  _spool->append("acr2");
+  AcrForwarder forwarder(_spool, NULL, NULL, "example.com", 200, 10);
+
+  // DIAMETER_TOO_BUSY, DIAMETER_UNABLE_TO_DELIVER and transient failures
+  // leave the ACR to be tried again.
+  forwarder.replay_response(3004);
+  forwarder.replay_response(3002);
+  forwarder.replay_response(4002);
+  forwarder.replay_timeout();
+  EXPECT_EQ(2u, _spool->depth());
+  EXPECT_EQ(0u, forwarder.replayed_count());
+
+  // Success and permanent failures don't.
+  forwarder.replay_response(2001);
+  forwarder.replay_response(5012);
+  EXPECT_EQ(0u, _spool->depth());
+  EXPECT_EQ(2u, forwarder.replayed_count());
+}
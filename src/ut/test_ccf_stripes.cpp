@@ -0,0 +1,60 @@
+/**
+ * @file test_ccf_stripes.cpp UT for striping ACRs across CCF connections.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <set>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "ccf_stripes.hpp"
+
+TEST(CcfStripesTest, UnstripedCcfUnchanged)
+{
+  CcfStripes stripes;
+  EXPECT_TRUE(stripes.configure({}));
+  EXPECT_TRUE(stripes.empty());
+  EXPECT_EQ("ccf1.example.com", stripes.select("ccf1.example.com", "call1"));
+}
+
+TEST(CcfStripesTest, SessionsAreSticky)
+{
+  CcfStripes stripes;
+  EXPECT_TRUE(stripes.configure({"ccf1.example.com=ccf1a.example.com;ccf1b.example.com;ccf1c.example.com"}));
+  EXPECT_FALSE(stripes.empty());
+
+  std::set<std::string> used;
+
+  for (int ii = 0; ii < 100; ii++)
+  {
+    std::string call_id = "call" + std::to_string(ii);
+    std::string stripe = stripes.select("ccf1.example.com", call_id);
+
+    // Every ACR for a session goes to the same stripe.
+    EXPECT_EQ(stripe, stripes.select("ccf1.example.com", call_id));
+    used.insert(stripe);
+  }
+
+  // And the sessions are spread across all the stripes.
+  EXPECT_EQ(3u, used.size());
+  EXPECT_EQ(1u, used.count("ccf1b.example.com"));
+
+  // Other CCFs aren't affected.
+  EXPECT_EQ("ccf2.example.com", stripes.select("ccf2.example.com", "call1"));
+}
+
+TEST(CcfStripesTest, InvalidConfig)
+{
+  CcfStripes stripes;
+  EXPECT_FALSE(stripes.configure({"ccf1.example.com"}));
+  EXPECT_FALSE(stripes.configure({"=ccf1a.example.com"}));
+  EXPECT_FALSE(stripes.configure({"ccf1.example.com="}));
+  EXPECT_FALSE(stripes.configure({"ccf1.example.com=ccf1a.example.com;;ccf1b.example.com"}));
+}
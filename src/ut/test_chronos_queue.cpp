@@ -0,0 +1,333 @@
+/**
+ * @file test_chronos_queue.cpp UT for sending timer operations from a queue.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <semaphore.h>
+#include <unistd.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "chronos_queue.hpp"
+#include "mock_chronos_connection.h"
+
+using ::testing::_;
+using ::testing::DoAll;
+using ::testing::Invoke;
+using ::testing::Return;
+using ::testing::SetArgReferee;
+
+static const SAS::TrailId FAKE_TRAIL_ID = 0;
+static const std::map<std::string, uint32_t> TAGS {{"CALL", 1}};
+
+// Remembers the outcome of a timer operation.
+class TestCallback : public ChronosQueue::Callback
+{
+public:
+  TestCallback() : _calls(0), _rc(0) {}
+
+  void on_timer_complete(HTTPCode rc, const std::string& timer_id)
+  {
+    _calls++;
+    _rc = rc;
+    _timer_id = timer_id;
+  }
+
+  int _calls;
+  HTTPCode _rc;
+  std::string _timer_id;
+};
+
+class ChronosQueueTest : public ::testing::Test
+{
+public:
+  ChronosQueueTest() :
+    _queue(&_chronos, 2, 3)
+  {
+  }
+
+  MockChronosConnection _chronos;
+  ChronosQueue _queue;
+};
+
+TEST_F(ChronosQueueTest, Post)
+{
+  TestCallback callback;
+  EXPECT_CALL(_chronos, send_post(_, 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS))
+    .WillOnce(DoAll(SetArgReferee<0>("NEW_TIMER"), Return(HTTP_OK)));
+
+  ASSERT_TRUE(_queue.start());
+  EXPECT_TRUE(_queue.send(ChronosQueue::POST, "", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, &callback));
+  _queue.stop();
+
+  EXPECT_EQ(1, callback._calls);
+  EXPECT_EQ(HTTP_OK, callback._rc);
+  EXPECT_EQ("NEW_TIMER", callback._timer_id);
+}
+
+TEST_F(ChronosQueueTest, PutFails)
+{
+  TestCallback callback;
+  EXPECT_CALL(_chronos, send_put(_, 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS))
+    .WillOnce(Return(HTTP_SERVER_UNAVAILABLE));
+
+  ASSERT_TRUE(_queue.start());
+  EXPECT_TRUE(_queue.send(ChronosQueue::PUT, "TIMER_ID", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, &callback));
+  _queue.stop();
+
+  EXPECT_EQ(1, callback._calls);
+  EXPECT_EQ(HTTP_SERVER_UNAVAILABLE, callback._rc);
+  EXPECT_EQ("TIMER_ID", callback._timer_id);
+}
+
+TEST_F(ChronosQueueTest, Delete)
+{
+  EXPECT_CALL(_chronos, send_delete("TIMER_ID", FAKE_TRAIL_ID)).WillOnce(Return(HTTP_OK));
+
+  ASSERT_TRUE(_queue.start());
+  EXPECT_TRUE(_queue.send_delete("TIMER_ID", FAKE_TRAIL_ID));
+  _queue.stop();
+}
+
+TEST_F(ChronosQueueTest, NotStarted)
+{
+  TestCallback callback;
+  EXPECT_FALSE(_queue.send(ChronosQueue::POST, "", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, &callback));
+  EXPECT_FALSE(_queue.send_delete("TIMER_ID", FAKE_TRAIL_ID));
+  EXPECT_EQ(0, callback._calls);
+}
+
+TEST_F(ChronosQueueTest, Full)
+{
+  // Hold up both threads in Chronos until we're ready.
+  sem_t started;
+  sem_t release;
+  sem_init(&started, 0, 0);
+  sem_init(&release, 0, 0);
+
+  EXPECT_CALL(_chronos, send_delete(_, FAKE_TRAIL_ID))
+    .Times(5)
+    .WillRepeatedly(Invoke([&](const std::string&, SAS::TrailId) -> HTTPCode
+                           {
+                             sem_post(&started);
+                             sem_wait(&release);
+                             return HTTP_OK;
+                           }));
+
+  ASSERT_TRUE(_queue.start());
+  EXPECT_TRUE(_queue.send_delete("TIMER_1", FAKE_TRAIL_ID));
+  EXPECT_TRUE(_queue.send_delete("TIMER_2", FAKE_TRAIL_ID));
+  sem_wait(&started);
+  sem_wait(&started);
+
+  // Both threads are busy, so only three more operations can be queued.
+  EXPECT_TRUE(_queue.send_delete("TIMER_3", FAKE_TRAIL_ID));
+  EXPECT_TRUE(_queue.send_delete("TIMER_4", FAKE_TRAIL_ID));
+  EXPECT_TRUE(_queue.send_delete("TIMER_5", FAKE_TRAIL_ID));
+  EXPECT_EQ(3u, _queue.depth());
+  EXPECT_FALSE(_queue.send_delete("TIMER_6", FAKE_TRAIL_ID));
+
+  for (int ii = 0; ii < 5; ii++)
+  {
+    sem_post(&release);
+  }
+
+  // Stopping waits for the queue to empty.
+  _queue.stop();
+  EXPECT_EQ(0u, _queue.depth());
+
+  sem_destroy(&started);
+  sem_destroy(&release);
+}
+
+TEST_F(ChronosQueueTest, SameTimerInOrder)
+{
+  // Hold up the update in Chronos until we're ready.
+  sem_t started;
+  sem_t release;
+  sem_init(&started, 0, 0);
+  sem_init(&release, 0, 0);
+  std::vector<std::string> sent;
+
+  EXPECT_CALL(_chronos, send_put(_, _, _, _, _, _, _))
+    .WillOnce(Invoke([&](std::string&, uint32_t, uint32_t, const std::string&, const std::string&, SAS::TrailId, const std::map<std::string, uint32_t>&) -> HTTPCode
+                     {
+                       sem_post(&started);
+                       sem_wait(&release);
+                       sent.push_back("PUT");
+                       return HTTP_OK;
+                     }));
+  EXPECT_CALL(_chronos, send_delete("TIMER_ID", FAKE_TRAIL_ID))
+    .WillOnce(Invoke([&](const std::string&, SAS::TrailId) -> HTTPCode
+                     {
+                       sent.push_back("DELETE");
+                       return HTTP_OK;
+                     }));
+  EXPECT_CALL(_chronos, send_delete("OTHER_TIMER", FAKE_TRAIL_ID))
+    .WillOnce(Return(HTTP_OK));
+
+  ASSERT_TRUE(_queue.start());
+  EXPECT_TRUE(_queue.send(ChronosQueue::PUT, "TIMER_ID", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, NULL));
+  sem_wait(&started);
+
+  // The other thread is free, but the deletion waits for the update.
+  // Operations on other timers don't wait behind it.
+  EXPECT_TRUE(_queue.send_delete("TIMER_ID", FAKE_TRAIL_ID));
+  EXPECT_TRUE(_queue.send_delete("OTHER_TIMER", FAKE_TRAIL_ID));
+
+  for (int ii = 0; (ii < 100) && (_queue.sent_count() == 0); ii++)
+  {
+    usleep(10000);
+  }
+
+  EXPECT_EQ(1u, _queue.sent_count());
+  EXPECT_EQ(1u, _queue.depth());
+  EXPECT_TRUE(sent.empty());
+
+  sem_post(&release);
+  _queue.stop();
+
+  ASSERT_EQ(2u, sent.size());
+  EXPECT_EQ("PUT", sent[0]);
+  EXPECT_EQ("DELETE", sent[1]);
+
+  sem_destroy(&started);
+  sem_destroy(&release);
+}
+
+class ChronosQueueCoalesceTest : public ::testing::Test
+{
+public:
+  // Operations wait much longer than the tests take, so are only sent when
+  // the queue is stopped.
+  ChronosQueueCoalesceTest() :
+    _queue(&_chronos, 2, 3, NULL, 60000)
+  {
+  }
+
+  MockChronosConnection _chronos;
+  ChronosQueue _queue;
+};
+
+TEST_F(ChronosQueueCoalesceTest, LatestUpdateWins)
+{
+  TestCallback callback1;
+  TestCallback callback2;
+  EXPECT_CALL(_chronos, send_put(_, 20, 200, "/uri2", "opaque2", FAKE_TRAIL_ID, TAGS))
+    .WillOnce(Return(HTTP_OK));
+
+  ASSERT_TRUE(_queue.start());
+  EXPECT_TRUE(_queue.send(ChronosQueue::PUT, "TIMER_ID", 10, 100, "/uri1", "opaque1", FAKE_TRAIL_ID, TAGS, &callback1));
+  EXPECT_TRUE(_queue.send(ChronosQueue::PUT, "TIMER_ID", 20, 200, "/uri2", "opaque2", FAKE_TRAIL_ID, TAGS, &callback2));
+  EXPECT_EQ(1u, _queue.depth());
+  _queue.stop();
+
+  // Both callers hear how the update went.
+  EXPECT_EQ(1, callback1._calls);
+  EXPECT_EQ(1, callback2._calls);
+  EXPECT_EQ(HTTP_OK, callback1._rc);
+  EXPECT_EQ(1u, _queue.sent_count());
+  EXPECT_EQ(1u, _queue.coalesced_count());
+}
+
+TEST_F(ChronosQueueCoalesceTest, DeleteCancelsUpdate)
+{
+  TestCallback callback;
+  EXPECT_CALL(_chronos, send_put(_, _, _, _, _, _, _)).Times(0);
+  EXPECT_CALL(_chronos, send_delete("TIMER_ID", FAKE_TRAIL_ID)).WillOnce(Return(HTTP_OK));
+
+  ASSERT_TRUE(_queue.start());
+  EXPECT_TRUE(_queue.send(ChronosQueue::PUT, "TIMER_ID", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, &callback));
+  EXPECT_TRUE(_queue.send_delete("TIMER_ID", FAKE_TRAIL_ID));
+
+  // The deletion isn't delayed, and the update waiting for the timer is
+  // dropped rather than being sent afterwards.
+  for (int ii = 0; (ii < 100) && (_queue.sent_count() == 0); ii++)
+  {
+    usleep(10000);
+  }
+
+  EXPECT_EQ(1u, _queue.sent_count());
+  EXPECT_EQ(0u, _queue.depth());
+  _queue.stop();
+
+  EXPECT_EQ(1, callback._calls);
+  EXPECT_EQ("TIMER_ID", callback._timer_id);
+  EXPECT_EQ(1u, _queue.sent_count());
+  EXPECT_EQ(1u, _queue.coalesced_count());
+}
+
+TEST_F(ChronosQueueCoalesceTest, DeletesNotCoalesced)
+{
+  EXPECT_CALL(_chronos, send_delete("TIMER_ID", FAKE_TRAIL_ID))
+    .Times(2)
+    .WillRepeatedly(Return(HTTP_OK));
+
+  ASSERT_TRUE(_queue.start());
+  EXPECT_TRUE(_queue.send_delete("TIMER_ID", FAKE_TRAIL_ID));
+  EXPECT_TRUE(_queue.send_delete("TIMER_ID", FAKE_TRAIL_ID));
+  _queue.stop();
+
+  EXPECT_EQ(2u, _queue.sent_count());
+  EXPECT_EQ(0u, _queue.coalesced_count());
+}
+
+TEST_F(ChronosQueueCoalesceTest, SeparateTimers)
+{
+  EXPECT_CALL(_chronos, send_put(_, _, _, _, _, _, _)).Times(3).WillRepeatedly(Return(HTTP_OK));
+
+  ASSERT_TRUE(_queue.start());
+  EXPECT_TRUE(_queue.send(ChronosQueue::PUT, "TIMER_1", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, NULL));
+  EXPECT_TRUE(_queue.send(ChronosQueue::PUT, "TIMER_2", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, NULL));
+  EXPECT_TRUE(_queue.send(ChronosQueue::PUT, "TIMER_3", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, NULL));
+
+  // Operations waiting to be coalesced count towards the queue's depth, but
+  // coalescing is always allowed.
+  EXPECT_FALSE(_queue.send(ChronosQueue::PUT, "TIMER_4", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, NULL));
+  EXPECT_TRUE(_queue.send(ChronosQueue::PUT, "TIMER_3", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, NULL));
+  _queue.stop();
+
+  EXPECT_EQ(3u, _queue.sent_count());
+}
+
+TEST_F(ChronosQueueCoalesceTest, CreatesNotCoalesced)
+{
+  TestCallback callback1;
+  TestCallback callback2;
+  EXPECT_CALL(_chronos, send_post(_, _, _, _, _, _, _))
+    .Times(2)
+    .WillRepeatedly(DoAll(SetArgReferee<0>("NEW_TIMER"), Return(HTTP_OK)));
+
+  ASSERT_TRUE(_queue.start());
+  EXPECT_TRUE(_queue.send(ChronosQueue::POST, "", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, &callback1));
+  EXPECT_TRUE(_queue.send(ChronosQueue::POST, "", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, &callback2));
+  _queue.stop();
+
+  EXPECT_EQ(1, callback1._calls);
+  EXPECT_EQ(1, callback2._calls);
+  EXPECT_EQ(0u, _queue.coalesced_count());
+}
+
+TEST_F(ChronosQueueCoalesceTest, FlushedOnTick)
+{
+  ChronosQueue queue(&_chronos, 1, 10, NULL, 10);
+  EXPECT_CALL(_chronos, send_put(_, _, _, _, _, _, _)).WillOnce(Return(HTTP_OK));
+
+  ASSERT_TRUE(queue.start());
+  EXPECT_TRUE(queue.send(ChronosQueue::PUT, "TIMER_ID", 10, 100, "/uri", "opaque", FAKE_TRAIL_ID, TAGS, NULL));
+
+  for (int ii = 0; (ii < 100) && (queue.sent_count() == 0); ii++)
+  {
+    usleep(10000);
+  }
+
+  EXPECT_EQ(1u, queue.sent_count());
+  queue.stop();
+}
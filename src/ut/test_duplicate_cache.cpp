@@ -0,0 +1,110 @@
+/**
+ * @file test_duplicate_cache.cpp UT for the duplicate ACR cache.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "duplicate_cache.hpp"
+
+class DuplicateCacheTest : public ::testing::Test
+{
+public:
+  DuplicateCacheTest() : _cache(1000) {}
+
+  DuplicateCache _cache;
+};
+
+TEST_F(DuplicateCacheTest, Keys)
+{
+  std::string key = DuplicateCache::key("CALL_ID", 0, 1, 3, "body");
+  EXPECT_EQ(key, DuplicateCache::key("CALL_ID", 0, 1, 3, "body"));
+
+  // Any difference gives a different key.
+  EXPECT_NE(key, DuplicateCache::key("CALL_ID2", 0, 1, 3, "body"));
+  EXPECT_NE(key, DuplicateCache::key("CALL_ID", 1, 1, 3, "body"));
+  EXPECT_NE(key, DuplicateCache::key("CALL_ID", 0, 2, 3, "body"));
+  EXPECT_NE(key, DuplicateCache::key("CALL_ID", 0, 1, 4, "body"));
+  EXPECT_NE(key, DuplicateCache::key("CALL_ID", 0, 1, 3, "body2"));
+}
+
+TEST_F(DuplicateCacheTest, Duplicates)
+{
+  std::string key1 = DuplicateCache::key("CALL_ID", 0, 1, 3, "body");
+  std::string key2 = DuplicateCache::key("CALL_ID", 0, 1, 3, "other body");
+
+  EXPECT_FALSE(_cache.check(key1, 10000));
+  EXPECT_FALSE(_cache.check(key2, 10000));
+  EXPECT_TRUE(_cache.check(key1, 10500));
+  EXPECT_TRUE(_cache.check(key1, 10999));
+  EXPECT_EQ(2u, _cache.suppressed());
+  EXPECT_EQ(2u, _cache.size());
+
+  // Once the window is up the ACR is forgotten, so the next one is handled
+  // (and remembered in its turn).
+  EXPECT_FALSE(_cache.check(key1, 11000));
+  EXPECT_TRUE(_cache.check(key1, 11500));
+  EXPECT_EQ(3u, _cache.suppressed());
+}
+
+TEST_F(DuplicateCacheTest, Expiry)
+{
+  for (int ii = 0; ii < 1000; ii++)
+  {
+    _cache.check(DuplicateCache::key("CALL_ID" + std::to_string(ii), 0, 0, 1, ""), 10000 + ii);
+  }
+
+  EXPECT_EQ(1000u, _cache.size());
+
+  // Entries are only forgotten when their shard is next used, so use them
+  // all.  By then the first 501 have expired.
+  for (int ii = 0; ii < 100; ii++)
+  {
+    _cache.check(DuplicateCache::key("NEW_CALL_ID" + std::to_string(ii), 0, 0, 1, ""), 11500);
+  }
+
+  EXPECT_EQ(599u, _cache.size());
+  EXPECT_EQ(0u, _cache.suppressed());
+}
+
+TEST_F(DuplicateCacheTest, TimerPops)
+{
+  // Every pop of a session's timer has the same key.
+  std::string key = DuplicateCache::timer_pop_key("CALL_ID", 0, 1);
+  EXPECT_EQ(key, DuplicateCache::timer_pop_key("CALL_ID", 0, 1));
+  EXPECT_NE(key, DuplicateCache::timer_pop_key("CALL_ID2", 0, 1));
+  EXPECT_NE(key, DuplicateCache::timer_pop_key("CALL_ID", 1, 1));
+  EXPECT_NE(key, DuplicateCache::key("CALL_ID", 0, 1, 3, ""));
+
+  // A pop is only remembered for as long as it's asked to be, so the next
+  // real pop isn't taken for a repeat.
+  EXPECT_FALSE(_cache.check_within(key, 300, 10000));
+  EXPECT_TRUE(_cache.check_within(key, 300, 10299));
+  EXPECT_FALSE(_cache.check_within(key, 300, 10300));
+
+  // It's never remembered for longer than the cache's window.
+  EXPECT_FALSE(_cache.check_within(key, 5000, 20000));
+  EXPECT_TRUE(_cache.check_within(key, 5000, 20999));
+  EXPECT_FALSE(_cache.check_within(key, 5000, 21000));
+  EXPECT_EQ(2u, _cache.suppressed());
+}
+
+TEST_F(DuplicateCacheTest, ShortWindowExpiresFirst)
+{
+  // An entry with a short window expires before one ahead of it in the
+  // queue.
+  std::string key1 = DuplicateCache::key("CALL_ID", 0, 1, 3, "body");
+  std::string key2 = DuplicateCache::timer_pop_key("CALL_ID", 0, 1);
+
+  EXPECT_FALSE(_cache.check(key1, 10000));
+  EXPECT_FALSE(_cache.check_within(key2, 100, 10000));
+  EXPECT_FALSE(_cache.check_within(key2, 100, 10100));
+  EXPECT_TRUE(_cache.check(key1, 10100));
+}
@@ -0,0 +1,671 @@
+/**
+ * @file test_e2e_perf.cpp End-to-end throughput harness for Ralf.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Pushes synthetic call lifecycles (START, INTERIMs, STOP) through
+// BillingTask, SessionManager and PeerMessageSender, with stand-ins for
+// memcached (Astaire), Chronos and the CDF that each add a configurable
+// latency.  Reports the sustained ACR rate, the rate per core of CPU used,
+// and latency percentiles for each stage.
+//
+// This is disabled in the normal UT run.  Use "make e2e_perf" in src to run
+// it (at full size), or run ralf_test with --gtest_also_run_disabled_tests
+// and --gtest_filter=E2EPerfTest.* for a small sanity check.  The following
+// environment variables control the run.
+//   RALF_E2E_LIFECYCLES        - Number of calls (default 1000).
+//   RALF_E2E_INTERIMS          - INTERIMs per call (default 2).
+//   RALF_E2E_THREADS           - Number of HTTP worker threads (default 2).
+//   RALF_E2E_CALLS_IN_FLIGHT   - Calls in progress per thread (default 16).
+//   RALF_E2E_STORE_LATENCY_US  - Latency added to each store operation.
+//   RALF_E2E_CHRONOS_LATENCY_US - Latency added to each Chronos request.
+//   RALF_E2E_CDF_LATENCY_US    - Latency before the CDF answers each ACR.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <deque>
+#include <map>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "test_utils.hpp"
+
+#include "handlers.hpp"
+#include "message.hpp"
+#include "mockhttpstack.hpp"
+#include "localstore.h"
+#include "session_store.h"
+#include "session_manager.hpp"
+#include "chronosconnection.h"
+#include "peer_message_sender.hpp"
+#include "peer_message_sender_factory.hpp"
+#include "ralf_time.hpp"
+#include "latency_histogram.hpp"
+
+using ::testing::NiceMock;
+
+static int env_int(const char* name, int default_value)
+{
+  const char* value = getenv(name);
+  return (value != NULL) ? atoi(value) : default_value;
+}
+
+// Latency histogram that can be updated from several threads.
+class StageStats
+{
+public:
+  StageStats() { pthread_mutex_init(&_lock, NULL); }
+  ~StageStats() { pthread_mutex_destroy(&_lock); }
+
+  void record(uint64_t latency_us)
+  {
+    pthread_mutex_lock(&_lock);
+    _hist.record(latency_us);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  void print(const char* name)
+  {
+    pthread_mutex_lock(&_lock);
+    printf("%-10s %10lu %10lu %10lu %10lu %10lu %10lu\n",
+           name,
+           (unsigned long)_hist.count(),
+           (unsigned long)_hist.percentile(50),
+           (unsigned long)_hist.percentile(90),
+           (unsigned long)_hist.percentile(99),
+           (unsigned long)_hist.percentile(99.9),
+           (unsigned long)_hist.max());
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  pthread_mutex_t _lock;
+  LatencyHistogram _hist;
+};
+
+static void delay_us(int latency_us)
+{
+  if (latency_us > 0)
+  {
+    usleep(latency_us);
+  }
+}
+
+// Stand-in for memcached, via Astaire.
+class DelayedStore : public LocalStore
+{
+public:
+  DelayedStore(int latency_us, StageStats* stats) :
+    LocalStore(), _latency_us(latency_us), _stats(stats) {}
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         Store::Format data_format)
+  {
+    uint64_t start = RalfTime::now_us();
+    delay_us(_latency_us);
+    Store::Status status = LocalStore::get_data(table, key, data, cas, trail, data_format);
+    _stats->record(RalfTime::now_us() - start);
+    return status;
+  }
+
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail,
+                         Store::Format data_format)
+  {
+    uint64_t start = RalfTime::now_us();
+    delay_us(_latency_us);
+    Store::Status status = LocalStore::set_data(table, key, data, cas, expiry, trail, data_format);
+    _stats->record(RalfTime::now_us() - start);
+    return status;
+  }
+
+  Store::Status delete_data(const std::string& table,
+                            const std::string& key,
+                            SAS::TrailId trail)
+  {
+    uint64_t start = RalfTime::now_us();
+    delay_us(_latency_us);
+    Store::Status status = LocalStore::delete_data(table, key, trail);
+    _stats->record(RalfTime::now_us() - start);
+    return status;
+  }
+
+private:
+  int _latency_us;
+  StageStats* _stats;
+};
+
+// Stand-in for Chronos.
+class DelayedChronosConnection : public ChronosConnection
+{
+public:
+  DelayedChronosConnection(int latency_us, StageStats* stats) :
+    ChronosConnection("localhost:10888", NULL),
+    _latency_us(latency_us),
+    _stats(stats),
+    _next_timer_id(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  ~DelayedChronosConnection()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  HTTPCode send_delete(const std::string& delete_id, SAS::TrailId trail)
+  {
+    return timer_request();
+  }
+
+  HTTPCode send_put(std::string& put_identity,
+                    uint32_t timer_interval,
+                    uint32_t repeat_for,
+                    const std::string& callback_uri,
+                    const std::string& opaque_data,
+                    SAS::TrailId trail,
+                    const std::map<std::string, uint32_t>& tags)
+  {
+    return timer_request();
+  }
+
+  HTTPCode send_post(std::string& post_identity,
+                     uint32_t timer_interval,
+                     uint32_t repeat_for,
+                     const std::string& callback_uri,
+                     const std::string& opaque_data,
+                     SAS::TrailId trail,
+                     const std::map<std::string, uint32_t>& tags)
+  {
+    pthread_mutex_lock(&_lock);
+    post_identity = "timer-" + std::to_string(_next_timer_id++);
+    pthread_mutex_unlock(&_lock);
+
+    return timer_request();
+  }
+
+private:
+  HTTPCode timer_request()
+  {
+    uint64_t start = RalfTime::now_us();
+    delay_us(_latency_us);
+    _stats->record(RalfTime::now_us() - start);
+    return HTTP_OK;
+  }
+
+  int _latency_us;
+  StageStats* _stats;
+  pthread_mutex_t _lock;
+  uint64_t _next_timer_id;
+};
+
+// Stand-in for the CDF.  Answers each ACR with success after the configured
+// latency, from a pool of responder threads.
+class DelayedCdfStack : public Diameter::Stack
+{
+public:
+  DelayedCdfStack(Rf::Dictionary* dict,
+                  int latency_us,
+                  int num_threads,
+                  StageStats* stats) :
+    _dict(dict),
+    _latency_us(latency_us),
+    _stats(stats),
+    _terminated(false),
+    _next_session(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+
+    for (int ii = 0; ii < num_threads; ii++)
+    {
+      pthread_t thread;
+      pthread_create(&thread, NULL, responder_thread_fn, this);
+      _threads.push_back(thread);
+    }
+  }
+
+  ~DelayedCdfStack()
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    for (size_t ii = 0; ii < _threads.size(); ii++)
+    {
+      pthread_join(_threads[ii], NULL);
+    }
+
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  void send(struct msg* fd_msg, Diameter::Transaction* tsx, unsigned int timeout_ms)
+  {
+    // We don't need the ACR itself.
+    fd_msg_free(fd_msg);
+
+    uint64_t now = RalfTime::now_us();
+    pthread_mutex_lock(&_lock);
+    _pending.insert(std::make_pair(now + _latency_us, std::make_pair(now, tsx)));
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  static void* responder_thread_fn(void* stack_ptr)
+  {
+    ((DelayedCdfStack*)stack_ptr)->responder_thread();
+    return NULL;
+  }
+
+  void responder_thread()
+  {
+    pthread_mutex_lock(&_lock);
+
+    while (!_terminated)
+    {
+      uint64_t now = RalfTime::now_us();
+
+      if ((_pending.empty()) || (_pending.begin()->first > now))
+      {
+        uint64_t wait_us = _pending.empty() ? 100000 : (_pending.begin()->first - now);
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        uint64_t wake_ns = ((uint64_t)wake.tv_sec * 1000000000) + wake.tv_nsec + (wait_us * 1000);
+        wake.tv_sec = wake_ns / 1000000000;
+        wake.tv_nsec = wake_ns % 1000000000;
+        pthread_cond_timedwait(&_cond, &_lock, &wake);
+        continue;
+      }
+
+      uint64_t sent = _pending.begin()->second.first;
+      Diameter::Transaction* tsx = _pending.begin()->second.second;
+      _pending.erase(_pending.begin());
+      std::string session_id = "ralf.example.com;" + std::to_string(_next_session++);
+      pthread_mutex_unlock(&_lock);
+
+      _stats->record(now - sent);
+
+      Rf::AccountingResponse aca(_dict, this, 2001, session_id);
+      aca.add(Diameter::AVP(_dict->ACCT_INTERIM_INTERVAL).val_i32(300));
+      tsx->on_response(aca);
+      delete tsx;
+
+      pthread_mutex_lock(&_lock);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  Rf::Dictionary* _dict;
+  int _latency_us;
+  StageStats* _stats;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  std::vector<pthread_t> _threads;
+  bool _terminated;
+  uint64_t _next_session;
+
+  // ACRs waiting for an answer, keyed by when the answer is due, with the
+  // time each was sent.
+  std::multimap<uint64_t, std::pair<uint64_t, Diameter::Transaction*> > _pending;
+};
+
+// Each worker thread works through its calls, sending the next ACR on each
+// call once the previous one has been answered.
+class Worker;
+
+// Tells the worker that owns a call when each of its ACRs has been handled.
+// PeerMessageSender deletes itself once it has finished with an ACR, so we
+// use that as the signal.
+class TrackingPeerMessageSender : public PeerMessageSender
+{
+public:
+  TrackingPeerMessageSender(SAS::TrailId trail) :
+    PeerMessageSender(trail, "example.com", 200) {}
+
+  virtual ~TrackingPeerMessageSender();
+
+  void send(Message* msg,
+            SessionManager* sm,
+            Rf::Dictionary* dict,
+            Diameter::Stack* diameter_stack)
+  {
+    _call_id = msg->call_id;
+    _acr_sent = true;
+    PeerMessageSender::send(msg, sm, dict, diameter_stack);
+  }
+
+  // Set when an ACR is sent on this thread, so the worker can tell whether
+  // a request resulted in an ACR.
+  static __thread bool _acr_sent;
+
+private:
+  std::string _call_id;
+};
+
+__thread bool TrackingPeerMessageSender::_acr_sent = false;
+
+class TrackingPeerMessageSenderFactory : public PeerMessageSenderFactory
+{
+public:
+  TrackingPeerMessageSenderFactory() : PeerMessageSenderFactory("example.com", 200) {}
+
+  PeerMessageSender* newSender(SAS::TrailId trail)
+  {
+    return new TrackingPeerMessageSender(trail);
+  }
+};
+
+class Worker
+{
+public:
+  Worker(int index,
+         int num_calls,
+         int calls_in_flight,
+         int interims,
+         BillingHandlerConfig* cfg,
+         HttpStack* http_stack,
+         StageStats* handler_stats,
+         StageStats* acr_stats) :
+    _index(index),
+    _num_calls(num_calls),
+    _calls_in_flight(calls_in_flight),
+    _interims(interims),
+    _cfg(cfg),
+    _http_stack(http_stack),
+    _handler_stats(handler_stats),
+    _acr_stats(acr_stats),
+    _slots(calls_in_flight),
+    _calls_started(0),
+    _calls_finished(0),
+    _acrs(0),
+    _errors(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+  }
+
+  ~Worker()
+  {
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  void start() { pthread_create(&_thread, NULL, thread_fn, this); }
+  void join() { pthread_join(_thread, NULL); }
+
+  uint64_t acrs() { return _acrs; }
+  uint64_t errors() { return _errors; }
+
+  // Called when the ACR for one of our calls has been handled.
+  void acr_complete(int slot)
+  {
+    pthread_mutex_lock(&_lock);
+    _completed.push_back(slot);
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // Finds the worker and slot from a call ID.
+  static void parse_call_id(const std::string& call_id, int& worker, int& slot)
+  {
+    sscanf(call_id.c_str(), "e2e-%d-%d-", &worker, &slot);
+  }
+
+private:
+  struct Call
+  {
+    std::string call_id;
+    int acrs_sent;
+    uint64_t acr_start_us;
+  };
+
+  static void* thread_fn(void* worker_ptr)
+  {
+    ((Worker*)worker_ptr)->run();
+    return NULL;
+  }
+
+  void run()
+  {
+    for (int slot = 0; slot < _calls_in_flight && _calls_started < _num_calls; slot++)
+    {
+      start_call(slot);
+    }
+
+    pthread_mutex_lock(&_lock);
+
+    while (_calls_finished < _num_calls)
+    {
+      if (_completed.empty())
+      {
+        pthread_cond_wait(&_cond, &_lock);
+        continue;
+      }
+
+      int slot = _completed.front();
+      _completed.pop_front();
+      pthread_mutex_unlock(&_lock);
+
+      Call& call = _slots[slot];
+      _acr_stats->record(RalfTime::now_us() - call.acr_start_us);
+      _acrs++;
+      next_acr(slot);
+
+      pthread_mutex_lock(&_lock);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  void start_call(int slot)
+  {
+    Call& call = _slots[slot];
+    call.call_id = "e2e-" + std::to_string(_index) + "-" + std::to_string(slot) + "-" + std::to_string(_calls_started++);
+    call.acrs_sent = 0;
+    send_acr(slot);
+  }
+
+  // Moves a call on to its next ACR, or starts a new call in its slot.
+  void next_acr(int slot)
+  {
+    Call& call = _slots[slot];
+
+    if (call.acrs_sent < _interims + 2)
+    {
+      send_acr(slot);
+    }
+    else
+    {
+      _calls_finished++;
+
+      if (_calls_started < _num_calls)
+      {
+        start_call(slot);
+      }
+    }
+  }
+
+  void send_acr(int slot)
+  {
+    Call& call = _slots[slot];
+    int record_type = (call.acrs_sent == 0) ? 2 : (call.acrs_sent <= _interims) ? 3 : 4;
+    call.acrs_sent++;
+
+    std::string body = "{\"peers\":{\"ccf\":[\"cdf.example.com\"]},\"event\":{"
+                       "\"Accounting-Record-Type\":" + std::to_string(record_type) + ","
+                       "\"Acct-Interim-Interval\":300,"
+                       "\"Service-Information\":{\"IMS-Information\":{"
+                       "\"Role-Of-Node\":0,\"Node-Functionality\":0,"
+                       "\"User-Session-Id\":\"" + call.call_id + "\"}}}}";
+
+    MockHttpStack::Request req(_http_stack, "/call-id/", call.call_id, "", body, htp_method_POST);
+    BillingTask* task = new BillingTask(req, _cfg, 0);
+
+    TrackingPeerMessageSender::_acr_sent = false;
+    call.acr_start_us = RalfTime::now_us();
+    task->run();
+    _handler_stats->record(RalfTime::now_us() - call.acr_start_us);
+
+    if (!TrackingPeerMessageSender::_acr_sent)
+    {
+      // The request didn't result in an ACR, so there's nothing to wait for.
+      _errors++;
+      next_acr(slot);
+    }
+  }
+
+  int _index;
+  int _num_calls;
+  int _calls_in_flight;
+  int _interims;
+  BillingHandlerConfig* _cfg;
+  HttpStack* _http_stack;
+  StageStats* _handler_stats;
+  StageStats* _acr_stats;
+
+  pthread_t _thread;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  std::deque<int> _completed;
+
+  std::vector<Call> _slots;
+  int _calls_started;
+  int _calls_finished;
+  uint64_t _acrs;
+  uint64_t _errors;
+};
+
+static std::vector<Worker*> workers;
+
+TrackingPeerMessageSender::~TrackingPeerMessageSender()
+{
+  if (!_call_id.empty())
+  {
+    int worker = -1;
+    int slot = -1;
+    Worker::parse_call_id(_call_id, worker, slot);
+    workers[worker]->acr_complete(slot);
+  }
+}
+
+class E2EPerfTest : public ::testing::Test
+{
+};
+
+TEST_F(E2EPerfTest, DISABLED_Throughput)
+{
+  int lifecycles = env_int("RALF_E2E_LIFECYCLES", 1000);
+  int interims = env_int("RALF_E2E_INTERIMS", 2);
+  int num_threads = env_int("RALF_E2E_THREADS", 2);
+  int calls_in_flight = env_int("RALF_E2E_CALLS_IN_FLIGHT", 16);
+
+  StageStats handler_stats;
+  StageStats store_stats;
+  StageStats chronos_stats;
+  StageStats cdf_stats;
+  StageStats acr_stats;
+
+  Diameter::Stack* real_stack = Diameter::Stack::get_instance();
+  real_stack->initialize();
+  real_stack->configure(UT_DIR + "/diameterstack.conf", NULL);
+  Rf::Dictionary* dict = new Rf::Dictionary();
+
+  DelayedStore* data_store = new DelayedStore(env_int("RALF_E2E_STORE_LATENCY_US", 0), &store_stats);
+  SessionStore* session_store = new SessionStore(data_store);
+  DelayedChronosConnection* chronos = new DelayedChronosConnection(env_int("RALF_E2E_CHRONOS_LATENCY_US", 0), &chronos_stats);
+  DelayedCdfStack* cdf = new DelayedCdfStack(dict, env_int("RALF_E2E_CDF_LATENCY_US", 0), num_threads, &cdf_stats);
+  TrackingPeerMessageSenderFactory* factory = new TrackingPeerMessageSenderFactory();
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(session_store, {}, dict, factory, chronos, cdf, hc);
+  NiceMock<MockHttpStack>* http_stack = new NiceMock<MockHttpStack>();
+  BillingHandlerConfig* cfg = new BillingHandlerConfig();
+  cfg->mgr = mgr;
+  cfg->acr_deadline_ms = 0;
+
+  for (int ii = 0; ii < num_threads; ii++)
+  {
+    int calls = (lifecycles / num_threads) + ((ii < lifecycles % num_threads) ? 1 : 0);
+    workers.push_back(new Worker(ii, calls, calls_in_flight, interims, cfg, http_stack, &handler_stats, &acr_stats));
+  }
+
+  struct timespec cpu_start;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+  uint64_t start_us = RalfTime::now_us();
+
+  for (size_t ii = 0; ii < workers.size(); ii++)
+  {
+    workers[ii]->start();
+  }
+
+  uint64_t acrs = 0;
+  uint64_t errors = 0;
+
+  for (size_t ii = 0; ii < workers.size(); ii++)
+  {
+    workers[ii]->join();
+    acrs += workers[ii]->acrs();
+    errors += workers[ii]->errors();
+  }
+
+  uint64_t elapsed_us = RalfTime::now_us() - start_us;
+  struct timespec cpu_end;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+  double cpu_s = (cpu_end.tv_sec - cpu_start.tv_sec) + ((cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9);
+  double elapsed_s = elapsed_us / 1e6;
+
+  printf("\n%d calls, %lu ACRs in %.2fs using %.2f CPU seconds\n",
+         lifecycles, (unsigned long)acrs, elapsed_s, cpu_s);
+  printf("%.0f ACRs/s, %.0f ACRs/s per core\n",
+         acrs / elapsed_s, acrs / std::max(cpu_s, 1e-6));
+  printf("\n%-10s %10s %10s %10s %10s %10s %10s\n",
+         "Stage (us)", "count", "p50", "p90", "p99", "p99.9", "max");
+  handler_stats.print("handler");
+  store_stats.print("store");
+  chronos_stats.print("chronos");
+  cdf_stats.print("cdf");
+  acr_stats.print("acr");
+
+  EXPECT_EQ(0u, errors);
+  EXPECT_EQ((uint64_t)lifecycles * (interims + 2), acrs);
+
+  for (size_t ii = 0; ii < workers.size(); ii++)
+  {
+    delete workers[ii];
+  }
+  workers.clear();
+
+  delete cdf; cdf = NULL;
+  delete cfg; cfg = NULL;
+  delete http_stack; http_stack = NULL;
+  delete mgr; mgr = NULL;
+  delete hc; hc = NULL;
+  delete factory; factory = NULL;
+  delete chronos; chronos = NULL;
+  delete session_store; session_store = NULL;
+  delete data_store; data_store = NULL;
+  delete dict; dict = NULL;
+
+  real_stack->stop();
+  real_stack->wait_stopped();
+}
@@ -0,0 +1,183 @@
+/**
+ * @file test_flight_recorder.cpp UT for the slow request flight recorder.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "flight_recorder.hpp"
+#include "stage_statistics.hpp"
+
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+// Counts the non-comment lines in a dump.
+static int count_requests(const std::string& dump)
+{
+  std::istringstream iss(dump);
+  std::string line;
+  int count = 0;
+
+  while (std::getline(iss, line))
+  {
+    if (!line.empty() && (line[0] != '#'))
+    {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+// Records a request that took the given time.
+static void record_request(FlightRecorder& recorder,
+                           const std::string& call_id,
+                           uint64_t duration_us)
+{
+  FlightRecorder::Timeline timeline;
+  uint64_t arrival_us = RalfTime::now_us() - duration_us;
+  timeline.start(&recorder, arrival_us, call_id, 0);
+  timeline.mark_at(FlightRecorder::PARSED, 0, arrival_us + 100);
+  timeline.finish();
+}
+
+TEST(FlightRecorderTest, Timeline)
+{
+  FlightRecorder recorder(0);
+  FlightRecorder::Timeline timeline;
+  uint64_t arrival_us = RalfTime::now_us();
+
+  timeline.mark(FlightRecorder::PARSED);
+  EXPECT_FALSE(timeline.started());
+
+  timeline.start(&recorder, arrival_us, "call-id-1", 1234);
+  EXPECT_TRUE(timeline.started());
+  timeline.mark_at(FlightRecorder::PARSED, 0, arrival_us + 100);
+  timeline.mark_at(FlightRecorder::STAGE_START, StageStatistics::LOCAL_STORE, arrival_us + 200);
+  timeline.mark_at(FlightRecorder::STAGE_END, StageStatistics::LOCAL_STORE, arrival_us + 300);
+  timeline.mark_at(FlightRecorder::CDF_SEND, 0, arrival_us + 400);
+  timeline.mark_at(FlightRecorder::CDF_ANSWER, 2001, arrival_us + 500);
+  timeline.finish();
+  EXPECT_FALSE(timeline.started());
+
+  // Finishing again does nothing.
+  timeline.finish();
+
+  std::string dump = recorder.dump(false);
+  EXPECT_EQ(1, count_requests(dump));
+  EXPECT_THAT(dump, HasSubstr("call-id=call-id-1 trail=1234"));
+  EXPECT_THAT(dump, HasSubstr(" parsed@100 local_store_start@200 local_store_end@300"
+                              " cdf_send(0)@400 cdf_answer(2001)@500 complete@"));
+}
+
+TEST(FlightRecorderTest, SlowThreshold)
+{
+  FlightRecorder recorder(100);
+
+  record_request(recorder, "fast", 10000);
+  record_request(recorder, "slow", 200000);
+
+  std::string dump = recorder.dump(false);
+  EXPECT_EQ(1, count_requests(dump));
+  EXPECT_THAT(dump, HasSubstr("call-id=slow "));
+  EXPECT_THAT(dump, Not(HasSubstr("call-id=fast ")));
+
+  // Both requests are in the recent requests.
+  dump = recorder.dump(true);
+  EXPECT_EQ(3, count_requests(dump));
+  EXPECT_THAT(dump, HasSubstr("call-id=fast "));
+}
+
+TEST(FlightRecorderTest, Wraparound)
+{
+  FlightRecorder recorder(0, 8, 4);
+
+  for (int ii = 0; ii < 20; ii++)
+  {
+    record_request(recorder, "call-" + std::to_string(ii), 0);
+  }
+
+  // Only the most recent requests are kept, oldest first.
+  std::string dump = recorder.dump(false);
+  EXPECT_EQ(4, count_requests(dump));
+  EXPECT_THAT(dump, Not(HasSubstr("call-id=call-15 ")));
+  EXPECT_LT(dump.find("call-id=call-16 "), dump.find("call-id=call-19 "));
+
+  dump = recorder.dump(true);
+  EXPECT_EQ(12, count_requests(dump));
+  EXPECT_THAT(dump, HasSubstr("call-id=call-12 "));
+}
+
+TEST(FlightRecorderTest, Truncated)
+{
+  FlightRecorder recorder(0);
+  FlightRecorder::Timeline timeline;
+  std::string call_id(100, 'a');
+  timeline.start(&recorder, RalfTime::now_us(), call_id, 0);
+
+  for (int ii = 0; ii < FlightRecorder::MAX_EVENTS * 2; ii++)
+  {
+    timeline.mark(FlightRecorder::CDF_SEND, ii);
+  }
+
+  timeline.finish();
+
+  // The call ID is cut short, and the completion is still recorded.
+  std::string dump = recorder.dump(false);
+  EXPECT_THAT(dump, HasSubstr("call-id=" + std::string(FlightRecorder::MAX_CALL_ID, 'a') + " "));
+  EXPECT_THAT(dump, HasSubstr("complete@"));
+  EXPECT_THAT(dump, HasSubstr("(truncated)"));
+  EXPECT_THAT(dump, Not(HasSubstr("cdf_send(23)")));
+}
+
+TEST(FlightRecorderTest, CurrentTimeline)
+{
+  FlightRecorder recorder(0);
+  FlightRecorder::Timeline timeline;
+  timeline.start(&recorder, RalfTime::now_us(), "call-id-1", 0);
+
+  EXPECT_EQ(NULL, FlightRecorder::current());
+
+  {
+    FlightRecorder::CurrentTimeline current_timeline(&timeline);
+    EXPECT_EQ(&timeline, FlightRecorder::current());
+
+    // Stage timers mark the current timeline, even without statistics.
+    StageStatistics::StageTimer timer(NULL, StageStatistics::CHRONOS);
+    timer.stop();
+  }
+
+  EXPECT_EQ(NULL, FlightRecorder::current());
+  timeline.finish();
+
+  EXPECT_THAT(recorder.dump(false), HasSubstr(" chronos_start@"));
+  EXPECT_THAT(recorder.dump(false), HasSubstr(" chronos_end@"));
+}
+
+TEST(FlightRecorderTest, DumpToFile)
+{
+  FlightRecorder recorder(0);
+  record_request(recorder, "call-id-1", 0);
+
+  ASSERT_TRUE(recorder.start("/tmp"));
+  std::string filename = recorder.dump_to_file();
+  recorder.stop();
+  ASSERT_NE("", filename);
+
+  std::ifstream file(filename.c_str());
+  std::stringstream contents;
+  contents << file.rdbuf();
+  EXPECT_THAT(contents.str(), HasSubstr("call-id=call-id-1 "));
+  remove(filename.c_str());
+}
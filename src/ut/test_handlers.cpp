@@ -9,11 +9,15 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "handlers.hpp"
 #include "message.hpp"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "test_utils.hpp"
+#include "test_interposer.hpp"
 
 #include "mockdiameterstack.hpp"
 #include "mockhttpstack.hpp"
@@ -22,11 +26,13 @@
 #include "fakechronosconnection.cpp"
 #include "session_store.h"
 #include "peer_message_sender_factory.hpp"
+#include "ralf_time.hpp"
 
 using ::testing::_;
 using ::testing::Invoke;
 using ::testing::WithArgs;
 using ::testing::An;
+using ::testing::Return;
 
 static const int EVENT = 1;
 static const int START = 2;
@@ -36,6 +42,14 @@ static const int STOP = 4;
 static const SAS::TrailId FAKE_TRAIL_ID = 0;
 static const std::string CALL_ID = "abc123";
 
+class MockLoadMonitor : public LoadMonitor
+{
+public:
+  MockLoadMonitor() : LoadMonitor(100000, 20, 10.0, 10.0, 0.0) {}
+  MOCK_METHOD2(admit_request, bool(SAS::TrailId, bool));
+  MOCK_METHOD2(request_complete, void(int, SAS::TrailId));
+};
+
 class HandlerTest : public ::testing::Test
 {
   static Diameter::Stack* _real_stack;
@@ -122,6 +136,62 @@ class HandlerTest : public ::testing::Test
     _caught_diam_tsx = tsx;
   }
 
+  // Sends an EVENT ACR for the given CCFs straight to a sender from the given
+  // factory, so the test can choose which of the sender's helpers it uses.
+  static void send_event(PeerMessageSenderFactory* factory,
+                         const std::string& ccfs,
+                         uint64_t deadline_ms = 0)
+  {
+    std::string body = "{\"peers\": {\"ccf\": [" + ccfs + "]}, \"event\": {\"Accounting-Record-Type\": 1, \"Acct-Interim-Interval\": 300, \"Service-Information\": {\"IMS-Information\": {\"Role-Of-Node\": 0, \"Node-Functionality\": 0}}}}";
+    Message* msg = NULL;
+    ASSERT_EQ(200, BillingTask::parse_body(CALL_ID, false, body, &msg, FAKE_TRAIL_ID));
+    msg->deadline_ms = deadline_ms;
+
+    PeerMessageSender* sender = factory->newSender(FAKE_TRAIL_ID); // self-deleting
+    sender->send(msg, _mgr, _dict, _mock_stack);
+  }
+
+  // Answers an ACR and deletes its transaction.  The answer may cause further
+  // ACRs to be sent, which are caught as usual.
+  static void answer(struct msg* fd_msg,
+                     Diameter::Transaction* tsx,
+                     int result_code)
+  {
+    Rf::AccountingResponse aca(_dict,
+                               _mock_stack,
+                               result_code,
+                               CALL_ID);
+    fd_msg_free(fd_msg);
+    tsx->on_response(aca);
+    delete tsx;
+  }
+
+  // Answers the last ACR caught.
+  static void answer_caught(int result_code)
+  {
+    struct msg* fd_msg = _caught_fd_msg; _caught_fd_msg = NULL;
+    Diameter::Transaction* tsx = _caught_diam_tsx; _caught_diam_tsx = NULL;
+    answer(fd_msg, tsx, result_code);
+  }
+
+  // Returns the number of ACRs sent to a CCF.
+  static uint64_t requests(PeerStatistics& stats, const std::string& host)
+  {
+    std::vector<PeerStatistics::PeerSnapshot> peers = stats.snapshot();
+
+    for (std::vector<PeerStatistics::PeerSnapshot>::const_iterator it = peers.begin();
+         it != peers.end();
+         ++it)
+    {
+      if (it->host == host)
+      {
+        return it->requests;
+      }
+    }
+
+    return 0;
+  }
+
   void request_response_template(int result_code,
                                  int record_type,
                                  bool timer_interim)
@@ -405,6 +475,76 @@ TEST_F(HandlerTest, BadBody)
   task->run();
 }
 
+// Tests that timer pops are throttled by their own load monitor.
+TEST_F(HandlerTest, TimerPopThrottled)
+{
+  std::string body = "{\"event\": {\"Accounting-Record-Type\": 3, \"Service-Information\": {\"IMS-Information\": {\"Role-Of-Node\": 0, \"Node-Functionality\": 0}}}}";
+  MockLoadMonitor load_monitor;
+  _cfg->timer_pop_load_monitor = &load_monitor;
+
+  // Turned away by the load monitor, so rejected with a 503.
+  MockHttpStack::Request req(_httpstack,
+                             "/call-id/" + CALL_ID,
+                             "",
+                             "timer-interim=true",
+                             body,
+                             htp_method_POST);
+  BillingTask* task = new BillingTask(req, _cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(load_monitor, admit_request(_, _)).WillOnce(Return(false));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(0);
+  EXPECT_CALL(*_httpstack, send_reply(_, 503, _));
+  task->run();
+
+  // Admitted, so handled as usual (there's no session, so the pop is
+  // ignored), and the load monitor is told how long it took.
+  MockHttpStack::Request req2(_httpstack,
+                              "/call-id/" + CALL_ID,
+                              "",
+                              "timer-interim=true",
+                              body,
+                              htp_method_POST);
+  task = new BillingTask(req2, _cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(load_monitor, admit_request(_, _)).WillOnce(Return(true));
+  EXPECT_CALL(load_monitor, request_complete(_, _));
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  task->run();
+
+  _cfg->timer_pop_load_monitor = NULL;
+}
+
+// Tests that local timer pops are admitted and checked for duplicates just
+// like timer pops from Chronos.
+TEST_F(HandlerTest, LocalTimerPop)
+{
+  std::string body = "{\"event\": {\"Accounting-Record-Type\": 3, \"Service-Information\": {\"IMS-Information\": {\"Role-Of-Node\": 0, \"Node-Functionality\": 0}}}}";
+  std::string callback_uri = "/call-id/" + CALL_ID + "?timer-interim=true";
+  MockLoadMonitor load_monitor;
+  DuplicateCache duplicates(60000);
+  _cfg->timer_pop_load_monitor = &load_monitor;
+  _cfg->duplicates = &duplicates;
+  LocalTimerPopHandler handler(_cfg);
+
+  // Turned away by the load monitor.
+  EXPECT_CALL(load_monitor, admit_request(_, _)).WillOnce(Return(false));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(0);
+  handler.on_timer_pop(callback_uri, body);
+  EXPECT_EQ(0u, duplicates.size());
+
+  // Admitted twice.  Every pop has the same body, so the handler doesn't
+  // treat the second as a duplicate of the first - the session manager checks
+  // pops for repeats instead.
+  EXPECT_CALL(load_monitor, admit_request(_, _)).Times(2).WillRepeatedly(Return(true));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(2);
+  handler.on_timer_pop(callback_uri, body);
+  handler.on_timer_pop(callback_uri, body);
+  EXPECT_EQ(0u, duplicates.suppressed());
+
+  _cfg->timer_pop_load_monitor = NULL;
+  _cfg->duplicates = NULL;
+}
+
 // Tests that a simple EVENT ACR is handled.
 TEST_F(HandlerTest, SimpleMainline)
 {
@@ -450,3 +590,310 @@ TEST_F(HandlerTest, TimeoutMultiplePeers)
 {
   request_timeout_template(true);
 }
+
+// Tests that a request with multiple peers isn't retried once its deadline
+// has passed.
+TEST_F(HandlerTest, DeadlineStopsFailover)
+{
+  std::string body = "{\"peers\": {\"ccf\": [\"ec2-54-197-167-141.compute-1.amazonaws.com\", \"ec2-34-189-147-119.compute-1.amazonaws.com\"]}, \"event\": {\"Accounting-Record-Type\": 1, \"Acct-Interim-Interval\": 300, \"Service-Information\": {\"IMS-Information\": {\"Role-Of-Node\": 0, \"Node-Functionality\": 0}}}}";
+
+  // Time only moves on when the test says so.
+  cwtest_completely_control_time();
+  _cfg->acr_deadline_ms = 100;
+
+  MockHttpStack::Request req(_httpstack,
+                             "/call-id/" + CALL_ID,
+                             "",
+                             "",
+                             body,
+                             htp_method_POST);
+
+  BillingTask* task = new BillingTask(req,
+                                      _cfg,
+                                      FAKE_TRAIL_ID);
+
+  // The first request is only given what is left of the deadline, rather
+  // than the full Diameter timeout.
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 100))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+
+  // Once the deadline has passed, a timeout doesn't trigger a retry to the
+  // second peer.
+  cwtest_advance_time_ms(100);
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+  _caught_diam_tsx->on_timeout();
+
+  _cfg->acr_deadline_ms = 0;
+  cwtest_reset_time();
+}
+
+// Tests that an ACR queued behind a CCF's concurrency limit is sent once the
+// ACR ahead of it is answered.
+TEST_F(HandlerTest, LimitedAcrSentWhenSlotFrees)
+{
+  PeerConcurrencyLimiter limiter(1, 1, 1000, PeerConcurrencyLimiter::QUEUE, 10, 60000);
+  PeerMessageSenderFactory factory("example.com", 200, NULL, NULL, &limiter);
+
+  // The first ACR takes the only slot.
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf1.example.com\"");
+  struct msg* first_msg = _caught_fd_msg; _caught_fd_msg = NULL;
+  Diameter::Transaction* first_tsx = _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // The second waits for it.
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), _)).Times(0);
+  send_event(&factory, "\"ccf1.example.com\"");
+
+  int in_flight, queue_depth, limit;
+  ASSERT_TRUE(limiter.get_peer_stats("ccf1.example.com", in_flight, queue_depth, limit));
+  EXPECT_EQ(1, in_flight);
+  EXPECT_EQ(1, queue_depth);
+
+  // Answering the first sends the second.
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  EXPECT_CALL(*_hc, health_check_passed()).Times(2);
+  answer(first_msg, first_tsx, 2001);
+
+  limiter.get_peer_stats("ccf1.example.com", in_flight, queue_depth, limit);
+  EXPECT_EQ(1, in_flight);
+  EXPECT_EQ(0, queue_depth);
+
+  answer_caught(2001);
+  limiter.get_peer_stats("ccf1.example.com", in_flight, queue_depth, limit);
+  EXPECT_EQ(0, in_flight);
+}
+
+// Tests that an ACR whose deadline passes while it is queued behind a CCF's
+// concurrency limit gives its slot back rather than being sent.
+TEST_F(HandlerTest, LimitedAcrExpiresWhileQueued)
+{
+  PeerConcurrencyLimiter limiter(1, 1, 1000, PeerConcurrencyLimiter::QUEUE, 10, 60000);
+  PeerMessageSenderFactory factory("example.com", 200, NULL, NULL, &limiter);
+
+  cwtest_completely_control_time();
+
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf1.example.com\"");
+  struct msg* first_msg = _caught_fd_msg; _caught_fd_msg = NULL;
+  Diameter::Transaction* first_tsx = _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), _)).Times(0);
+  send_event(&factory, "\"ccf1.example.com\"", RalfTime::now_ms() + 100);
+
+  // The second ACR is given the slot after its deadline, so it is failed
+  // without being sent, and the slot is free again.
+  cwtest_advance_time_ms(100);
+  EXPECT_CALL(*_hc, health_check_passed());
+  answer(first_msg, first_tsx, 2001);
+
+  int in_flight, queue_depth, limit;
+  ASSERT_TRUE(limiter.get_peer_stats("ccf1.example.com", in_flight, queue_depth, limit));
+  EXPECT_EQ(0, in_flight);
+  EXPECT_EQ(0, queue_depth);
+
+  // So the next ACR goes straight out.
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf1.example.com\"");
+
+  EXPECT_CALL(*_hc, health_check_passed());
+  answer_caught(2001);
+
+  cwtest_reset_time();
+}
+
+// Tests that an ACR turned away by a CCF's concurrency limit is sent to the
+// next CCF instead.
+TEST_F(HandlerTest, LimitedAcrFailsOver)
+{
+  PeerConcurrencyLimiter limiter(1, 1, 1000, PeerConcurrencyLimiter::SHED, 10, 60000);
+  PeerStatistics peer_stats;
+  PeerMessageSenderFactory factory("example.com", 200, NULL, NULL, &limiter,
+                                   NULL, NULL, NULL, NULL, &peer_stats);
+
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf1.example.com\"");
+  struct msg* first_msg = _caught_fd_msg; _caught_fd_msg = NULL;
+  Diameter::Transaction* first_tsx = _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // The first CCF is full, so the second ACR goes to the second CCF.
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf1.example.com\", \"ccf2.example.com\"");
+
+  EXPECT_EQ(1u, limiter.shed_count());
+  EXPECT_EQ(1u, requests(peer_stats, "ccf1.example.com"));
+  EXPECT_EQ(1u, requests(peer_stats, "ccf2.example.com"));
+
+  EXPECT_CALL(*_hc, health_check_passed()).Times(2);
+  answer_caught(2001);
+  answer(first_msg, first_tsx, 2001);
+}
+
+// Tests that an ACR skips a CCF whose connection is known to be down.
+TEST_F(HandlerTest, DownCcfSkipped)
+{
+  PeerStateCache peer_state_cache;
+  PeerStatistics peer_stats;
+  PeerMessageSenderFactory factory("example.com", 200, &peer_state_cache,
+                                   NULL, NULL, NULL, NULL, NULL, NULL, &peer_stats);
+  peer_state_cache.update_peer_state("ccf1.example.com", false);
+  peer_state_cache.update_peer_state("ccf2.example.com", true);
+
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf1.example.com\", \"ccf2.example.com\"");
+
+  EXPECT_EQ(0u, requests(peer_stats, "ccf1.example.com"));
+  EXPECT_EQ(1u, requests(peer_stats, "ccf2.example.com"));
+  EXPECT_EQ(1u, peer_state_cache.skip_count("ccf1.example.com"));
+
+  EXPECT_CALL(*_hc, health_check_passed());
+  answer_caught(2001);
+}
+
+// Tests that an ACR is still sent to the first CCF if every CCF is known to
+// be down.
+TEST_F(HandlerTest, AllCcfsDownStillTried)
+{
+  PeerStateCache peer_state_cache;
+  PeerStatistics peer_stats;
+  PeerMessageSenderFactory factory("example.com", 200, &peer_state_cache,
+                                   NULL, NULL, NULL, NULL, NULL, NULL, &peer_stats);
+  peer_state_cache.update_peer_state("ccf1.example.com", false);
+  peer_state_cache.update_peer_state("ccf2.example.com", false);
+
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf1.example.com\", \"ccf2.example.com\"");
+
+  EXPECT_EQ(1u, requests(peer_stats, "ccf1.example.com"));
+  EXPECT_EQ(0u, requests(peer_stats, "ccf2.example.com"));
+  EXPECT_EQ(0u, peer_state_cache.skip_count());
+
+  EXPECT_CALL(*_hc, health_check_passed());
+  answer_caught(2001);
+}
+
+// Tests that an ACR is sent to a CCF within its SLO ahead of one that isn't.
+TEST_F(HandlerTest, UnhealthyCcfTriedLast)
+{
+  PeerHealthScorer health_scorer(100, 0.5, 0.5, 1.0, 1, 60000);
+  PeerStatistics peer_stats;
+  PeerMessageSenderFactory factory("example.com", 200, NULL, &health_scorer,
+                                   NULL, NULL, NULL, NULL, NULL, &peer_stats);
+
+  // The first CCF has been answering too slowly.
+  health_scorer.record_response("ccf1.example.com", 2001, 500000);
+  ASSERT_FALSE(health_scorer.is_healthy("ccf1.example.com"));
+
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf1.example.com\", \"ccf2.example.com\"");
+
+  EXPECT_EQ(0u, requests(peer_stats, "ccf1.example.com"));
+  EXPECT_EQ(1u, requests(peer_stats, "ccf2.example.com"));
+
+  EXPECT_CALL(*_hc, health_check_passed());
+  answer_caught(2001);
+}
+
+// Tests that a session's ACRs all go over the connection picked for it when
+// a CCF's ACRs are striped across several.
+TEST_F(HandlerTest, StripedCcf)
+{
+  CcfStripes ccf_stripes;
+  ASSERT_TRUE(ccf_stripes.configure({"ccf1.example.com=ccf1a.example.com;ccf1b.example.com"}));
+  std::string stripe = ccf_stripes.select("ccf1.example.com", CALL_ID);
+  PeerStatistics peer_stats;
+  PeerMessageSenderFactory factory("example.com", 200, NULL, NULL, NULL,
+                                   &ccf_stripes, NULL, NULL, NULL, &peer_stats);
+
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .Times(2)
+    .WillRepeatedly(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  EXPECT_CALL(*_hc, health_check_passed()).Times(2);
+
+  send_event(&factory, "\"ccf1.example.com\"");
+  answer_caught(2001);
+  send_event(&factory, "\"ccf1.example.com\"");
+  answer_caught(2001);
+
+  EXPECT_EQ(0u, requests(peer_stats, "ccf1.example.com"));
+  EXPECT_EQ(2u, requests(peer_stats, stripe));
+}
+
+// Tests that each ACR is given the timeout the estimator has learnt for its
+// CCF, rather than the configured Diameter timeout.
+TEST_F(HandlerTest, EstimatedTimeout)
+{
+  PeerTimeoutEstimator timeout_estimator(20, 150, 10);
+  PeerMessageSenderFactory factory("example.com", 200, NULL, NULL, NULL,
+                                   NULL, &timeout_estimator);
+
+  // The first CCF has been answering quickly.
+  for (int ii = 0; ii < PeerTimeoutEstimator::MIN_SAMPLES; ii++)
+  {
+    timeout_estimator.record_rtt("ccf1.example.com", 5000);
+  }
+  unsigned int timeout_ms = timeout_estimator.get_timeout("ccf1.example.com");
+  ASSERT_LT(timeout_ms, 150u);
+
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), timeout_ms))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf1.example.com\"");
+
+  EXPECT_CALL(*_hc, health_check_passed());
+  answer_caught(2001);
+
+  // We know nothing about the second CCF, so wait as long as we ever would.
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 150))
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf2.example.com\"");
+
+  EXPECT_CALL(*_hc, health_check_passed());
+  answer_caught(2001);
+}
+
+// Tests that an ACR that can't be delivered to any CCF is spooled to be
+// replayed later.
+TEST_F(HandlerTest, UndeliveredAcrSpooled)
+{
+  char path[] = "/tmp/ralf_acr_spool_XXXXXX";
+  int fd = mkstemp(path);
+  ::close(fd);
+  AcrSpool spool(path, 4096);
+  ASSERT_TRUE(spool.open());
+  AcrForwarder forwarder(&spool, _dict, _mock_stack, "example.com", 200, 10);
+  PeerMessageSenderFactory factory("example.com", 200, NULL, NULL, NULL,
+                                   NULL, NULL, &forwarder);
+
+  // Neither CCF can take the ACR.
+  EXPECT_CALL(*_mock_stack, send(_, An<Diameter::Transaction*>(), 200))
+    .Times(2)
+    .WillRepeatedly(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  send_event(&factory, "\"ccf1.example.com\", \"ccf2.example.com\"");
+  answer_caught(3002);
+  answer_caught(3002);
+
+  EXPECT_EQ(1u, forwarder.spooled_count());
+  ASSERT_EQ(1u, spool.depth());
+
+  std::string payload;
+  uint64_t spooled_ms;
+  ASSERT_TRUE(spool.peek(payload, spooled_ms));
+  AcrForwarder::SpooledAcr acr;
+  ASSERT_TRUE(AcrForwarder::decode(payload, acr));
+  EXPECT_EQ(CALL_ID, acr.call_id);
+  ASSERT_EQ(2u, acr.ccfs.size());
+  EXPECT_EQ("ccf1.example.com", acr.ccfs[0]);
+
+  unlink(path);
+}
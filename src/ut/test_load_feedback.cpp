@@ -0,0 +1,151 @@
+/**
+ * @file test_load_feedback.cpp UT for feeding backend state into throttling.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <unistd.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "load_feedback.hpp"
+#include "stage_statistics.hpp"
+
+using ::testing::Exactly;
+
+class MockLoadMonitor : public LoadMonitor
+{
+public:
+  MockLoadMonitor() : LoadMonitor(100000, 20, 10.0, 10.0, 0.0) {}
+  MOCK_METHOD0(incr_penalties, void());
+};
+
+class LoadFeedbackTest : public ::testing::Test
+{
+public:
+  LoadFeedbackTest() :
+    _feedback(&_load_monitor, 100, 10000, 1000)
+  {
+  }
+
+  MockLoadMonitor _load_monitor;
+  LoadFeedback _feedback;
+};
+
+TEST_F(LoadFeedbackTest, UnderTarget)
+{
+  EXPECT_CALL(_load_monitor, incr_penalties()).Times(Exactly(0));
+
+  for (int ii = 0; ii < 100; ii++)
+  {
+    _feedback.record_latency(StageStatistics::CDF, 5000);
+    _feedback.record_latency(StageStatistics::LOCAL_STORE, 500);
+    _feedback.record_cdf_in_flight(100);
+  }
+
+  EXPECT_NEAR(5000, _feedback.smoothed_latency_us(StageStatistics::CDF), 10);
+  EXPECT_NEAR(500, _feedback.smoothed_latency_us(StageStatistics::LOCAL_STORE), 10);
+  EXPECT_EQ(0u, _feedback.penalties());
+}
+
+TEST_F(LoadFeedbackTest, UnmonitoredStages)
+{
+  EXPECT_CALL(_load_monitor, incr_penalties()).Times(Exactly(0));
+
+  // Parsing and Chronos latencies already show up in the HTTP latency.
+  for (int ii = 0; ii < 100; ii++)
+  {
+    _feedback.record_latency(StageStatistics::PARSE, 1000000);
+    _feedback.record_latency(StageStatistics::CHRONOS, 1000000);
+  }
+
+  EXPECT_EQ(0u, _feedback.smoothed_latency_us(StageStatistics::CHRONOS));
+}
+
+TEST_F(LoadFeedbackTest, SmoothedLatency)
+{
+  // A single slow answer isn't enough to penalize.
+  EXPECT_CALL(_load_monitor, incr_penalties()).Times(Exactly(0));
+
+  for (int ii = 0; ii < 100; ii++)
+  {
+    _feedback.record_latency(StageStatistics::CDF, 5000);
+  }
+
+  _feedback.record_latency(StageStatistics::CDF, 40000);
+  EXPECT_LT(_feedback.smoothed_latency_us(StageStatistics::CDF), 10000u);
+  ::testing::Mock::VerifyAndClearExpectations(&_load_monitor);
+
+  // But a run of them is.
+  EXPECT_CALL(_load_monitor, incr_penalties()).Times(Exactly(1));
+
+  for (int ii = 0; ii < 10; ii++)
+  {
+    _feedback.record_latency(StageStatistics::CDF, 40000);
+  }
+
+  EXPECT_EQ(1u, _feedback.penalties());
+}
+
+TEST_F(LoadFeedbackTest, StoreLatency)
+{
+  EXPECT_CALL(_load_monitor, incr_penalties()).Times(Exactly(1));
+
+  for (int ii = 0; ii < 100; ii++)
+  {
+    _feedback.record_latency(StageStatistics::REMOTE_STORE, 5000);
+  }
+}
+
+TEST_F(LoadFeedbackTest, CdfInFlight)
+{
+  EXPECT_CALL(_load_monitor, incr_penalties()).Times(Exactly(1));
+  _feedback.record_cdf_in_flight(101);
+  ::testing::Mock::VerifyAndClearExpectations(&_load_monitor);
+
+  // Penalties are limited to one per interval.
+  EXPECT_CALL(_load_monitor, incr_penalties()).Times(Exactly(0));
+  _feedback.record_cdf_in_flight(102);
+  ::testing::Mock::VerifyAndClearExpectations(&_load_monitor);
+
+  usleep(LoadFeedback::MIN_PENALTY_INTERVAL_US * 2);
+
+  EXPECT_CALL(_load_monitor, incr_penalties()).Times(Exactly(1));
+  _feedback.record_cdf_in_flight(103);
+  EXPECT_EQ(2u, _feedback.penalties());
+}
+
+TEST_F(LoadFeedbackTest, NoLimits)
+{
+  LoadFeedback feedback(&_load_monitor, 0, 0, 0);
+  EXPECT_CALL(_load_monitor, incr_penalties()).Times(Exactly(0));
+
+  feedback.record_cdf_in_flight(1000000);
+  feedback.record_latency(StageStatistics::CDF, 1000000);
+  feedback.record_latency(StageStatistics::LOCAL_STORE, 1000000);
+}
+
+TEST_F(LoadFeedbackTest, FromStageStatistics)
+{
+  StageStatistics stats(NULL, StageStatistics::DEFAULT_PERIOD_MS, &_feedback);
+  EXPECT_CALL(_load_monitor, incr_penalties()).Times(Exactly(1));
+
+  for (int ii = 0; ii < 101; ii++)
+  {
+    stats.incr_gauge(StageStatistics::CDF_IN_FLIGHT);
+  }
+
+  for (int ii = 0; ii < 101; ii++)
+  {
+    stats.decr_gauge(StageStatistics::CDF_IN_FLIGHT);
+  }
+
+  stats.record_latency(StageStatistics::CDF, 8000);
+  EXPECT_EQ(1000u, _feedback.smoothed_latency_us(StageStatistics::CDF));
+}
@@ -0,0 +1,298 @@
+/**
+ * @file test_local_timer_wheel.cpp UT for the in-process INTERIM timers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <fstream>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "local_timer_wheel.hpp"
+#include "ralf_time.hpp"
+
+using ::testing::StartsWith;
+
+static const SAS::TrailId FAKE_TRAIL_ID = 0;
+static const std::map<std::string, uint32_t> TAGS {{"CALL", 1}};
+static const std::string CHECKPOINT_FILE = "/tmp/test_local_timer_wheel.checkpoint";
+
+// Remembers the timers that have popped.
+class TestPopHandler : public LocalTimerWheel::PopHandler
+{
+public:
+  TestPopHandler() : _pops(0) {}
+
+  void on_timer_pop(const std::string& callback_uri,
+                    const std::string& opaque_data)
+  {
+    _pops++;
+    _callback_uri = callback_uri;
+    _opaque_data = opaque_data;
+  }
+
+  std::atomic<int> _pops;
+  std::string _callback_uri;
+  std::string _opaque_data;
+};
+
+// The wheel's tick thread isn't started, so time only moves on when the test
+// polls, and pops are handled on the test's thread.
+class LocalTimerWheelTest : public ::testing::Test
+{
+public:
+  LocalTimerWheelTest() :
+    _start_ms(RalfTime::now_ms()),
+    _wheel(&_handler, CHECKPOINT_FILE, 100, 0)
+  {
+  }
+
+  virtual ~LocalTimerWheelTest()
+  {
+    remove(CHECKPOINT_FILE.c_str());
+  }
+
+  // Polls the wheel as if the given number of seconds had passed since the
+  // test started, plus a tick or so.
+  void poll_at(uint64_t secs)
+  {
+    _wheel.poll(_start_ms + (secs * 1000) + 200);
+  }
+
+  uint64_t _start_ms;
+  TestPopHandler _handler;
+  LocalTimerWheel _wheel;
+};
+
+TEST_F(LocalTimerWheelTest, PostAndPop)
+{
+  std::string timer_id;
+  EXPECT_EQ(HTTP_OK, _wheel.send_post(timer_id, 10, 30, "/uri", "opaque", FAKE_TRAIL_ID, TAGS));
+  EXPECT_THAT(timer_id, StartsWith("local-"));
+  EXPECT_EQ(1u, _wheel.size());
+
+  _wheel.poll(_start_ms + 9000);
+  EXPECT_EQ(0, _handler._pops);
+
+  poll_at(10);
+  EXPECT_EQ(1, _handler._pops);
+  EXPECT_EQ("/uri", _handler._callback_uri);
+  EXPECT_EQ("opaque", _handler._opaque_data);
+
+  // The timer repeats until its 30 seconds are up.
+  poll_at(20);
+  EXPECT_EQ(2, _handler._pops);
+  poll_at(30);
+  EXPECT_EQ(3, _handler._pops);
+  EXPECT_EQ(0u, _wheel.size());
+
+  poll_at(60);
+  EXPECT_EQ(3, _handler._pops);
+  EXPECT_EQ(3u, _wheel.pop_count());
+}
+
+TEST_F(LocalTimerWheelTest, Delete)
+{
+  std::string timer_id;
+  _wheel.send_post(timer_id, 10, 30, "/uri", "opaque", FAKE_TRAIL_ID, TAGS);
+
+  EXPECT_EQ(HTTP_OK, _wheel.send_delete(timer_id, FAKE_TRAIL_ID));
+  EXPECT_EQ(0u, _wheel.size());
+  EXPECT_EQ(HTTP_NOT_FOUND, _wheel.send_delete(timer_id, FAKE_TRAIL_ID));
+
+  poll_at(30);
+  EXPECT_EQ(0, _handler._pops);
+}
+
+TEST_F(LocalTimerWheelTest, PutReplaces)
+{
+  std::string timer_id;
+  _wheel.send_post(timer_id, 10, 30, "/uri1", "opaque1", FAKE_TRAIL_ID, TAGS);
+
+  std::string put_id = timer_id;
+  EXPECT_EQ(HTTP_OK, _wheel.send_put(put_id, 20, 20, "/uri2", "opaque2", FAKE_TRAIL_ID, TAGS));
+  EXPECT_EQ(timer_id, put_id);
+  EXPECT_EQ(1u, _wheel.size());
+
+  poll_at(10);
+  EXPECT_EQ(0, _handler._pops);
+  poll_at(20);
+  EXPECT_EQ(1, _handler._pops);
+  EXPECT_EQ("/uri2", _handler._callback_uri);
+  EXPECT_EQ(0u, _wheel.size());
+}
+
+TEST_F(LocalTimerWheelTest, PutCreates)
+{
+  // For example, a timer that was in Chronos before we switched to local
+  // timers.
+  std::string timer_id = "CHRONOS_TIMER";
+  EXPECT_EQ(HTTP_OK, _wheel.send_put(timer_id, 10, 10, "/uri", "opaque", FAKE_TRAIL_ID, TAGS));
+  EXPECT_EQ("CHRONOS_TIMER", timer_id);
+
+  poll_at(10);
+  EXPECT_EQ(1, _handler._pops);
+}
+
+TEST_F(LocalTimerWheelTest, Cascade)
+{
+  // Timers in each level of the wheel pop on time.
+  std::string timer_id;
+  _wheel.send_post(timer_id, 5, 5, "/level0", "", FAKE_TRAIL_ID, TAGS);
+  _wheel.send_post(timer_id, 300, 300, "/level1", "", FAKE_TRAIL_ID, TAGS);
+  _wheel.send_post(timer_id, 3600, 3600, "/level2", "", FAKE_TRAIL_ID, TAGS);
+  _wheel.send_post(timer_id, 86400, 86400, "/level3", "", FAKE_TRAIL_ID, TAGS);
+
+  const char* uris[] = { "/level0", "/level1", "/level2", "/level3" };
+  uint64_t secs[] = { 5, 300, 3600, 86400 };
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    _wheel.poll(_start_ms + (secs[ii] * 1000) - 1000);
+    EXPECT_EQ(ii, _handler._pops);
+    poll_at(secs[ii]);
+    EXPECT_EQ(ii + 1, _handler._pops);
+    EXPECT_EQ(uris[ii], _handler._callback_uri);
+  }
+}
+
+TEST_F(LocalTimerWheelTest, CheckpointAndRecover)
+{
+  std::string timer_id;
+  _wheel.send_post(timer_id, 10, 30, "/uri1", "opaque1", FAKE_TRAIL_ID, TAGS);
+  _wheel.send_post(timer_id, 20, 20, "/uri2", "opaque2", FAKE_TRAIL_ID, TAGS);
+  EXPECT_TRUE(_wheel.checkpoint());
+
+  TestPopHandler handler;
+  LocalTimerWheel wheel(&handler, CHECKPOINT_FILE, 100, 0);
+  EXPECT_TRUE(wheel.recover());
+  EXPECT_EQ(2u, wheel.size());
+
+  wheel.poll(_start_ms + 10200);
+  EXPECT_EQ(1, handler._pops);
+  EXPECT_EQ("/uri1", handler._callback_uri);
+  EXPECT_EQ("opaque1", handler._opaque_data);
+
+  // The restored timer keeps the same ID.
+  EXPECT_EQ(HTTP_OK, wheel.send_delete(timer_id, FAKE_TRAIL_ID));
+  EXPECT_EQ(1u, wheel.size());
+}
+
+TEST_F(LocalTimerWheelTest, RecoverWhileDown)
+{
+  uint64_t now_ms = RalfTime::wall_clock_ms();
+  std::ofstream file(CHECKPOINT_FILE.c_str());
+  file << "# ralf local timers v2\n";
+
+  // Finished while we were down.
+  file << "+\texpired\t10000\t" << now_ms - 20000 << "\t" << now_ms - 10000 << "\t/uri1\topaque1\n";
+
+  // Missed a pop while we were down, but still running.
+  file << "+\tmissed\t10000\t" << now_ms - 5000 << "\t" << now_ms + 30000 << "\t/uri2\topaque2\n";
+
+  // Corrupt.
+  file << "+\tcorrupt\t10000\n";
+  file << "+\tbad_escape\t10000\t" << now_ms << "\t" << now_ms + 30000 << "\t/uri3\t\\x\n";
+  file.close();
+
+  EXPECT_TRUE(_wheel.recover());
+  EXPECT_EQ(1u, _wheel.size());
+
+  // The missed pop happens straight away.
+  _wheel.poll(_start_ms + 200);
+  EXPECT_EQ(1, _handler._pops);
+  EXPECT_EQ("/uri2", _handler._callback_uri);
+}
+
+TEST_F(LocalTimerWheelTest, NoCheckpoint)
+{
+  EXPECT_FALSE(_wheel.recover());
+
+  std::ofstream file(CHECKPOINT_FILE.c_str());
+  file << "some other file\n";
+  file.close();
+
+  EXPECT_FALSE(_wheel.recover());
+}
+
+TEST_F(LocalTimerWheelTest, Threads)
+{
+  TestPopHandler handler;
+  LocalTimerWheel wheel(&handler, CHECKPOINT_FILE, 10, 2);
+  ASSERT_TRUE(wheel.start());
+
+  std::string timer_id;
+  wheel.send_post(timer_id, 1, 1, "/uri", "opaque", FAKE_TRAIL_ID, TAGS);
+
+  for (int ii = 0; (ii < 200) && (handler._pops == 0); ii++)
+  {
+    usleep(10000);
+  }
+
+  EXPECT_EQ(1, handler._pops);
+
+  // Stopping saves the timers.
+  wheel.send_post(timer_id, 10, 10, "/uri", "opaque", FAKE_TRAIL_ID, TAGS);
+  wheel.stop();
+
+  std::ifstream file(CHECKPOINT_FILE.c_str());
+  std::string line;
+  std::getline(file, line);
+  std::getline(file, line);
+  EXPECT_THAT(line, StartsWith("+\t" + timer_id + "\t"));
+}
+
+TEST_F(LocalTimerWheelTest, ChangesSavedEachTick)
+{
+  std::string timer_id1;
+  std::string timer_id2;
+  std::string timer_id3;
+  _wheel.send_post(timer_id1, 10, 30, "/uri1", "opaque1", FAKE_TRAIL_ID, TAGS);
+  EXPECT_TRUE(_wheel.checkpoint());
+
+  // Changes after the checkpoint are saved on the next tick, whatever the
+  // timers' bodies hold.
+  const std::string awkward = "tab\tnewline\nbackslash\\t";
+  _wheel.send_post(timer_id2, 10, 10, "/uri2", awkward, FAKE_TRAIL_ID, TAGS);
+  _wheel.send_post(timer_id3, 10, 30, "/uri3", "opaque3", FAKE_TRAIL_ID, TAGS);
+  _wheel.send_put(timer_id1, 20, 30, "/uri1", "updated", FAKE_TRAIL_ID, TAGS);
+  _wheel.send_delete(timer_id3, FAKE_TRAIL_ID);
+
+  {
+    TestPopHandler handler;
+    LocalTimerWheel wheel(&handler, CHECKPOINT_FILE, 100, 0);
+    EXPECT_TRUE(wheel.recover());
+    EXPECT_EQ(1u, wheel.size());
+  }
+
+  poll_at(0);
+
+  // Simulate crashing part way through writing a change.
+  std::ofstream file(CHECKPOINT_FILE.c_str(), std::ios::app);
+  file << "+\tlocal-cut-short\t10000";
+  file.close();
+
+  TestPopHandler handler;
+  LocalTimerWheel wheel(&handler, CHECKPOINT_FILE, 100, 0);
+  EXPECT_TRUE(wheel.recover());
+  EXPECT_EQ(2u, wheel.size());
+
+  wheel.poll(_start_ms + 10200);
+  EXPECT_EQ(1, handler._pops);
+  EXPECT_EQ("/uri2", handler._callback_uri);
+  EXPECT_EQ(awkward, handler._opaque_data);
+
+  wheel.poll(_start_ms + 20200);
+  EXPECT_EQ(2, handler._pops);
+  EXPECT_EQ("/uri1", handler._callback_uri);
+  EXPECT_EQ("updated", handler._opaque_data);
+}
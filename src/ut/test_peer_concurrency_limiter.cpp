@@ -0,0 +1,219 @@
+/**
+ * @file test_peer_concurrency_limiter.cpp UT for the per-CCF concurrency limit.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <unistd.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "peer_concurrency_limiter.hpp"
+#include "ralf_time.hpp"
+
+static const std::string CCF1 = "ccf1.example.com";
+static const std::string CCF2 = "ccf2.example.com";
+
+// Waiter that just records what happened to it.
+class TestWaiter : public PeerConcurrencyLimiter::Waiter
+{
+public:
+  TestWaiter() : admitted_count(0), shed_count(0) {}
+
+  void admitted() { admitted_count++; }
+  void shed() { shed_count++; }
+
+  int admitted_count;
+  int shed_count;
+};
+
+class PeerConcurrencyLimiterTest : public ::testing::Test
+{
+public:
+  // Limit of 4 (and at least 1), 100ms target RTT.
+  PeerConcurrencyLimiterTest() :
+    _queueing(4, 1, 100, PeerConcurrencyLimiter::QUEUE, 2, 3600000),
+    _shedding(4, 1, 100, PeerConcurrencyLimiter::SHED, 2, 3600000)
+  {
+  }
+
+  void expect_stats(PeerConcurrencyLimiter& limiter,
+                    int exp_in_flight,
+                    int exp_queue_depth,
+                    int exp_limit)
+  {
+    int in_flight, queue_depth, limit;
+    EXPECT_TRUE(limiter.get_peer_stats(CCF1, in_flight, queue_depth, limit));
+    EXPECT_EQ(exp_in_flight, in_flight);
+    EXPECT_EQ(exp_queue_depth, queue_depth);
+    EXPECT_EQ(exp_limit, limit);
+  }
+
+  PeerConcurrencyLimiter _queueing;
+  PeerConcurrencyLimiter _shedding;
+  TestWaiter _waiter;
+};
+
+TEST_F(PeerConcurrencyLimiterTest, AdmitsUpToLimit)
+{
+  for (int ii = 0; ii < 4; ii++)
+  {
+    EXPECT_EQ(PeerConcurrencyLimiter::ADMITTED, _shedding.acquire(CCF1, &_waiter));
+  }
+
+  EXPECT_EQ(PeerConcurrencyLimiter::REJECTED, _shedding.acquire(CCF1, &_waiter));
+  EXPECT_EQ(1u, _shedding.shed_count());
+  expect_stats(_shedding, 4, 0, 4);
+
+  // Other peers have their own limit.
+  EXPECT_EQ(PeerConcurrencyLimiter::ADMITTED, _shedding.acquire(CCF2, &_waiter));
+  EXPECT_EQ(2u, _shedding.peers().size());
+}
+
+TEST_F(PeerConcurrencyLimiterTest, QueuedRequestsAdmittedOnRelease)
+{
+  for (int ii = 0; ii < 4; ii++)
+  {
+    _queueing.acquire(CCF1, &_waiter);
+  }
+
+  TestWaiter queued1;
+  TestWaiter queued2;
+  TestWaiter overflow;
+  EXPECT_EQ(PeerConcurrencyLimiter::QUEUED, _queueing.acquire(CCF1, &queued1));
+  EXPECT_EQ(PeerConcurrencyLimiter::QUEUED, _queueing.acquire(CCF1, &queued2));
+
+  // The queue is full.
+  EXPECT_EQ(PeerConcurrencyLimiter::REJECTED, _queueing.acquire(CCF1, &overflow));
+  expect_stats(_queueing, 4, 2, 4);
+
+  // A successful answer frees a slot for the first queued request.
+  _queueing.release(CCF1, 2001, 10000, false);
+  EXPECT_EQ(1, queued1.admitted_count);
+  EXPECT_EQ(0, queued2.admitted_count);
+  expect_stats(_queueing, 4, 1, 4);
+}
+
+TEST_F(PeerConcurrencyLimiterTest, TooBusyReducesLimit)
+{
+  for (int ii = 0; ii < 4; ii++)
+  {
+    _queueing.acquire(CCF1, &_waiter);
+  }
+
+  _queueing.release(CCF1, 3004, 10000, false);
+  expect_stats(_queueing, 3, 0, 2);
+
+  // A second overload signal within the same RTT doesn't cut the limit again.
+  _queueing.release(CCF1, 0, 200000, true);
+  expect_stats(_queueing, 2, 0, 2);
+}
+
+TEST_F(PeerConcurrencyLimiterTest, SlowAnswerReducesLimit)
+{
+  _queueing.acquire(CCF1, &_waiter);
+  _queueing.release(CCF1, 2001, 200000, false);
+  expect_stats(_queueing, 0, 0, 2);
+}
+
+TEST_F(PeerConcurrencyLimiterTest, LimitRecovers)
+{
+  _queueing.acquire(CCF1, &_waiter);
+  _queueing.release(CCF1, 3004, 10000, false);
+  expect_stats(_queueing, 0, 0, 2);
+
+  // Each good answer grows the limit by 1/limit, up to the maximum.
+  for (int ii = 0; ii < 20; ii++)
+  {
+    _queueing.acquire(CCF1, &_waiter);
+    _queueing.release(CCF1, 2001, 10000, false);
+  }
+
+  expect_stats(_queueing, 0, 0, 4);
+}
+
+TEST_F(PeerConcurrencyLimiterTest, DeliveryFailureLeavesLimit)
+{
+  _queueing.acquire(CCF1, &_waiter);
+  _queueing.release(CCF1, 3002, 10000, false);
+  expect_stats(_queueing, 0, 0, 4);
+}
+
+TEST_F(PeerConcurrencyLimiterTest, ExpiredRequestsAreShed)
+{
+  // Requests can't be queued for any time at all.
+  PeerConcurrencyLimiter limiter(1, 1, 100, PeerConcurrencyLimiter::QUEUE, 2, 0);
+  TestWaiter queued;
+
+  limiter.acquire(CCF1, &_waiter);
+  EXPECT_EQ(PeerConcurrencyLimiter::QUEUED, limiter.acquire(CCF1, &queued));
+
+  limiter.release(CCF1, 2001, 10000, false);
+  EXPECT_EQ(0, queued.admitted_count);
+  EXPECT_EQ(1, queued.shed_count);
+  EXPECT_EQ(1u, limiter.shed_count());
+}
+
+TEST_F(PeerConcurrencyLimiterTest, ExpiredRequestsShedOnAcquire)
+{
+  PeerConcurrencyLimiter limiter(1, 1, 100, PeerConcurrencyLimiter::QUEUE, 2, 0);
+  TestWaiter queued1;
+  TestWaiter queued2;
+
+  limiter.acquire(CCF1, &_waiter);
+  EXPECT_EQ(PeerConcurrencyLimiter::QUEUED, limiter.acquire(CCF1, &queued1));
+
+  // Nothing has completed, but the next request for the peer still sheds the
+  // one that has waited too long.
+  EXPECT_EQ(PeerConcurrencyLimiter::QUEUED, limiter.acquire(CCF1, &queued2));
+  EXPECT_EQ(1, queued1.shed_count);
+  EXPECT_EQ(0, queued2.shed_count);
+  expect_stats(limiter, 1, 1, 1);
+}
+
+TEST_F(PeerConcurrencyLimiterTest, ShedExpired)
+{
+  PeerConcurrencyLimiter limiter(1, 1, 100, PeerConcurrencyLimiter::QUEUE, 2, 1000);
+  TestWaiter queued;
+  uint64_t now_ms = RalfTime::now_ms();
+
+  limiter.acquire(CCF1, &_waiter);
+  limiter.acquire(CCF1, &queued);
+
+  limiter.shed_expired(now_ms);
+  EXPECT_EQ(0, queued.shed_count);
+
+  limiter.shed_expired(now_ms + 2000);
+  EXPECT_EQ(1, queued.shed_count);
+  expect_stats(limiter, 1, 0, 1);
+}
+
+TEST_F(PeerConcurrencyLimiterTest, ShedThread)
+{
+  PeerConcurrencyLimiter limiter(1, 1, 100, PeerConcurrencyLimiter::QUEUE, 2, 20);
+  TestWaiter queued;
+  ASSERT_TRUE(limiter.start());
+
+  limiter.acquire(CCF1, &_waiter);
+  limiter.acquire(CCF1, &queued);
+
+  for (int ii = 0; (ii < 200) && (limiter.shed_count() == 0); ii++)
+  {
+    usleep(10000);
+  }
+
+  limiter.stop();
+  EXPECT_EQ(1, queued.shed_count);
+}
+
+TEST_F(PeerConcurrencyLimiterTest, UnknownPeer)
+{
+  int in_flight, queue_depth, limit;
+  EXPECT_FALSE(_queueing.get_peer_stats(CCF1, in_flight, queue_depth, limit));
+}
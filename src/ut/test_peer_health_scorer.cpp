@@ -0,0 +1,136 @@
+/**
+ * @file test_peer_health_scorer.cpp UT for CCF health scoring.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "peer_health_scorer.hpp"
+
+static const std::string CCF1 = "ccf1.example.com";
+static const std::string CCF2 = "ccf2.example.com";
+static const std::string CCF3 = "ccf3.example.com";
+
+class PeerHealthScorerTest : public ::testing::Test
+{
+public:
+  PeerHealthScorerTest() :
+    // 100ms latency SLO, 20% timeouts, 50% errors, alpha of 0.5, at least 2
+    // samples, and a long probe interval so that probes don't interfere.
+    _scorer(100, 0.2, 0.5, 0.5, 2, 3600000)
+  {
+  }
+
+  PeerHealthScorer _scorer;
+};
+
+TEST_F(PeerHealthScorerTest, UnknownPeerIsHealthy)
+{
+  EXPECT_TRUE(_scorer.is_healthy(CCF1));
+
+  double latency_ms, timeout_rate, error_rate;
+  EXPECT_FALSE(_scorer.get_score(CCF1, latency_ms, timeout_rate, error_rate));
+}
+
+TEST_F(PeerHealthScorerTest, FastPeerIsHealthy)
+{
+  for (int ii = 0; ii < 10; ii++)
+  {
+    _scorer.record_response(CCF1, 2001, 10000);
+  }
+
+  EXPECT_TRUE(_scorer.is_healthy(CCF1));
+
+  double latency_ms, timeout_rate, error_rate;
+  ASSERT_TRUE(_scorer.get_score(CCF1, latency_ms, timeout_rate, error_rate));
+  EXPECT_DOUBLE_EQ(10.0, latency_ms);
+  EXPECT_DOUBLE_EQ(0.0, timeout_rate);
+  EXPECT_DOUBLE_EQ(0.0, error_rate);
+}
+
+TEST_F(PeerHealthScorerTest, SlowPeerIsUnhealthy)
+{
+  // A single slow sample isn't enough to judge the peer.
+  _scorer.record_response(CCF1, 2001, 800000);
+  EXPECT_TRUE(_scorer.is_healthy(CCF1));
+
+  _scorer.record_response(CCF1, 2001, 800000);
+  EXPECT_FALSE(_scorer.is_healthy(CCF1));
+}
+
+TEST_F(PeerHealthScorerTest, TimeoutsMakePeerUnhealthy)
+{
+  _scorer.record_response(CCF1, 2001, 10000);
+  _scorer.record_timeout(CCF1, 50000);
+  EXPECT_FALSE(_scorer.is_healthy(CCF1));
+}
+
+TEST_F(PeerHealthScorerTest, ProtocolErrorsMakePeerUnhealthy)
+{
+  _scorer.record_response(CCF1, 3004, 10000);
+  _scorer.record_response(CCF1, 3004, 10000);
+  EXPECT_FALSE(_scorer.is_healthy(CCF1));
+
+  // Application errors don't count against the peer.
+  _scorer.record_response(CCF2, 5002, 10000);
+  _scorer.record_response(CCF2, 5002, 10000);
+  EXPECT_TRUE(_scorer.is_healthy(CCF2));
+}
+
+TEST_F(PeerHealthScorerTest, PeerRecovers)
+{
+  _scorer.record_response(CCF1, 2001, 800000);
+  _scorer.record_response(CCF1, 2001, 800000);
+  EXPECT_FALSE(_scorer.is_healthy(CCF1));
+
+  for (int ii = 0; ii < 10; ii++)
+  {
+    _scorer.record_response(CCF1, 2001, 10000);
+  }
+  EXPECT_TRUE(_scorer.is_healthy(CCF1));
+}
+
+TEST_F(PeerHealthScorerTest, OrderPreservesPriority)
+{
+  _scorer.record_response(CCF1, 2001, 800000);
+  _scorer.record_response(CCF1, 2001, 800000);
+  _scorer.record_response(CCF2, 2001, 800000);
+  _scorer.record_response(CCF2, 2001, 800000);
+
+  std::vector<std::string> ccfs = {CCF1, CCF2, CCF3};
+  _scorer.order_ccfs(ccfs);
+
+  std::vector<std::string> expected = {CCF3, CCF1, CCF2};
+  EXPECT_EQ(expected, ccfs);
+}
+
+TEST_F(PeerHealthScorerTest, AllUnhealthyLeavesOrderAlone)
+{
+  _scorer.record_timeout(CCF1, 200000);
+  _scorer.record_timeout(CCF1, 200000);
+  _scorer.record_timeout(CCF2, 200000);
+  _scorer.record_timeout(CCF2, 200000);
+
+  std::vector<std::string> ccfs = {CCF1, CCF2};
+  _scorer.order_ccfs(ccfs);
+
+  std::vector<std::string> expected = {CCF1, CCF2};
+  EXPECT_EQ(expected, ccfs);
+}
+
+TEST(PeerHealthScorerProbeTest, UnhealthyPeerIsProbed)
+{
+  // With a probe interval of zero an unhealthy peer is always probed.
+  PeerHealthScorer scorer(100, 0.2, 0.5, 0.5, 2, 0);
+
+  scorer.record_response(CCF1, 2001, 800000);
+  scorer.record_response(CCF1, 2001, 800000);
+  EXPECT_TRUE(scorer.is_healthy(CCF1));
+}
@@ -0,0 +1,105 @@
+/**
+ * @file test_peer_state_cache.cpp UT for the Diameter peer state cache.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "peer_state_cache.hpp"
+
+// Peer state cache that reports a fixed state for every peer, rather than
+// querying freeDiameter.
+class TestPeerStateCache : public PeerStateCache
+{
+public:
+  TestPeerStateCache(int refresh_interval_ms) :
+    PeerStateCache(refresh_interval_ms),
+    queried_state(UNKNOWN),
+    queries(0)
+  {}
+
+  PeerState queried_state;
+  int queries;
+
+protected:
+  PeerState query_peer_state(const std::string& host)
+  {
+    queries++;
+    return queried_state;
+  }
+};
+
+TEST(PeerStateCacheTest, UnknownPeerIsNotDown)
+{
+  TestPeerStateCache cache(1000);
+  EXPECT_FALSE(cache.is_down("ccf1.example.com"));
+  EXPECT_EQ(1, cache.queries);
+}
+
+TEST(PeerStateCacheTest, HookUpdatesState)
+{
+  TestPeerStateCache cache(1000);
+
+  cache.update_peer_state("ccf1.example.com", false);
+  EXPECT_TRUE(cache.is_down("ccf1.example.com"));
+
+  cache.update_peer_state("ccf1.example.com", true);
+  EXPECT_FALSE(cache.is_down("ccf1.example.com"));
+
+  // Neither lookup should have needed to query freeDiameter.
+  EXPECT_EQ(0, cache.queries);
+}
+
+TEST(PeerStateCacheTest, QueriedStateIsCached)
+{
+  TestPeerStateCache cache(1000);
+  cache.queried_state = PeerStateCache::DOWN;
+
+  EXPECT_TRUE(cache.is_down("ccf1.example.com"));
+  EXPECT_TRUE(cache.is_down("ccf1.example.com"));
+  EXPECT_EQ(1, cache.queries);
+}
+
+TEST(PeerStateCacheTest, InvalidateForcesRefresh)
+{
+  TestPeerStateCache cache(1000);
+
+  cache.update_peer_state("ccf1.example.com", true);
+  cache.invalidate("ccf1.example.com");
+
+  cache.queried_state = PeerStateCache::DOWN;
+  EXPECT_TRUE(cache.is_down("ccf1.example.com"));
+  EXPECT_EQ(1, cache.queries);
+}
+
+TEST(PeerStateCacheTest, StaleEntriesAreRefreshed)
+{
+  // With a refresh interval of zero, every lookup goes to freeDiameter.
+  TestPeerStateCache cache(0);
+
+  cache.update_peer_state("ccf1.example.com", false);
+  cache.queried_state = PeerStateCache::UP;
+  EXPECT_FALSE(cache.is_down("ccf1.example.com"));
+  EXPECT_EQ(1, cache.queries);
+}
+
+TEST(PeerStateCacheTest, SkipCounts)
+{
+  TestPeerStateCache cache(1000);
+
+  cache.record_skip("ccf1.example.com");
+  cache.record_skip("ccf1.example.com");
+  cache.record_skip("ccf2.example.com");
+
+  EXPECT_EQ(3u, cache.skip_count());
+  EXPECT_EQ(2u, cache.skip_count("ccf1.example.com"));
+  EXPECT_EQ(1u, cache.skip_count("ccf2.example.com"));
+  EXPECT_EQ(0u, cache.skip_count("ccf3.example.com"));
+}
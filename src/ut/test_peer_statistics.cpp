@@ -0,0 +1,203 @@
+/**
+ * @file test_peer_statistics.cpp UT for per-CCF statistics.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "rapidjson/document.h"
+
+#include "peer_statistics.hpp"
+
+static const std::string CCF1 = "ccf1.example.com";
+static const std::string CCF2 = "ccf2.example.com";
+
+class PeerStatisticsTest : public ::testing::Test
+{
+public:
+  PeerStatistics _stats;
+};
+
+TEST_F(PeerStatisticsTest, Empty)
+{
+  EXPECT_EQ(0u, _stats.snapshot().size());
+  EXPECT_EQ("{\"peers\":[]}", _stats.to_json());
+}
+
+TEST_F(PeerStatisticsTest, RequestsAndResponses)
+{
+  for (int ii = 1; ii <= 100; ii++)
+  {
+    _stats.record_request(CCF1);
+    _stats.record_response(CCF1, (ii <= 98) ? 2001 : 5012, ii * 1000);
+  }
+
+  _stats.record_request(CCF1);
+  _stats.record_timeout(CCF1);
+  _stats.record_unable_to_deliver(CCF1);
+
+  std::vector<PeerStatistics::PeerSnapshot> snapshots = _stats.snapshot();
+  ASSERT_EQ(1u, snapshots.size());
+  const PeerStatistics::PeerSnapshot& snapshot = snapshots[0];
+
+  EXPECT_EQ(CCF1, snapshot.host);
+  EXPECT_EQ(101u, snapshot.requests);
+  EXPECT_EQ(100u, snapshot.responses);
+  EXPECT_EQ(1u, snapshot.timeouts);
+  EXPECT_EQ(1u, snapshot.unable_to_deliver);
+  EXPECT_EQ(98u, snapshot.result_codes.at(2001));
+  EXPECT_EQ(2u, snapshot.result_codes.at(5012));
+  EXPECT_NEAR(50000, snapshot.rtt_p50_us, 1000);
+  EXPECT_NEAR(99000, snapshot.rtt_p99_us, 2000);
+  EXPECT_EQ(100000u, snapshot.rtt_max_us);
+}
+
+TEST_F(PeerStatisticsTest, Failover)
+{
+  _stats.record_shed(CCF1);
+  _stats.record_unable_to_deliver(CCF1);
+  _stats.record_failover(CCF1, CCF2);
+
+  std::vector<PeerStatistics::PeerSnapshot> snapshots = _stats.snapshot();
+  ASSERT_EQ(2u, snapshots.size());
+  EXPECT_EQ(CCF1, snapshots[0].host);
+  EXPECT_EQ(1u, snapshots[0].shed);
+  EXPECT_EQ(1u, snapshots[0].failovers_out);
+  EXPECT_EQ(0u, snapshots[0].failovers_in);
+  EXPECT_EQ(CCF2, snapshots[1].host);
+  EXPECT_EQ(0u, snapshots[1].failovers_out);
+  EXPECT_EQ(1u, snapshots[1].failovers_in);
+}
+
+TEST_F(PeerStatisticsTest, ManyPeers)
+{
+  // Peers come back in order.
+  for (int ii = 0; ii < 100; ii++)
+  {
+    std::string host = "ccf" + std::to_string(1000 + ii) + ".example.com";
+    _stats.record_request(host);
+    _stats.record_request(host);
+  }
+
+  std::vector<PeerStatistics::PeerSnapshot> snapshots = _stats.snapshot();
+  ASSERT_EQ(100u, snapshots.size());
+
+  for (int ii = 0; ii < 100; ii++)
+  {
+    EXPECT_EQ("ccf" + std::to_string(1000 + ii) + ".example.com", snapshots[ii].host);
+    EXPECT_EQ(2u, snapshots[ii].requests);
+  }
+}
+
+TEST_F(PeerStatisticsTest, ManyThreads)
+{
+  // Each thread records into its own cells, which are merged when read.
+  const int NUM_THREADS = 4;
+  pthread_t threads[NUM_THREADS];
+
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_create(&threads[ii], NULL, [](void* stats_ptr) -> void*
+                   {
+                     PeerStatistics* stats = (PeerStatistics*)stats_ptr;
+
+                     for (int jj = 1; jj <= 1000; jj++)
+                     {
+                       stats->record_request(CCF1);
+                       stats->record_response(CCF1, (jj % 10 == 0) ? 3004 : 2001, jj);
+                     }
+
+                     stats->record_failover(CCF1, CCF2);
+                     return NULL;
+                   }, &_stats);
+  }
+
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  std::vector<PeerStatistics::PeerSnapshot> snapshots = _stats.snapshot();
+  ASSERT_EQ(2u, snapshots.size());
+  EXPECT_EQ(4000u, snapshots[0].requests);
+  EXPECT_EQ(4000u, snapshots[0].responses);
+  EXPECT_EQ(3600u, snapshots[0].result_codes.at(2001));
+  EXPECT_EQ(400u, snapshots[0].result_codes.at(3004));
+  EXPECT_NEAR(500, snapshots[0].rtt_p50_us, 10);
+  EXPECT_EQ(1000u, snapshots[0].rtt_max_us);
+  EXPECT_EQ(4u, snapshots[0].failovers_out);
+  EXPECT_EQ(4u, snapshots[1].failovers_in);
+}
+
+TEST_F(PeerStatisticsTest, Reset)
+{
+  _stats.record_request(CCF1);
+  _stats.reset();
+  EXPECT_EQ(0u, _stats.snapshot().size());
+}
+
+TEST_F(PeerStatisticsTest, Json)
+{
+  PeerConcurrencyLimiter limiter(10, 1, 100, PeerConcurrencyLimiter::SHED, 0, 0);
+  PeerTimeoutEstimator estimator(20, 1000, 10);
+  PeerStatistics stats(NULL, &limiter, &estimator);
+
+  ASSERT_EQ(PeerConcurrencyLimiter::ADMITTED, limiter.acquire(CCF1, NULL));
+  stats.record_request(CCF1);
+  stats.record_response(CCF1, 2001, 5000);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(stats.to_json().c_str());
+  ASSERT_FALSE(doc.HasParseError());
+  ASSERT_TRUE(doc["peers"].IsArray());
+  ASSERT_EQ(1u, doc["peers"].Size());
+
+  const rapidjson::Value& peer = doc["peers"][0u];
+  EXPECT_EQ(CCF1, std::string(peer["host"].GetString()));
+  EXPECT_EQ(1u, peer["requests"].GetUint64());
+  EXPECT_EQ(1u, peer["responses"].GetUint64());
+  EXPECT_EQ(1u, peer["result_codes"]["2001"].GetUint64());
+  EXPECT_EQ(5000u, peer["rtt_us"]["max"].GetUint64());
+  EXPECT_EQ(1, peer["in_flight"].GetInt());
+  EXPECT_EQ(10, peer["concurrency_limit"].GetInt());
+  EXPECT_EQ(1000, peer["timeout_ms"].GetInt());
+  EXPECT_FALSE(peer.HasMember("skipped"));
+
+  limiter.release(CCF1, 2001, 5000, false);
+}
+
+TEST_F(PeerStatisticsTest, Spool)
+{
+  char path[] = "/tmp/ralf_acr_spool_XXXXXX";
+  int fd = mkstemp(path);
+  ::close(fd);
+
+  AcrSpool spool(path, 4096);
+  ASSERT_TRUE(spool.open());
+  spool.append("acr1");
+  spool.append("acr2");
+  AcrForwarder forwarder(&spool, NULL, NULL, "example.com", 200, 10);
+  PeerStatistics stats(NULL, NULL, NULL, &forwarder);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(stats.to_json().c_str());
+  ASSERT_FALSE(doc.HasParseError());
+  ASSERT_TRUE(doc.HasMember("spool"));
+  EXPECT_EQ(2u, doc["spool"]["depth"].GetUint64());
+  EXPECT_EQ(0u, doc["spool"]["dropped"].GetUint64());
+  EXPECT_EQ(0u, doc["spool"]["replayed"].GetUint64());
+  EXPECT_EQ(0u, doc["spool"]["replay_rate"].GetUint64());
+
+  spool.close();
+  unlink(path);
+}
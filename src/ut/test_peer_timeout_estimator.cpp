@@ -0,0 +1,93 @@
+/**
+ * @file test_peer_timeout_estimator.cpp UT for adaptive CCF timeouts.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "peer_timeout_estimator.hpp"
+
+static const std::string CCF1 = "ccf1.example.com";
+static const std::string CCF2 = "ccf2.example.com";
+
+class PeerTimeoutEstimatorTest : public ::testing::Test
+{
+public:
+  // 20ms floor, 1s ceiling, 10ms margin, 99th percentile.
+  PeerTimeoutEstimatorTest() :
+    _estimator(20, 1000, 10)
+  {
+  }
+
+  void record_rtts(const std::string& host, unsigned long rtt_us, int count)
+  {
+    for (int ii = 0; ii < count; ii++)
+    {
+      _estimator.record_rtt(host, rtt_us);
+    }
+  }
+
+  PeerTimeoutEstimator _estimator;
+};
+
+TEST_F(PeerTimeoutEstimatorTest, UnknownPeerUsesCeiling)
+{
+  EXPECT_EQ(1000, _estimator.get_timeout(CCF1));
+}
+
+TEST_F(PeerTimeoutEstimatorTest, NeedsEnoughSamples)
+{
+  record_rtts(CCF1, 50000, PeerTimeoutEstimator::MIN_SAMPLES - 1);
+  EXPECT_EQ(1000, _estimator.get_timeout(CCF1));
+}
+
+TEST_F(PeerTimeoutEstimatorTest, PercentilePlusMargin)
+{
+  record_rtts(CCF1, 50000, PeerTimeoutEstimator::WINDOW_SIZE);
+  EXPECT_EQ(60, _estimator.get_timeout(CCF1));
+
+  // Other peers are independent.
+  EXPECT_EQ(1000, _estimator.get_timeout(CCF2));
+  EXPECT_EQ(1u, _estimator.peers().size());
+}
+
+TEST_F(PeerTimeoutEstimatorTest, OutliersIgnored)
+{
+  // A single slow answer in the window is below the 99th percentile.
+  record_rtts(CCF1, 50000, PeerTimeoutEstimator::WINDOW_SIZE - 1);
+  record_rtts(CCF1, 500000, 1);
+  record_rtts(CCF1, 50000, PeerTimeoutEstimator::RECALCULATE_INTERVAL);
+  EXPECT_EQ(60, _estimator.get_timeout(CCF1));
+}
+
+TEST_F(PeerTimeoutEstimatorTest, ClampedToFloorAndCeiling)
+{
+  record_rtts(CCF1, 1000, PeerTimeoutEstimator::WINDOW_SIZE);
+  EXPECT_EQ(20, _estimator.get_timeout(CCF1));
+
+  record_rtts(CCF2, 5000000, PeerTimeoutEstimator::WINDOW_SIZE);
+  EXPECT_EQ(1000, _estimator.get_timeout(CCF2));
+}
+
+TEST_F(PeerTimeoutEstimatorTest, TimeoutsGrowTimeout)
+{
+  record_rtts(CCF1, 50000, PeerTimeoutEstimator::WINDOW_SIZE);
+  EXPECT_EQ(60, _estimator.get_timeout(CCF1));
+
+  // The peer slows down, so everything times out.  Each timeout is recorded
+  // at the timeout in force, so the timeout grows by the margin each time it
+  // is recalculated, until it reaches the ceiling.
+  for (int ii = 0; ii < 100 * PeerTimeoutEstimator::WINDOW_SIZE; ii++)
+  {
+    _estimator.record_timeout(CCF1, _estimator.get_timeout(CCF1));
+  }
+
+  EXPECT_EQ(1000, _estimator.get_timeout(CCF1));
+}
@@ -9,6 +9,8 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <set>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -17,10 +19,18 @@
 #include "session_manager.hpp"
 #include "mock_chronos_connection.h"
 #include "mock_health_checker.hpp"
+#include "chronos_queue.hpp"
+#include "duplicate_cache.hpp"
 
 #include "peer_message_sender.hpp"
 #include "peer_message_sender_factory.hpp"
 
+using ::testing::DoAll;
+using ::testing::InvokeWithoutArgs;
+using ::testing::Return;
+using ::testing::SaveArg;
+using ::testing::SetArgReferee;
+
 const SAS::TrailId FAKE_TRAIL_ID = 0;
 const std::string BILLING_REALM = "billing.example.com";
 const int DIAMETER_TIMEOUT = 200;
@@ -111,6 +121,51 @@ public:
   PeerMessageSender* newSender(SAS::TrailId trail) {return new DummyUnknownErrorPeerMessageSender(trail, BILLING_REALM, DIAMETER_TIMEOUT);}
 };
 
+// Simulates a request to a CDF that returns successfully, but only after a
+// STOP has removed the session from the given stores
+class DummyStoppedPeerMessageSender : public PeerMessageSender
+{
+public:
+  DummyStoppedPeerMessageSender(SAS::TrailId trail,
+                                const std::string& dest_realm,
+                                const int diameter_timeout,
+                                const std::vector<SessionStore*>& stores) :
+    PeerMessageSender(trail, dest_realm, diameter_timeout),
+    _stores(stores)
+  {}
+
+  void send(Message* msg, SessionManager* sm, Rf::Dictionary* dict, Diameter::Stack* diameter_stack)
+  {
+    for (std::vector<SessionStore*>::const_iterator it = _stores.begin(); it != _stores.end(); ++it)
+    {
+      (*it)->delete_session_data(msg->call_id, msg->role, msg->function, msg->trail);
+    }
+
+    sm->on_ccf_response(true, 100, "test_session_id", 2001, msg);
+    delete this;
+  };
+
+private:
+  std::vector<SessionStore*> _stores;
+};
+
+class DummyStoppedPeerMessageSenderFactory : public PeerMessageSenderFactory
+{
+public:
+  DummyStoppedPeerMessageSenderFactory(const std::string& dest_realm,
+                                       const int diameter_timeout,
+                                       const std::vector<SessionStore*>& stores) :
+    PeerMessageSenderFactory(dest_realm, diameter_timeout),
+    _stores(stores)
+  {}
+  virtual ~DummyStoppedPeerMessageSenderFactory(){}
+
+  PeerMessageSender* newSender(SAS::TrailId trail) {return new DummyStoppedPeerMessageSender(trail, BILLING_REALM, DIAMETER_TIMEOUT, _stores);}
+
+private:
+  std::vector<SessionStore*> _stores;
+};
+
 class SessionManagerTest : public ::testing::Test
 {
   SessionManagerTest()
@@ -602,6 +657,108 @@ TEST_F(SessionManagerTest, CorrectTagForwarded)
   delete memstore;
 }
 
+TEST_F(SessionManagerTest, QueuedTimers)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM, DIAMETER_TIMEOUT);
+  MockChronosConnection* mock_chronos = new MockChronosConnection();
+  mock_chronos->accept_all_requests();
+  ChronosQueue* timer_queue = new ChronosQueue(mock_chronos, 1);
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, mock_chronos, _diameter_stack, hc, NULL, timer_queue);
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+  Message* interim_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID);
+  Message* stop_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(4), 0, FAKE_TRAIL_ID);
+
+  // START stores the session and creates the timer from the queue.  The
+  // timer ID is filled in once Chronos has answered.  Stopping the queue
+  // waits for it to empty.
+  EXPECT_CALL(*mock_chronos, send_post(_, _, _, _, _, _, _)).Times(1);
+  timer_queue->start();
+  mgr->handle(start_msg);
+  timer_queue->stop();
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(1u, sess->acct_record_number);
+  EXPECT_EQ("TIMER_ID", sess->timer_id);
+  delete sess;
+  sess = NULL;
+
+  // INTERIM updates the timer from the queue.
+  EXPECT_CALL(*mock_chronos, send_put(_, _, _, _, _, _, _)).Times(1);
+  timer_queue->start();
+  mgr->handle(interim_msg);
+  timer_queue->stop();
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(2u, sess->acct_record_number);
+  delete sess;
+  sess = NULL;
+
+  // STOP deletes the timer from the queue.
+  EXPECT_CALL(*mock_chronos, send_delete("TIMER_ID", _)).Times(1);
+  timer_queue->start();
+  mgr->handle(stop_msg);
+  timer_queue->stop();
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_EQ(NULL, sess);
+
+  delete mgr;
+  delete hc;
+  delete factory;
+  delete timer_queue;
+  delete mock_chronos;
+  delete store;
+  delete memstore;
+}
+
+TEST_F(SessionManagerTest, QueuedTimerOutlivesSession)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM, DIAMETER_TIMEOUT);
+  MockChronosConnection* mock_chronos = new MockChronosConnection();
+  mock_chronos->accept_all_requests();
+  ChronosQueue* timer_queue = new ChronosQueue(mock_chronos, 1);
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, mock_chronos, _diameter_stack, hc, NULL, timer_queue);
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+  Message* stop_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(4), 0, FAKE_TRAIL_ID);
+
+  // The STOP arrives while the START's timer is being created.  It finds the
+  // session, which has no timer yet, and deletes it.  Once Chronos answers,
+  // the new timer isn't wanted, so is deleted too.
+  EXPECT_CALL(*mock_chronos, send_post(_, _, _, _, _, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs([&]() { mgr->handle(stop_msg); }),
+                    SetArgReferee<0>("TIMER_ID"),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*mock_chronos, send_delete("TIMER_ID", _)).Times(1);
+  timer_queue->start();
+  mgr->handle(start_msg);
+  timer_queue->stop();
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_EQ(NULL, sess);
+
+  delete mgr;
+  delete hc;
+  delete factory;
+  delete timer_queue;
+  delete mock_chronos;
+  delete store;
+  delete memstore;
+}
+
 class SessionManagerGRTest : public ::testing::Test
 {
   SessionManagerGRTest()
@@ -734,6 +891,72 @@ TEST_F(SessionManagerGRTest, SimpleTest)
   ASSERT_EQ(NULL, sess);
 }
 
+TEST_F(SessionManagerGRTest, TimerPopTest)
+{
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+  _mgr->handle(start_msg);
+
+  // One of the remote sites has lost the session.
+  _remote_store2->delete_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+
+  // A timer pop doesn't touch the timer, and brings every store up to date,
+  // putting the session back where it was lost.
+  EXPECT_CALL(*_mock_chronos, send_put(_, _, _, _, _, _, _)).Times(0);
+  EXPECT_CALL(*_mock_chronos, send_post(_, _, _, _, _, _, _)).Times(0);
+  Message* pop_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID, true);
+  _mgr->handle(pop_msg);
+
+  SessionStore* stores[] = {_local_store, _remote_store1, _remote_store2};
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    sess = stores[ii]->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+    ASSERT_NE((SessionStore::Session*)NULL, sess);
+    EXPECT_EQ(2u, sess->acct_record_number);
+    EXPECT_EQ("test_session_id", sess->session_id);
+    EXPECT_EQ(300u, sess->session_refresh_time);
+    delete sess; sess = NULL;
+  }
+}
+
+TEST_F(SessionManagerGRTest, TimerPopAfterStopTest)
+{
+  DummyStoppedPeerMessageSenderFactory* stopped_factory =
+    new DummyStoppedPeerMessageSenderFactory(BILLING_REALM,
+                                             DIAMETER_TIMEOUT,
+                                             {_local_store, _remote_store1, _remote_store2});
+  SessionManager* stopped_mgr = new SessionManager(_local_store,
+                                                   {_remote_store1, _remote_store2},
+                                                   _dict,
+                                                   stopped_factory,
+                                                   _mock_chronos,
+                                                   _diameter_stack,
+                                                   _hc);
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+  _mgr->handle(start_msg);
+
+  // The session ends while the timer pop's INTERIM is waiting for the CDF,
+  // so the pop's answer mustn't put the session back in any store.
+  Message* pop_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID, true);
+  stopped_mgr->handle(pop_msg);
+
+  sess = _local_store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_EQ(NULL, sess);
+  sess = _remote_store1->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_EQ(NULL, sess);
+  sess = _remote_store2->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_EQ(NULL, sess);
+
+  delete stopped_mgr;
+  delete stopped_factory;
+}
+
 TEST_F(SessionManagerGRTest, InterimUnknownTest)
 {
   DummyUnknownErrorPeerMessageSenderFactory* fail_factory = new DummyUnknownErrorPeerMessageSenderFactory(BILLING_REALM, DIAMETER_TIMEOUT);
@@ -828,3 +1051,132 @@ TEST_F(SessionManagerGRTest, EmptyLocalTest)
   EXPECT_EQ(2u, sess->acct_record_number);
   delete sess; sess = NULL;
 }
+
+TEST_F(SessionManagerTest, InterimTimerJitter)
+{
+  // Each session's timer is shortened by its own amount, within the jitter
+  // and no more than a quarter of the interval.
+  std::set<uint32_t> intervals;
+
+  for (int ii = 0; ii < 100; ii++)
+  {
+    Message msg("CALL_ID_" + std::to_string(ii), ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 600, FAKE_TRAIL_ID);
+    uint32_t interval = SessionManager::timer_interval(&msg, 300, 30);
+    EXPECT_LE(270u, interval);
+    EXPECT_GE(300u, interval);
+    EXPECT_EQ(interval, SessionManager::timer_interval(&msg, 300, 30));
+    intervals.insert(interval);
+
+    EXPECT_LE(75u, SessionManager::timer_interval(&msg, 100, 1000));
+    EXPECT_EQ(300u, SessionManager::timer_interval(&msg, 300, 0));
+  }
+
+  EXPECT_LT(10u, intervals.size());
+
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM, DIAMETER_TIMEOUT);
+  MockChronosConnection* mock_chronos = new MockChronosConnection();
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, mock_chronos, _diameter_stack, hc, NULL, NULL, 20);
+
+  // The timer is set with the jittered interval, but the session keeps the
+  // interval the CDF asked for.
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  uint32_t expected = SessionManager::timer_interval(start_msg, 100, 20);
+  uint32_t interval = 0;
+  EXPECT_CALL(*mock_chronos, send_post(_, _, _, _, _, _, _))
+    .WillOnce(DoAll(SaveArg<1>(&interval), SetArgReferee<0>("TIMER_ID"), Return(HTTP_OK)));
+  mgr->handle(start_msg);
+  EXPECT_EQ(expected, interval);
+
+  SessionStore::Session* sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(100u, sess->interim_interval);
+  delete sess;
+  sess = NULL;
+
+  // Renewing the timer uses the same interval.
+  Message* interim_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 300, FAKE_TRAIL_ID);
+  interval = 0;
+  EXPECT_CALL(*mock_chronos, send_put(_, _, _, _, _, _, _))
+    .WillOnce(DoAll(SaveArg<1>(&interval), Return(HTTP_OK)));
+  mgr->handle(interim_msg);
+  EXPECT_EQ(expected, interval);
+
+  delete mgr;
+  delete hc;
+  delete factory;
+  delete mock_chronos;
+  delete store;
+  delete memstore;
+}
+
+TEST_F(SessionManagerTest, RepeatedTimerPop)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM, DIAMETER_TIMEOUT);
+  MockChronosConnection* mock_chronos = new MockChronosConnection();
+  mock_chronos->accept_all_requests();
+  HealthChecker* hc = new HealthChecker();
+  DuplicateCache* duplicates = new DuplicateCache(60000);
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, mock_chronos, _diameter_stack, hc, NULL, NULL, 0, duplicates);
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+  mgr->handle(start_msg);
+
+  // The first pop is sent, but a second straight after it is a repeat, so is
+  // ignored.
+  Message* pop_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID, true);
+  mgr->handle(pop_msg);
+  pop_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID, true);
+  mgr->handle(pop_msg);
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(2u, sess->acct_record_number);
+  delete sess; sess = NULL;
+  EXPECT_EQ(1u, duplicates->suppressed());
+
+  // Real INTERIMs from Sprout aren't checked here.
+  Message* interim_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID);
+  mgr->handle(interim_msg);
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(3u, sess->acct_record_number);
+  delete sess; sess = NULL;
+
+  delete mgr;
+  delete duplicates;
+  delete factory;
+  delete hc;
+  delete mock_chronos;
+  delete store;
+  delete memstore;
+}
+
+TEST_F(SessionManagerTest, OpaqueData)
+{
+  Message msg("CALL_ID", TERMINATING, ICSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  EXPECT_EQ("/call-id/CALL_ID?timer-interim=true", msg.callback_uri());
+  EXPECT_EQ(&msg.callback_uri(), &msg.callback_uri());
+
+  // The body is the same as it's always been, whether or not it comes from
+  // the precomputed bodies.
+  const std::string body = "{\"event\":{\"Service-Information\":{\"IMS-Information\":{\"Role-Of-Node\":1,\"Node-Functionality\":2}},\"Accounting-Record-Type\":3}}";
+  EXPECT_EQ(body, SessionManager::create_opaque_data(&msg));
+
+  // Roles and functions outside the precomputed bodies get the same body,
+  // built when it's needed.
+  Message odd_msg("CALL_ID", (role_of_node_t)5, (node_functionality_t)20, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  EXPECT_EQ("{\"event\":{\"Service-Information\":{\"IMS-Information\":{\"Role-Of-Node\":5,\"Node-Functionality\":20}},\"Accounting-Record-Type\":3}}",
+            SessionManager::create_opaque_data(&odd_msg));
+
+  Message negative_msg("CALL_ID", (role_of_node_t)-1, (node_functionality_t)-1, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  EXPECT_EQ("{\"event\":{\"Service-Information\":{\"IMS-Information\":{\"Role-Of-Node\":-1,\"Node-Functionality\":-1}},\"Accounting-Record-Type\":3}}",
+            SessionManager::create_opaque_data(&negative_msg));
+}
@@ -9,6 +9,9 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -22,6 +25,7 @@ using ::testing::DoAll;
 using ::testing::Return;
 using ::testing::SetArgReferee;
 using ::testing::An;
+using ::testing::Invoke;
 
 static const SAS::TrailId FAKE_TRAIL = 0;
 
@@ -142,3 +146,222 @@ TEST_F(SessionStoreCorruptDataTest, SemanticallyInvalidJson)
   session = this->_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
   ASSERT_TRUE(session == NULL);
 }
+
+/// Fixture for reads of one session from several threads at once.
+class SessionStoreCoalescedReadTest : public ::testing::Test
+{
+public:
+  static const int NUM_THREADS = 4;
+
+  SessionStoreCoalescedReadTest() :
+    _stats(NULL),
+    _reads(0),
+    _coalesced(0)
+  {
+    _memstore = new MockStore();
+    _store = new SessionStore(_memstore, &_stats);
+  }
+
+  virtual ~SessionStoreCoalescedReadTest()
+  {
+    delete _store; _store = NULL;
+    delete _memstore; _memstore = NULL;
+  }
+
+  // Stands in for the store's get_data, holding up the read until all the
+  // other threads are waiting for it.
+  Store::Status slow_get_data(const std::string& table,
+                              const std::string& key,
+                              std::string& data,
+                              uint64_t& cas,
+                              SAS::TrailId trail,
+                              Store::Format format)
+  {
+    for (int ii = 0; (ii < 500) && (_coalesced < NUM_THREADS - 1); ii++)
+    {
+      usleep(10000);
+      collect_stats();
+    }
+
+    data = "{\"session_id\":\"session_id\",\"ccfs\":[\"ccf1\"],"
+           "\"acct_record_num\":2,\"timer_id\":\"timer_id\","
+           "\"refresh_time\":300,\"interim_interval\":300}";
+    cas = 7;
+    return Store::OK;
+  }
+
+  void collect_stats()
+  {
+    _stats.aggregate();
+    _reads += _stats.counter_count(StageStatistics::SESSION_READS);
+    _coalesced += _stats.counter_count(StageStatistics::SESSION_READS_COALESCED);
+  }
+
+  static void* read_from_thread(void* test_ptr)
+  {
+    SessionStoreCoalescedReadTest* test = (SessionStoreCoalescedReadTest*)test_ptr;
+    return test->_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  }
+
+  MockStore* _memstore;
+  StageStatistics _stats;
+  SessionStore* _store;
+  uint64_t _reads;
+  uint64_t _coalesced;
+};
+
+TEST_F(SessionStoreCoalescedReadTest, OneStoreRead)
+{
+  EXPECT_CALL(*_memstore, get_data(_, _, _, _, _, An<Store::Format>()))
+    .WillOnce(Invoke(this, &SessionStoreCoalescedReadTest::slow_get_data));
+
+  pthread_t threads[NUM_THREADS];
+
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_create(&threads[ii], NULL, read_from_thread, this);
+  }
+
+  // Every thread gets its own copy of the session.
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    SessionStore::Session* session = NULL;
+    pthread_join(threads[ii], (void**)&session);
+    ASSERT_TRUE(session != NULL);
+    EXPECT_EQ("session_id", session->session_id);
+    EXPECT_EQ(2u, session->acct_record_number);
+    delete session; session = NULL;
+  }
+
+  collect_stats();
+  EXPECT_EQ((uint64_t)NUM_THREADS, _reads);
+  EXPECT_EQ((uint64_t)NUM_THREADS - 1, _coalesced);
+}
+
+/// Fixture for the circuit breaker.  The probe thread's interval is long
+/// enough that it never probes during a test, so the tests probe themselves.
+class SessionStoreBreakerTest : public ::testing::Test
+{
+public:
+  SessionStoreBreakerTest()
+  {
+    _memstore = new MockStore();
+    _store = new SessionStore(_memstore, NULL, StageStatistics::REMOTE_STORE, 3, 600000);
+    _key = SessionStore::create_key("call_id", ORIGINATING, SCSCF);
+  }
+
+  virtual ~SessionStoreBreakerTest()
+  {
+    delete _store; _store = NULL;
+    delete _memstore; _memstore = NULL;
+  }
+
+  // Makes the store fail enough reads to trip the breaker.
+  void trip_breaker()
+  {
+    EXPECT_CALL(*_memstore, get_data(_, _key, _, _, _, An<Store::Format>()))
+      .Times(3)
+      .WillRepeatedly(Return(Store::ERROR));
+
+    for (int ii = 0; ii < 3; ii++)
+    {
+      EXPECT_FALSE(_store->breaker_open());
+      EXPECT_EQ(NULL, _store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL));
+    }
+
+    EXPECT_TRUE(_store->breaker_open());
+  }
+
+  MockStore* _memstore;
+  SessionStore* _store;
+  std::string _key;
+};
+
+TEST_F(SessionStoreBreakerTest, SkipsStoreWhenOpen)
+{
+  trip_breaker();
+
+  // The store isn't used while the breaker is open.  Writes and deletes are
+  // remembered, but reads aren't.
+  EXPECT_EQ(NULL, _store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL));
+
+  SessionStore::Session session;
+  session.session_id = "session_id";
+  session.acct_record_number = 2;
+  session.session_refresh_time = 300;
+  session.interim_interval = 300;
+  EXPECT_EQ(Store::ERROR, _store->set_session_data("call_id", ORIGINATING, SCSCF, &session, true, FAKE_TRAIL));
+  EXPECT_EQ(Store::ERROR, _store->delete_session_data("other_call_id", ORIGINATING, SCSCF, FAKE_TRAIL));
+  EXPECT_EQ(2u, _store->pending_writes());
+
+  // Only the latest write for a session is kept.
+  session.acct_record_number = 3;
+  _store->set_session_data("call_id", ORIGINATING, SCSCF, &session, false, FAKE_TRAIL);
+  EXPECT_EQ(2u, _store->pending_writes());
+}
+
+TEST_F(SessionStoreBreakerTest, SuccessResetsErrors)
+{
+  EXPECT_CALL(*_memstore, get_data(_, _key, _, _, _, An<Store::Format>()))
+    .WillOnce(Return(Store::ERROR))
+    .WillOnce(Return(Store::ERROR))
+    .WillOnce(Return(Store::NOT_FOUND))
+    .WillOnce(Return(Store::ERROR))
+    .WillOnce(Return(Store::ERROR));
+
+  for (int ii = 0; ii < 5; ii++)
+  {
+    _store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  }
+
+  EXPECT_FALSE(_store->breaker_open());
+}
+
+TEST_F(SessionStoreBreakerTest, ProbeAndReconcile)
+{
+  trip_breaker();
+
+  SessionStore::Session session;
+  session.session_id = "session_id";
+  session.acct_record_number = 2;
+  session.session_refresh_time = 300;
+  session.interim_interval = 300;
+  _store->set_session_data("call_id", ORIGINATING, SCSCF, &session, true, FAKE_TRAIL);
+  std::string other_key = SessionStore::create_key("other_call_id", ORIGINATING, SCSCF);
+  _store->delete_session_data("other_call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+
+  // While the store is still down the breaker stays open.
+  EXPECT_CALL(*_memstore, get_data(_, "circuit-breaker-probe", _, _, _, An<Store::Format>()))
+    .WillOnce(Return(Store::ERROR))
+    .WillOnce(Return(Store::NOT_FOUND));
+  EXPECT_FALSE(_store->probe());
+  EXPECT_TRUE(_store->breaker_open());
+
+  // When it comes back, the skipped write and delete are replayed.
+  EXPECT_CALL(*_memstore, get_data(_, _key, _, _, _, An<Store::Format>()))
+    .WillOnce(Return(Store::NOT_FOUND));
+  EXPECT_CALL(*_memstore, set_data(_, _key, _, 0, _, _, An<Store::Format>()))
+    .WillOnce(Return(Store::OK));
+  EXPECT_CALL(*_memstore, delete_data(_, other_key, _))
+    .WillOnce(Return(Store::OK));
+
+  EXPECT_TRUE(_store->probe());
+  EXPECT_FALSE(_store->breaker_open());
+  EXPECT_EQ(0u, _store->pending_writes());
+}
+
+TEST_F(SessionStoreBreakerTest, FailDuringReconcile)
+{
+  trip_breaker();
+  _store->delete_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+
+  EXPECT_CALL(*_memstore, get_data(_, "circuit-breaker-probe", _, _, _, An<Store::Format>()))
+    .WillOnce(Return(Store::NOT_FOUND));
+  EXPECT_CALL(*_memstore, delete_data(_, _key, _))
+    .WillOnce(Return(Store::ERROR));
+
+  // The delete is kept for the next time the store comes back.
+  EXPECT_FALSE(_store->probe());
+  EXPECT_TRUE(_store->breaker_open());
+  EXPECT_EQ(1u, _store->pending_writes());
+}
@@ -0,0 +1,280 @@
+/**
+ * @file test_stage_statistics.cpp UT for per-stage statistics.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "stage_statistics.hpp"
+
+class StageStatisticsTest : public ::testing::Test
+{
+public:
+  StageStatisticsTest() : _stats(NULL) {}
+
+  StageStatistics _stats;
+};
+
+TEST_F(StageStatisticsTest, BucketsAreAccurate)
+{
+  for (uint64_t value = 0; value < 100000000; value = (value * 3 / 2) + 1)
+  {
+    uint64_t bucket_value = StageStatistics::bucket_value(StageStatistics::bucket_index(value));
+    EXPECT_GE(bucket_value, value);
+    EXPECT_LE(bucket_value, value + (value / 8));
+  }
+}
+
+TEST_F(StageStatisticsTest, EmptyStage)
+{
+  _stats.aggregate();
+  StageStatistics::StageSummary summary = _stats.stage_summary(StageStatistics::CDF);
+  EXPECT_EQ(0u, summary.count);
+  EXPECT_EQ(0u, summary.mean_us);
+  EXPECT_EQ(0u, summary.p99_us);
+  EXPECT_EQ(0u, summary.max_us);
+}
+
+TEST_F(StageStatisticsTest, Percentiles)
+{
+  for (int ii = 1; ii <= 100; ii++)
+  {
+    _stats.record_latency(StageStatistics::CDF, ii * 1000);
+  }
+
+  _stats.record_latency(StageStatistics::PARSE, 10);
+  _stats.aggregate();
+
+  StageStatistics::StageSummary summary = _stats.stage_summary(StageStatistics::CDF);
+  EXPECT_EQ(100u, summary.count);
+  EXPECT_EQ(50500u, summary.mean_us);
+  EXPECT_NEAR(50000, summary.p50_us, 50000 / 8);
+  EXPECT_NEAR(90000, summary.p90_us, 90000 / 8);
+  EXPECT_NEAR(99000, summary.p99_us, 99000 / 8);
+  EXPECT_EQ(100000u, summary.max_us);
+
+  // Each stage is separate.
+  summary = _stats.stage_summary(StageStatistics::PARSE);
+  EXPECT_EQ(1u, summary.count);
+  EXPECT_EQ(10u, summary.p50_us);
+  EXPECT_EQ(0u, _stats.stage_summary(StageStatistics::CHRONOS).count);
+}
+
+TEST_F(StageStatisticsTest, ResetEachPeriod)
+{
+  _stats.record_latency(StageStatistics::LOCAL_STORE, 500);
+  _stats.aggregate();
+  EXPECT_EQ(1u, _stats.stage_summary(StageStatistics::LOCAL_STORE).count);
+
+  _stats.aggregate();
+  EXPECT_EQ(0u, _stats.stage_summary(StageStatistics::LOCAL_STORE).count);
+  EXPECT_EQ(0u, _stats.stage_summary(StageStatistics::LOCAL_STORE).max_us);
+}
+
+TEST_F(StageStatisticsTest, StageTimer)
+{
+  {
+    StageStatistics::StageTimer timer(&_stats, StageStatistics::REMOTE_STORE);
+  }
+
+  // Stopping the timer records it once only.
+  StageStatistics::StageTimer timer(&_stats, StageStatistics::REMOTE_STORE);
+  timer.stop();
+  timer.stop();
+
+  // A timer without statistics does nothing.
+  StageStatistics::StageTimer null_timer(NULL, StageStatistics::REMOTE_STORE);
+  null_timer.stop();
+
+  _stats.aggregate();
+  EXPECT_EQ(2u, _stats.stage_summary(StageStatistics::REMOTE_STORE).count);
+}
+
+TEST_F(StageStatisticsTest, ResultCodes)
+{
+  _stats.record_result(2001);
+  _stats.record_result(2001);
+  _stats.record_result(3002);
+  _stats.record_result(3004);
+  _stats.record_result(3010);
+  _stats.record_result(4010);
+  _stats.record_result(5012);
+  _stats.record_result(StageStatistics::TIMEOUT);
+  _stats.record_result(1001);
+  _stats.aggregate();
+
+  EXPECT_EQ(2u, _stats.result_count(StageStatistics::RC_2001));
+  EXPECT_EQ(1u, _stats.result_count(StageStatistics::RC_3002));
+  EXPECT_EQ(1u, _stats.result_count(StageStatistics::RC_3004));
+  EXPECT_EQ(1u, _stats.result_count(StageStatistics::RC_OTHER_3XXX));
+  EXPECT_EQ(1u, _stats.result_count(StageStatistics::RC_4XXX));
+  EXPECT_EQ(1u, _stats.result_count(StageStatistics::RC_5XXX));
+  EXPECT_EQ(1u, _stats.result_count(StageStatistics::RC_TIMEOUT));
+  EXPECT_EQ(1u, _stats.result_count(StageStatistics::RC_OTHER));
+
+  _stats.aggregate();
+  EXPECT_EQ(0u, _stats.result_count(StageStatistics::RC_2001));
+}
+
+TEST_F(StageStatisticsTest, Counters)
+{
+  _stats.incr_counter(StageStatistics::CHRONOS_SENT);
+  _stats.incr_counter(StageStatistics::CHRONOS_COALESCED);
+  _stats.incr_counter(StageStatistics::CHRONOS_COALESCED);
+  _stats.aggregate();
+
+  EXPECT_EQ(1u, _stats.counter_count(StageStatistics::CHRONOS_SENT));
+  EXPECT_EQ(2u, _stats.counter_count(StageStatistics::CHRONOS_COALESCED));
+
+  // Counts are per period.
+  _stats.aggregate();
+  EXPECT_EQ(0u, _stats.counter_count(StageStatistics::CHRONOS_COALESCED));
+}
+
+TEST_F(StageStatisticsTest, Gauges)
+{
+  _stats.incr_gauge(StageStatistics::CDF_IN_FLIGHT);
+  _stats.incr_gauge(StageStatistics::CDF_IN_FLIGHT);
+  _stats.incr_gauge(StageStatistics::CDF_IN_FLIGHT);
+  _stats.decr_gauge(StageStatistics::CDF_IN_FLIGHT);
+  _stats.aggregate();
+
+  StageStatistics::GaugeSummary summary = _stats.gauge_summary(StageStatistics::CDF_IN_FLIGHT);
+  EXPECT_EQ(2, summary.current);
+  EXPECT_EQ(3, summary.high_water_mark);
+  EXPECT_EQ(0, _stats.gauge_summary(StageStatistics::HTTP_IN_FLIGHT).current);
+
+  // The high water mark starts again from the current value.
+  _stats.decr_gauge(StageStatistics::CDF_IN_FLIGHT);
+  _stats.aggregate();
+  summary = _stats.gauge_summary(StageStatistics::CDF_IN_FLIGHT);
+  EXPECT_EQ(1, summary.current);
+  EXPECT_EQ(2, summary.high_water_mark);
+}
+
+static void* record_from_thread(void* stats_ptr)
+{
+  StageStatistics* stats = (StageStatistics*)stats_ptr;
+
+  for (int ii = 0; ii < 1000; ii++)
+  {
+    stats->record_latency(StageStatistics::CHRONOS, 200);
+    stats->record_result(2001);
+  }
+
+  return NULL;
+}
+
+TEST_F(StageStatisticsTest, MergesThreads)
+{
+  pthread_t threads[4];
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    pthread_create(&threads[ii], NULL, record_from_thread, &_stats);
+  }
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  _stats.record_latency(StageStatistics::CHRONOS, 400);
+  _stats.aggregate();
+
+  StageStatistics::StageSummary summary = _stats.stage_summary(StageStatistics::CHRONOS);
+  EXPECT_EQ(4001u, summary.count);
+  EXPECT_NEAR(200, summary.p99_us, 200 / 8);
+  EXPECT_EQ(400u, summary.max_us);
+  EXPECT_EQ(4000u, _stats.result_count(StageStatistics::RC_2001));
+}
+
+TEST_F(StageStatisticsTest, TimerPopsPerSecond)
+{
+  // Start on a whole second, with nothing left over from before then.
+  uint64_t start_ms = ((RalfTime::now_ms() / 1000) + 1) * 1000;
+  _stats.aggregate(start_ms);
+
+  // 10 seconds with 1 pop in each, except for a storm of 100 in one of
+  // them.
+  for (int ii = 0; ii < 10; ii++)
+  {
+    int pops = (ii == 5) ? 100 : 1;
+
+    for (int jj = 0; jj < pops; jj++)
+    {
+      _stats.record_timer_pop(start_ms + (ii * 1000) + jj);
+    }
+  }
+
+  // Seconds still in progress aren't counted.
+  _stats.record_timer_pop(start_ms + 10000);
+  _stats.aggregate(start_ms + 10500);
+  StageStatistics::TimerPopSummary summary = _stats.timer_pop_summary();
+  EXPECT_EQ(10u, summary.seconds);
+  EXPECT_EQ(10u, summary.mean);
+  EXPECT_EQ(1u, summary.p50);
+  EXPECT_EQ(1u, summary.p90);
+  EXPECT_EQ(100u, summary.p99);
+  EXPECT_EQ(100u, summary.max);
+
+  // The next period only covers the seconds since, and seconds without pops
+  // count as 0.
+  _stats.aggregate(start_ms + 12000);
+  summary = _stats.timer_pop_summary();
+  EXPECT_EQ(2u, summary.seconds);
+  EXPECT_EQ(0u, summary.mean);
+  EXPECT_EQ(1u, summary.max);
+
+  // Entries are reused for later seconds.
+  _stats.record_timer_pop(start_ms + ((StageStatistics::POP_SECONDS + 13) * 1000));
+  _stats.aggregate(start_ms + ((StageStatistics::POP_SECONDS + 14) * 1000));
+  summary = _stats.timer_pop_summary();
+  EXPECT_EQ((uint64_t)StageStatistics::POP_SECONDS - 1, summary.seconds);
+  EXPECT_EQ(1u, summary.max);
+}
+
+TEST_F(StageStatisticsTest, SeparateObjects)
+{
+  // A thread recording to two objects keeps their figures apart.
+  StageStatistics other(NULL);
+  _stats.record_latency(StageStatistics::PARSE, 10);
+  other.record_latency(StageStatistics::PARSE, 20);
+  _stats.record_latency(StageStatistics::PARSE, 10);
+  _stats.aggregate();
+  other.aggregate();
+
+  EXPECT_EQ(2u, _stats.stage_summary(StageStatistics::PARSE).count);
+  EXPECT_EQ(10u, _stats.stage_summary(StageStatistics::PARSE).max_us);
+  EXPECT_EQ(1u, other.stage_summary(StageStatistics::PARSE).count);
+  EXPECT_EQ(20u, other.stage_summary(StageStatistics::PARSE).max_us);
+}
+
+TEST_F(StageStatisticsTest, AggregationThread)
+{
+  StageStatistics stats(NULL, 10);
+  ASSERT_TRUE(stats.start());
+  stats.record_latency(StageStatistics::CDF, 1000);
+
+  // Wait for the figures to be published.
+  bool published = false;
+
+  for (int ii = 0; (ii < 100) && (!published); ii++)
+  {
+    usleep(10000);
+    published = (stats.stage_summary(StageStatistics::CDF).count == 1);
+  }
+
+  EXPECT_TRUE(published);
+  stats.stop();
+}